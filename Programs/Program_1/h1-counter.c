@@ -4,41 +4,76 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <netdb.h>
 #include <string.h>
 #include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
 
+#include "p2pnet.h"
+
+#define SERVER_HOST "www.ecst.csuchico.edu"
 #define SERVER_PORT "80"
+// HTTPS port, used with -t
+#define SERVER_TLS_PORT "443"
+// Capacity of the receive buffer (one byte is kept free for the null terminator)
+#define RECV_BUFFER_SIZE 65536
+// Length of "<h1>" minus one, carried between chunks so split tags are still counted
+#define TAG_CARRY 3
 
 // Function prototypes
-int lookup_and_connect(const char* host, const char* service);
-int sendall(int s, char* buf, int* len);
-int recvall(int s, char* buf, int* len);
+SSL* start_tls(SSL_CTX* ctx, int s, const char* host, const char* session_file);
+void save_session(SSL* ssl, const char* session_file);
+int sendall(int s, SSL* ssl, char* buf, int* len);
+ssize_t recvall(int s, SSL* ssl, char* buf, size_t cap, size_t* len);
 
 
 int main(int argc, char* argv[])
 {	
-    // Buffer for receiving data
-    char buf[1024];
+    // Buffer for receiving data, prefixed by the tail of the previous chunk
+    static char buf[TAG_CARRY + RECV_BUFFER_SIZE + 1];
     // Socket file descriptor
     int sockfd;
     // Chunk size for receiving data
     int count = 0;
+    // -t: fetch over HTTPS; -s: file the TLS session is kept in between runs, so the
+    // next run resumes it instead of doing a full handshake
+    int use_tls = 0;
+    const char* session_file = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ts:")) != -1)
+    {
+        if (opt == 't')
+        {
+            use_tls = 1;
+        }
+        else if (opt == 's')
+        {
+            session_file = optarg;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-t [-s session_file]] <chunk size>\n", argv[0]);
+            exit(1);
+        }
+    }
 
     // Validate input arguments
-    if (argc == 2)
+    if (argc - optind == 1)
     {
         // Convert command-line argument to integer (chunk size)
-        count = atoi(argv[1]);
+        count = atoi(argv[optind]);
     }
-    else
+
+    if (count <= 0)
     {
-        perror("Invalid Chunk Size, Try Again");
+        fprintf(stderr, "Invalid Chunk Size, Try Again\n");
         // Exit if no valid argument is provided
         exit(1);
     }
 
-    sockfd = lookup_and_connect("www.ecst.csuchico.edu", SERVER_PORT);
+    sockfd = p2p_connect(SERVER_HOST, use_tls ? SERVER_TLS_PORT : SERVER_PORT, AF_UNSPEC);
 
     if (sockfd < 0)
     {
@@ -46,11 +81,27 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
+    // The server is verified against the system CAs
+    SSL_CTX* ctx = NULL;
+    SSL* ssl = NULL;
+    if (use_tls)
+    {
+        ctx = SSL_CTX_new(TLS_client_method());
+        ssl = ctx != NULL ? start_tls(ctx, sockfd, SERVER_HOST, session_file) : NULL;
+        if (ssl == NULL)
+        {
+            ERR_print_errors_fp(stderr);
+            fprintf(stderr, "TLS handshake failed\n");
+            close(sockfd);
+            exit(1);
+        }
+    }
+
     // HTTP GET request to fetch specific file from the server
     char request[] = "GET /~kkredo/file.html HTTP/1.0\r\n\r\n";
 
     int send_len = strlen(request);
-    int bytes_sent = sendall(sockfd, request, &send_len);
+    int bytes_sent = sendall(sockfd, ssl, request, &send_len);
 
     if (bytes_sent < 0)
     {
@@ -60,17 +111,28 @@ int main(int argc, char* argv[])
     }
 
     // Variables to track received bytes and count <h1> tags in the response
-    int bytes = 0;
+    long bytes = 0;
     int h1_tags = 0;
-    int bytes_recv = 0;
-    // Pointer to chunk size
-    int* len = &count;
+    ssize_t bytes_recv = 0;
+    // Number of bytes carried over from the end of the previous chunk
+    size_t carry = 0;
+    // The first chunk is the requested size, clamped to the buffer capacity. recvall()
+    // waits for whole chunks, so every chunk but the last is full and there is nothing
+    // to adapt to: the size simply doubles after each one until it reaches the capacity,
+    // so long responses take few calls whatever chunk size was asked for
+    size_t chunk = (size_t)count < RECV_BUFFER_SIZE ? (size_t)count : RECV_BUFFER_SIZE;
 
     // Receive data from the server in chunks and count <h1> tags
-    while ((bytes_recv = recvall(sockfd, buf, len)) > 0)
+    while (1)
     {
+        size_t len = chunk;
+        bytes_recv = recvall(sockfd, ssl, buf + carry, RECV_BUFFER_SIZE, &len);
+        if (bytes_recv <= 0)
+        {
+            break;
+        }
         // Null-terminate the received data for string operations
-        buf[bytes_recv] = '\0';
+        buf[carry + bytes_recv] = '\0';
         // Move pointer past the current <h1> tag
         char* h1_start = buf;
 
@@ -81,107 +143,161 @@ int main(int argc, char* argv[])
         }
 
         bytes += bytes_recv;
+
+        // Keep the last few bytes so a tag split across two chunks is still found
+        size_t total = carry + bytes_recv;
+        carry = total < TAG_CARRY ? total : TAG_CARRY;
+        memmove(buf, buf + total - carry, carry);
+
+        chunk = chunk * 2 < RECV_BUFFER_SIZE ? chunk * 2 : RECV_BUFFER_SIZE;
     }
 
     printf("Number of <h1> tags: %d\n", h1_tags);
 
-    printf("Number of bytes: %d\n", bytes);
+    printf("Number of bytes: %ld\n", bytes);
 
-    if (sockfd < 0)
+    if (bytes_recv < 0)
     {
         perror("Receive Failed");
     }
 
+    if (ssl != NULL)
+    {
+        // TLS 1.3 servers send the resumable session after the handshake, so it is only
+        // known once the response has been read
+        save_session(ssl, session_file);
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        SSL_CTX_free(ctx);
+    }
+    close(sockfd);
+
     return 0;
 }
 
-int sendall(int s, char* buf, int* len)
+// Handshake over the connected socket s, checking that the certificate names host.
+// A session saved in session_file by an earlier run is offered for resumption.
+// Returns the connection or NULL
+SSL* start_tls(SSL_CTX* ctx, int s, const char* host, const char* session_file)
 {
-    int total = 0;
-    int bytes_left = *len;
-    int n;
+    if (SSL_CTX_set_default_verify_paths(ctx) != 1)
+    {
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    // HTTP/1.0 ends the body by closing, which many servers do without a close alert
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
 
-    while (total < *len)
+    SSL* ssl = SSL_new(ctx);
+    if (ssl == NULL)
     {
-        n = send(s, buf + total, bytes_left, 0);
-        if (n == -1)
+        return NULL;
+    }
+    SSL_set_fd(ssl, s);
+    SSL_set_tlsext_host_name(ssl, host);
+    SSL_set1_host(ssl, host);
+
+    FILE* saved = session_file != NULL ? fopen(session_file, "r") : NULL;
+    if (saved != NULL)
+    {
+        SSL_SESSION* session = PEM_read_SSL_SESSION(saved, NULL, NULL, NULL);
+        if (session != NULL)
         {
-            break;
+            SSL_set_session(ssl, session);
+            SSL_SESSION_free(session);
         }
-        total += n;
-        bytes_left -= n;
+        fclose(saved);
     }
-    *len = total;
 
-    return n == -1 ? -1 : 0;
+    if (SSL_connect(ssl) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    printf("TLS: %s, session %s\n", SSL_get_version(ssl), SSL_session_reused(ssl) ? "resumed" : "new");
+    return ssl;
 }
 
-int recvall(int s, char* buf, int* len)
+// Keep the connection's session for the next run, if a session file was named
+void save_session(SSL* ssl, const char* session_file)
+{
+    SSL_SESSION* session = SSL_get1_session(ssl);
+    FILE* out = session_file != NULL && session != NULL && SSL_SESSION_is_resumable(session) ? fopen(session_file, "w") : NULL;
+
+    if (out != NULL)
+    {
+        PEM_write_SSL_SESSION(out, session);
+        fclose(out);
+    }
+    SSL_SESSION_free(session);
+}
+
+// Send all *len bytes, through ssl when it is not NULL
+int sendall(int s, SSL* ssl, char* buf, int* len)
 {
     int total = 0;
     int bytes_left = *len;
-    int n;
+    int n = 0;
 
+    if (ssl == NULL)
+    {
+        return p2p_send_all(s, buf, *len, 0);
+    }
     while (total < *len)
     {
-        n = recv(s, buf + total, bytes_left, 0);
-        if (n == -1 || n == -0)
+        n = SSL_write(ssl, buf + total, bytes_left);
+        if (n <= 0)
         {
+            n = -1;
             break;
         }
-        // Update total bytes sent
         total += n;
-        // Update remaining bytes
         bytes_left -= n;
     }
-    // Update len with total bytes sent
     *len = total;
 
-    // Return -1 if sending failed, otherwise return 0
-    return n == -1 ? -1 : total;	
+    return n == -1 ? -1 : 0;
 }
-int lookup_and_connect(const char* host, const char* service) 
-{
-    struct addrinfo hints;
-    struct addrinfo *rp, *result;
-    int s;
 
-    /* Translate host name into peer's IP address */
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0;
+/*
+ * Receive exactly *len bytes into buf unless the peer closes the connection first.
+ * *len is clamped to cap so callers can never overrun their buffer, and MSG_WAITALL
+ * lets the kernel gather the whole chunk in a single call in the common case. With
+ * ssl set the data is read through TLS instead.
+ *
+ * On return *len holds the number of bytes stored. Returns that count (0 on EOF)
+ * or -1 if the receive failed before any data arrived.
+ */
+ssize_t recvall(int s, SSL* ssl, char* buf, size_t cap, size_t* len)
+{
+    size_t total = 0;
+    size_t want = *len < cap ? *len : cap;
+    ssize_t n = 0;
 
-    if ((s = getaddrinfo(host, service, &hints, &result)) != 0)
+    if (ssl == NULL)
     {
-        fprintf(stderr, "stream-talk-client: getaddrinfo: %s\n", gai_strerror(s));
-        return -1;
+        n = p2p_recv_all(s, buf, want);
+        *len = n > 0 ? (size_t)n : 0;
+        return n;
     }
-
-    /* Iterate through the address list and try to connect */
-    for (rp = result; rp != NULL; rp = rp->ai_next) 
+    while (total < want)
     {
-        if ((s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1) 
+        // SSL_read returns one record at a time; the loop gathers the chunk
+        n = SSL_read(ssl, buf + total, want - total);
+        if (n <= 0)
         {
-            continue;
+            n = SSL_get_error(ssl, n) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
         }
-
-        if (connect(s, rp->ai_addr, rp->ai_addrlen) != -1) 
+        if (n <= 0)
         {
             break;
         }
-        close(s);
-    }
-
-    if (rp == NULL) 
-    {
-        perror("stream-talk-client: connect");
-        freeaddrinfo(result);
-        return -1;
+        // Update total bytes received
+        total += n;
     }
-    freeaddrinfo(result);
+    // Update len with total bytes received
+    *len = total;
 
-    return s;
+    // Return -1 if receiving failed before anything arrived, otherwise the total
+    return (n < 0 && total == 0) ? -1 : (ssize_t)total;
 }
-
@@ -5,21 +5,28 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <netdb.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "p2pnet.h"
 
 #define SERVER_PORT "5432"
 #define MAX_LINE 256
+/* Bulk mode reads stdin in blocks of this size */
+#define BULK_READ_SIZE 65536
+/* Bulk mode coalesces messages into sends of up to this many bytes */
+#define BULK_SEND_SIZE 262144
 
 /*
- * Lookup a host IP address and connect to it using service. Arguments match the first two
- * arguments to getaddrinfo(3).
+ * Bulk mode: read stdin in large blocks, split it into the same NUL-terminated messages
+ * the line-by-line loop produces, and send them in large coalesced writes. Prints line
+ * and byte rates to stderr when stdin is exhausted.
  *
- * Returns a connected socket descriptor or -1 on error. Caller is responsible for closing
- * the returned socket.
+ * Returns 0 on success or -1 on error.
  */
-int lookup_and_connect(const char *host, const char *service);
+int stream_bulk(int s);
 
 int main(int argc, char *argv[]) 
 {
@@ -27,29 +34,43 @@ int main(int argc, char *argv[])
 	char buf[MAX_LINE];
 	int s;
 	int len;
+	int bulk = 0;
 
-	if (argc == 2) 
+	if (argc == 3 && strcmp(argv[1], "-b") == 0) 
+	{
+		bulk = 1;
+		host = argv[2];
+	}
+	else if (argc == 2) 
 	{
 		host = argv[1];
 	}
 	else 
 	{
-		fprintf(stderr, "usage: %s host\n", argv[0]);
+		fprintf(stderr, "usage: %s [-b] host\n", argv[0]);
 		exit(1);
 	}
 
 	/* Lookup IP and connect to server */
-	if ((s = lookup_and_connect(host, SERVER_PORT)) < 0) 
+	if ((s = p2p_connect(host, SERVER_PORT, AF_INET)) < 0) 
 	{
+		perror("stream-talk-client: connect");
 		exit(1);
 	}
 
+	if (bulk) 
+	{
+		int rc = stream_bulk(s);
+		close(s);
+		return rc < 0 ? 1 : 0;
+	}
+
 	/* Main loop: get and send lines of text */
 	while (fgets(buf, sizeof(buf), stdin)) 
 	{
 		buf[MAX_LINE - 1] = '\0';
 		len = strlen(buf) + 1;
-		if ( send(s, buf, len, 0) == -1) 
+		if (p2p_send_all(s, buf, len, 0) < 0) 
 		{
 			perror("stream-talk-client: send");
 			close(s);
@@ -62,48 +83,95 @@ int main(int argc, char *argv[])
 	return 0;
 }
 
-int lookup_and_connect(const char *host, const char *service) 
+int stream_bulk(int s) 
 {
-	struct addrinfo hints;
-	struct addrinfo *rp, *result;
-	int s;
-
-	/* Translate host name into peer's IP address */
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = 0;
-	hints.ai_protocol = 0;
+	static char in[BULK_READ_SIZE];
+	static char out[BULK_SEND_SIZE];
+	/* Bytes of the current (unfinished) message already copied into out */
+	size_t partial = 0;
+	size_t out_len = 0;
+	unsigned long long lines = 0;
+	unsigned long long bytes = 0;
+	struct timespec start, end;
+	ssize_t n;
 
-	if ((s = getaddrinfo(host, service, &hints, &result)) != 0)
-    {
-		fprintf(stderr, "stream-talk-client: getaddrinfo: %s\n", gai_strerror(s));
-		return -1;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	/* Iterate through the address list and try to connect */
-	for ( rp = result; rp != NULL; rp = rp->ai_next ) 
+	while ((n = read(STDIN_FILENO, in, sizeof(in))) != 0) 
 	{
-		if ((s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1) 
+		if (n < 0) 
 		{
-			continue;
+			if (errno == EINTR) 
+			{
+				continue;
+			}
+			perror("stream-talk-client: read");
+			return -1;
 		}
 
-		if (connect(s, rp->ai_addr, rp->ai_addrlen) != -1) 
+		for (size_t i = 0; i < (size_t)n; ) 
 		{
-			break;
+			/* Messages match fgets(): at most MAX_LINE - 1 characters, newline included */
+			size_t room = MAX_LINE - 1 - partial;
+			size_t avail = (size_t)n - i;
+			size_t take = avail < room ? avail : room;
+			char *nl = memchr(in + i, '\n', take);
+			int done;
+
+			if (nl != NULL) 
+			{
+				take = nl - (in + i) + 1;
+			}
+			done = nl != NULL || partial + take == MAX_LINE - 1;
+
+			memcpy(out + out_len, in + i, take);
+			out_len += take;
+			partial += take;
+			i += take;
+
+			if (done) 
+			{
+				out[out_len++] = '\0';
+				bytes += partial + 1;
+				lines++;
+				partial = 0;
+
+				/* Flush once another full message might not fit */
+				if (out_len > BULK_SEND_SIZE - MAX_LINE) 
+				{
+					if (p2p_send_all(s, out, out_len, MSG_MORE) < 0) 
+					{
+						perror("stream-talk-client: send");
+						return -1;
+					}
+					out_len = 0;
+				}
+			}
 		}
+	}
 
-		close(s);
+	/* A final line without a newline is still sent, as fgets() would return it */
+	if (partial > 0) 
+	{
+		out[out_len++] = '\0';
+		bytes += partial + 1;
+		lines++;
 	}
-    
-	if (rp == NULL) 
+
+	if (out_len > 0 && p2p_send_all(s, out, out_len, 0) < 0) 
 	{
-		perror("stream-talk-client: connect");
-        freeaddrinfo(result);
+		perror("stream-talk-client: send");
 		return -1;
 	}
-    freeaddrinfo(result);
 
-	return s;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (secs <= 0) 
+	{
+		secs = 1e-9;
+	}
+	fprintf(stderr, "stream-talk-client: %llu lines, %llu bytes in %.3f s (%.0f lines/s, %.2f MB/s)\n",
+		lines, bytes, secs, lines / secs, bytes / secs / 1e6);
+
+	return 0;
 }
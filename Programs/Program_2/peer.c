@@ -3,7 +3,6 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <netdb.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -11,10 +10,11 @@
 #include <dirent.h>
 #include <stdint.h>
 
+#include "p2pnet.h"
+
 #define MAX_BUFFER_SIZE 1024
 #define SERVER_PORT 5000
 
-int lookup_and_connect(const char* host, const char* service);
 void join(uint32_t peerID, int sockfd);
 void publish(int sockfd);
 void search(int sockfd);
@@ -43,7 +43,7 @@ int main(int argc, char* argv[])
         exit(1);
     }
     // Attempt to connect to the registry using the provided IP address and port number
-    sockfd = lookup_and_connect(regIP, regPNumber);
+    sockfd = p2p_connect(regIP, regPNumber, AF_UNSPEC);
 
     if (sockfd < 0)
     {
@@ -68,7 +68,7 @@ void join(u_int32_t peerID, int sockfd)
     memcpy(buf + 1, &network_order_peer_id, sizeof(network_order_peer_id));
 
     // Send JOIN request
-    if (send(sockfd, buf, sizeof(uint32_t) + 1, 0) < 0)
+    if (p2p_send_all(sockfd, buf, sizeof(uint32_t) + 1, 0) < 0)
     {
         perror("Send Failed\n");
         return;
@@ -129,7 +129,7 @@ void publish(int sockfd)
     // Convert file count into network byte order
     uint32_t network_order_count = htonl(count);
     memcpy(buf + 1, &network_order_count, sizeof(network_order_count));
-    if (send(sockfd, buf, iterator, 0) < 0)
+    if (p2p_send_all(sockfd, buf, iterator, 0) < 0)
     {    
         perror("Error Sending PUBLISH");
         return;
@@ -153,16 +153,17 @@ void search(int sockfd)
     // Copies filename buffer into buf
     memcpy(buf + 1, filename, strlen(filename) + 1);
 
-    if (send(sockfd, buf, strlen(filename) + 2, 0) < 0) 
+    if (p2p_send_all(sockfd, buf, strlen(filename) + 2, 0) < 0) 
     {
         perror("Error Sending SEARCH");
         return;
     }
     // Buffer to hold server's response
     unsigned char response[10];
-    int received = recv(sockfd, response, sizeof(response), 0);
+    // The reply may arrive in pieces; all 10 bytes are needed
+    ssize_t received = p2p_recv_all(sockfd, response, sizeof(response));
  
-    if (received <= 0)
+    if (received != sizeof(response))
     {
         perror("Error Receiving Response");
         return;
@@ -239,48 +240,3 @@ void display_options(uint32_t  peerID, int sockfd)
     }
 
 }
-
-int lookup_and_connect(const char* host, const char* service) 
-{
-    struct addrinfo hints;
-    struct addrinfo *rp, *result;
-    int s;
-
-    /* Translate host name into peer's IP address */
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0;
-
-    if ((s = getaddrinfo(host, service, &hints, &result)) != 0)
-    {
-        fprintf(stderr, "stream-talk-client: getaddrinfo: %s\n", gai_strerror(s));
-        return -1;
-    }
-
-    /* Iterate through the address list and try to connect */
-    for (rp = result; rp != NULL; rp = rp->ai_next) 
-    {
-        if ((s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1) 
-        {
-            continue;
-        }
-
-        if (connect(s, rp->ai_addr, rp->ai_addrlen) != -1) 
-        {
-            break;
-        }
-        close(s);
-    }
-
-    if (rp == NULL) 
-    {
-        perror("stream-talk-client: connect");
-        freeaddrinfo(result);
-        return -1;
-    }
-    freeaddrinfo(result);
-
-    return s;
-}
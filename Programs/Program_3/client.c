@@ -0,0 +1,1383 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Client side of the peer, on the event loop (see client.h).
+//
+// The registry connection is non-blocking and buffered both ways. Requests are queued
+// with their encoded bytes in the order they were sent; the registry answers in order,
+// so each reply completes the oldest request. A BUSY reply means the registry turned
+// the connection away before reading anything, so everything queued is sent again on a
+// new connection once the registry's delay has passed.
+//
+// A download, or a HAVE probe of a holder, is a small state machine: look the file up,
+// connect to each endpoint of the holder in turn, send the request, read the status,
+// then write (and for deflate, inflate) the data into the file until the holder closes.
+// Neither connecting nor the TLS handshake blocks the loop: the handshake runs a step at
+// a time as the socket becomes ready. A download that fails once its file is open
+// removes the partial file.
+
+#define _GNU_SOURCE
+#include "client.h"
+#include "tls.h"
+#include "upload.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+// Number of SEARCH results remembered; the least recently used one is replaced
+#define SEARCH_CACHE_SIZE 64
+// Longest filename kept in the SEARCH cache (the registry's own limit)
+#define SEARCH_CACHE_NAME_LEN 128
+// Seconds a found result is reused before asking the registry again
+#define SEARCH_TTL 30
+// Seconds a "not indexed" result is reused; short so newly published files show up soon
+#define SEARCH_NEGATIVE_TTL 5
+// Largest reply payload accepted from the registry
+#define MAX_REPLY_LEN (64 * 1024)
+// Times in a row the registry is reconnected to after it said it was busy
+#define BUSY_MAX_RETRIES 10
+// v2 action codes the client sends or expects
+#define ACTION_SEARCH 2
+#define ACTION_BUSY 7
+#define ACTION_LOOKUP_PEER 8
+// Bytes received from a holder at a time, and receives per wakeup, so one fast holder
+// cannot hold up the rest of the loop
+#define RECV_CHUNK (64 * 1024)
+#define RECV_BURST 16
+// Bytes inflated at a time
+#define INFLATE_CHUNK (256 * 1024)
+// Longest a download waits on its holder without any progress, connecting included,
+// before it moves on to the next endpoint or gives up
+#define DOWNLOAD_TIMEOUT_MS 15000
+// Longest a registry reconnect, TLS handshake included, may take
+#define RECONNECT_TIMEOUT_MS 10000
+
+// A request the registry has not answered yet
+struct PendingRequest
+{
+    struct PendingRequest* next;
+    // v2 requests are answered with a frame carrying action; v1 requests with reply_len
+    // bytes, or nothing when it is 0
+    int v1;
+    uint8_t action;
+    size_t reply_len;
+    client_reply_fn fn;
+    void* arg;
+    // The encoded request, kept until it is answered so it can be sent again
+    size_t len;
+    uint8_t bytes[];
+};
+
+// A SEARCH or LOOKUP_PEER in progress, and its result
+struct Lookup
+{
+    // Empty for LOOKUP_PEER
+    char filename[MAX_REQUEST_LEN];
+    uint32_t peer_id;
+    struct PeerEndpoint endpoints[MAX_ENDPOINTS];
+    int endpoint_count;
+    int status;
+    client_holder_fn fn;
+    void* arg;
+};
+
+// A remembered SEARCH result
+struct SearchCacheEntry
+{
+    int used;
+    char filename[SEARCH_CACHE_NAME_LEN];
+    // 0 when the registry did not have the file
+    uint32_t peer_id;
+    struct PeerEndpoint endpoints[MAX_ENDPOINTS];
+    int endpoint_count;
+    // Monotonic time (ms) after which the result must be looked up again
+    uint64_t expires;
+    // Value of search_cache_clock when the entry was last used, for LRU replacement
+    unsigned long last_used;
+};
+
+enum download_state
+{
+    // Waiting for the connection to an endpoint of the holder
+    DOWNLOAD_CONNECTING,
+    // Running the TLS handshake on it
+    DOWNLOAD_HANDSHAKING,
+    // Sending the request, then reading the status
+    DOWNLOAD_REQUESTING,
+    // Writing the file data to disk
+    DOWNLOAD_RECEIVING
+};
+
+// A download from another peer, or a HAVE probe asking a holder whether it has a file
+struct Download
+{
+    char filename[MAX_REQUEST_LEN];
+    int verbose;
+    // Set for a HAVE probe: the SEARCH waiting for its answer
+    struct Lookup* probe_for;
+    client_fetch_fn fn;
+    void* arg;
+    struct PeerEndpoint endpoints[MAX_ENDPOINTS];
+    int endpoint_count;
+    int next_endpoint;
+    int sock;
+    enum download_state state;
+    // Mask of codecs offered, 0 for a plain FETCH, and the one the holder chose
+    int offer_codecs;
+    int codec;
+    // Request bytes not yet written, and whether TLS still holds some back
+    struct P2pBuffer request;
+    int request_pending;
+    // Status, then the chosen codec when codecs were offered
+    unsigned char status[2];
+    size_t status_len;
+    size_t status_have;
+    FILE* file;
+    z_stream zs;
+    int inflating;
+    int stream_end;
+    long long total;
+    long long wire_bytes;
+    // Timeout timer (0 when none is set) and when the connection last made progress
+    uint64_t timer;
+    uint64_t last_active;
+};
+
+static struct P2pLoop* event_loop = NULL;
+static char* registry_host = NULL;
+static char* registry_service = NULL;
+static int registry_sock = -1;
+static int registry_version = 1;
+static struct P2pBuffer registry_in;
+static struct P2pBuffer registry_out;
+// TLS kept part of the last write back
+static int registry_backlog = 0;
+static struct PendingRequest* pending_head = NULL;
+static struct PendingRequest* pending_tail = NULL;
+// Set from a BUSY reply until the new connection is up
+static int reconnecting = 0;
+// The reconnect in progress: its socket, whether it is handshaking and its timeout
+static int reconnect_sock = -1;
+static int reconnect_handshaking = 0;
+static uint64_t reconnect_timer = 0;
+static int busy_retries = 0;
+static int settle_scheduled = 0;
+// Recent SEARCH results, so repeated lookups cost no round trip to the registry
+static struct SearchCacheEntry search_cache[SEARCH_CACHE_SIZE];
+static unsigned long search_cache_clock = 0;
+static int active_downloads = 0;
+
+static int connect_blocking(const char* host, const char* service);
+static int attach_registry(int sock);
+static void close_registry(void);
+static void drop_registry(void);
+static void registry_event(struct P2pLoop* loop, int fd, short revents, void* arg);
+static int flush_registry(void);
+static void update_registry_events(void);
+static void process_replies(void);
+static void registry_busy(uint32_t retry_ms);
+static void reconnect_registry(struct P2pLoop* loop, void* arg);
+static void reconnect_event(struct P2pLoop* loop, int fd, short revents, void* arg);
+static void reconnect_timeout(struct P2pLoop* loop, void* arg);
+static void reconnect_failed(void);
+static struct PendingRequest* new_request(size_t len, client_reply_fn fn, void* arg);
+static void queue_request(struct PendingRequest* request);
+static void settle_registry(struct P2pLoop* loop, void* arg);
+static void fail_pending(void);
+static void search_reply(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg);
+static void search_reply_v1(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg);
+static void lookup_reply(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg);
+static void decode_holder(const uint8_t* response, uint32_t response_len, struct Lookup* lookup);
+static void finish_lookup(struct Lookup* lookup, int status);
+static void finish_lookup_later(struct P2pLoop* loop, void* arg);
+static void probe_holder(struct Lookup* lookup);
+static void probe_done(struct Lookup* lookup, long long result);
+static int cache_get(struct Lookup* lookup);
+static void cache_put(const struct Lookup* lookup);
+static void fetch_found(int status, uint32_t peer_id, const struct PeerEndpoint* endpoints, int endpoint_count, void* arg);
+static void connect_next(struct Download* download);
+static void download_event(struct P2pLoop* loop, int fd, short revents, void* arg);
+static void download_connected(struct Download* download);
+static void download_handshake(struct Download* download);
+static void start_request(struct Download* download);
+static void download_progress(struct Download* download);
+static void download_timeout(struct P2pLoop* loop, void* arg);
+static void send_request(struct Download* download);
+static void read_status(struct Download* download);
+static void receive_data(struct Download* download);
+static void finish_receiving(struct Download* download, ssize_t last);
+static void close_download_socket(struct Download* download);
+static void download_failed(struct Download* download);
+static void finish_download(struct Download* download, long long result);
+
+int client_start(struct P2pLoop* loop, const char* host, const char* service)
+{
+    event_loop = loop;
+    registry_host = strdup(host);
+    registry_service = strdup(service);
+    if (registry_host == NULL || registry_service == NULL)
+    {
+        return -1;
+    }
+
+    int sock = connect_blocking(host, service);
+    return sock < 0 ? -1 : attach_registry(sock);
+}
+
+void client_set_version(int version)
+{
+    registry_version = version;
+}
+
+int client_version(void)
+{
+    return registry_version;
+}
+
+void client_request(uint8_t action, const void* payload, uint32_t payload_len, client_reply_fn fn, void* arg)
+{
+    struct PendingRequest* request = new_request(V2_HEADER_LEN + (size_t)payload_len, fn, arg);
+    if (request == NULL)
+    {
+        return;
+    }
+    request->action = action;
+    // Requests carry no flags
+    p2p_frame_header_encode(request->bytes, action, 0, payload_len);
+    if (payload_len > 0)
+    {
+        memcpy(request->bytes + V2_HEADER_LEN, payload, payload_len);
+    }
+    queue_request(request);
+}
+
+void client_request_v1(const void* msg, size_t msg_len, size_t reply_len, client_reply_fn fn, void* arg)
+{
+    struct PendingRequest* request = new_request(msg_len, fn, arg);
+    if (request == NULL)
+    {
+        return;
+    }
+    request->v1 = 1;
+    request->reply_len = reply_len;
+    memcpy(request->bytes, msg, msg_len);
+    queue_request(request);
+}
+
+void client_search(const char* filename, client_holder_fn fn, void* arg)
+{
+    struct Lookup* lookup = calloc(1, sizeof(*lookup));
+    size_t name_len = strlen(filename);
+
+    if (lookup == NULL)
+    {
+        perror("Error Starting SEARCH");
+        fn(-1, 0, NULL, 0, arg);
+        return;
+    }
+    lookup->fn = fn;
+    lookup->arg = arg;
+
+    // Long enough for a FETCH too: action code, codec offer, name and terminator
+    if (name_len + 3 > MAX_REQUEST_LEN)
+    {
+        fprintf(stderr, "File Name Too Long\n");
+        lookup->status = -1;
+        p2p_loop_timer(event_loop, 0, finish_lookup_later, lookup);
+        return;
+    }
+    memcpy(lookup->filename, filename, name_len + 1);
+
+    // A result younger than its TTL is returned without contacting the registry
+    if (cache_get(lookup))
+    {
+        p2p_loop_timer(event_loop, 0, finish_lookup_later, lookup);
+        return;
+    }
+
+    if (registry_version >= 2)
+    {
+        // v2 SEARCH payload is the bare filename; its length comes from the frame header
+        client_request(ACTION_SEARCH, filename, name_len, search_reply, lookup);
+        return;
+    }
+    // v1: action code 2, then the filename and its terminator; the reply is always 10 bytes
+    unsigned char request[MAX_REQUEST_LEN];
+    request[0] = ACTION_SEARCH;
+    memcpy(request + 1, filename, name_len + 1);
+    client_request_v1(request, name_len + 2, 10, search_reply_v1, lookup);
+}
+
+void client_search_invalidate(const char* filename)
+{
+    for (int i = 0; i < SEARCH_CACHE_SIZE; i++)
+    {
+        if (search_cache[i].used && strcmp(search_cache[i].filename, filename) == 0)
+        {
+            search_cache[i].used = 0;
+            break;
+        }
+    }
+}
+
+void client_lookup(uint32_t peer_id, client_holder_fn fn, void* arg)
+{
+    struct Lookup* lookup = calloc(1, sizeof(*lookup));
+    if (lookup == NULL)
+    {
+        perror("Error Starting LOOKUP");
+        fn(-1, 0, NULL, 0, arg);
+        return;
+    }
+    lookup->fn = fn;
+    lookup->arg = arg;
+
+    uint32_t network_order_id = htonl(peer_id);
+    client_request(ACTION_LOOKUP_PEER, &network_order_id, sizeof(network_order_id), lookup_reply, lookup);
+}
+
+void client_fetch(const char* filename, int verbose, client_fetch_fn fn, void* arg)
+{
+    struct Download* download = calloc(1, sizeof(*download));
+    if (download == NULL)
+    {
+        perror("Error Starting Download");
+        fn(filename, -1, arg);
+        return;
+    }
+    // A name too long to request is refused by the SEARCH below
+    snprintf(download->filename, sizeof(download->filename), "%s", filename);
+    download->verbose = verbose;
+    download->fn = fn;
+    download->arg = arg;
+    download->sock = -1;
+    active_downloads++;
+
+    client_search(filename, fetch_found, download);
+}
+
+int client_downloads(void)
+{
+    return active_downloads;
+}
+
+void client_close(void)
+{
+    close_registry();
+    while (pending_head != NULL)
+    {
+        struct PendingRequest* request = pending_head;
+        pending_head = request->next;
+        free(request);
+    }
+    pending_tail = NULL;
+}
+
+// Connect to host, then start TLS when it is on. Returns the blocking socket or -1
+// (errno tells why when the connection itself failed)
+static int connect_blocking(const char* host, const char* service)
+{
+    int sock = p2p_connect(host, service, AF_UNSPEC);
+    if (sock < 0)
+    {
+        return -1;
+    }
+
+    // Every connection is encrypted once TLS is on
+    if (tls_client_enabled() && tls_connect(sock, host, service) < 0)
+    {
+        fprintf(stderr, "TLS Handshake With %s Failed\n", host);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Serve a new registry connection from the loop, first sending every request the
+// connection it replaces did not answer. Returns 0 or -1
+static int attach_registry(int sock)
+{
+    if (tls_set_nonblocking(sock) < 0 || p2p_loop_watch(event_loop, sock, POLLIN, registry_event, NULL) < 0)
+    {
+        tls_close(sock);
+        return -1;
+    }
+    registry_sock = sock;
+    for (struct PendingRequest* request = pending_head; request != NULL; request = request->next)
+    {
+        if (p2p_buffer_append(&registry_out, request->bytes, request->len) < 0)
+        {
+            close_registry();
+            return -1;
+        }
+    }
+    update_registry_events();
+    return 0;
+}
+
+// Close the registry connection and drop whatever it had buffered
+static void close_registry(void)
+{
+    if (registry_sock >= 0)
+    {
+        p2p_loop_unwatch(event_loop, registry_sock);
+        tls_close(registry_sock);
+        registry_sock = -1;
+    }
+    p2p_buffer_consume(&registry_in, registry_in.len);
+    p2p_buffer_consume(&registry_out, registry_out.len);
+    registry_backlog = 0;
+}
+
+// The connection failed or the registry closed it: every unanswered request fails
+static void drop_registry(void)
+{
+    close_registry();
+    fail_pending();
+}
+
+static void registry_event(struct P2pLoop* loop, int fd, short revents, void* arg)
+{
+    (void)loop;
+    (void)arg;
+
+    if ((revents & POLLOUT) && flush_registry() < 0)
+    {
+        fprintf(stderr, "Lost Connection To Registry\n");
+        drop_registry();
+        return;
+    }
+    if (revents & (POLLIN | POLLERR | POLLHUP))
+    {
+        ssize_t got;
+        while ((got = p2p_buffer_read(&registry_in, fd, tls_recv)) > 0)
+        {
+        }
+        int closed = got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+
+        // Replies that arrived before the registry closed are still answered; a BUSY
+        // reply among them replaces the connection
+        process_replies();
+        if (closed && registry_sock == fd && !reconnecting)
+        {
+            fprintf(stderr, "Lost Connection To Registry\n");
+            drop_registry();
+            return;
+        }
+    }
+    update_registry_events();
+}
+
+// Write as much as the registry connection takes. Returns 0, or -1 if it failed
+static int flush_registry(void)
+{
+    ssize_t left = p2p_buffer_write(&registry_out, registry_sock, tls_send);
+    if (left == 0)
+    {
+        left = tls_flush(registry_sock);
+    }
+    if (left < 0)
+    {
+        return -1;
+    }
+    registry_backlog = left > 0;
+    return 0;
+}
+
+static void update_registry_events(void)
+{
+    if (registry_sock >= 0)
+    {
+        p2p_loop_modify(event_loop, registry_sock, POLLIN | (registry_out.len > 0 || registry_backlog ? POLLOUT : 0));
+    }
+}
+
+// Complete every request whose reply has arrived, oldest first
+static void process_replies(void)
+{
+    while (registry_sock >= 0)
+    {
+        struct PendingRequest* request = pending_head;
+
+        if (request != NULL && request->v1)
+        {
+            if (registry_in.len < request->reply_len)
+            {
+                return;
+            }
+            pending_head = request->next;
+            pending_tail = pending_head != NULL ? pending_tail : NULL;
+            request->fn(0, 0, registry_in.data + registry_in.head, request->reply_len, request->arg);
+            p2p_buffer_consume(&registry_in, request->reply_len);
+            free(request);
+            continue;
+        }
+
+        // Only a BUSY frame arrives without being asked for
+        struct P2pFrameHeader header;
+        const uint8_t* payload;
+        int framed = p2p_buffer_frame(&registry_in, &header, &payload, MAX_REPLY_LEN);
+        if (framed == 0)
+        {
+            return;
+        }
+        if (framed < 0 || (header.action != ACTION_BUSY && (request == NULL || header.action != request->action)))
+        {
+            fprintf(stderr, "Unexpected Reply From Registry\n");
+            drop_registry();
+            return;
+        }
+        if (header.action == ACTION_BUSY)
+        {
+            // BUSY carries the error flag, so only the payload tells anything
+            uint32_t retry_ms = 0;
+            if (header.payload_len == sizeof(retry_ms))
+            {
+                memcpy(&retry_ms, payload, sizeof(retry_ms));
+            }
+            registry_busy(ntohl(retry_ms));
+            return;
+        }
+
+        busy_retries = 0;
+        pending_head = request->next;
+        pending_tail = pending_head != NULL ? pending_tail : NULL;
+        request->fn((header.flags & V2_FLAG_ERROR) ? -1 : 0, header.flags, payload, header.payload_len, request->arg);
+        p2p_buffer_consume(&registry_in, V2_HEADER_LEN + header.payload_len);
+        free(request);
+    }
+}
+
+// The registry turned this connection away. Wait as long as it asked plus up to a
+// quarter more at random, so peers turned away together do not all return at once,
+// then reconnect
+static void registry_busy(uint32_t retry_ms)
+{
+    close_registry();
+    if (busy_retries++ == BUSY_MAX_RETRIES)
+    {
+        fprintf(stderr, "Registry Still Busy, Giving Up\n");
+        reconnecting = 0;
+        fail_pending();
+        return;
+    }
+
+    retry_ms = retry_ms > 0 ? retry_ms : 1;
+    uint32_t wait_ms = retry_ms + rand() % (retry_ms / 4 + 1);
+    printf(" Registry Busy, Retrying In %u ms\n", wait_ms);
+    reconnecting = p2p_loop_timer(event_loop, wait_ms, reconnect_registry, NULL) != 0;
+    if (!reconnecting)
+    {
+        fail_pending();
+    }
+}
+
+// Connect to the registry again from the loop; the TLS handshake runs there too, so
+// downloads keep going meanwhile
+static void reconnect_registry(struct P2pLoop* loop, void* arg)
+{
+    (void)arg;
+    int sock = p2p_connect_start(registry_host, registry_service, AF_UNSPEC);
+    if (sock < 0 || p2p_loop_watch(loop, sock, POLLOUT, reconnect_event, NULL) < 0)
+    {
+        if (sock >= 0)
+        {
+            close(sock);
+        }
+        fprintf(stderr, "Failed To Reconnect To Registry\n");
+        reconnecting = 0;
+        fail_pending();
+        return;
+    }
+    reconnect_sock = sock;
+    reconnect_handshaking = 0;
+    reconnect_timer = p2p_loop_timer(loop, RECONNECT_TIMEOUT_MS, reconnect_timeout, NULL);
+}
+
+static void reconnect_event(struct P2pLoop* loop, int fd, short revents, void* arg)
+{
+    (void)revents;
+    (void)arg;
+
+    if (!reconnect_handshaking)
+    {
+        if (p2p_connect_finish(fd) < 0 ||
+            (tls_client_enabled() && tls_connect_start(fd, registry_host, registry_service) < 0))
+        {
+            reconnect_failed();
+            return;
+        }
+        reconnect_handshaking = 1;
+    }
+    if (tls_client_enabled())
+    {
+        short events;
+        int done = tls_handshake(fd, &events);
+        if (done < 0)
+        {
+            fprintf(stderr, "TLS Handshake With %s Failed\n", registry_host);
+            reconnect_failed();
+            return;
+        }
+        if (done == 0)
+        {
+            p2p_loop_modify(loop, fd, events);
+            return;
+        }
+    }
+
+    p2p_loop_unwatch(loop, fd);
+    p2p_loop_cancel(loop, reconnect_timer);
+    reconnect_timer = 0;
+    reconnect_sock = -1;
+    reconnecting = 0;
+    if (attach_registry(fd) < 0)
+    {
+        fail_pending();
+    }
+}
+
+static void reconnect_timeout(struct P2pLoop* loop, void* arg)
+{
+    (void)loop;
+    (void)arg;
+    reconnect_timer = 0;
+    fprintf(stderr, "Timed Out Reconnecting To Registry\n");
+    reconnect_failed();
+}
+
+// Give up on the reconnect in progress, failing the requests that were waiting for it
+static void reconnect_failed(void)
+{
+    p2p_loop_unwatch(event_loop, reconnect_sock);
+    tls_close(reconnect_sock);
+    reconnect_sock = -1;
+    if (reconnect_timer != 0)
+    {
+        p2p_loop_cancel(event_loop, reconnect_timer);
+        reconnect_timer = 0;
+    }
+    reconnecting = 0;
+    fprintf(stderr, "Failed To Reconnect To Registry\n");
+    fail_pending();
+}
+
+// Allocate a request with room for len encoded bytes
+static struct PendingRequest* new_request(size_t len, client_reply_fn fn, void* arg)
+{
+    struct PendingRequest* request = calloc(1, sizeof(*request) + len);
+    if (request == NULL)
+    {
+        perror("Error Queuing Request");
+        fn(-1, 0, NULL, 0, arg);
+        return NULL;
+    }
+    request->fn = fn;
+    request->arg = arg;
+    request->len = len;
+    return request;
+}
+
+// Queue a request and send it when the connection takes it. The reply is handled from
+// the loop; so is a request that can never be sent, which fails there
+static void queue_request(struct PendingRequest* request)
+{
+    if (pending_tail != NULL)
+    {
+        pending_tail->next = request;
+    }
+    else
+    {
+        pending_head = request;
+    }
+    pending_tail = request;
+
+    if (registry_sock >= 0 && p2p_buffer_append(&registry_out, request->bytes, request->len) < 0)
+    {
+        perror("Error Queuing Request");
+        drop_registry();
+    }
+    update_registry_events();
+    if (!settle_scheduled)
+    {
+        settle_scheduled = p2p_loop_timer(event_loop, 0, settle_registry, NULL) != 0;
+    }
+}
+
+// Complete v1 requests that get no reply, and fail requests queued while there is no
+// connection to send them on
+static void settle_registry(struct P2pLoop* loop, void* arg)
+{
+    (void)loop;
+    (void)arg;
+    settle_scheduled = 0;
+    process_replies();
+    if (registry_sock < 0 && !reconnecting)
+    {
+        fail_pending();
+    }
+}
+
+static void fail_pending(void)
+{
+    // Requests the callbacks queue are not part of this failure
+    struct PendingRequest* request = pending_head;
+    pending_head = NULL;
+    pending_tail = NULL;
+    while (request != NULL)
+    {
+        struct PendingRequest* next = request->next;
+        request->fn(-1, 0, NULL, 0, request->arg);
+        free(request);
+        request = next;
+    }
+}
+
+static void search_reply(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg)
+{
+    struct Lookup* lookup = arg;
+
+    if (status < 0 || payload_len < 5)
+    {
+        fprintf(stderr, "Error Receiving Response\n");
+        finish_lookup(lookup, -1);
+        return;
+    }
+    decode_holder(payload, payload_len, lookup);
+
+    // A holder matched only by its summary may not have the file; ask it directly
+    if (lookup->peer_id != 0 && (flags & V2_FLAG_CANDIDATE))
+    {
+        probe_holder(lookup);
+        return;
+    }
+    cache_put(lookup);
+    finish_lookup(lookup, 0);
+}
+
+static void search_reply_v1(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg)
+{
+    struct Lookup* lookup = arg;
+    (void)flags;
+
+    if (status < 0 || payload_len != 10)
+    {
+        fprintf(stderr, "Error Receiving Response\n");
+        finish_lookup(lookup, -1);
+        return;
+    }
+
+    // Response layout: 4-byte peer ID, 4-byte IPv4 address, 2-byte port
+    uint16_t port;
+    memcpy(&lookup->peer_id, payload, sizeof(lookup->peer_id));
+    lookup->peer_id = ntohl(lookup->peer_id);
+    inet_ntop(AF_INET, payload + 4, lookup->endpoints[0].host, sizeof(lookup->endpoints[0].host));
+    memcpy(&port, payload + 8, sizeof(port));
+    lookup->endpoints[0].port = ntohs(port);
+    lookup->endpoint_count = 1;
+    cache_put(lookup);
+    finish_lookup(lookup, 0);
+}
+
+static void lookup_reply(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg)
+{
+    struct Lookup* lookup = arg;
+    (void)flags;
+
+    if (status < 0 || payload_len < 5)
+    {
+        finish_lookup(lookup, -1);
+        return;
+    }
+    decode_holder(payload, payload_len, lookup);
+    finish_lookup(lookup, 0);
+}
+
+// Reads a v2 SEARCH or LOOKUP_PEER reply: 4-byte peer ID, endpoint count, then
+// (family, port, address) entries
+static void decode_holder(const uint8_t* response, uint32_t response_len, struct Lookup* lookup)
+{
+    memcpy(&lookup->peer_id, response, sizeof(lookup->peer_id));
+    lookup->peer_id = ntohl(lookup->peer_id);
+    lookup->endpoint_count = 0;
+    uint32_t offset = 5;
+    for (int e = 0; e < response[4] && e < MAX_ENDPOINTS; e++)
+    {
+        struct sockaddr_storage addr;
+        ssize_t used = p2p_endpoint_decode(response + offset, response_len - offset, &addr);
+        if (used < 0)
+        {
+            break;
+        }
+        struct PeerEndpoint* endpoint = &lookup->endpoints[e];
+        if (addr.ss_family == AF_INET6)
+        {
+            struct sockaddr_in6* addr6 = (struct sockaddr_in6*)&addr;
+            endpoint->port = ntohs(addr6->sin6_port);
+            inet_ntop(AF_INET6, &addr6->sin6_addr, endpoint->host, sizeof(endpoint->host));
+        }
+        else
+        {
+            struct sockaddr_in* addr4 = (struct sockaddr_in*)&addr;
+            endpoint->port = ntohs(addr4->sin_port);
+            inet_ntop(AF_INET, &addr4->sin_addr, endpoint->host, sizeof(endpoint->host));
+        }
+        offset += used;
+        lookup->endpoint_count++;
+    }
+}
+
+static void finish_lookup(struct Lookup* lookup, int status)
+{
+    lookup->fn(status, lookup->peer_id, lookup->endpoints, lookup->endpoint_count, lookup->arg);
+    free(lookup);
+}
+
+// finish_lookup() for results known when the lookup was started
+static void finish_lookup_later(struct P2pLoop* loop, void* arg)
+{
+    struct Lookup* lookup = arg;
+    (void)loop;
+    finish_lookup(lookup, lookup->status);
+}
+
+// Ask the holder a SEARCH found whether it really has the file
+static void probe_holder(struct Lookup* lookup)
+{
+    struct Download* probe = calloc(1, sizeof(*probe));
+    if (probe == NULL)
+    {
+        probe_done(lookup, -1);
+        return;
+    }
+    strcpy(probe->filename, lookup->filename);
+    probe->probe_for = lookup;
+    probe->sock = -1;
+    memcpy(probe->endpoints, lookup->endpoints, sizeof(probe->endpoints));
+    probe->endpoint_count = lookup->endpoint_count;
+    connect_next(probe);
+}
+
+// The holder answered the probe: 1 if it has the file, 0 if not, -1 on error
+static void probe_done(struct Lookup* lookup, long long result)
+{
+    if (result != 1)
+    {
+        fprintf(stderr, "Peer %u Does Not Have %s (Summary False Positive)\n", lookup->peer_id, lookup->filename);
+        lookup->peer_id = 0;
+        lookup->endpoint_count = 0;
+    }
+    cache_put(lookup);
+    finish_lookup(lookup, 0);
+}
+
+// Fill lookup from the cache if it holds a result for its filename younger than its TTL.
+// Returns 1 if it did
+static int cache_get(struct Lookup* lookup)
+{
+    uint64_t now = p2p_now_ms();
+
+    for (int i = 0; i < SEARCH_CACHE_SIZE; i++)
+    {
+        struct SearchCacheEntry* entry = &search_cache[i];
+        if (entry->used && now < entry->expires && strcmp(entry->filename, lookup->filename) == 0)
+        {
+            lookup->peer_id = entry->peer_id;
+            lookup->endpoint_count = entry->endpoint_count;
+            memcpy(lookup->endpoints, entry->endpoints, entry->endpoint_count * sizeof(entry->endpoints[0]));
+            entry->last_used = ++search_cache_clock;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Remember a SEARCH result, refreshing the entry for its filename or replacing a free
+// entry, or failing that the least recently used one
+static void cache_put(const struct Lookup* lookup)
+{
+    struct SearchCacheEntry* slot = NULL;
+
+    if (strlen(lookup->filename) >= SEARCH_CACHE_NAME_LEN)
+    {
+        return;
+    }
+    for (int i = 0; i < SEARCH_CACHE_SIZE; i++)
+    {
+        struct SearchCacheEntry* entry = &search_cache[i];
+        if (entry->used && strcmp(entry->filename, lookup->filename) == 0)
+        {
+            slot = entry;
+            break;
+        }
+        if (slot == NULL || (slot->used && (!entry->used || entry->last_used < slot->last_used)))
+        {
+            slot = entry;
+        }
+    }
+
+    slot->used = 1;
+    strcpy(slot->filename, lookup->filename);
+    slot->peer_id = lookup->peer_id;
+    slot->endpoint_count = lookup->endpoint_count;
+    memcpy(slot->endpoints, lookup->endpoints, lookup->endpoint_count * sizeof(lookup->endpoints[0]));
+    slot->expires = p2p_now_ms() + (lookup->peer_id != 0 ? SEARCH_TTL : SEARCH_NEGATIVE_TTL) * 1000;
+    slot->last_used = ++search_cache_clock;
+}
+
+static void fetch_found(int status, uint32_t peer_id, const struct PeerEndpoint* endpoints, int endpoint_count, void* arg)
+{
+    struct Download* download = arg;
+
+    if (status < 0)
+    {
+        finish_download(download, -1);
+        return;
+    }
+    if (peer_id == 0)
+    {
+        printf("File Not Indexed By Registry\n");
+        finish_download(download, -1);
+        return;
+    }
+
+    if (download->verbose)
+    {
+        // Prints peer id and every endpoint that holds requested file
+        printf("File Found At\n Peer %u\n", peer_id);
+        for (int e = 0; e < endpoint_count; e++)
+        {
+            printf(strchr(endpoints[e].host, ':') ? "[%s]:%u\n" : "%s:%u\n", endpoints[e].host, endpoints[e].port);
+        }
+    }
+
+    memcpy(download->endpoints, endpoints, endpoint_count * sizeof(endpoints[0]));
+    download->endpoint_count = endpoint_count;
+    // Offer compression first; holders that do not support it refuse the request, and
+    // are asked again with a plain FETCH
+    download->offer_codecs = FETCH_CODEC_MASK(FETCH_CODEC_DEFLATE);
+    connect_next(download);
+}
+
+// Start connecting to the next endpoint of the holder that takes a connection attempt
+static void connect_next(struct Download* download)
+{
+    while (download->next_endpoint < download->endpoint_count)
+    {
+        const struct PeerEndpoint* endpoint = &download->endpoints[download->next_endpoint++];
+        char port_str[6];
+        snprintf(port_str, sizeof(port_str), "%u", endpoint->port);
+
+        int sock = p2p_connect_start(endpoint->host, port_str, AF_UNSPEC);
+        if (sock >= 0 && p2p_loop_watch(event_loop, sock, POLLOUT, download_event, download) == 0)
+        {
+            download->sock = sock;
+            download->state = DOWNLOAD_CONNECTING;
+            download_progress(download);
+            return;
+        }
+        if (sock >= 0)
+        {
+            close(sock);
+        }
+    }
+
+    if (download->probe_for == NULL)
+    {
+        perror("Error Connecting To Peer");
+    }
+    download_failed(download);
+}
+
+static void download_event(struct P2pLoop* loop, int fd, short revents, void* arg)
+{
+    struct Download* download = arg;
+    (void)loop;
+    (void)fd;
+    (void)revents;
+
+    download_progress(download);
+    switch (download->state)
+    {
+        case DOWNLOAD_CONNECTING:
+            download_connected(download);
+            break;
+        case DOWNLOAD_HANDSHAKING:
+            download_handshake(download);
+            break;
+        case DOWNLOAD_REQUESTING:
+            if (download->request_pending)
+            {
+                send_request(download);
+            }
+            else
+            {
+                read_status(download);
+            }
+            break;
+        case DOWNLOAD_RECEIVING:
+            receive_data(download);
+            break;
+    }
+}
+
+// The connection attempt finished: on success start TLS, otherwise move on to the next
+// endpoint
+static void download_connected(struct Download* download)
+{
+    const struct PeerEndpoint* endpoint = &download->endpoints[download->next_endpoint - 1];
+    char port_str[6];
+    snprintf(port_str, sizeof(port_str), "%u", endpoint->port);
+
+    if (p2p_connect_finish(download->sock) < 0 ||
+        (tls_client_enabled() && tls_connect_start(download->sock, endpoint->host, port_str) < 0))
+    {
+        close_download_socket(download);
+        connect_next(download);
+        return;
+    }
+    download->state = DOWNLOAD_HANDSHAKING;
+    download_handshake(download);
+}
+
+// Run the TLS handshake as far as the socket allows, then send the request. Without TLS
+// the request goes out right away
+static void download_handshake(struct Download* download)
+{
+    if (tls_client_enabled())
+    {
+        short events;
+        int done = tls_handshake(download->sock, &events);
+        if (done < 0)
+        {
+            fprintf(stderr, "TLS Handshake With %s Failed\n", download->endpoints[download->next_endpoint - 1].host);
+            close_download_socket(download);
+            connect_next(download);
+            return;
+        }
+        if (done == 0)
+        {
+            p2p_loop_modify(event_loop, download->sock, events);
+            return;
+        }
+    }
+    start_request(download);
+}
+
+static void start_request(struct Download* download)
+{
+    // HAVE probe: action code 6. Plain FETCH: action code 3. Compressed FETCH: action
+    // code 5 and the codec offer. Then the filename and its terminator
+    unsigned char request[2];
+    size_t request_len = 0;
+    if (download->probe_for != NULL)
+    {
+        request[request_len++] = ACTION_HAVE;
+    }
+    else if (download->offer_codecs != 0)
+    {
+        request[request_len++] = ACTION_FETCH_CODEC;
+        request[request_len++] = download->offer_codecs;
+    }
+    else
+    {
+        request[request_len++] = ACTION_FETCH;
+    }
+    if (p2p_buffer_append(&download->request, request, request_len) < 0 ||
+        p2p_buffer_append(&download->request, download->filename, strlen(download->filename) + 1) < 0)
+    {
+        perror("Error Sending Fetch Request");
+        download_failed(download);
+        return;
+    }
+
+    // The status, then the chosen codec if one was offered
+    download->status[0] = 0;
+    download->status[1] = FETCH_CODEC_NONE;
+    download->status_len = download->probe_for == NULL && download->offer_codecs != 0 ? 2 : 1;
+    download->status_have = 0;
+    download->state = DOWNLOAD_REQUESTING;
+    send_request(download);
+}
+
+static void send_request(struct Download* download)
+{
+    ssize_t left = p2p_buffer_write(&download->request, download->sock, tls_send);
+    if (left == 0)
+    {
+        left = tls_flush(download->sock);
+    }
+    if (left < 0)
+    {
+        perror("Error Sending Fetch Request");
+        download_failed(download);
+        return;
+    }
+    download->request_pending = left > 0;
+    p2p_loop_modify(event_loop, download->sock, left > 0 ? POLLOUT : POLLIN);
+}
+
+static void read_status(struct Download* download)
+{
+    while (download->status_have < download->status_len)
+    {
+        ssize_t got = tls_recv(download->sock, download->status + download->status_have, download->status_len - download->status_have, 0);
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if (got <= 0)
+        {
+            break;
+        }
+        download->status_have += got;
+        // A refusal is the status byte alone
+        if (download->status[0] != 0)
+        {
+            break;
+        }
+    }
+
+    // A HAVE probe only needs the status
+    if (download->probe_for != NULL)
+    {
+        finish_download(download, download->status_have == 1 ? download->status[0] == 0 : -1);
+        return;
+    }
+
+    if (download->status_have != download->status_len || download->status[0] != 0 ||
+        (download->status[1] != FETCH_CODEC_NONE && !(download->offer_codecs & FETCH_CODEC_MASK(download->status[1]))))
+    {
+        close_download_socket(download);
+        if (download->offer_codecs != 0)
+        {
+            // Ask again, from the first endpoint, without offering codecs
+            download->offer_codecs = 0;
+            download->next_endpoint = 0;
+            connect_next(download);
+            return;
+        }
+        fprintf(stderr, "File Error\n");
+        download_failed(download);
+        return;
+    }
+    download->codec = download->status[1];
+
+    // Successful fetch, now receive the file data
+    if (download->verbose)
+    {
+        printf("Fetch Successful. Receiving File Data...\n");
+    }
+    download->file = fopen(download->filename, "wb+");
+    if (download->file == NULL)
+    {
+        perror("Error Opening File For Writing");
+        finish_download(download, -1);
+        return;
+    }
+    if (download->codec == FETCH_CODEC_DEFLATE)
+    {
+        if (inflateInit(&download->zs) != Z_OK)
+        {
+            fprintf(stderr, "Error Starting Decompression\n");
+            finish_download(download, -1);
+            return;
+        }
+        download->inflating = 1;
+    }
+    download->state = DOWNLOAD_RECEIVING;
+    receive_data(download);
+}
+
+// Write the data that has arrived to the file, inflating it first when it is compressed
+static void receive_data(struct Download* download)
+{
+    // Shared by every download; only one runs at a time
+    static unsigned char wire[RECV_CHUNK];
+    static unsigned char plain[INFLATE_CHUNK];
+
+    for (int burst = 0; burst < RECV_BURST; burst++)
+    {
+        ssize_t got = tls_recv(download->sock, wire, sizeof(wire), 0);
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if (got <= 0)
+        {
+            finish_receiving(download, got);
+            return;
+        }
+        download->wire_bytes += got;
+        if (!download->inflating)
+        {
+            if (fwrite(wire, 1, got, download->file) != (size_t)got)
+            {
+                perror("Error Writing File");
+                finish_download(download, -1);
+                return;
+            }
+            download->total += got;
+            continue;
+        }
+
+        // Inflate until this piece is used up; a full output buffer means there is more
+        int result = Z_OK;
+        download->zs.next_in = wire;
+        download->zs.avail_in = got;
+        do
+        {
+            download->zs.next_out = plain;
+            download->zs.avail_out = sizeof(plain);
+            result = inflate(&download->zs, Z_NO_FLUSH);
+            size_t produced = sizeof(plain) - download->zs.avail_out;
+            if (fwrite(plain, 1, produced, download->file) != produced)
+            {
+                perror("Error Writing File");
+                finish_download(download, -1);
+                return;
+            }
+            download->total += produced;
+        } while (result == Z_OK && download->zs.avail_out == 0);
+        download->stream_end = result == Z_STREAM_END;
+        if (result != Z_OK && result != Z_BUF_ERROR && !download->stream_end)
+        {
+            errno = EIO;
+            finish_receiving(download, -1);
+            return;
+        }
+    }
+}
+
+// The holder closed the connection (last is 0) or it failed (-1)
+static void finish_receiving(struct Download* download, ssize_t last)
+{
+    // A compressed stream cut short is an error, not a shorter file
+    if (last == 0 && download->inflating && !download->stream_end)
+    {
+        last = -1;
+        errno = EIO;
+    }
+    if (last < 0)
+    {
+        perror("Error Receiving File Data");
+        finish_download(download, -1);
+        return;
+    }
+    // Data still buffered must reach the file before it counts as saved
+    if (fflush(download->file) != 0)
+    {
+        perror("Error Writing File");
+        finish_download(download, -1);
+        return;
+    }
+
+    if (download->verbose && download->codec == FETCH_CODEC_DEFLATE)
+    {
+        printf("File Received And Saved As: %s (%lld Bytes, %lld Compressed)\n", download->filename, download->total, download->wire_bytes);
+    }
+    else if (download->verbose)
+    {
+        printf("File Received And Saved As: %s\n", download->filename);
+    }
+    finish_download(download, download->total);
+}
+
+// Note that the download made progress, and make sure a timeout is set for when it stops
+// making any
+static void download_progress(struct Download* download)
+{
+    download->last_active = p2p_now_ms();
+    if (download->timer == 0)
+    {
+        download->timer = p2p_loop_timer(event_loop, DOWNLOAD_TIMEOUT_MS, download_timeout, download);
+    }
+}
+
+// A holder that stops answering must not hold up the download, or a batch run, forever.
+// A connection that never came up moves on to the next endpoint; one that stalled later
+// fails the download
+static void download_timeout(struct P2pLoop* loop, void* arg)
+{
+    struct Download* download = arg;
+    uint64_t idle = p2p_now_ms() - download->last_active;
+
+    download->timer = 0;
+    if (idle < DOWNLOAD_TIMEOUT_MS)
+    {
+        download->timer = p2p_loop_timer(loop, DOWNLOAD_TIMEOUT_MS - idle, download_timeout, download);
+        return;
+    }
+
+    fprintf(stderr, "Timed Out Waiting For Peer\n");
+    errno = ETIMEDOUT;
+    if (download->state == DOWNLOAD_CONNECTING || download->state == DOWNLOAD_HANDSHAKING)
+    {
+        close_download_socket(download);
+        connect_next(download);
+        return;
+    }
+    download_failed(download);
+}
+
+static void close_download_socket(struct Download* download)
+{
+    if (download->sock >= 0)
+    {
+        p2p_loop_unwatch(event_loop, download->sock);
+        tls_close(download->sock);
+        download->sock = -1;
+    }
+    p2p_buffer_consume(&download->request, download->request.len);
+    download->request_pending = 0;
+}
+
+// The holder may have left or lost the file; ask the registry again next time
+static void download_failed(struct Download* download)
+{
+    if (download->probe_for == NULL)
+    {
+        client_search_invalidate(download->filename);
+    }
+    finish_download(download, -1);
+}
+
+static void finish_download(struct Download* download, long long result)
+{
+    close_download_socket(download);
+    if (download->timer != 0)
+    {
+        p2p_loop_cancel(event_loop, download->timer);
+    }
+    p2p_buffer_free(&download->request);
+    if (download->file != NULL)
+    {
+        fclose(download->file);
+        // Not a shorter copy of the file, so nothing is left behind
+        if (result < 0)
+        {
+            unlink(download->filename);
+        }
+    }
+    if (download->inflating)
+    {
+        inflateEnd(&download->zs);
+    }
+
+    if (download->probe_for != NULL)
+    {
+        probe_done(download->probe_for, result);
+    }
+    else
+    {
+        active_downloads--;
+        download->fn(download->filename, result, download->arg);
+    }
+    free(download);
+}
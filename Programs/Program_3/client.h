@@ -0,0 +1,66 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "p2pnet.h"
+
+// Asynchronous client side of the peer: requests to the registry, SEARCH and LOOKUP_PEER
+// lookups, and downloads from other peers. Every call starts the work and returns at
+// once; the outcome is reported to a callback that runs from the event loop, not from
+// inside the call that started it (unless there was no memory to start it at all). Any
+// number of lookups and downloads run at a time, on the same loop that serves uploads.
+
+// One address a peer holding a file can be reached on, as returned by SEARCH
+struct PeerEndpoint
+{
+    // Numeric IPv4 or IPv6 address
+    char host[INET6_ADDRSTRLEN];
+    uint16_t port;
+};
+
+// A registry reply: status 0 with its flags and payload, or -1 if the request failed or
+// the registry rejected it
+typedef void (*client_reply_fn)(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg);
+// A SEARCH or LOOKUP_PEER result: status 0 with peer_id 0 if nobody matched, or the
+// peer and the endpoint_count endpoints it can be reached on; -1 on error
+typedef void (*client_holder_fn)(int status, uint32_t peer_id, const struct PeerEndpoint* endpoints, int endpoint_count, void* arg);
+// A finished download: the bytes written to the file, or -1 if it failed
+typedef void (*client_fetch_fn)(const char* filename, long long bytes, void* arg);
+
+// Connect to the registry (blocking, with TLS when it is on) and serve the connection
+// from loop. Returns 0 or -1 with errno set
+int client_start(struct P2pLoop* loop, const char* host, const char* service);
+// Protocol version in use with the registry: 1 until a HELLO negotiates 2
+void client_set_version(int version);
+int client_version(void);
+
+// Send a v2 request. Requests are answered in the order they were sent. A registry that
+// turns the connection away as busy is reconnected to after the delay it asked for,
+// and everything not yet answered is sent again
+void client_request(uint8_t action, const void* payload, uint32_t payload_len, client_reply_fn fn, void* arg);
+// Send a v1 request whose reply is reply_len bytes, or none at all when it is 0; fn
+// then runs once the requests sent before it have been answered
+void client_request_v1(const void* msg, size_t msg_len, size_t reply_len, client_reply_fn fn, void* arg);
+
+// SEARCH through a cache of recent results. A holder the registry only matched through
+// its Bloom summary is asked whether it has the file before it is reported
+void client_search(const char* filename, client_holder_fn fn, void* arg);
+// Forget the cached SEARCH result for filename, e.g. after fetching from its holder failed
+void client_search_invalidate(const char* filename);
+// LOOKUP_PEER (v2 only)
+void client_lookup(uint32_t peer_id, client_holder_fn fn, void* arg);
+// Find filename and download it into the current directory. verbose prints the
+// interactive progress messages
+void client_fetch(const char* filename, int verbose, client_fetch_fn fn, void* arg);
+// Downloads started and not yet finished
+int client_downloads(void);
+
+// Close the registry connection
+void client_close(void);
+
+#endif
@@ -3,24 +3,167 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <netdb.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <dirent.h>
 #include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+
+#include "share_index.h"
+#include "upload.h"
+#include "tls.h"
+#include "client.h"
+#include "p2pnet.h"
 
 #define MAX_BUFFER_SIZE 1024
 #define SERVER_PORT 5000
+// Directory whose files are published, including its subdirectories
+#define SHARE_ROOT "SharedFiles"
+// Metadata cache of the share, kept next to it so unchanged directories are not re-read
+#define SHARE_INDEX_CACHE ".share_index"
+// Concurrent downloads in batch mode unless -j says otherwise
+#define DEFAULT_BATCH_JOBS 4
+// Upper bound for -j
+#define MAX_BATCH_JOBS 256
+// Uploads served at once unless -m says otherwise
+#define DEFAULT_MAX_UPLOADS 8
+// v2 action code for the upload load report
+#define ACTION_HEARTBEAT 4
+// v2 action code for publishing a Bloom summary instead of the file list
+#define ACTION_PUBLISH_SUMMARY 5
+// Summary layout shared with the registry: 512-bit blocks, each name setting
+// SUMMARY_HASHES bits in one block, sized for about 1% false positives
+#define SUMMARY_BLOCK_LEN 64
+#define SUMMARY_BITS_PER_NAME 10
+#define SUMMARY_HASHES 7
+// Largest summary the registry accepts, and blocks sent per PUBLISH_SUMMARY frame
+#define SUMMARY_MAX_BLOCKS 65536
+#define SUMMARY_CHUNK_BLOCKS 1000
+// PUBLISH_SUMMARY header: name count, hash count, total blocks and first block
+#define SUMMARY_HEADER_LEN (4 + 1 + 4 + 4)
+
+// What the next line of interactive input answers
+enum input_prompt
+{
+    PROMPT_COMMAND,
+    PROMPT_SEARCH,
+    PROMPT_FETCH,
+    PROMPT_LOOKUP,
+    // LIMITS asks for its three settings in turn
+    PROMPT_TOTAL_RATE,
+    PROMPT_CONN_RATE,
+    PROMPT_UPLOADS
+};
+
+// Interactive input. Lines are read from the loop; while a registry command runs they
+// wait in the buffer, so commands still take effect in the order they were typed
+struct InputState
+{
+    struct P2pBuffer pending;
+    enum input_prompt prompt;
+    // A JOIN, PUBLISH, SEARCH or LOOKUP is waiting for the registry
+    int paused;
+    // stdin reached end of file
+    int eof;
+    // EXIT was given; the peer stops once its downloads have finished
+    int exiting;
+    uint32_t peer_id;
+    // LIMITS settings entered so far
+    struct UploadLimits limits;
+};
+
+// Called once a JOIN or PUBLISH has been answered, successfully or not
+typedef void (*step_fn)(void* arg);
+
+// A JOIN or PUBLISH waiting for the registry
+struct Step
+{
+    step_fn done;
+    void* arg;
+    uint32_t peer_id;
+    uint32_t count;
+};
 
-int lookup_and_connect(const char* host, const char* service);
-void join(uint32_t peerID, int sockfd);
-void publish(int sockfd);
-void search(int sockfd);
-void fetch(int sockfd);
-void close_program(int sockfd);
-void display_options(uint32_t peerID, int socket);
+// A PUBLISH_SUMMARY whose chunks are waiting to be acknowledged
+struct SummaryState
+{
+    struct Step* step;
+    uint32_t chunks_left;
+    int failed;
+    size_t names;
+    uint32_t bytes;
+};
+
+// Batch download: the manifest and the running totals
+struct BatchState
+{
+    char** names;
+    int count;
+    // Index of the next name to start
+    int next;
+    // Downloads running, and how many may run at once
+    int running;
+    int jobs;
+    int fetched;
+    int failed;
+    long long bytes;
+    double start;
+};
+
+// Set by -2 on the command line: negotiate v2 with a HELLO instead of a v1 JOIN
+int want_v2 = 0;
+// Set by -s: publish a Bloom summary of the share instead of the list of names (v2 only)
+int want_summary = 0;
+// Port this peer serves FETCH on (-l), advertised in HELLO; 0 advertises nothing
+uint16_t listen_port = 0;
+// Explicit addresses to advertise (-a); none means "the address the registry sees"
+struct sockaddr_storage advertised[MAX_ENDPOINTS];
+int advertised_count = 0;
+// Event loop the whole peer runs on: registry requests, downloads, uploads and the
+// interactive input
+struct P2pLoop* loop = NULL;
+struct InputState input;
+
+void join(uint32_t peerID, step_fn done, void* arg);
+void hello_done(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg);
+void join_done(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg);
+void publish(step_fn done, void* arg);
+void publish_done(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg);
+void publish_summary(const struct ShareIndex* index, struct Step* step);
+void summary_chunk_done(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg);
+uint64_t summary_hash(const char* name);
+struct Step* new_step(step_fn done, void* arg);
+void finish_step(struct Step* step);
+void search(const char* filename);
+void search_done(int status, uint32_t peer_id, const struct PeerEndpoint* endpoints, int endpoint_count, void* arg);
+void lookup_peer(const char* input_line);
+void lookup_done(int status, uint32_t peer_id, const struct PeerEndpoint* endpoints, int endpoint_count, void* arg);
+void fetch(const char* filename);
+void fetch_done(const char* filename, long long bytes, void* arg);
+int batch_fetch(uint32_t peerID, const char* manifest, int jobs);
+void batch_joined(void* arg);
+void batch_published(void* arg);
+void batch_next(struct BatchState* batch);
+void batch_fetched(const char* filename, long long bytes, void* arg);
+double monotonic_now(void);
+int add_advertised_address(const char* host);
+void report_uploads(int active_uploads);
+void heartbeat_done(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg);
+void set_limits(void);
+void close_program(void);
+void stop_peer(void);
+void show_prompt(const char* prompt);
+void command_done(void* arg);
+ssize_t read_stdin(int fd, void* buf, size_t len, int flags);
+void read_input(struct P2pLoop* event_loop, int fd, short revents, void* arg);
+void handle_input(void);
+void handle_line(const char* line);
+void run_command(const char* command);
+void display_options(uint32_t peerID);
 
 int main(int argc, char* argv[])
 {
@@ -28,410 +171,967 @@ int main(int argc, char* argv[])
     char regIP[MAX_BUFFER_SIZE];
     char regPNumber[SERVER_PORT];
     uint32_t pID;
-    int sockfd;
+    // Batch mode: download every file named in this manifest, then exit
+    const char* fetch_list = NULL;
+    int jobs = DEFAULT_BATCH_JOBS;
+    // Upload shaping; rates are given in KB/s on the command line
+    struct UploadLimits limits = {0, 0, DEFAULT_MAX_UPLOADS};
+
+    // TLS: CA that signs the registry's and other peers' certificates, and this peer's
+    // own certificate and key for serving downloads
+    const char* tls_ca = NULL;
+    const char* tls_cert = NULL;
+    const char* tls_key = NULL;
+
+    static const struct option long_options[] =
+    {
+        {"fetch-list", required_argument, NULL, 'f'},
+        {"tls-ca", required_argument, NULL, 'C'},
+        {"tls-cert", required_argument, NULL, 'E'},
+        {"tls-key", required_argument, NULL, 'K'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "2sl:a:f:j:u:U:m:z:", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            // Non-interactive: join, publish, fetch every file in the manifest and exit
+            case 'f':
+                fetch_list = optarg;
+                break;
+            // Number of concurrent downloads in batch mode
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1 || jobs > MAX_BATCH_JOBS)
+                {
+                    fprintf(stderr, "Invalid Job Count: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            // Use the v2 wire protocol
+            case '2':
+                want_v2 = 1;
+                break;
+            // Publish a summary of the share; only v2 can carry one
+            case 's':
+                want_summary = 1;
+                want_v2 = 1;
+                break;
+            // Advertise a listen port; endpoints are only carried by v2 HELLO
+            case 'l':
+                listen_port = atoi(optarg);
+                want_v2 = 1;
+                break;
+            // Advertise an explicit IPv4 or IPv6 address
+            case 'a':
+                if (add_advertised_address(optarg) < 0)
+                {
+                    fprintf(stderr, "Invalid Address: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            // Total upload rate in KB/s, 0 for unlimited
+            case 'u':
+                limits.global_rate = strtoull(optarg, NULL, 10) * 1024;
+                break;
+            // Upload rate of each connection in KB/s, 0 for unlimited
+            case 'U':
+                limits.conn_rate = strtoull(optarg, NULL, 10) * 1024;
+                break;
+            // Uploads served at once; later requests queue
+            case 'm':
+                limits.max_active = atoi(optarg);
+                if (limits.max_active < 1)
+                {
+                    fprintf(stderr, "Invalid Upload Count: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            // Compress uploads with deflate at this level for downloaders that accept it
+            case 'z':
+                upload_set_compression(atoi(optarg));
+                break;
+            // Use TLS on every connection (long options only)
+            case 'C':
+                tls_ca = optarg;
+                break;
+            case 'E':
+                tls_cert = optarg;
+                break;
+            case 'K':
+                tls_key = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: peer [-2] [-s] [-l listen_port] [-a address]... [-u KB/s] [-U KB/s] [-m uploads] [-z level] [--fetch-list file [-j jobs]] [--tls-ca file] [--tls-cert file --tls-key file] <registry> <port> <peer_id>\n");
+                exit(1);
+        }
+    }
 
     // Validate input arguments
-    if (argc == 4)
+    if (argc - optind == 3 && (advertised_count == 0 || listen_port != 0))
     {
         // Convert command line argument to integer
-        strncpy(regIP, argv[1], MAX_BUFFER_SIZE);
-        strncpy(regPNumber, argv[2], MAX_BUFFER_SIZE);
-        pID = atoi(argv[3]);
+        strncpy(regIP, argv[optind], MAX_BUFFER_SIZE);
+        strncpy(regPNumber, argv[optind + 1], MAX_BUFFER_SIZE);
+        pID = atoi(argv[optind + 2]);
     }
     else
     {
-        perror("Error Input");
+        fprintf(stderr, "Usage: peer [-2] [-s] [-l listen_port] [-a address]... [-u KB/s] [-U KB/s] [-m uploads] [-z level] [--fetch-list file [-j jobs]] [--tls-ca file] [--tls-cert file --tls-key file] <registry> <port> <peer_id>\n");
+        exit(1);
+    }
+    // The registry refuses ID 0, which its replies use for "no peer"
+    if (pID == 0)
+    {
+        fprintf(stderr, "Peer ID 0 Is Reserved\n");
+        exit(1);
+    }
+
+    // Seeds the jitter added to retries when the registry is busy
+    srand(time(NULL) ^ getpid());
+
+    // Either TLS option turns it on for every connection; without --tls-ca servers are
+    // verified against the system CAs. A TLS peer serving downloads needs its own
+    // certificate, since its downloaders expect TLS too
+    if (tls_ca != NULL || tls_cert != NULL)
+    {
+        if ((tls_cert != NULL) != (tls_key != NULL) || (listen_port != 0 && tls_cert == NULL))
+        {
+            fprintf(stderr, "TLS Needs Both --tls-cert And --tls-key To Serve Downloads\n");
+            exit(1);
+        }
+        if (tls_client_init(tls_ca) < 0 || (tls_cert != NULL && tls_server_init(tls_cert, tls_key) < 0))
+        {
+            fprintf(stderr, "Failed To Set Up TLS\n");
+            exit(1);
+        }
+    }
+
+    loop = p2p_loop_new();
+    if (loop == NULL)
+    {
+        perror("Failed To Start Event Loop\n");
         exit(1);
     }
-    // Attempt to connect to the registry using the provided IP address and port number
-    sockfd = lookup_and_connect(regIP, regPNumber);
 
-    if (sockfd < 0)
+    // Attempt to connect to the registry using the provided IP address and port number
+    if (client_start(loop, regIP, regPNumber) < 0)
     {
         perror("Failed To Connect To Registry\n");
         exit(1);
     }
 
-    // Display available options to the user, passing in the peer ID and socket file descriptor
-    display_options(pID, sockfd);
+    // Serve FETCH requests on the advertised port
+    if (listen_port != 0 && upload_start(loop, listen_port, SHARE_ROOT, &limits, report_uploads) < 0)
+    {
+        perror("Failed To Listen For Downloads\n");
+        exit(1);
+    }
+
+    if (fetch_list != NULL)
+    {
+        int status = batch_fetch(pID, fetch_list, jobs);
+        client_close();
+        return status;
+    }
+
+    // Display available options to the user, passing in the peer ID
+    display_options(pID);
+    client_close();
 
     return 0;
 }   
 
-void join(u_int32_t peerID, int sockfd)
+void join(uint32_t peerID, step_fn done, void* arg)
 {
+    struct Step* step = new_step(done, arg);
+    if (step == NULL)
+    {
+        return;
+    }
+    step->peer_id = peerID;
+
+    if (want_v2)
+    {
+        // HELLO payload: peer ID, the highest version this peer speaks, then the listen
+        // endpoints as a count and (family, port, address) entries
+        unsigned char hello[5 + 1 + MAX_ENDPOINTS * MAX_ENDPOINT_LEN];
+        size_t hello_len = 5;
+        uint32_t network_order_id = htonl(peerID);
+        memcpy(hello, &network_order_id, sizeof(network_order_id));
+        hello[4] = 2;
+
+        if (listen_port != 0)
+        {
+            uint16_t network_order_port = htons(listen_port);
+            struct sockaddr_storage any[2];
+            struct sockaddr_storage* list = advertised;
+            int count = advertised_count;
+
+            // Without -a, advertise unspecified addresses; the registry substitutes the
+            // address it sees for whichever family the connection uses
+            if (count == 0)
+            {
+                memset(any, 0, sizeof(any));
+                any[0].ss_family = AF_INET;
+                any[1].ss_family = AF_INET6;
+                list = any;
+                count = 2;
+            }
+
+            hello[hello_len++] = count;
+            for (int e = 0; e < count; e++)
+            {
+                struct sockaddr_storage endpoint = list[e];
+                if (endpoint.ss_family == AF_INET6)
+                {
+                    ((struct sockaddr_in6*)&endpoint)->sin6_port = network_order_port;
+                }
+                else
+                {
+                    ((struct sockaddr_in*)&endpoint)->sin_port = network_order_port;
+                }
+                hello_len += p2p_endpoint_encode(hello + hello_len, &endpoint);
+            }
+        }
+
+        // A registry too busy to take the connection is retried by the client
+        client_request(0, hello, hello_len, hello_done, step);
+        return;
+    }
+
     // Buffer for JOIN request
     unsigned char buf[5];
     // Action code for JOIN is 0
     buf[0] = 0;
-    // Write Peer ID to buf    
+    // Write Peer ID to buf
     uint32_t network_order_peer_id = htonl(peerID);
     memcpy(buf + 1, &network_order_peer_id, sizeof(network_order_peer_id));
 
-    // Send JOIN request
-    if (send(sockfd, buf, sizeof(uint32_t) + 1, 0) < 0)
+    // Send JOIN request; v1 JOIN has no reply
+    client_request_v1(buf, sizeof(uint32_t) + 1, 0, join_done, step);
+}
+
+// The registry answered HELLO with the protocol version it chose
+void hello_done(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg)
+{
+    struct Step* step = arg;
+    (void)flags;
+
+    if (status < 0 || payload_len != 1)
     {
-        perror("Send Failed\n");
-        return;
+        fprintf(stderr, "HELLO Failed\n");
+    }
+    else
+    {
+        client_set_version(payload[0]);
+        printf(" HELLO Sent. Peer ID: %u, Protocol Version: %u\n", step->peer_id, payload[0]);
+    }
+    finish_step(step);
+}
+
+void join_done(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg)
+{
+    struct Step* step = arg;
+    (void)flags;
+    (void)payload;
+    (void)payload_len;
+
+    if (status < 0)
+    {
+        fprintf(stderr, "Send Failed\n");
     }
-    printf(" JOIN Request Sent. Peer ID: %u\n", peerID);
+    else
+    {
+        printf(" JOIN Request Sent. Peer ID: %u\n", step->peer_id);
+    }
+    finish_step(step);
 }
 
-// Publishes information about the files located in "SharedFiles" directory to the registry
-void publish(int sockfd)
+// Publishes the files under the "SharedFiles" directory (recursively, as paths relative
+// to it) to the registry. Files that do not fit in one message are left out, unless the
+// share is published as a summary (-s)
+void publish(step_fn done, void* arg)
 {
     // Holds information sent to the registry
     unsigned char buf[MAX_BUFFER_SIZE];
-    // Counts the number of regular files (not directories) found in "SharedFiles" directory
+    // Counts the number of regular files published
     uint32_t count = 0;
-    // Pointer to store the directory stream
-    DIR* dirent;
-    // Calls opendir to open "SharedFiles" (where files to be published are stored) 
-    dirent = opendir("SharedFiles");
-    // Pointer to iterate through each file in the directory
-    struct dirent *dirpointer;
-    // 5 represents current position in buf array where files will be written, first 5 bytes reserved for action code + file count
-    size_t iterator = 5;
+    // Every regular file in the share, from the parallel indexer
+    struct ShareIndex index;
+    int version = client_version();
+    // v1 reserves 5 bytes for action code + file count; v2 only the file count, since the
+    // client adds the frame header
+    size_t header_len = version >= 2 ? sizeof(count) : 1 + sizeof(count);
+    // Current position in buf array where files will be written
+    size_t iterator = header_len;
+
+    struct Step* step = new_step(done, arg);
+    if (step == NULL)
+    {
+        return;
+    }
 
-    if (!dirent)
+    double start = monotonic_now();
+    if (share_index_build(SHARE_ROOT, SHARE_INDEX_CACHE, 0, &index) < 0)
     {
         perror("Error Opening Directory\n");
+        finish_step(step);
         return;
     }
-    // Action code for PUBLISH is 1
-    buf[0] = 1;
-    
-    // Read each file in ShardFiles directory and add its name to the buffer
-    while ((dirpointer = readdir(dirent)) != NULL)
+    fprintf(stderr, "Indexed %zu Files In %.3f s (%zu Directories Read, %zu Unchanged)\n",
+            index.count, monotonic_now() - start, index.dirs_scanned, index.dirs_cached);
+
+    if (want_summary && version >= 2)
+    {
+        publish_summary(&index, step);
+        share_index_free(&index);
+        return;
+    }
+
+    // Add each file's path to the buffer
+    for (size_t i = 0; i < index.count; i++)
     {
-        // Checks if the current entry is a regular file, DT_REG represents regular files
-        if (dirpointer->d_type == DT_REG)
+        // Length of current file's path
+        size_t name_len = strlen(index.entries[i].path);
+        // v1 names end in a null terminator, v2 names start with a 16-bit length
+        size_t entry_len = version >= 2 ? sizeof(uint16_t) + name_len : name_len + 1;
+        if (iterator + entry_len > MAX_BUFFER_SIZE)
         {
-            // Length of current file's name
-            size_t name_len = strlen(dirpointer->d_name);
-            if (iterator + name_len + 1 > MAX_BUFFER_SIZE)
-            {
-                fprintf(stderr, "Buffer Overflow, Too Many Files.\n");
-                closedir(dirent);
-                return;
-            }
-            // Ensures enough space in the buffer 
-            // Current file’s name is copied into the buffer starting at position iterator 
-            // strlen(dirpointer->d_name) + 1 ensures that the null terminator is also copied.
-            memcpy(buf + iterator, dirpointer->d_name, strlen(dirpointer->d_name) + 1);
-            // Points to the next available position in the buffer
-            // Size increment is name_len + 1 to account for the file name and its null terminator.
-            iterator += name_len + 1;
-            count++;
+            fprintf(stderr, "Message Full, Publishing %u Of %zu Files.\n", count, index.count);
+            break;
+        }
+        if (version >= 2)
+        {
+            uint16_t network_order_len = htons(name_len);
+            memcpy(buf + iterator, &network_order_len, sizeof(network_order_len));
+            memcpy(buf + iterator + sizeof(network_order_len), index.entries[i].path, name_len);
         }
+        else
+        {
+            // Current file's path is copied into the buffer starting at position iterator,
+            // including its null terminator
+            memcpy(buf + iterator, index.entries[i].path, name_len + 1);
+        }
+        // Points to the next available position in the buffer
+        iterator += entry_len;
+        count++;
     }
-    
-    closedir(dirent);
+    share_index_free(&index);
+
     // Convert file count into network byte order
     uint32_t network_order_count = htonl(count);
-    memcpy(buf + 1, &network_order_count, sizeof(network_order_count));
-    if (send(sockfd, buf, iterator, 0) < 0)
-    {    
-        perror("Error Sending PUBLISH");
+    memcpy(buf + header_len - sizeof(network_order_count), &network_order_count, sizeof(network_order_count));
+    step->count = count;
+
+    if (version >= 2)
+    {
+        // The registry acknowledges v2 PUBLISH frames
+        client_request(1, buf, iterator, publish_done, step);
         return;
     }
-    printf("PUBLISH Request Sent. File Count: %u\n", count);
+
+    // Action code for PUBLISH is 1; v1 PUBLISH has no reply
+    buf[0] = 1;
+    client_request_v1(buf, iterator, 0, publish_done, step);
 }
-void fetch(int sockfd)
+
+void publish_done(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg)
 {
-    // Create buffers for:
-    // Name of file that user wants to search for
-    // Buffer to hold the message to be sent to the server (search command and filename)
-    char filename[MAX_BUFFER_SIZE];
-    unsigned char buf[MAX_BUFFER_SIZE];
-    unsigned char fetch_req[MAX_BUFFER_SIZE];
-    int packet_len = 0;
-    uint8_t fetch_action;
-    uint32_t peer_id; 
-    uint32_t peer_ip;
+    struct Step* step = arg;
+    (void)flags;
+    (void)payload;
+    (void)payload_len;
+
+    if (status < 0)
+    {
+        fprintf(stderr, client_version() >= 2 ? "PUBLISH Rejected\n" : "Error Sending PUBLISH\n");
+    }
+    else
+    {
+        printf("PUBLISH Request Sent. File Count: %u\n", step->count);
+    }
+    finish_step(step);
+}
+
+// Publishes a blocked Bloom filter of every path in the share. The chunks go out back
+// to back and step finishes once the registry has acknowledged all of them
+void publish_summary(const struct ShareIndex* index, struct Step* step)
+{
+    uint64_t bits = (uint64_t)index->count * SUMMARY_BITS_PER_NAME;
+    uint32_t block_count = (bits + SUMMARY_BLOCK_LEN * 8 - 1) / (SUMMARY_BLOCK_LEN * 8);
+
+    if (block_count == 0)
+    {
+        block_count = 1;
+    }
+    if (block_count > SUMMARY_MAX_BLOCKS)
+    {
+        // Still correct, just with more false positives
+        block_count = SUMMARY_MAX_BLOCKS;
+    }
+
+    unsigned char* blocks = calloc(block_count, SUMMARY_BLOCK_LEN);
+    unsigned char* chunk = malloc(SUMMARY_HEADER_LEN + SUMMARY_CHUNK_BLOCKS * SUMMARY_BLOCK_LEN);
+    struct SummaryState* state = calloc(1, sizeof(*state));
+    if (blocks == NULL || chunk == NULL || state == NULL)
+    {
+        perror("Error Building Summary");
+        free(blocks);
+        free(chunk);
+        free(state);
+        finish_step(step);
+        return;
+    }
 
+    // The low half of the hash picks the block and the high half the bits within it:
+    // bit i is (high + i * step) mod 512
+    for (size_t i = 0; i < index->count; i++)
+    {
+        uint64_t hash = summary_hash(index->entries[i].path);
+        unsigned char* block = blocks + (((hash & 0xffffffff) * block_count) >> 32) * SUMMARY_BLOCK_LEN;
+        uint32_t high = hash >> 32;
+        uint32_t bit_step = (high >> 16) | 1;
+        for (uint32_t k = 0; k < SUMMARY_HASHES; k++)
+        {
+            uint32_t bit = (high + k * bit_step) % (SUMMARY_BLOCK_LEN * 8);
+            block[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+
+    state->step = step;
+    state->chunks_left = (block_count + SUMMARY_CHUNK_BLOCKS - 1) / SUMMARY_CHUNK_BLOCKS;
+    state->names = index->count;
+    state->bytes = block_count * SUMMARY_BLOCK_LEN;
 
-    printf("Enter A File Name: ");
-    fgets(filename, MAX_BUFFER_SIZE, stdin);
-    filename[strcspn(filename, "\n")] = 0;
-    uint16_t port;
+    // Chunk header: name count, hash count, total blocks, first block in this chunk
+    uint32_t network_order_names = htonl(index->count);
+    uint32_t network_order_total = htonl(block_count);
+    for (uint32_t first = 0; first < block_count; first += SUMMARY_CHUNK_BLOCKS)
+    {
+        uint32_t count = block_count - first < SUMMARY_CHUNK_BLOCKS ? block_count - first : SUMMARY_CHUNK_BLOCKS;
+        uint32_t network_order_first = htonl(first);
+        memcpy(chunk, &network_order_names, sizeof(network_order_names));
+        chunk[4] = SUMMARY_HASHES;
+        memcpy(chunk + 5, &network_order_total, sizeof(network_order_total));
+        memcpy(chunk + 9, &network_order_first, sizeof(network_order_first));
+        memcpy(chunk + SUMMARY_HEADER_LEN, blocks + (size_t)first * SUMMARY_BLOCK_LEN, (size_t)count * SUMMARY_BLOCK_LEN);
 
-    // Action code for SEARCH is 2 
-    buf[0] = 2;
+        client_request(ACTION_PUBLISH_SUMMARY, chunk, SUMMARY_HEADER_LEN + count * SUMMARY_BLOCK_LEN, summary_chunk_done, state);
+    }
 
-    // Copies filename buffer into buf
-    memcpy(buf + 1, filename, strlen(filename) + 1);
+    free(blocks);
+    free(chunk);
+}
 
-    printf("Registry sockfd: %d\n", sockfd);
+void summary_chunk_done(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg)
+{
+    struct SummaryState* state = arg;
+    (void)flags;
+    (void)payload;
+    (void)payload_len;
 
-    if (send(sockfd, buf, strlen(filename) + 2, 0) < 0) 
+    if (status < 0 && !state->failed)
     {
-        perror("Error Sending Search");
-        return;
+        fprintf(stderr, "PUBLISH Summary Rejected\n");
+        state->failed = 1;
     }
-    // Buffer to hold server's response
-    unsigned char response[10];
-    int received = recv(sockfd, response, sizeof(response), 0);
- 
-    if (received <= 0)
+    if (--state->chunks_left > 0)
     {
-        perror("Error Receiving Response");
         return;
     }
-    // First 4 bytes of the response buffer are interpreted as the peer id of the peer that holds the requested file.
-    // Check if the file exists on the peer
+    if (!state->failed)
+    {
+        printf("PUBLISH Summary Sent. File Count: %zu, %u Bytes\n", state->names, state->bytes);
+    }
+    finish_step(state->step);
+    free(state);
+}
 
-    packet_len += sizeof(peer_id);
-    memcpy(&peer_id, response, packet_len);
-    memcpy(&peer_ip, response + packet_len, sizeof(peer_ip));
-    packet_len += sizeof(peer_ip);
-    memcpy(&port, response + packet_len, sizeof(port));
+// Hash shared with the registry: 64-bit FNV-1a over the name, finished with the
+// MurmurHash3 mixer so every bit depends on the whole name
+uint64_t summary_hash(const char* name)
+{
+    uint64_t hash = 14695981039346656037ull;
 
-    peer_id = ntohl(peer_id);
-    port = ntohl(port);
-    packet_len += sizeof(port);
-    
+    for (const char* c = name; *c != '\0'; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
 
-    // Stores of ip address of peer
-    char peer_addr[INET_ADDRSTRLEN];
-    
-    if (peer_ip == 0)
+// Remember what to call once a JOIN or PUBLISH has been answered. Returns NULL, after
+// calling done, if there is no memory for it
+struct Step* new_step(step_fn done, void* arg)
+{
+    struct Step* step = calloc(1, sizeof(*step));
+    if (step == NULL)
+    {
+        perror("Error Starting Request");
+        done(arg);
+        return NULL;
+    }
+    step->done = done;
+    step->arg = arg;
+    return step;
+}
+
+void finish_step(struct Step* step)
+{
+    step->done(step->arg);
+    free(step);
+}
+
+void search(const char* filename)
+{
+    client_search(filename, search_done, NULL);
+}
+
+void search_done(int status, uint32_t peer_id, const struct PeerEndpoint* endpoints, int endpoint_count, void* arg)
+{
+    if (status == 0 && peer_id == 0)
     {
         printf("File Not Indexed By Registry\n");
-        return;
     }
-    else
+    else if (status == 0)
     {
-        // Converts binary ip address into readable string, stores in ip
-        inet_ntop(AF_INET, &peer_ip, peer_addr, INET_ADDRSTRLEN);
-        // Stores port number of peer
-        memcpy(&port, &response[8], sizeof(port));
-        port = ntohs(port);
-        
-        // Prints peer id, ip address, and port number that hold requested file
-        printf("File Found At\n Peer %u\n", peer_ip);
-        printf("%s:%u\n", peer_addr, port);
-    }    
-
-    char port_str[6];
-    snprintf(port_str, sizeof(port_str), "%u", port);
-    int peer_fd = lookup_and_connect(peer_addr, port_str);
+        // Prints peer ID and each IP address and port number that hold requested file
+        printf("File found at\n Peer %u\n", peer_id);
+        for (int e = 0; e < endpoint_count; e++)
+        {
+            printf(strchr(endpoints[e].host, ':') ? "[%s]:%u\n" : "%s:%u\n", endpoints[e].host, endpoints[e].port);
+        }
+    }
+    command_done(arg);
+}
 
-    if (peer_fd < 0)
+// Asks the registry for the endpoints of the peer that joined with a given ID (v2 only)
+void lookup_peer(const char* input_line)
+{
+    if (client_version() < 2)
     {
-        perror("Error Connecting To Peer");
+        printf("LOOKUP Needs The v2 Protocol (-2)\n");
+        command_done(NULL);
         return;
     }
+    client_lookup(strtoul(input_line, NULL, 10), lookup_done, NULL);
+}
 
-    // Prepare the fetch request
-    packet_len = 0;
-    fetch_action = 3;
-    packet_len += sizeof(fetch_action);
+void lookup_done(int status, uint32_t peer_id, const struct PeerEndpoint* endpoints, int endpoint_count, void* arg)
+{
+    if (status < 0)
+    {
+        fprintf(stderr, "LOOKUP Failed\n");
+    }
+    else if (peer_id == 0)
+    {
+        printf("Peer Not Connected To Registry\n");
+    }
+    else
+    {
+        printf("Peer %u\n", peer_id);
+        for (int e = 0; e < endpoint_count; e++)
+        {
+            printf(strchr(endpoints[e].host, ':') ? "[%s]:%u\n" : "%s:%u\n", endpoints[e].host, endpoints[e].port);
+        }
+    }
+    command_done(arg);
+}
 
-    // New buffer for peer
-    fetch_req[0] = 3;
-    
-    memcpy(fetch_req + 1, filename, strlen(filename) + 1);
+// Downloads in the background; the next command can be entered right away
+void fetch(const char* filename)
+{
+    client_fetch(filename, 1, fetch_done, NULL);
+}
+
+void fetch_done(const char* filename, long long bytes, void* arg)
+{
+    (void)filename;
+    (void)bytes;
+    (void)arg;
 
-    printf("%s", fetch_req);
-    // Send the fetch request
-    if (send(peer_fd, fetch_req, strlen(filename) + 2, 0) < 0)
+    // EXIT waits for the last download
+    if (input.exiting && client_downloads() == 0)
     {
-        perror("Error Sending Fetch Request");
-        return;
+        stop_peer();
     }
+    fflush(stdout);
+}
 
-    // Receive the fetch response
-    received = recv(peer_fd, response, 1, 0);
+// Batch mode: joins, publishes, then downloads every file named in manifest (one name
+// per line; blank lines and lines starting with '#' are skipped) with up to jobs
+// downloads running at once, and prints a throughput summary. Returns the process exit
+// status: 0 if every file was fetched
+int batch_fetch(uint32_t peerID, const char* manifest, int jobs)
+{
+    FILE* list = fopen(manifest, "r");
+    if (list == NULL)
+    {
+        perror("Error Opening Fetch List");
+        return 1;
+    }
 
-    if (response[0] != 0)
+    struct BatchState batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.jobs = jobs;
+
+    char line[MAX_BUFFER_SIZE];
+    int capacity = 0;
+    while (fgets(line, sizeof(line), list) != NULL)
     {
-        perror("File Error");
-        return;
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '\0' || line[0] == '#')
+        {
+            continue;
+        }
+        if (batch.count == capacity)
+        {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            char** grown = realloc(batch.names, capacity * sizeof(char*));
+            if (grown == NULL)
+            {
+                perror("Error Reading Fetch List");
+                fclose(list);
+                return 1;
+            }
+            batch.names = grown;
+        }
+        batch.names[batch.count] = strdup(line);
+        if (batch.names[batch.count] == NULL)
+        {
+            perror("Error Reading Fetch List");
+            fclose(list);
+            return 1;
+        }
+        batch.count++;
     }
+    fclose(list);
 
-    // Successful fetch, now receive the file data
-    printf("Fetch Successful. Receiving File Data...\n");
+    join(peerID, batch_joined, &batch);
+    p2p_loop_run(loop);
+    double elapsed = monotonic_now() - batch.start;
 
-    FILE* file = fopen(filename, "wb+");
+    printf("Fetched %d/%d Files (%d Failed), %lld Bytes In %.3f s, %.2f MB/s\n",
+           batch.fetched, batch.count, batch.failed, batch.bytes, elapsed,
+           elapsed > 0 ? batch.bytes / elapsed / 1e6 : 0.0);
 
-    if (file == NULL)
+    for (int i = 0; i < batch.count; i++)
     {
-        perror("Error Opening File For Writing");
-        return;
+        free(batch.names[i]);
     }
+    free(batch.names);
+    return batch.failed == 0 ? 0 : 1;
+}
+
+void batch_joined(void* arg)
+{
+    publish(batch_published, arg);
+}
 
-    // Continuously receive file data in chunks and write to the local file
-    int bytes_received;
+void batch_published(void* arg)
+{
+    struct BatchState* batch = arg;
+
+    batch->start = monotonic_now();
+    batch_next(batch);
+}
 
-    while ((bytes_received = recv(peer_fd, buf, sizeof(buf), 0)) > 0)
+// Starts downloads until jobs are running or every name has been started; once the last
+// one has finished, stops the loop
+void batch_next(struct BatchState* batch)
+{
+    while (batch->running < batch->jobs && batch->next < batch->count)
+    {
+        batch->running++;
+        client_fetch(batch->names[batch->next++], 0, batch_fetched, batch);
+    }
+    if (batch->running == 0)
     {
-        // Write received data to the file
-        fwrite(buf, 1, bytes_received, file);
+        p2p_loop_stop(loop);
     }
-    if (bytes_received < 0)
+}
+
+void batch_fetched(const char* filename, long long bytes, void* arg)
+{
+    struct BatchState* batch = arg;
+
+    batch->running--;
+    if (bytes < 0)
     {
-        perror("Error Receiving File Data");
+        batch->failed++;
+        printf("FAILED %s\n", filename);
     }
     else
     {
-        printf("File Received And Saved As: %s\n", filename);
+        batch->fetched++;
+        batch->bytes += bytes;
+        printf("FETCHED %s %lld\n", filename, bytes);
     }
-    // Close the file after writing data
-    fclose(file);
-
-    // Close the peer after receiving the data
-    close(peer_fd);
+    batch_next(batch);
 }
 
-void search(int sockfd)
+// Seconds, with sub-second precision, on the monotonic clock
+double monotonic_now(void)
 {
-    // Create buffers for:
-    // Name of file that user wants to search for
-    // Buffer to hold the message to be sent to the server (search command and filename)
-    char filename[MAX_BUFFER_SIZE];
-    unsigned char buf[MAX_BUFFER_SIZE];
-    printf("Enter A File Name: ");
-    fgets(filename, MAX_BUFFER_SIZE, stdin);
-    filename[strcspn(filename, "\n")] = 0;
-
-    // Action code 
-    buf[0] = 2;
-    // Copies filename buffer into buf
-    memcpy(buf + 1, filename, strlen(filename) + 1);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    if (send(sockfd, buf, strlen(filename) + 2, 0) < 0) 
+// Parses an IPv4 or IPv6 literal and adds it to the advertised endpoints.
+// Returns 0 on success or -1 if the address is invalid or the list is full.
+int add_advertised_address(const char* host)
+{
+    if (advertised_count == MAX_ENDPOINTS)
     {
-        perror("Error Sending SEARCH");
-        return;
+        return -1;
     }
-    // Buffer to hold server's response
-    unsigned char response[10];
-    int received = recv(sockfd, response, sizeof(response), 0);
- 
-    if (received <= 0)
+
+    struct sockaddr_storage* addr = &advertised[advertised_count];
+    memset(addr, 0, sizeof(*addr));
+    if (inet_pton(AF_INET, host, &((struct sockaddr_in*)addr)->sin_addr) == 1)
     {
-        perror("Error Receiving Response");
-        return;
+        addr->ss_family = AF_INET;
     }
-    // First 4 bytes of the response buffer are interpreted as the peer ID of the peer that holds the requested file.
-    uint32_t peer_id;
-    memcpy(&peer_id, &response[0], sizeof(peer_id));
-    peer_id = ntohl(peer_id); 
-    
-    if (peer_id == 0)
+    else if (inet_pton(AF_INET6, host, &((struct sockaddr_in6*)addr)->sin6_addr) == 1)
     {
-        printf("File Not Indexed By Registry\n");
+        addr->ss_family = AF_INET6;
     }
     else
     {
-        // Extract IP address and port number of peer that holds the file
-        char ip[INET_ADDRSTRLEN];
-        // Stores of IP address of peer
-        uint32_t ip_addr;
-        // Converts binary IP address into readable string, stores in ip
-        memcpy(&ip_addr, &response[4], sizeof(ip_addr));        
-        inet_ntop(AF_INET, &ip_addr, ip, INET_ADDRSTRLEN);
-        // Stores port number of peer
-        uint16_t port;
-        memcpy(&port, &response[8], sizeof(port));
-        port = ntohs(port);
-
-        // Prints peer ID, IP address, and port number that hold requested file
-        printf("File found at\n Peer %u\n", peer_id);
-        printf("%s:%u\n", ip, port);
+        return -1;
     }
+
+    advertised_count++;
+    return 0;
 }
 
-void close_program(int sockfd)
+// Tells the registry how many uploads are running so it can steer SEARCHes to less
+// loaded peers. Called from the loop by the upload side; v1 has no way to report load
+void report_uploads(int active_uploads)
 {
-    close(sockfd);
-    printf("Peer Application Exited.\n");
-    exit(0);
+    if (client_version() >= 2)
+    {
+        uint32_t network_order_active = htonl(active_uploads);
+        client_request(ACTION_HEARTBEAT, &network_order_active, sizeof(network_order_active), heartbeat_done, NULL);
+    }
 }
 
-void display_options(uint32_t  peerID, int sockfd)
+void heartbeat_done(int status, uint16_t flags, const uint8_t* payload, uint32_t payload_len, void* arg)
 {
-    char command[MAX_BUFFER_SIZE];
+    (void)flags;
+    (void)payload;
+    (void)payload_len;
+    (void)arg;
 
-    while(1)
+    if (status < 0)
     {
-        printf("Enter a command: ");
+        fprintf(stderr, "HEARTBEAT Failed\n");
+    }
+}
 
-        fgets(command, MAX_BUFFER_SIZE, stdin);
-        
-        //Remove trailing newline that fgets uses
-        command[strcspn(command, "\n")] = 0;
+// Applies the upload shaping settings LIMITS asked for to running transfers
+void set_limits(void)
+{
+    struct UploadLimits limits;
 
-        if (strcmp(command, "JOIN") == 0)
-        {
-            join(peerID, sockfd);
-        }
-        else if (strcmp(command, "PUBLISH") == 0)
-        {
-            publish(sockfd);
-        }
-        else if (strcmp(command, "SEARCH") == 0)
-        {
-            search(sockfd);
-        }
-        else if (strcmp(command, "FETCH") == 0)
-        {
-            fetch(sockfd);
-        }
-        else if (strcmp(command, "EXIT") == 0)
-        {
-            close_program(sockfd);
-        }
-        else
-        {
-            printf("Invalid Command, Please use JOIN, PUBLISH, SEARCH, or EXIT.\n");
-        }
+    upload_set_limits(&input.limits);
+    upload_get_limits(&limits);
+    printf("Upload Limits: %llu KB/s Total, %llu KB/s Per Connection, %d Concurrent\n",
+           (unsigned long long)(limits.global_rate / 1024), (unsigned long long)(limits.conn_rate / 1024), limits.max_active);
+}
+
+// EXIT, or the end of input: stop taking commands, and stop the peer once the downloads
+// still running have finished
+void close_program(void)
+{
+    input.exiting = 1;
+    if (client_downloads() > 0)
+    {
+        printf("Waiting For %d Download(s) To Finish\n", client_downloads());
+        fflush(stdout);
+        return;
     }
+    stop_peer();
+}
+
+void stop_peer(void)
+{
+    printf("Peer Application Exited.\n");
+    p2p_loop_stop(loop);
+}
 
+void show_prompt(const char* prompt)
+{
+    printf("%s", prompt);
+    fflush(stdout);
 }
 
-int lookup_and_connect(const char* host, const char* service) 
+// A JOIN, PUBLISH, SEARCH or LOOKUP finished: prompt again and take the commands typed
+// in the meantime
+void command_done(void* arg)
 {
-    struct addrinfo hints;
-    struct addrinfo *rp, *result;
-    int s;
+    (void)arg;
+    input.paused = 0;
+    show_prompt("Enter a command: ");
+    handle_input();
+}
 
-    /* Translate host name into peer's IP address */
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0;
+// read() in the shape P2pBuffer reads with
+ssize_t read_stdin(int fd, void* buf, size_t len, int flags)
+{
+    (void)flags;
+    return read(fd, buf, len);
+}
 
-    if ((s = getaddrinfo(host, service, &hints, &result)) != 0)
+void read_input(struct P2pLoop* event_loop, int fd, short revents, void* arg)
+{
+    (void)revents;
+    (void)arg;
+
+    ssize_t got = p2p_buffer_read(&input.pending, fd, read_stdin);
+    if (got < 0 && (errno == EAGAIN || errno == EINTR))
     {
-        fprintf(stderr, "stream-talk-client: getaddrinfo: %s\n", gai_strerror(s));
-        return -1;
+        return;
     }
+    if (got <= 0)
+    {
+        input.eof = 1;
+        p2p_loop_unwatch(event_loop, fd);
+    }
+    handle_input();
+}
 
-    /* Iterate through the address list and try to connect */
-    for (rp = result; rp != NULL; rp = rp->ai_next) 
+// Runs every complete line of input, unless a registry command is still running. At the
+// end of input a last line without a newline counts too, and then the peer exits
+void handle_input(void)
+{
+    while (!input.paused && !input.exiting && input.pending.len > 0)
     {
-        if ((s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1) 
+        char* start = (char*)input.pending.data + input.pending.head;
+        char* newline = memchr(start, '\n', input.pending.len);
+        if (newline == NULL && !input.eof)
         {
-            continue;
+            return;
         }
 
-        if (connect(s, rp->ai_addr, rp->ai_addrlen) != -1) 
-        {
+        char line[MAX_BUFFER_SIZE];
+        size_t line_len = newline != NULL ? (size_t)(newline - start) : input.pending.len;
+        size_t kept = line_len < sizeof(line) - 1 ? line_len : sizeof(line) - 1;
+        memcpy(line, start, kept);
+        line[kept] = '\0';
+        p2p_buffer_consume(&input.pending, newline != NULL ? line_len + 1 : line_len);
+        handle_line(line);
+    }
+    if (input.eof && input.pending.len == 0 && !input.paused && !input.exiting)
+    {
+        close_program();
+    }
+}
+
+void handle_line(const char* line)
+{
+    enum input_prompt prompt = input.prompt;
+
+    input.prompt = PROMPT_COMMAND;
+    switch (prompt)
+    {
+        case PROMPT_COMMAND:
+            run_command(line);
+            break;
+        case PROMPT_SEARCH:
+            input.paused = 1;
+            search(line);
+            break;
+        case PROMPT_FETCH:
+            fetch(line);
+            show_prompt("Enter a command: ");
+            break;
+        case PROMPT_LOOKUP:
+            input.paused = 1;
+            lookup_peer(line);
+            break;
+        case PROMPT_TOTAL_RATE:
+            input.limits.global_rate = strtoull(line, NULL, 10) * 1024;
+            input.prompt = PROMPT_CONN_RATE;
+            show_prompt("Per-Connection KB/s (0 For Unlimited): ");
+            break;
+        case PROMPT_CONN_RATE:
+            input.limits.conn_rate = strtoull(line, NULL, 10) * 1024;
+            input.prompt = PROMPT_UPLOADS;
+            show_prompt("Concurrent Uploads: ");
+            break;
+        case PROMPT_UPLOADS:
+            input.limits.max_active = atoi(line);
+            set_limits();
+            show_prompt("Enter a command: ");
             break;
-        }
-        close(s);
     }
+}
 
-    if (rp == NULL) 
+void run_command(const char* command)
+{
+    if (strcmp(command, "JOIN") == 0)
     {
-        perror("stream-talk-client: connect");
-        freeaddrinfo(result);
-        return -1;
+        input.paused = 1;
+        join(input.peer_id, command_done, NULL);
     }
-    freeaddrinfo(result);
+    else if (strcmp(command, "PUBLISH") == 0)
+    {
+        input.paused = 1;
+        publish(command_done, NULL);
+    }
+    else if (strcmp(command, "SEARCH") == 0)
+    {
+        input.prompt = PROMPT_SEARCH;
+        show_prompt("Enter A File Name: ");
+    }
+    else if (strcmp(command, "FETCH") == 0)
+    {
+        input.prompt = PROMPT_FETCH;
+        show_prompt("Enter A File Name: ");
+    }
+    else if (strcmp(command, "LOOKUP") == 0)
+    {
+        input.prompt = PROMPT_LOOKUP;
+        show_prompt("Enter A Peer ID: ");
+    }
+    else if (strcmp(command, "LIMITS") == 0)
+    {
+        upload_get_limits(&input.limits);
+        input.prompt = PROMPT_TOTAL_RATE;
+        show_prompt("Total Upload KB/s (0 For Unlimited): ");
+    }
+    else if (strcmp(command, "EXIT") == 0)
+    {
+        close_program();
+    }
+    else
+    {
+        printf("Invalid Command, Please use JOIN, PUBLISH, SEARCH, FETCH, LOOKUP, LIMITS, or EXIT.\n");
+        show_prompt("Enter a command: ");
+    }
+}
 
-    return s;
+// Reads commands from the loop until EXIT or the end of input. Registry commands hold
+// the input back until they are answered; downloads run in the background
+void display_options(uint32_t peerID)
+{
+    input.peer_id = peerID;
+    if (p2p_loop_watch(loop, STDIN_FILENO, POLLIN, read_input, NULL) < 0)
+    {
+        perror("Error Reading Commands");
+        return;
+    }
+    show_prompt("Enter a command: ");
+    p2p_loop_run(loop);
 }
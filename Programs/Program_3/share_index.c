@@ -0,0 +1,713 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Recursive share indexer used by PUBLISH. Directories are scanned in parallel by a
+// small thread pool: each worker keeps its own deque of directories, works LIFO on it
+// (depth first, good locality) and steals from the other end of another worker's deque
+// when it runs dry, so one huge subtree does not leave the other workers idle.
+//
+// Directories are read with getdents64() into a large buffer, and d_type decides what
+// each entry is; statx() is only issued for entries whose type the filesystem does not
+// report and for the regular files of directories that changed. A metadata cache of
+// every directory's inode, mtime and listing is written after each scan, and a
+// directory whose inode and mtime still match its cached record is not read at all.
+// Creating, deleting or renaming an entry updates the directory's mtime, so the file
+// list stays exact; the size and mtime of a file modified in place are refreshed the
+// next time its directory changes.
+
+#define _GNU_SOURCE
+#include "share_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+// Upper bound on indexer threads
+#define SHARE_INDEX_MAX_THREADS 64
+// Threads used when the caller asks for one per CPU
+#define SHARE_INDEX_DEFAULT_THREADS 16
+// Bytes of directory entries fetched per getdents64() call
+#define DIRENT_BUF_SIZE (64 * 1024)
+// First line of the metadata cache file
+#define CACHE_MAGIC "share-index 1"
+
+// A file from the cached listing of a directory
+struct CachedFile
+{
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    const char* name;
+};
+
+// Cached record of one directory: its identity and its immediate children
+struct CachedDir
+{
+    const char* path;
+    uint64_t inode;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    struct CachedFile* files;
+    size_t file_count;
+    const char** subdirs;
+    size_t subdir_count;
+};
+
+// The metadata cache loaded from disk. Strings point into text
+struct ShareCache
+{
+    char* text;
+    struct CachedDir* dirs;
+    size_t dir_count;
+    struct CachedFile* files;
+    const char** subdirs;
+    // Open-addressing table of dir indices + 1 (0 is empty), keyed by path
+    size_t* table;
+    size_t table_size;
+};
+
+// A worker's deque of directories (relative paths) still to scan
+struct WorkerQueue
+{
+    pthread_mutex_t lock;
+    char** tasks;
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
+
+// What one worker found, merged after all workers finish
+struct WorkerOutput
+{
+    struct ShareEntry* entries;
+    size_t count;
+    size_t cap;
+    // Records for the new cache file, in cache file format
+    char* cache;
+    size_t cache_len;
+    size_t cache_cap;
+    size_t dirs_scanned;
+    size_t dirs_cached;
+};
+
+struct IndexJob
+{
+    int root_fd;
+    int threads;
+    struct WorkerQueue queues[SHARE_INDEX_MAX_THREADS];
+    struct WorkerOutput outputs[SHARE_INDEX_MAX_THREADS];
+    // Directories queued or being scanned; the walk is done when it reaches zero
+    atomic_long pending;
+    // Cache from the previous run, or NULL
+    struct ShareCache* cache;
+};
+
+struct WorkerArg
+{
+    struct IndexJob* job;
+    int id;
+};
+
+static void* index_worker(void* arg);
+static void scan_directory(struct IndexJob* job, int id, const char* path, char* dirent_buf);
+static void queue_push(struct IndexJob* job, int id, char* path);
+static char* queue_pop(struct WorkerQueue* queue, int steal);
+static char* join_path(const char* dir, const char* name);
+static int add_entry(struct WorkerOutput* out, const char* dir, const char* name, uint64_t inode, uint64_t size, int64_t mtime_sec, uint32_t mtime_nsec);
+static void append_record(struct WorkerOutput* out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static struct ShareCache* cache_load(const char* cache_path);
+static const struct CachedDir* cache_find(const struct ShareCache* cache, const char* path);
+static void cache_free(struct ShareCache* cache);
+static void cache_write(const char* cache_path, struct IndexJob* job);
+static uint64_t path_hash(const char* path);
+static int compare_entries(const void* a, const void* b);
+
+int share_index_build(const char* root, const char* cache_path, int threads, struct ShareIndex* index)
+{
+    memset(index, 0, sizeof(*index));
+
+    if (threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 && cpus < SHARE_INDEX_DEFAULT_THREADS ? (int)cpus : SHARE_INDEX_DEFAULT_THREADS;
+    }
+    if (threads > SHARE_INDEX_MAX_THREADS)
+    {
+        threads = SHARE_INDEX_MAX_THREADS;
+    }
+
+    struct IndexJob* job = calloc(1, sizeof(*job));
+    if (job == NULL)
+    {
+        return -1;
+    }
+    job->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (job->root_fd < 0)
+    {
+        free(job);
+        return -1;
+    }
+    job->threads = threads;
+    job->cache = cache_path != NULL ? cache_load(cache_path) : NULL;
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_mutex_init(&job->queues[t].lock, NULL);
+    }
+
+    // The walk starts at the root, whose relative path is empty
+    char* start = strdup("");
+    if (start != NULL)
+    {
+        queue_push(job, 0, start);
+    }
+
+    pthread_t workers[SHARE_INDEX_MAX_THREADS];
+    struct WorkerArg args[SHARE_INDEX_MAX_THREADS];
+    int started = 0;
+    for (int t = 1; t < threads; t++)
+    {
+        args[t].job = job;
+        args[t].id = t;
+        if (pthread_create(&workers[t], NULL, index_worker, &args[t]) != 0)
+        {
+            break;
+        }
+        started = t;
+    }
+    // This thread is worker 0
+    args[0].job = job;
+    args[0].id = 0;
+    index_worker(&args[0]);
+    for (int t = 1; t <= started; t++)
+    {
+        pthread_join(workers[t], NULL);
+    }
+
+    // Merge the per-worker results
+    size_t total = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        total += job->outputs[t].count;
+        index->dirs_scanned += job->outputs[t].dirs_scanned;
+        index->dirs_cached += job->outputs[t].dirs_cached;
+    }
+    index->entries = malloc((total > 0 ? total : 1) * sizeof(index->entries[0]));
+    for (int t = 0; t < threads; t++)
+    {
+        struct WorkerOutput* out = &job->outputs[t];
+        if (index->entries != NULL)
+        {
+            memcpy(index->entries + index->count, out->entries, out->count * sizeof(out->entries[0]));
+            index->count += out->count;
+        }
+        else
+        {
+            for (size_t e = 0; e < out->count; e++)
+            {
+                free(out->entries[e].path);
+            }
+        }
+        free(out->entries);
+    }
+    qsort(index->entries, index->count, sizeof(index->entries[0]), compare_entries);
+
+    if (cache_path != NULL)
+    {
+        cache_write(cache_path, job);
+    }
+
+    for (int t = 0; t < threads; t++)
+    {
+        free(job->outputs[t].cache);
+        free(job->queues[t].tasks);
+        pthread_mutex_destroy(&job->queues[t].lock);
+    }
+    cache_free(job->cache);
+    close(job->root_fd);
+    free(job);
+    return index->entries != NULL ? 0 : -1;
+}
+
+void share_index_free(struct ShareIndex* index)
+{
+    for (size_t e = 0; e < index->count; e++)
+    {
+        free(index->entries[e].path);
+    }
+    free(index->entries);
+    memset(index, 0, sizeof(*index));
+}
+
+// Worker loop: scan directories from the own deque, steal when it is empty, and stop once
+// no directory is queued or being scanned anywhere
+static void* index_worker(void* arg)
+{
+    struct WorkerArg* worker = arg;
+    struct IndexJob* job = worker->job;
+    char* dirent_buf = malloc(DIRENT_BUF_SIZE);
+    int idle = 0;
+
+    if (dirent_buf == NULL)
+    {
+        return NULL;
+    }
+
+    while (1)
+    {
+        char* path = queue_pop(&job->queues[worker->id], 0);
+        for (int k = 1; path == NULL && k < job->threads; k++)
+        {
+            path = queue_pop(&job->queues[(worker->id + k) % job->threads], 1);
+        }
+
+        if (path == NULL)
+        {
+            if (atomic_load(&job->pending) == 0)
+            {
+                break;
+            }
+            // Another worker is still scanning and may queue more directories
+            if (++idle < 64)
+            {
+                sched_yield();
+            }
+            else
+            {
+                struct timespec pause = {0, 50000};
+                nanosleep(&pause, NULL);
+            }
+            continue;
+        }
+
+        idle = 0;
+        scan_directory(job, worker->id, path, dirent_buf);
+        free(path);
+        atomic_fetch_sub(&job->pending, 1);
+    }
+
+    free(dirent_buf);
+    return NULL;
+}
+
+// Lists one directory, from the cache when it is unchanged, queueing its subdirectories
+static void scan_directory(struct IndexJob* job, int id, const char* path, char* dirent_buf)
+{
+    struct WorkerOutput* out = &job->outputs[id];
+    int dir_fd = openat(job->root_fd, path[0] != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct statx dir_stat;
+
+    if (dir_fd < 0)
+    {
+        return;
+    }
+    if (statx(dir_fd, "", AT_EMPTY_PATH, STATX_INO | STATX_MTIME, &dir_stat) < 0)
+    {
+        close(dir_fd);
+        return;
+    }
+    append_record(out, "D %llu %lld %u %s\n", (unsigned long long)dir_stat.stx_ino, (long long)dir_stat.stx_mtime.tv_sec, dir_stat.stx_mtime.tv_nsec, path);
+
+    const struct CachedDir* cached = cache_find(job->cache, path);
+    if (cached != NULL && cached->inode == dir_stat.stx_ino &&
+        cached->mtime_sec == dir_stat.stx_mtime.tv_sec && cached->mtime_nsec == dir_stat.stx_mtime.tv_nsec)
+    {
+        // Unchanged since the last run: reuse its listing without reading it
+        for (size_t f = 0; f < cached->file_count; f++)
+        {
+            const struct CachedFile* file = &cached->files[f];
+            if (add_entry(out, path, file->name, file->inode, file->size, file->mtime_sec, file->mtime_nsec) == 0)
+            {
+                append_record(out, "F %llu %llu %lld %u %s\n", (unsigned long long)file->inode, (unsigned long long)file->size, (long long)file->mtime_sec, file->mtime_nsec, file->name);
+            }
+        }
+        for (size_t s = 0; s < cached->subdir_count; s++)
+        {
+            char* child = join_path(path, cached->subdirs[s]);
+            if (child != NULL)
+            {
+                queue_push(job, id, child);
+                append_record(out, "S %s\n", cached->subdirs[s]);
+            }
+        }
+        out->dirs_cached++;
+        close(dir_fd);
+        return;
+    }
+
+    out->dirs_scanned++;
+    ssize_t bytes;
+    while ((bytes = getdents64(dir_fd, dirent_buf, DIRENT_BUF_SIZE)) > 0)
+    {
+        for (ssize_t offset = 0; offset < bytes;)
+        {
+            struct dirent64* entry = (struct dirent64*)(dirent_buf + offset);
+            const char* name = entry->d_name;
+            unsigned char type = entry->d_type;
+            struct statx file_stat;
+            int have_stat = 0;
+
+            offset += entry->d_reclen;
+            // Skip the directory itself, its parent and names the cache file cannot hold
+            if ((name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) || strchr(name, '\n') != NULL)
+            {
+                continue;
+            }
+
+            // Some filesystems do not report the type in the directory entry
+            if (type == DT_UNKNOWN)
+            {
+                if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO, &file_stat) < 0)
+                {
+                    continue;
+                }
+                have_stat = 1;
+                type = S_ISDIR(file_stat.stx_mode) ? DT_DIR : S_ISREG(file_stat.stx_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            if (type == DT_DIR)
+            {
+                char* child = join_path(path, name);
+                if (child != NULL)
+                {
+                    queue_push(job, id, child);
+                    append_record(out, "S %s\n", name);
+                }
+            }
+            else if (type == DT_REG)
+            {
+                if (!have_stat && statx(dir_fd, name, AT_SYMLINK_NOFOLLOW, STATX_SIZE | STATX_MTIME, &file_stat) < 0)
+                {
+                    continue;
+                }
+                if (add_entry(out, path, name, entry->d_ino, file_stat.stx_size, file_stat.stx_mtime.tv_sec, file_stat.stx_mtime.tv_nsec) == 0)
+                {
+                    append_record(out, "F %llu %llu %lld %u %s\n", (unsigned long long)entry->d_ino, (unsigned long long)file_stat.stx_size, (long long)file_stat.stx_mtime.tv_sec, file_stat.stx_mtime.tv_nsec, name);
+                }
+            }
+            // Symbolic links and special files are not shared
+        }
+    }
+    close(dir_fd);
+}
+
+// Queue a directory on a worker's deque; the deque takes ownership of path
+static void queue_push(struct IndexJob* job, int id, char* path)
+{
+    struct WorkerQueue* queue = &job->queues[id];
+
+    atomic_fetch_add(&job->pending, 1);
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == queue->cap)
+    {
+        size_t new_cap = queue->cap == 0 ? 256 : queue->cap * 2;
+        char** grown = realloc(queue->tasks, new_cap * sizeof(char*));
+        if (grown == NULL)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            free(path);
+            atomic_fetch_sub(&job->pending, 1);
+            return;
+        }
+        queue->tasks = grown;
+        queue->cap = new_cap;
+    }
+    queue->tasks[queue->tail++] = path;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Take a directory from a deque: the newest for its owner, the oldest when stealing
+static char* queue_pop(struct WorkerQueue* queue, int steal)
+{
+    char* path = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail > queue->head)
+    {
+        path = steal ? queue->tasks[queue->head++] : queue->tasks[--queue->tail];
+        if (queue->head == queue->tail)
+        {
+            queue->head = 0;
+            queue->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return path;
+}
+
+// Relative path of name inside dir ("" is the share root)
+static char* join_path(const char* dir, const char* name)
+{
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char* path = malloc(dir_len + 1 + name_len + 1);
+
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    if (dir_len == 0)
+    {
+        memcpy(path, name, name_len + 1);
+        return path;
+    }
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+static int add_entry(struct WorkerOutput* out, const char* dir, const char* name, uint64_t inode, uint64_t size, int64_t mtime_sec, uint32_t mtime_nsec)
+{
+    if (out->count == out->cap)
+    {
+        size_t new_cap = out->cap == 0 ? 1024 : out->cap * 2;
+        struct ShareEntry* grown = realloc(out->entries, new_cap * sizeof(out->entries[0]));
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        out->entries = grown;
+        out->cap = new_cap;
+    }
+
+    struct ShareEntry* entry = &out->entries[out->count];
+    entry->path = join_path(dir, name);
+    if (entry->path == NULL)
+    {
+        return -1;
+    }
+    entry->size = size;
+    entry->mtime_sec = mtime_sec;
+    entry->mtime_nsec = mtime_nsec;
+    entry->inode = inode;
+    out->count++;
+    return 0;
+}
+
+// Append one line to a worker's part of the new cache file
+static void append_record(struct WorkerOutput* out, const char* format, ...)
+{
+    va_list args;
+
+    // Longest record: a path of PATH_MAX plus the numeric fields
+    if (out->cache_cap - out->cache_len < 4096 + 128)
+    {
+        size_t new_cap = out->cache_cap == 0 ? 64 * 1024 : out->cache_cap * 2;
+        char* grown = realloc(out->cache, new_cap);
+        if (grown == NULL)
+        {
+            return;
+        }
+        out->cache = grown;
+        out->cache_cap = new_cap;
+    }
+
+    va_start(args, format);
+    int written = vsnprintf(out->cache + out->cache_len, out->cache_cap - out->cache_len, format, args);
+    va_end(args);
+    if (written > 0 && (size_t)written < out->cache_cap - out->cache_len)
+    {
+        out->cache_len += written;
+    }
+}
+
+// Read the cache written by an earlier run. Returns NULL if there is none or it is invalid
+static struct ShareCache* cache_load(const char* cache_path)
+{
+    FILE* file = fopen(cache_path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    struct ShareCache* cache = calloc(1, sizeof(*cache));
+    long length = -1;
+    if (cache != NULL && fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        cache->text = malloc(length + 1);
+    }
+    if (cache == NULL || cache->text == NULL || fread(cache->text, 1, length, file) != (size_t)length)
+    {
+        fclose(file);
+        cache_free(cache);
+        return NULL;
+    }
+    fclose(file);
+    cache->text[length] = '\0';
+
+    size_t magic_len = strlen(CACHE_MAGIC);
+    if (strncmp(cache->text, CACHE_MAGIC "\n", magic_len + 1) != 0)
+    {
+        cache_free(cache);
+        return NULL;
+    }
+
+    // Count the records so every array is allocated once
+    size_t dir_total = 0;
+    size_t file_total = 0;
+    size_t subdir_total = 0;
+    for (char* line = cache->text + magic_len + 1; *line != '\0';)
+    {
+        dir_total += line[0] == 'D';
+        file_total += line[0] == 'F';
+        subdir_total += line[0] == 'S';
+        char* end = strchr(line, '\n');
+        line = end != NULL ? end + 1 : line + strlen(line);
+    }
+    cache->dirs = calloc(dir_total + 1, sizeof(cache->dirs[0]));
+    cache->files = calloc(file_total + 1, sizeof(cache->files[0]));
+    cache->subdirs = calloc(subdir_total + 1, sizeof(cache->subdirs[0]));
+    cache->table_size = 16;
+    while (cache->table_size < dir_total * 2)
+    {
+        cache->table_size *= 2;
+    }
+    cache->table = calloc(cache->table_size, sizeof(cache->table[0]));
+    if (cache->dirs == NULL || cache->files == NULL || cache->subdirs == NULL || cache->table == NULL)
+    {
+        cache_free(cache);
+        return NULL;
+    }
+
+    // Each D record is followed by the F and S records of its children
+    struct CachedDir* dir = NULL;
+    size_t file_count = 0;
+    size_t subdir_count = 0;
+    for (char* line = cache->text + magic_len + 1; *line != '\0';)
+    {
+        char* end = strchr(line, '\n');
+        if (end == NULL)
+        {
+            break;
+        }
+        *end = '\0';
+
+        unsigned long long inode;
+        unsigned long long size;
+        long long mtime_sec;
+        unsigned int mtime_nsec;
+        int name_offset = -1;
+        if (line[0] == 'D' && sscanf(line, "D %llu %lld %u%n", &inode, &mtime_sec, &mtime_nsec, &name_offset) == 3 && line[name_offset] == ' ')
+        {
+            dir = &cache->dirs[cache->dir_count++];
+            // The name follows a single separating space and may itself start with spaces
+            dir->path = line + name_offset + 1;
+            dir->inode = inode;
+            dir->mtime_sec = mtime_sec;
+            dir->mtime_nsec = mtime_nsec;
+            dir->files = &cache->files[file_count];
+            dir->subdirs = &cache->subdirs[subdir_count];
+        }
+        else if (dir != NULL && line[0] == 'F' && sscanf(line, "F %llu %llu %lld %u%n", &inode, &size, &mtime_sec, &mtime_nsec, &name_offset) == 4 && line[name_offset] == ' ')
+        {
+            struct CachedFile* cached_file = &cache->files[file_count++];
+            cached_file->inode = inode;
+            cached_file->size = size;
+            cached_file->mtime_sec = mtime_sec;
+            cached_file->mtime_nsec = mtime_nsec;
+            cached_file->name = line + name_offset + 1;
+            dir->file_count++;
+        }
+        else if (dir != NULL && line[0] == 'S' && line[1] == ' ')
+        {
+            cache->subdirs[subdir_count++] = line + 2;
+            dir->subdir_count++;
+        }
+        line = end + 1;
+    }
+
+    for (size_t d = 0; d < cache->dir_count; d++)
+    {
+        size_t slot = path_hash(cache->dirs[d].path) & (cache->table_size - 1);
+        while (cache->table[slot] != 0)
+        {
+            slot = (slot + 1) & (cache->table_size - 1);
+        }
+        cache->table[slot] = d + 1;
+    }
+    return cache;
+}
+
+static const struct CachedDir* cache_find(const struct ShareCache* cache, const char* path)
+{
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    size_t slot = path_hash(path) & (cache->table_size - 1);
+    while (cache->table[slot] != 0)
+    {
+        const struct CachedDir* dir = &cache->dirs[cache->table[slot] - 1];
+        if (strcmp(dir->path, path) == 0)
+        {
+            return dir;
+        }
+        slot = (slot + 1) & (cache->table_size - 1);
+    }
+    return NULL;
+}
+
+static void cache_free(struct ShareCache* cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    free(cache->text);
+    free(cache->dirs);
+    free(cache->files);
+    free(cache->subdirs);
+    free(cache->table);
+    free(cache);
+}
+
+// Write the records gathered by every worker to a temporary file and move it into place,
+// so an interrupted run never leaves a truncated cache behind
+static void cache_write(const char* cache_path, struct IndexJob* job)
+{
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+
+    FILE* file = fopen(tmp_path, "wb");
+    if (file == NULL)
+    {
+        return;
+    }
+    int ok = fputs(CACHE_MAGIC "\n", file) >= 0;
+    for (int t = 0; t < job->threads && ok; t++)
+    {
+        ok = fwrite(job->outputs[t].cache, 1, job->outputs[t].cache_len, file) == job->outputs[t].cache_len;
+    }
+    if (fclose(file) != 0 || !ok || rename(tmp_path, cache_path) != 0)
+    {
+        unlink(tmp_path);
+    }
+}
+
+// FNV-1a over a path
+static uint64_t path_hash(const char* path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (const char* c = path; *c != '\0'; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+    return strcmp(((const struct ShareEntry*)a)->path, ((const struct ShareEntry*)b)->path);
+}
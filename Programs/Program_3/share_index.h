@@ -0,0 +1,37 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+#ifndef SHARE_INDEX_H
+#define SHARE_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One regular file found under the share root
+struct ShareEntry
+{
+    // Path relative to the share root, e.g. "music/song.mp3"
+    char* path;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint64_t inode;
+};
+
+// Every file in a share, sorted by path
+struct ShareIndex
+{
+    struct ShareEntry* entries;
+    size_t count;
+    // Directories read from disk and directories whose listing came from the cache
+    size_t dirs_scanned;
+    size_t dirs_cached;
+};
+
+// Walks root recursively with threads workers (0 picks one per CPU). cache_path, if not
+// NULL, is a metadata cache from an earlier run: directories whose inode and mtime are
+// unchanged reuse their cached listing instead of being read again, and the cache is
+// rewritten afterwards. Returns 0 on success or -1 if root cannot be opened.
+int share_index_build(const char* root, const char* cache_path, int threads, struct ShareIndex* index);
+void share_index_free(struct ShareIndex* index);
+
+#endif
@@ -0,0 +1,510 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// TLS for the peer's connections, on OpenSSL. Each socket that speaks TLS has an entry
+// in a table indexed by its descriptor; sockets without one are plain TCP.
+//
+// Outgoing connections verify the server's certificate against the host they were
+// opened to. The first registry connection handshakes blocking; downloads, HAVE probes
+// and registry reconnects handshake non-blocking from the client's event loop. New
+// sessions are kept per host:port, so the next connection to the same address resumes
+// instead of doing a full handshake.
+//
+// Download connections are non-blocking and are asked for kernel TLS. Once the kernel
+// encrypts the socket, file data goes out with plain sendfile() and send() as before.
+// Without it, data on non-blocking connections is encrypted here one record-sized piece
+// at a time from a buffer the connection owns, so a write the socket only partly takes
+// is retried with exactly the same bytes, as OpenSSL requires.
+
+#define _GNU_SOURCE
+#include "tls.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+// Plaintext encrypted at a time on download connections without kernel TLS: one record
+#define TLS_STAGE_SIZE (16 * 1024)
+// Servers whose last session is remembered for resumption
+#define TLS_SESSION_CACHE 64
+// Longest host:port key of a remembered session
+#define TLS_SESSION_KEY_LEN 320
+// Longest a blocking handshake may wait on each read or write before it gives up
+#define TLS_HANDSHAKE_TIMEOUT_S 10
+
+struct TlsConn
+{
+    SSL* ssl;
+    // Set for non-blocking connections: accepted ones, and outgoing ones once the
+    // client switched them
+    int nonblocking;
+    // Non-blocking connections without kernel TLS: data accepted by a send but not yet
+    // written, always retried as a whole
+    unsigned char* stage;
+    size_t stage_len;
+    // host:port the session belongs to, for outgoing connections
+    char session_key[TLS_SESSION_KEY_LEN];
+};
+
+// A remembered session
+struct TlsSession
+{
+    char key[TLS_SESSION_KEY_LEN];
+    SSL_SESSION* session;
+    unsigned long last_used;
+};
+
+static SSL_CTX* client_ctx = NULL;
+static SSL_CTX* server_ctx = NULL;
+// TLS state of each socket, indexed by descriptor
+static struct TlsConn** conns = NULL;
+static int conn_limit = 0;
+static struct TlsSession sessions[TLS_SESSION_CACHE];
+static unsigned long session_clock = 0;
+
+static int conn_table_init(void);
+static struct TlsConn* conn_for(int sock);
+static struct TlsConn* client_conn_new(int sock, const char* host, const char* service);
+static int session_ready(SSL* ssl, SSL_SESSION* session);
+static int drain_stage(struct TlsConn* conn);
+static ssize_t tls_failure(struct TlsConn* conn, int result);
+
+int tls_client_init(const char* ca_file)
+{
+    if (conn_table_init() < 0)
+    {
+        return -1;
+    }
+    client_ctx = SSL_CTX_new(TLS_client_method());
+    if (client_ctx == NULL)
+    {
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(client_ctx, TLS1_2_VERSION);
+    // OpenSSL writes with plain write(), which has no MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+    int loaded = ca_file != NULL ? SSL_CTX_load_verify_locations(client_ctx, ca_file, NULL) : SSL_CTX_set_default_verify_paths(client_ctx);
+    if (loaded != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_verify(client_ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(client_ctx, session_ready);
+    return 0;
+}
+
+int tls_server_init(const char* cert_file, const char* key_file)
+{
+    if (conn_table_init() < 0)
+    {
+        return -1;
+    }
+    server_ctx = SSL_CTX_new(TLS_server_method());
+    if (server_ctx == NULL)
+    {
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(server_ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(server_ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(server_ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(server_ctx) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    // Kernel TLS keeps sendfile() zero-copy; OpenSSL falls back by itself where the
+    // kernel or cipher does not support it
+    SSL_CTX_set_options(server_ctx, SSL_OP_ENABLE_KTLS);
+    // TLS 1.2 downloaders resume from the session cache, which needs an ID context
+    static const unsigned char session_context[] = "p2p-peer";
+    SSL_CTX_set_session_id_context(server_ctx, session_context, sizeof(session_context) - 1);
+    return 0;
+}
+
+int tls_client_enabled(void)
+{
+    return client_ctx != NULL;
+}
+
+int tls_server_enabled(void)
+{
+    return server_ctx != NULL;
+}
+
+int tls_connect(int sock, const char* host, const char* service)
+{
+    struct TlsConn* conn = client_conn_new(sock, host, service);
+    if (conn == NULL)
+    {
+        return -1;
+    }
+
+    // A server that accepts the connection but never answers must not hold the caller
+    // forever; the socket's own timeouts are put back afterwards
+    struct timeval saved_rcv;
+    struct timeval saved_snd;
+    struct timeval timeout = {TLS_HANDSHAKE_TIMEOUT_S, 0};
+    socklen_t saved_len = sizeof(saved_rcv);
+    getsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &saved_rcv, &saved_len);
+    saved_len = sizeof(saved_snd);
+    getsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &saved_snd, &saved_len);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    int result = SSL_connect(conn->ssl);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &saved_rcv, sizeof(saved_rcv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &saved_snd, sizeof(saved_snd));
+    if (result != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_free(conn->ssl);
+        free(conn);
+        return -1;
+    }
+    conns[sock] = conn;
+    return 0;
+}
+
+int tls_connect_start(int sock, const char* host, const char* service)
+{
+    struct TlsConn* conn = client_conn_new(sock, host, service);
+    if (conn == NULL)
+    {
+        return -1;
+    }
+    SSL_set_connect_state(conn->ssl);
+    conn->nonblocking = 1;
+    conns[sock] = conn;
+    return 0;
+}
+
+int tls_handshake(int sock, short* events)
+{
+    struct TlsConn* conn = conn_for(sock);
+    if (conn == NULL)
+    {
+        return -1;
+    }
+    int result = SSL_do_handshake(conn->ssl);
+    if (result == 1)
+    {
+        return 1;
+    }
+    int error = SSL_get_error(conn->ssl, result);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+    {
+        *events = error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+        return 0;
+    }
+    ERR_print_errors_fp(stderr);
+    return -1;
+}
+
+int tls_accept(int sock)
+{
+    if (sock >= conn_limit)
+    {
+        return -1;
+    }
+    struct TlsConn* conn = calloc(1, sizeof(*conn));
+    if (conn == NULL || (conn->ssl = SSL_new(server_ctx)) == NULL)
+    {
+        free(conn);
+        return -1;
+    }
+    SSL_set_fd(conn->ssl, sock);
+    SSL_set_accept_state(conn->ssl);
+    conn->nonblocking = 1;
+    conns[sock] = conn;
+    return 0;
+}
+
+int tls_set_nonblocking(int sock)
+{
+    struct TlsConn* conn = conn_for(sock);
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        return -1;
+    }
+    if (conn != NULL)
+    {
+        conn->nonblocking = 1;
+    }
+    return 0;
+}
+
+ssize_t tls_send(int sock, const void* buf, size_t len, int flags)
+{
+    struct TlsConn* conn = conn_for(sock);
+    if (conn == NULL || BIO_get_ktls_send(SSL_get_wbio(conn->ssl)))
+    {
+        return send(sock, buf, len, flags);
+    }
+
+    // Blocking connections write everything in one go
+    if (!conn->nonblocking)
+    {
+        size_t written;
+        int result = SSL_write_ex(conn->ssl, buf, len, &written);
+        return result == 1 ? (ssize_t)written : tls_failure(conn, result);
+    }
+
+    int drained = drain_stage(conn);
+    if (drained <= 0)
+    {
+        errno = drained == 0 ? EAGAIN : EPIPE;
+        return -1;
+    }
+    size_t total = 0;
+    while (total < len && drained > 0)
+    {
+        size_t piece = len - total < TLS_STAGE_SIZE ? len - total : TLS_STAGE_SIZE;
+        memcpy(conn->stage, (const unsigned char*)buf + total, piece);
+        conn->stage_len = piece;
+        total += piece;
+        drained = drain_stage(conn);
+    }
+    return total;
+}
+
+ssize_t tls_recv(int sock, void* buf, size_t len, int flags)
+{
+    struct TlsConn* conn = conn_for(sock);
+    if (conn == NULL)
+    {
+        return recv(sock, buf, len, flags);
+    }
+
+    size_t total = 0;
+    do
+    {
+        size_t got;
+        int result = (flags & MSG_PEEK) ? SSL_peek_ex(conn->ssl, buf, len, &got) : SSL_read_ex(conn->ssl, (unsigned char*)buf + total, len - total, &got);
+        if (result != 1)
+        {
+            int error = SSL_get_error(conn->ssl, result);
+            if (error == SSL_ERROR_ZERO_RETURN || total > 0)
+            {
+                return total;
+            }
+            return tls_failure(conn, result);
+        }
+        total += got;
+        // A peek cannot look past the record it returned
+        if (flags & MSG_PEEK)
+        {
+            break;
+        }
+    }
+    while ((flags & MSG_WAITALL) && total < len);
+    return total;
+}
+
+ssize_t tls_sendfile(int sock, int file_fd, off_t* offset, size_t count)
+{
+    struct TlsConn* conn = conn_for(sock);
+    if (conn == NULL || BIO_get_ktls_send(SSL_get_wbio(conn->ssl)))
+    {
+        // The kernel encrypts, so the file never passes through user space
+        return sendfile(sock, file_fd, offset, count);
+    }
+
+    int drained = drain_stage(conn);
+    if (drained <= 0)
+    {
+        errno = drained == 0 ? EAGAIN : EPIPE;
+        return -1;
+    }
+    size_t total = 0;
+    while (total < count && drained > 0)
+    {
+        size_t piece = count - total < TLS_STAGE_SIZE ? count - total : TLS_STAGE_SIZE;
+        ssize_t got = pread(file_fd, conn->stage, piece, *offset);
+        if (got <= 0)
+        {
+            if (got < 0 && total == 0)
+            {
+                return -1;
+            }
+            break;
+        }
+        conn->stage_len = got;
+        *offset += got;
+        total += got;
+        drained = drain_stage(conn);
+    }
+    return total;
+}
+
+ssize_t tls_flush(int sock)
+{
+    struct TlsConn* conn = conn_for(sock);
+    if (conn == NULL)
+    {
+        return 0;
+    }
+    int drained = drain_stage(conn);
+    return drained < 0 ? -1 : (ssize_t)conn->stage_len;
+}
+
+int tls_close(int sock)
+{
+    struct TlsConn* conn = conn_for(sock);
+    if (conn != NULL)
+    {
+        // Best effort: a non-blocking socket that is full just closes without the alert
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+        free(conn->stage);
+        free(conn);
+        conns[sock] = NULL;
+    }
+    return close(sock);
+}
+
+// Size the descriptor table for every socket the process may open
+static int conn_table_init(void)
+{
+    if (conns != NULL)
+    {
+        return 0;
+    }
+    struct rlimit limit;
+    conn_limit = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY ? (int)limit.rlim_cur : 65536;
+    conns = calloc(conn_limit, sizeof(*conns));
+    return conns != NULL ? 0 : -1;
+}
+
+static struct TlsConn* conn_for(int sock)
+{
+    return sock >= 0 && sock < conn_limit ? conns[sock] : NULL;
+}
+
+// Set up an outgoing connection to host, resuming its last session when there is one.
+// The caller handshakes and enters it in the table
+static struct TlsConn* client_conn_new(int sock, const char* host, const char* service)
+{
+    if (sock >= conn_limit)
+    {
+        return NULL;
+    }
+    struct TlsConn* conn = calloc(1, sizeof(*conn));
+    if (conn == NULL || (conn->ssl = SSL_new(client_ctx)) == NULL)
+    {
+        free(conn);
+        return NULL;
+    }
+    SSL_set_fd(conn->ssl, sock);
+    SSL_set_app_data(conn->ssl, conn);
+    snprintf(conn->session_key, sizeof(conn->session_key), "%s:%s", host, service);
+
+    // Holders are reached by address, the registry usually by name
+    if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(conn->ssl), host) != 1)
+    {
+        SSL_set_tlsext_host_name(conn->ssl, host);
+        SSL_set1_host(conn->ssl, host);
+    }
+
+    for (int i = 0; i < TLS_SESSION_CACHE; i++)
+    {
+        if (sessions[i].session != NULL && strcmp(sessions[i].key, conn->session_key) == 0)
+        {
+            SSL_set_session(conn->ssl, sessions[i].session);
+            sessions[i].last_used = ++session_clock;
+            break;
+        }
+    }
+    return conn;
+}
+
+// A server sent a session that can be resumed: remember it under the connection's
+// host:port, replacing the least recently used entry
+static int session_ready(SSL* ssl, SSL_SESSION* session)
+{
+    struct TlsConn* conn = SSL_get_app_data(ssl);
+    struct TlsSession* slot = &sessions[0];
+
+    for (int i = 0; i < TLS_SESSION_CACHE; i++)
+    {
+        if (sessions[i].session != NULL && strcmp(sessions[i].key, conn->session_key) == 0)
+        {
+            slot = &sessions[i];
+            break;
+        }
+        if (sessions[i].last_used < slot->last_used)
+        {
+            slot = &sessions[i];
+        }
+    }
+    SSL_SESSION_free(slot->session);
+    slot->session = session;
+    strcpy(slot->key, conn->session_key);
+    slot->last_used = ++session_clock;
+    // Keep the reference OpenSSL handed over
+    return 1;
+}
+
+// Write the staged record. Returns 1 once nothing is staged, 0 if the socket is full,
+// or -1 if the connection failed
+static int drain_stage(struct TlsConn* conn)
+{
+    if (conn->stage == NULL && (conn->stage = malloc(TLS_STAGE_SIZE)) == NULL)
+    {
+        return -1;
+    }
+    if (conn->stage_len == 0)
+    {
+        return 1;
+    }
+    size_t written;
+    int result = SSL_write_ex(conn->ssl, conn->stage, conn->stage_len, &written);
+    if (result == 1)
+    {
+        conn->stage_len = 0;
+        return 1;
+    }
+    int error = SSL_get_error(conn->ssl, result);
+    return error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ ? 0 : -1;
+}
+
+// Turn a failed SSL call into the -1 and errno a socket call would give. A connection
+// that ends without the close alert may have been cut short, so it is an I/O error
+// rather than the end of the stream
+static ssize_t tls_failure(struct TlsConn* conn, int result)
+{
+    int error = SSL_get_error(conn->ssl, result);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+    {
+        errno = EAGAIN;
+    }
+    else if (error == SSL_ERROR_SYSCALL && errno == 0)
+    {
+        errno = EIO;
+    }
+#ifdef SSL_R_UNEXPECTED_EOF_WHILE_READING
+    else if (error == SSL_ERROR_SSL && ERR_GET_REASON(ERR_peek_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING)
+    {
+        errno = EIO;
+    }
+#endif
+    else if (error != SSL_ERROR_SYSCALL)
+    {
+        errno = EPROTO;
+    }
+    ERR_clear_error();
+    return -1;
+}
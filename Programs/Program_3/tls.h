@@ -0,0 +1,57 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Optional TLS for every connection the peer opens (registry, FETCH, HAVE) and for the
+// downloads it serves. Connections are identified by their socket: the send and receive
+// calls below take the place of send(), recv() and sendfile() and fall through to them
+// for sockets without TLS, so callers need not care which kind they hold.
+
+// Encrypt outgoing connections, verifying servers against ca_file (NULL for the
+// system CAs). Returns 0 on success or -1 if the CA cannot be loaded
+int tls_client_init(const char* ca_file);
+// Serve downloads over TLS with this certificate chain and key. Returns 0 or -1
+int tls_server_init(const char* cert_file, const char* key_file);
+int tls_client_enabled(void);
+int tls_server_enabled(void);
+
+// Handshake on a connected blocking socket, giving up if the server stalls. The server's
+// certificate must name host; a session from an earlier connection to host:service is
+// resumed when it can be. Returns 0 or -1
+int tls_connect(int sock, const char* host, const char* service);
+// Start TLS on a connected non-blocking socket, like tls_connect() but without waiting:
+// tls_handshake() runs the handshake. Returns 0 or -1
+int tls_connect_start(int sock, const char* host, const char* service);
+// Continue the handshake of a connection tls_connect_start() began. Returns 1 once it
+// is done, 0 when it must be called again after the socket is ready for *events
+// (POLLIN or POLLOUT), or -1 if it failed
+int tls_handshake(int sock, short* events);
+// Make a socket non-blocking, TLS or not; tls_send() then stages what the socket does
+// not take. Returns 0 or -1
+int tls_set_nonblocking(int sock);
+// Start TLS on an accepted non-blocking socket; the handshake runs inside the first
+// tls_recv() calls. Returns 0 or -1
+int tls_accept(int sock);
+
+// send()/recv() replacements. recv honours MSG_WAITALL, MSG_PEEK and MSG_DONTWAIT. It
+// only reports the end of the stream after the close alert; a connection that just ends
+// may have been cut short, so that fails with EIO. On non-blocking sockets a send may
+// keep up to one TLS record of the data to itself, which tls_flush() pushes out; it is
+// counted as sent
+ssize_t tls_send(int sock, const void* buf, size_t len, int flags);
+ssize_t tls_recv(int sock, void* buf, size_t len, int flags);
+// sendfile() replacement. With kernel TLS the file goes out with sendfile() itself;
+// otherwise it is read and encrypted here
+ssize_t tls_sendfile(int sock, int file_fd, off_t* offset, size_t count);
+// Write out data a send kept back. Returns the bytes still waiting (0 when done), or -1
+// if the connection failed
+ssize_t tls_flush(int sock);
+
+// Send the TLS close alert if possible, release the connection and close the socket
+int tls_close(int sock);
+
+#endif
@@ -0,0 +1,888 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Serving side of FETCH with upload shaping, on the peer's event loop alongside its
+// registry requests and downloads. Each pass that sees activity on a download
+// connection ends with one run of pump(), which does the shaping:
+//
+// - At most max_active transfers run at once. Later requests are validated and then
+//   wait, in arrival order, until a transfer finishes.
+// - A global token bucket bounds the total upload rate and a bucket per connection
+//   bounds each transfer. Each bucket holds at most a tenth of a second of its rate.
+// - Bandwidth is shared between downloaders (remote addresses, however many connections
+//   each opens) by deficit round robin: every round, each downloader with data to send
+//   earns a quantum of bytes and spends it on its own connections, and the downloader
+//   served first rotates, so nobody is starved when the global bucket is the limit.
+//
+// File data goes out with sendfile() on non-blocking sockets, so a slow downloader only
+// holds its own connection back. Downloads that negotiated deflate are instead read and
+// compressed one chunk at a time as the socket drains; shaping and fairness count the
+// compressed bytes, since those are what use the link. Files that are already
+// compressed (by extension, or because a sample of the start does not shrink) are sent
+// as they are. While a transfer waits for tokens, pump() runs again every
+// SHAPED_POLL_MS to refill the buckets.
+//
+// With --tls-cert every download connection is TLS (tls.c). Kernel TLS keeps the
+// sendfile() path; without it the file is encrypted in user space, and a transfer only
+// closes once the last encrypted record has been written.
+
+#define _GNU_SOURCE
+#include "upload.h"
+#include "tls.h"
+#include "p2pnet.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+// Download connections served at once, running or waiting
+#define MAX_UPLOAD_CONNS 128
+// Status bytes sent before the data
+#define FETCH_OK 0
+#define FETCH_ERROR 1
+// Bytes each downloader may send per deficit round robin round
+#define DRR_QUANTUM (64 * 1024)
+// Largest single sendfile() call
+#define SEND_CHUNK (256 * 1024)
+// Smallest token bucket capacity, so low rates still send reasonably sized chunks
+#define MIN_BURST (16 * 1024)
+// How often the buckets are refilled while a transfer waits for tokens
+#define SHAPED_POLL_MS 5
+// File bytes read and compressed at a time
+#define COMPRESS_CHUNK (64 * 1024)
+// Bytes of the start of a file compressed to decide whether compression is worth it,
+// and the smallest saving (in percent) that makes it so
+#define COMPRESS_SAMPLE (16 * 1024)
+#define COMPRESS_MIN_SAVING 10
+
+enum upload_state
+{
+    // Reading the FETCH request
+    UPLOAD_READING,
+    // File opened, waiting for a free transfer slot
+    UPLOAD_WAITING,
+    // Streaming the file
+    UPLOAD_SENDING
+};
+
+struct UploadConn
+{
+    int used;
+    int sock;
+    enum upload_state state;
+    char request[MAX_REQUEST_LEN];
+    size_t request_len;
+    int file_fd;
+    off_t offset;
+    off_t size;
+    // Downloader (flow) the connection belongs to
+    int flow;
+    // Per-connection token bucket
+    double tokens;
+    // Arrival order, for starting waiting transfers first come first served
+    unsigned long seq;
+    // Set when the loop reported the socket writable
+    int writable;
+    // Codec the data is sent in, and for deflate the stream state, the chunk being
+    // compressed and the compressed bytes not yet sent
+    int codec;
+    z_stream zs;
+    unsigned char* chunk;
+    unsigned char* out;
+    size_t out_len;
+    size_t out_pos;
+    int stream_done;
+    // Every byte has been handed to TLS; closes once tls_flush() has written it all
+    int finished;
+};
+
+// One downloader, identified by its address without the port
+struct UploadFlow
+{
+    int used;
+    struct sockaddr_storage addr;
+    // Connections of this downloader
+    int conns;
+    // Bytes it may still send in the current round
+    long long deficit;
+};
+
+static struct P2pLoop* event_loop = NULL;
+static struct UploadLimits current_limits;
+static int compress_level = 0;
+static int listen_fd = -1;
+static int share_fd = -1;
+static upload_activity_fn activity_callback;
+static struct UploadConn conns[MAX_UPLOAD_CONNS];
+static struct UploadFlow flows[MAX_UPLOAD_CONNS];
+static int active_uploads = 0;
+static unsigned long next_seq = 0;
+// Pending run of pump(), and when it is due
+static uint64_t pump_timer = 0;
+static uint64_t pump_due = 0;
+// Shaping state carried from one run of pump() to the next
+static double global_tokens = 0;
+static double last_refill = 0;
+static double last_report = 0;
+static int reported = 0;
+static int first_flow = 0;
+
+static void accept_event(struct P2pLoop* loop, int fd, short revents, void* arg);
+static void conn_event(struct P2pLoop* loop, int fd, short revents, void* arg);
+static void pump(struct P2pLoop* loop, void* arg);
+static void schedule_pump(uint64_t delay_ms);
+static void accept_downloads(void);
+static void read_request(struct UploadConn* conn);
+static int valid_share_path(const char* name);
+static int open_share_file(const char* name);
+static void start_transfer(struct UploadConn* conn);
+static int choose_codec(const struct UploadConn* conn, const char* name, int offered);
+static void send_file_data(struct UploadConn* conn, struct UploadFlow* flow, const struct UploadLimits* limits, double* global_tokens);
+static ssize_t send_compressed(struct UploadConn* conn, size_t budget);
+static void close_conn(struct UploadConn* conn);
+static void reject(struct UploadConn* conn);
+static int flow_for(const struct sockaddr_storage* addr);
+static double bucket_capacity(uint64_t rate);
+static double upload_now(void);
+
+int upload_start(struct P2pLoop* loop, uint16_t port, const char* share_root, const struct UploadLimits* limits, upload_activity_fn on_activity)
+{
+    share_fd = open(share_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (share_fd < 0)
+    {
+        return -1;
+    }
+
+    // Dual-stack listener, or IPv4 only on hosts without IPv6
+    listen_fd = p2p_listen(port, 64);
+    if (listen_fd < 0)
+    {
+        close(share_fd);
+        return -1;
+    }
+
+    // A downloader that hangs up mid-transfer must not kill the peer
+    signal(SIGPIPE, SIG_IGN);
+
+    event_loop = loop;
+    upload_set_limits(limits);
+    activity_callback = on_activity;
+    last_refill = upload_now();
+    if (p2p_loop_watch(loop, listen_fd, POLLIN, accept_event, NULL) < 0)
+    {
+        close(listen_fd);
+        close(share_fd);
+        return -1;
+    }
+    return 0;
+}
+
+void upload_set_compression(int level)
+{
+    compress_level = level < 0 ? 0 : level > Z_BEST_COMPRESSION ? Z_BEST_COMPRESSION : level;
+}
+
+void upload_set_limits(const struct UploadLimits* limits)
+{
+    current_limits = *limits;
+    if (current_limits.max_active < 1)
+    {
+        current_limits.max_active = 1;
+    }
+    // More slots or higher rates may let waiting transfers go
+    if (event_loop != NULL)
+    {
+        schedule_pump(0);
+    }
+}
+
+void upload_get_limits(struct UploadLimits* limits)
+{
+    *limits = current_limits;
+}
+
+static void accept_event(struct P2pLoop* loop, int fd, short revents, void* arg)
+{
+    (void)loop;
+    (void)fd;
+    (void)revents;
+    (void)arg;
+    accept_downloads();
+}
+
+static void conn_event(struct P2pLoop* loop, int fd, short revents, void* arg)
+{
+    struct UploadConn* conn = arg;
+
+    (void)loop;
+    (void)fd;
+    if (conn->state == UPLOAD_READING)
+    {
+        read_request(conn);
+    }
+    else if (conn->state == UPLOAD_WAITING)
+    {
+        // Only a hang-up is expected while waiting; anything else is ignored
+        char discard[64];
+        ssize_t got = tls_recv(conn->sock, discard, sizeof(discard), MSG_DONTWAIT);
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            close_conn(conn);
+        }
+    }
+    else if (revents & (POLLERR | POLLHUP))
+    {
+        close_conn(conn);
+    }
+    else if (revents & POLLOUT)
+    {
+        conn->writable = 1;
+    }
+    schedule_pump(0);
+}
+
+// One round of shaping: refill the buckets, start waiting transfers while slots are
+// free, give every downloader its deficit round robin turn, then watch each connection
+// for what it needs next
+static void pump(struct P2pLoop* loop, void* arg)
+{
+    struct UploadLimits limits = current_limits;
+
+    (void)arg;
+    pump_timer = 0;
+
+    // Refill the buckets for the time that passed
+    double now = upload_now();
+    double elapsed = now - last_refill;
+    last_refill = now;
+    if (limits.global_rate != 0)
+    {
+        global_tokens += limits.global_rate * elapsed;
+        if (global_tokens > bucket_capacity(limits.global_rate))
+        {
+            global_tokens = bucket_capacity(limits.global_rate);
+        }
+    }
+    for (int c = 0; c < MAX_UPLOAD_CONNS; c++)
+    {
+        if (conns[c].used && limits.conn_rate != 0)
+        {
+            conns[c].tokens += limits.conn_rate * elapsed;
+            if (conns[c].tokens > bucket_capacity(limits.conn_rate))
+            {
+                conns[c].tokens = bucket_capacity(limits.conn_rate);
+            }
+        }
+    }
+
+    // Start waiting transfers, oldest first, while slots are free
+    while (active_uploads < limits.max_active)
+    {
+        struct UploadConn* oldest = NULL;
+        for (int c = 0; c < MAX_UPLOAD_CONNS; c++)
+        {
+            if (conns[c].used && conns[c].state == UPLOAD_WAITING && (oldest == NULL || conns[c].seq < oldest->seq))
+            {
+                oldest = &conns[c];
+            }
+        }
+        if (oldest == NULL)
+        {
+            break;
+        }
+        start_transfer(oldest);
+    }
+
+    // One deficit round robin round over the downloaders, starting one further each time
+    for (int k = 0; k < MAX_UPLOAD_CONNS; k++)
+    {
+        int f = (first_flow + k) % MAX_UPLOAD_CONNS;
+        struct UploadFlow* flow = &flows[f];
+        int backlogged = 0;
+
+        if (!flow->used)
+        {
+            continue;
+        }
+        for (int c = 0; c < MAX_UPLOAD_CONNS; c++)
+        {
+            backlogged |= conns[c].used && conns[c].flow == f && conns[c].state == UPLOAD_SENDING;
+        }
+        if (!backlogged)
+        {
+            flow->deficit = 0;
+            continue;
+        }
+
+        // Unspent credit carries over, but only up to one extra quantum
+        flow->deficit += DRR_QUANTUM;
+        if (flow->deficit > 2 * DRR_QUANTUM)
+        {
+            flow->deficit = 2 * DRR_QUANTUM;
+        }
+        for (int c = 0; c < MAX_UPLOAD_CONNS && flow->deficit > 0; c++)
+        {
+            if (conns[c].used && conns[c].flow == f && conns[c].state == UPLOAD_SENDING && conns[c].writable)
+            {
+                send_file_data(&conns[c], flow, &limits, &global_tokens);
+            }
+        }
+    }
+    first_flow = (first_flow + 1) % MAX_UPLOAD_CONNS;
+
+    // Transfers out of tokens are not watched for writability until the buckets refill
+    int throttled = 0;
+    for (int c = 0; c < MAX_UPLOAD_CONNS; c++)
+    {
+        struct UploadConn* conn = &conns[c];
+        if (!conn->used)
+        {
+            continue;
+        }
+        short events = POLLIN;
+        if (conn->state == UPLOAD_SENDING)
+        {
+            int out_of_tokens = (limits.global_rate != 0 && global_tokens < 1) || (limits.conn_rate != 0 && conn->tokens < 1);
+            events = out_of_tokens ? 0 : POLLOUT;
+            throttled |= out_of_tokens;
+        }
+        p2p_loop_modify(loop, conn->sock, events);
+    }
+    if (throttled)
+    {
+        schedule_pump(SHAPED_POLL_MS);
+    }
+
+    // Report the number of running transfers at most once a second
+    if (activity_callback != NULL && active_uploads != reported)
+    {
+        if (now - last_report >= 1)
+        {
+            reported = active_uploads;
+            last_report = now;
+            activity_callback(reported);
+        }
+        else
+        {
+            schedule_pump((uint64_t)((1 - (now - last_report)) * 1000) + 1);
+        }
+    }
+}
+
+// Run pump() after delay_ms, or sooner if it is already due sooner
+static void schedule_pump(uint64_t delay_ms)
+{
+    uint64_t due = p2p_now_ms() + delay_ms;
+
+    if (pump_timer != 0)
+    {
+        if (pump_due <= due)
+        {
+            return;
+        }
+        p2p_loop_cancel(event_loop, pump_timer);
+    }
+    pump_timer = p2p_loop_timer(event_loop, delay_ms, pump, NULL);
+    pump_due = due;
+}
+
+// Accept every pending download connection
+static void accept_downloads(void)
+{
+    while (1)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        int sock = accept4(listen_fd, (struct sockaddr*)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0)
+        {
+            return;
+        }
+
+        struct UploadConn* conn = NULL;
+        for (int c = 0; c < MAX_UPLOAD_CONNS; c++)
+        {
+            if (!conns[c].used)
+            {
+                conn = &conns[c];
+                break;
+            }
+        }
+        int flow = conn != NULL ? flow_for(&addr) : -1;
+        if (flow < 0 || (tls_server_enabled() && tls_accept(sock) < 0))
+        {
+            if (flow >= 0 && flows[flow].conns == 0)
+            {
+                flows[flow].used = 0;
+            }
+            close(sock);
+            continue;
+        }
+
+        memset(conn, 0, sizeof(*conn));
+        conn->used = 1;
+        conn->sock = sock;
+        conn->state = UPLOAD_READING;
+        conn->file_fd = -1;
+        conn->flow = flow;
+        flows[flow].conns++;
+        if (p2p_loop_watch(event_loop, sock, POLLIN, conn_event, conn) < 0)
+        {
+            close_conn(conn);
+        }
+    }
+}
+
+// Read the FETCH request (action code 3, file name, terminator) and open the file, or
+// answer a HAVE probe right away
+static void read_request(struct UploadConn* conn)
+{
+    ssize_t got = tls_recv(conn->sock, conn->request + conn->request_len, sizeof(conn->request) - conn->request_len, 0);
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        close_conn(conn);
+        return;
+    }
+    if (got < 0)
+    {
+        return;
+    }
+    conn->request_len += got;
+
+    // Plain FETCH has the name right after the action code, compressed FETCH after the
+    // codec offer
+    size_t name_start = conn->request[0] == ACTION_FETCH_CODEC ? 2 : 1;
+    if (conn->request[0] != ACTION_FETCH && conn->request[0] != ACTION_FETCH_CODEC && conn->request[0] != ACTION_HAVE)
+    {
+        reject(conn);
+        return;
+    }
+    const char* name = conn->request + name_start;
+    if (conn->request_len <= name_start || memchr(name, '\0', conn->request_len - name_start) == NULL)
+    {
+        // Too long to ever complete
+        if (conn->request_len == sizeof(conn->request))
+        {
+            reject(conn);
+        }
+        return;
+    }
+
+    // HAVE answers whether FETCH would find the file, so it resolves the name the same
+    // way; close_conn() closes the file again
+    struct stat file_stat;
+    conn->file_fd = open_share_file(name);
+    if (conn->file_fd < 0 || fstat(conn->file_fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
+    {
+        reject(conn);
+        return;
+    }
+    if (conn->request[0] == ACTION_HAVE)
+    {
+        unsigned char status = FETCH_OK;
+        tls_send(conn->sock, &status, sizeof(status), MSG_NOSIGNAL);
+        close_conn(conn);
+        return;
+    }
+    conn->size = file_stat.st_size;
+    conn->codec = name_start == 2 ? choose_codec(conn, name, (unsigned char)conn->request[1]) : -1;
+    conn->state = UPLOAD_WAITING;
+    conn->seq = ++next_seq;
+}
+
+// Published names are paths relative to the share root; refuse the names that plainly
+// leave it. Symbolic links are handled by open_share_file()
+static int valid_share_path(const char* name)
+{
+    if (name[0] == '\0' || name[0] == '/')
+    {
+        return 0;
+    }
+    for (const char* part = name; part != NULL; part = strchr(part, '/'))
+    {
+        if (*part == '/')
+        {
+            part++;
+        }
+        if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0'))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Open a shared file by its published name, relative to the share root, without
+// following a symbolic link anywhere in the path (the share index skips them too), so no
+// name reaches a file outside the share. O_NONBLOCK keeps a FIFO in the share from
+// blocking the open; it changes nothing for regular files. Returns the descriptor or -1
+static int open_share_file(const char* name)
+{
+    if (!valid_share_path(name))
+    {
+        errno = EACCES;
+        return -1;
+    }
+
+#ifdef SYS_openat2
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+    int fd = (int)syscall(SYS_openat2, share_fd, name, &how, sizeof(how));
+    // Kernels before 5.6 lack openat2(); they get the walk below
+    if (fd >= 0 || errno != ENOSYS)
+    {
+        return fd;
+    }
+#endif
+
+    // One component at a time, each opened relative to the directory before it and
+    // refused if it is a symbolic link
+    char path[MAX_REQUEST_LEN];
+    if (strlen(name) >= sizeof(path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(path, name);
+
+    int dir_fd = share_fd;
+    char* component = path;
+    char* slash;
+    while ((slash = strchr(component, '/')) != NULL)
+    {
+        *slash = '\0';
+        if (component[0] != '\0' && strcmp(component, ".") != 0)
+        {
+            int next_fd = openat(dir_fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (dir_fd != share_fd)
+            {
+                close(dir_fd);
+            }
+            if (next_fd < 0)
+            {
+                return -1;
+            }
+            dir_fd = next_fd;
+        }
+        component = slash + 1;
+    }
+    int file_fd = openat(dir_fd, component, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+    if (dir_fd != share_fd)
+    {
+        int saved_errno = errno;
+        close(dir_fd);
+        errno = saved_errno;
+    }
+    return file_fd;
+}
+
+// Decide how to send a file to a downloader that offered the codecs in offered.
+// Compression is skipped for file types that are compressed already and for files
+// whose first bytes do not shrink
+static int choose_codec(const struct UploadConn* conn, const char* name, int offered)
+{
+    static const char* const compressed_types[] =
+    {
+        ".gz", ".tgz", ".bz2", ".xz", ".zst", ".lz4", ".zip", ".7z", ".rar", ".jpg", ".jpeg",
+        ".png", ".gif", ".webp", ".mp3", ".mp4", ".m4a", ".mkv", ".webm", ".ogg", ".flac", NULL
+    };
+    unsigned char sample[COMPRESS_SAMPLE];
+    unsigned char packed[COMPRESS_SAMPLE + COMPRESS_SAMPLE / 100 + 64];
+    uLongf packed_len = sizeof(packed);
+
+    if (compress_level == 0 || !(offered & FETCH_CODEC_MASK(FETCH_CODEC_DEFLATE)) || conn->size == 0)
+    {
+        return FETCH_CODEC_NONE;
+    }
+    const char* extension = strrchr(name, '.');
+    for (int t = 0; extension != NULL && compressed_types[t] != NULL; t++)
+    {
+        if (strcasecmp(extension, compressed_types[t]) == 0)
+        {
+            return FETCH_CODEC_NONE;
+        }
+    }
+
+    ssize_t sample_len = pread(conn->file_fd, sample, sizeof(sample), 0);
+    if (sample_len <= 0 || compress2(packed, &packed_len, sample, sample_len, Z_BEST_SPEED) != Z_OK ||
+        packed_len * 100 > (uLongf)sample_len * (100 - COMPRESS_MIN_SAVING))
+    {
+        return FETCH_CODEC_NONE;
+    }
+    return FETCH_CODEC_DEFLATE;
+}
+
+// Send the OK status (and the chosen codec, if the downloader negotiated one) and start
+// streaming
+static void start_transfer(struct UploadConn* conn)
+{
+    unsigned char status[2] = {FETCH_OK, conn->codec};
+    size_t status_len = conn->codec < 0 ? 1 : 2;
+
+    if (conn->codec == FETCH_CODEC_DEFLATE)
+    {
+        conn->chunk = malloc(COMPRESS_CHUNK);
+        conn->out = malloc(COMPRESS_CHUNK);
+        if (conn->chunk == NULL || conn->out == NULL || deflateInit(&conn->zs, compress_level) != Z_OK)
+        {
+            reject(conn);
+            return;
+        }
+    }
+    if (tls_send(conn->sock, status, status_len, MSG_NOSIGNAL) != (ssize_t)status_len)
+    {
+        close_conn(conn);
+        return;
+    }
+    conn->state = UPLOAD_SENDING;
+    conn->tokens = 0;
+    active_uploads++;
+    if (conn->size == 0)
+    {
+        close_conn(conn);
+    }
+}
+
+// Send as much of the file as the downloader's deficit and both buckets allow
+static void send_file_data(struct UploadConn* conn, struct UploadFlow* flow, const struct UploadLimits* limits, double* global_tokens)
+{
+    // Data TLS kept back goes out before anything new
+    ssize_t backlog = tls_flush(conn->sock);
+    if (backlog < 0 || (backlog == 0 && conn->finished))
+    {
+        close_conn(conn);
+        return;
+    }
+    if (backlog > 0)
+    {
+        conn->writable = 0;
+        return;
+    }
+
+    // Compressed transfers do not know how many bytes are left; send_compressed() stops
+    // at the end of its buffer
+    long long budget = conn->codec == FETCH_CODEC_DEFLATE ? SEND_CHUNK : conn->size - conn->offset;
+
+    if (budget > SEND_CHUNK)
+    {
+        budget = SEND_CHUNK;
+    }
+    if (budget > flow->deficit)
+    {
+        budget = flow->deficit;
+    }
+    if (limits->global_rate != 0 && budget > (long long)*global_tokens)
+    {
+        budget = (long long)*global_tokens;
+    }
+    if (limits->conn_rate != 0 && budget > (long long)conn->tokens)
+    {
+        budget = (long long)conn->tokens;
+    }
+    if (budget <= 0)
+    {
+        return;
+    }
+
+    ssize_t sent;
+    if (conn->codec == FETCH_CODEC_DEFLATE)
+    {
+        sent = send_compressed(conn, budget);
+    }
+    else
+    {
+        sent = tls_sendfile(conn->sock, conn->file_fd, &conn->offset, budget);
+    }
+    if (sent < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            conn->writable = 0;
+            return;
+        }
+        close_conn(conn);
+        return;
+    }
+
+    flow->deficit -= sent;
+    *global_tokens -= sent;
+    conn->tokens -= sent;
+    // A short send means the socket buffer is full
+    if (conn->codec != FETCH_CODEC_DEFLATE && sent < budget)
+    {
+        conn->writable = 0;
+    }
+    // Closing the connection marks the end of the file
+    if (conn->codec == FETCH_CODEC_DEFLATE ? conn->stream_done && conn->out_pos == conn->out_len :
+        sent == 0 || conn->offset >= conn->size)
+    {
+        if (tls_flush(conn->sock) > 0)
+        {
+            conn->finished = 1;
+            conn->writable = 0;
+            return;
+        }
+        close_conn(conn);
+    }
+}
+
+// Send up to budget bytes of the compressed stream, compressing the next chunks of the
+// file once everything compressed so far has been sent. Returns the bytes sent, or -1
+// with errno set
+static ssize_t send_compressed(struct UploadConn* conn, size_t budget)
+{
+    if (conn->out_pos == conn->out_len && !conn->stream_done)
+    {
+        conn->out_pos = 0;
+        conn->out_len = 0;
+        // deflate() may swallow whole chunks without output, so keep feeding it
+        while (conn->out_len == 0 && !conn->stream_done)
+        {
+            if (conn->zs.avail_in == 0 && conn->offset < conn->size)
+            {
+                ssize_t got = pread(conn->file_fd, conn->chunk, COMPRESS_CHUNK, conn->offset);
+                if (got <= 0)
+                {
+                    if (got == 0)
+                    {
+                        errno = EIO;
+                    }
+                    return -1;
+                }
+                conn->offset += got;
+                conn->zs.next_in = conn->chunk;
+                conn->zs.avail_in = got;
+            }
+            conn->zs.next_out = conn->out;
+            conn->zs.avail_out = COMPRESS_CHUNK;
+            int result = deflate(&conn->zs, conn->offset >= conn->size ? Z_FINISH : Z_NO_FLUSH);
+            if (result == Z_STREAM_ERROR)
+            {
+                errno = EIO;
+                return -1;
+            }
+            conn->out_len = COMPRESS_CHUNK - conn->zs.avail_out;
+            conn->stream_done = result == Z_STREAM_END;
+        }
+    }
+
+    size_t pending = conn->out_len - conn->out_pos;
+    size_t wanted = budget < pending ? budget : pending;
+    ssize_t sent = tls_send(conn->sock, conn->out + conn->out_pos, wanted, MSG_NOSIGNAL);
+    if (sent > 0)
+    {
+        conn->out_pos += sent;
+        // A short send means the socket buffer is full
+        if ((size_t)sent < wanted)
+        {
+            conn->writable = 0;
+        }
+    }
+    return sent;
+}
+
+static void close_conn(struct UploadConn* conn)
+{
+    if (conn->state == UPLOAD_SENDING)
+    {
+        active_uploads--;
+    }
+    p2p_loop_unwatch(event_loop, conn->sock);
+    tls_close(conn->sock);
+    if (conn->file_fd >= 0)
+    {
+        close(conn->file_fd);
+    }
+    if (conn->zs.state != NULL)
+    {
+        deflateEnd(&conn->zs);
+    }
+    free(conn->chunk);
+    free(conn->out);
+    if (--flows[conn->flow].conns == 0)
+    {
+        flows[conn->flow].used = 0;
+    }
+    conn->used = 0;
+    // A slot may have freed up for a waiting transfer
+    schedule_pump(0);
+}
+
+// Tell the downloader the file cannot be served, then close
+static void reject(struct UploadConn* conn)
+{
+    unsigned char status = FETCH_ERROR;
+
+    tls_send(conn->sock, &status, sizeof(status), MSG_NOSIGNAL);
+    close_conn(conn);
+}
+
+// Find or create the flow for a downloader's address
+static int flow_for(const struct sockaddr_storage* addr)
+{
+    struct sockaddr_storage key;
+    int free_flow = -1;
+
+    // The port differs per connection, so only the address identifies the downloader
+    memset(&key, 0, sizeof(key));
+    key.ss_family = addr->ss_family;
+    if (addr->ss_family == AF_INET6)
+    {
+        ((struct sockaddr_in6*)&key)->sin6_addr = ((const struct sockaddr_in6*)addr)->sin6_addr;
+    }
+    else
+    {
+        ((struct sockaddr_in*)&key)->sin_addr = ((const struct sockaddr_in*)addr)->sin_addr;
+    }
+
+    for (int f = 0; f < MAX_UPLOAD_CONNS; f++)
+    {
+        if (flows[f].used && memcmp(&flows[f].addr, &key, sizeof(key)) == 0)
+        {
+            return f;
+        }
+        if (!flows[f].used && free_flow < 0)
+        {
+            free_flow = f;
+        }
+    }
+    if (free_flow >= 0)
+    {
+        flows[free_flow].used = 1;
+        flows[free_flow].addr = key;
+        flows[free_flow].conns = 0;
+        flows[free_flow].deficit = 0;
+    }
+    return free_flow;
+}
+
+// A bucket holds a tenth of a second of its rate, but never less than MIN_BURST
+static double bucket_capacity(uint64_t rate)
+{
+    double capacity = rate / 10.0;
+    return capacity < MIN_BURST ? MIN_BURST : capacity;
+}
+
+static double upload_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,57 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdint.h>
+
+struct P2pLoop;
+
+// Longest FETCH or HAVE request: action code, codec offer, name and its terminator
+#define MAX_REQUEST_LEN 1024
+// Plain FETCH: action code, then the file name and its terminator. The holder answers
+// with a status byte, 0 if it serves the file, then sends the data and closes
+#define ACTION_FETCH 3
+
+// Compressed FETCH: action code, a bitmask of codecs the downloader accepts, then the
+// file name and its terminator. The status byte is followed by the chosen codec, and
+// the data is then sent in that codec until the connection closes. Holders that do not
+// know the action refuse it, and downloaders fall back to a plain FETCH (action 3)
+#define ACTION_FETCH_CODEC 5
+// Codec numbers, and their bits in the offer mask
+#define FETCH_CODEC_NONE 0
+#define FETCH_CODEC_DEFLATE 1
+#define FETCH_CODEC_MASK(codec) (1 << ((codec) - 1))
+// HAVE probe: action code, then the file name and its terminator. The holder answers
+// with the status byte alone and closes; used to confirm holders the registry only
+// matched through a Bloom summary
+#define ACTION_HAVE 6
+
+// Upload shaping settings. Rates are bytes per second; 0 means unlimited
+struct UploadLimits
+{
+    // Total upload rate across all connections
+    uint64_t global_rate;
+    // Rate of each individual connection
+    uint64_t conn_rate;
+    // Transfers that may run at once; later requests wait their turn
+    int max_active;
+};
+
+// Called from the event loop whenever the number of running transfers changes, at most
+// once a second
+typedef void (*upload_activity_fn)(int active_uploads);
+
+// Start serving FETCH requests for files under share_root on port (IPv4 and IPv6) from
+// loop. Returns 0 on success or -1 if the port cannot be opened
+int upload_start(struct P2pLoop* loop, uint16_t port, const char* share_root, const struct UploadLimits* limits, upload_activity_fn on_activity);
+
+// zlib level (1-9) for downloads that accept deflate; 0, the default, serves them
+// uncompressed. Must be set before upload_start()
+void upload_set_compression(int level);
+
+// Replace the shaping settings; running transfers pick them up immediately
+void upload_set_limits(const struct UploadLimits* limits);
+void upload_get_limits(struct UploadLimits* limits);
+
+#endif
@@ -1,159 +1,259 @@
 /* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <sys/select.h>
-#include <stdint.h>
-#include <stdbool.h>
-
-// Maximum number of pending connections
-#define MAX_PENDING 5            
-// Maximum number of peers allowed
-#define MAX_PEERS 5              
-// Maximum number of files a peer can publish
-#define MAX_FILES 10             
-// Maximum length of a filename
-#define MAX_FILENAME_LEN 128     
-// Buffer size for receiving data
-#define BUFFER_SIZE 1024         
-
-
-// Enumeration representing the states of a peer
-enum client_state
-{
-    // Peer has not joined yet
-    CLIENT_UNKNOWN,      
-    // Peer has joined but not published files
-    CLIENT_JOINED,       
-    // Peer has published files and is fully registered
-    CLIENT_REGISTERED    
-};
-
-// Struct to represent peer information
-struct PeerData
-{
-    // Unique ID for the peer
-    uint32_t peer_id;                
-    // Socket descriptor for the peer
-    int peer_socket;                 
-    // Peer network address
-    struct sockaddr_in peer_addr;    
-    // Array of filenames published by the peer
-    char** files;                    
-    // Number of files published
-    int file_count;                  
-    // Current state of the peer
-    enum client_state state;         
-};
-
-// Struct to manage the registry server's state
-struct RegistryContext
-{
-    // Socket descriptor for the registry
-    int registry_socket;              
-    // Array of peer information
-    struct PeerData peers[MAX_PEERS]; 
-    // Set of active sockets for select()
-    fd_set active_sockets;            
-    // Maximum socket descriptor value
-    int max_socket;                   
-};
-
-// Function prototypes
-int initialize_registry_socket(int port);
-void monitor_connections(struct RegistryContext* reg_context);
-void accept_new_peer(struct RegistryContext* reg_context);
-void process_peer_message(struct RegistryContext* reg_context, int peer_socket);
-void handle_join(struct RegistryContext* reg_context, int peer_socket, uint32_t peer_id);
-void handle_publish(struct RegistryContext* reg_context, int peer_socket, char files[][MAX_FILENAME_LEN], int file_count);
-void handle_search(struct RegistryContext* reg_context, int peer_socket, char* search_file);
-void send_search(int peer_socket, uint32_t peer_id, struct sockaddr_in* addr);
-void cleanup_peer(struct PeerData* peer);
+// accept4()
+#define _GNU_SOURCE
+
+#include "registry.h"
+
+#include <errno.h>
+#include <fcntl.h>
 
 int main(int argc, char* argv[])
 {
-    if (argc < 2)
+    struct RegistryContext reg_context;
+    memset(&reg_context, 0, sizeof(reg_context));
+    reg_context.backend = BACKEND_SELECT;
+
+    int opt;
+    const char* cluster_nodes = NULL;
+    int cluster_self = -1;
+    int backlog = DEFAULT_BACKLOG;
+    const char* record_path = NULL;
+    const char* tls_cert = NULL;
+    const char* tls_key = NULL;
+    const char* tls_ca = NULL;
+    bool replica_leader = false;
+    const char* replica_follow = NULL;
+    uint32_t max_staleness_ms = DEFAULT_MAX_STALENESS_MS;
+    while ((opt = getopt(argc, argv, "b:lc:i:q:a:r:t:k:T:Lf:S:")) != -1)
+    {
+        switch (opt)
+        {
+            // Event loop backend: "select" (default) or "uring"
+            case 'b':
+                if (strcmp(optarg, "uring") == 0)
+                {
+                    reg_context.backend = BACKEND_URING;
+                }
+                else if (strcmp(optarg, "select") != 0)
+                {
+                    fprintf(stderr, "Unknown backend: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            // Prefer SEARCH holders in the requester's subnet
+            case 'l':
+                reg_context.prefer_local = true;
+                break;
+            // Cluster mode: comma-separated host:port of every node, and this node's index
+            case 'c':
+                cluster_nodes = optarg;
+                break;
+            case 'i':
+                cluster_self = atoi(optarg);
+                break;
+            // Listen backlog: connections the kernel holds before they are accepted
+            case 'q':
+                backlog = atoi(optarg);
+                break;
+            // Admit at most this many new connections per second; the rest are told
+            // when to come back
+            case 'a':
+                reg_context.accept_rate = strtoul(optarg, NULL, 10);
+                break;
+            // Record every connection's input to this file for registry_replay
+            case 'r':
+                record_path = optarg;
+                break;
+            // Serve TLS with this certificate chain and private key
+            case 't':
+                tls_cert = optarg;
+                break;
+            case 'k':
+                tls_key = optarg;
+                break;
+            // CA that signs the other cluster nodes' certificates (default: system CAs)
+            case 'T':
+                tls_ca = optarg;
+                break;
+            // Replication: stream catalog changes to followers, or follow a leader at
+            // host:port and answer reads from a copy at most -S milliseconds old
+            case 'L':
+                replica_leader = true;
+                break;
+            case 'f':
+                replica_follow = optarg;
+                break;
+            case 'S':
+                max_staleness_ms = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-b select|uring] [-l] [-q backlog] [-a accepts/s] [-r recording] [-t cert -k key [-T ca]] [-c host:port,... -i index | -L | -f host:port [-S ms]] <port>\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if (optind >= argc)
     {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-b select|uring] [-l] [-q backlog] [-a accepts/s] [-r recording] [-t cert -k key [-T ca]] [-c host:port,... -i index | -L | -f host:port [-S ms]] <port>\n", argv[0]);
         exit(1);
     }
 
-    int port = atoi(argv[1]);
+    // Seeds the random choices made when spreading SEARCH answers across holders
+    srand(time(NULL) ^ getpid());
 
-    struct RegistryContext reg_context;
-    memset(&reg_context, 0, sizeof(reg_context));
+    int port = atoi(argv[optind]);
+
+    // Broken connections must surface as send errors, not kill the registry
+    signal(SIGPIPE, SIG_IGN);
     
     // Initialize the registry socket and prepare to listen
-    reg_context.registry_socket = initialize_registry_socket(port);
+    reg_context.registry_socket = initialize_registry_socket(port, backlog);
     FD_SET(reg_context.registry_socket, &reg_context.active_sockets);
     reg_context.max_socket = reg_context.registry_socket;
 
-    printf("Registry server is listening on port %d...\n", port);
-
-    // Monitor and process incoming connections and messages
-    monitor_connections(&reg_context);
+    // Fall back to select() when the kernel cannot run the io_uring backend
+    if (reg_context.backend == BACKEND_URING && (!uring_supported() || uring_init(&reg_context) < 0))
+    {
+        fprintf(stderr, "io_uring backend unavailable, falling back to select\n");
+        reg_context.backend = BACKEND_SELECT;
+    }
 
-    close(reg_context.registry_socket);
-    return 0;
-}
+    if ((tls_cert != NULL) != (tls_key != NULL))
+    {
+        fprintf(stderr, "TLS needs both a certificate (-t) and a key (-k)\n");
+        exit(1);
+    }
+    if (tls_cert != NULL && tls_init(&reg_context, tls_cert, tls_key, tls_ca) < 0)
+    {
+        exit(1);
+    }
 
-// Initialize a socket for the registry server and start listening for connections
-int initialize_registry_socket(int port)
-{
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in registry_addr;
+    if (record_path != NULL && record_open(&reg_context, record_path) < 0)
+    {
+        perror("Failed to open the session recording");
+        exit(1);
+    }
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0)
+    if (catalog_init(&reg_context) < 0)
+    {
+        perror("Failed to allocate the file catalog");
+        exit(1);
+    }
+    if (peer_index_init(&reg_context) < 0)
     {
-        perror("Error creating socket");
+        perror("Failed to allocate the peer ID index");
         exit(1);
     }
 
-    memset(&registry_addr, 0, sizeof(registry_addr));
-    registry_addr.sin_family = AF_INET;
-    // Bind to all network interfaces
-    registry_addr.sin_addr.s_addr = INADDR_ANY;
-    // Set the port number
-    registry_addr.sin_port = htons(port);
+    // Running without the cache only costs speed
+    if (search_cache_init(&reg_context) < 0)
+    {
+        fprintf(stderr, "SEARCH cache unavailable\n");
+    }
 
-    if (bind(sock, (struct sockaddr*)&registry_addr, sizeof(registry_addr)) < 0)
+    if (cluster_nodes != NULL && cluster_init(&reg_context, cluster_nodes, cluster_self) < 0)
     {
-        perror("Error binding socket");
-        close(sock);
         exit(1);
     }
 
-    if (listen(sock, MAX_PENDING) < 0)
+    // A cluster partitions the catalog, while a follower copies all of it from one leader
+    if ((replica_leader || replica_follow != NULL) && cluster_nodes != NULL)
+    {
+        fprintf(stderr, "Replication (-L/-f) cannot be combined with cluster mode\n");
+        exit(1);
+    }
+    if (replica_leader && replica_follow != NULL)
+    {
+        fprintf(stderr, "A registry is either a leader (-L) or a follower (-f)\n");
+        exit(1);
+    }
+    if (replica_leader && replica_init_leader(&reg_context) < 0)
     {
-        perror("Error listening on socket");
-        close(sock);
         exit(1);
     }
+    if (replica_follow != NULL && replica_init_follower(&reg_context, replica_follow, max_staleness_ms) < 0)
+    {
+        exit(1);
+    }
+
+    printf("Registry server is listening on port %d...\n", port);
+
+    // Monitor and process incoming connections and messages
+    if (reg_context.backend == BACKEND_URING)
+    {
+        uring_run(&reg_context);
+    }
+    else
+    {
+        monitor_connections(&reg_context);
+    }
+
+    close(reg_context.registry_socket);
+    return 0;
+}
 
+// Initialize a socket for the registry server and start listening for connections
+int initialize_registry_socket(int port, int backlog)
+{
+    // Dual-stack, so IPv4 peers arrive as IPv4-mapped addresses on the same socket, and
+    // non-blocking: the select() backend accepts until the queue is empty, which needs a
+    // listener that reports EAGAIN instead of blocking
+    int sock = p2p_listen(port, backlog);
+    if (sock < 0)
+    {
+        perror("Error opening the registry socket");
+        exit(1);
+    }
     return sock;
 }
 // Monitor sockets for activity and process incoming connections or messages
 void monitor_connections(struct RegistryContext* reg_context)
 {
-    while (1)
+    while (!registry_stop)
     {
         fd_set read_fds = reg_context->active_sockets;
-        int ready_sockets = select(reg_context->max_socket + 1, &read_fds, NULL, NULL, NULL);
+        fd_set write_fds = reg_context->write_sockets;
+        // Wake up for the next cluster or replication deadline, if one is set
+        int timeout_ms = next_deadline_ms(reg_context);
+        struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        int ready_sockets = select(reg_context->max_socket + 1, &read_fds, &write_fds, NULL, timeout_ms >= 0 ? &timeout : NULL);
 
         if (ready_sockets < 0)
         {
+            if (errno == EINTR)
+            {
+                continue;
+            }
             perror("Select error");
             break;
         }
+        if (timeout_ms >= 0)
+        {
+            expire_deadlines(reg_context);
+        }
         // Check each socket for activity
         for (int i = 0; i <= reg_context->max_socket; i++)
         {
+            // Queued responses go out first; that may also resume the peer's input
+            if (FD_ISSET(i, &write_fds))
+            {
+                struct PeerData* peer = find_peer(reg_context, i);
+                if (peer != NULL)
+                {
+                    uint32_t generation = peer->generation;
+                    output_flush(reg_context, peer);
+                    // A failed send drops the peer, so its socket is not read below
+                    if (peer->generation != generation)
+                    {
+                        continue;
+                    }
+                }
+                else
+                {
+                    FD_CLR(i, &reg_context->write_sockets);
+                }
+            }
             if (FD_ISSET(i, &read_fds))
             {
                 if (i == reg_context->registry_socket)
@@ -171,19 +271,208 @@ void monitor_connections(struct RegistryContext* reg_context)
     }
 }
 
-// Accept a new connection and add it to the registry context
+double monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Milliseconds until the earliest cluster or replication deadline (0 if one has
+// passed), or -1 if none is set and the backend may wait indefinitely
+int next_deadline_ms(struct RegistryContext* reg_context)
+{
+    double next = reg_context->cluster != NULL ? cluster_next_deadline(reg_context) : 0;
+    if (reg_context->replica != NULL)
+    {
+        double replica_next = replica_next_deadline(reg_context);
+        if (replica_next > 0 && (next == 0 || replica_next < next))
+        {
+            next = replica_next;
+        }
+    }
+    if (next == 0)
+    {
+        return -1;
+    }
+    double wait = next - monotonic_seconds();
+    return wait > 0 ? (int)(wait * 1000) + 1 : 0;
+}
+
+// Act on every deadline that has passed; called by both backends after they wake up
+void expire_deadlines(struct RegistryContext* reg_context)
+{
+    double now = monotonic_seconds();
+
+    if (reg_context->cluster != NULL)
+    {
+        cluster_expire(reg_context, now);
+    }
+    if (reg_context->replica != NULL)
+    {
+        replica_expire(reg_context, now);
+    }
+}
+
+// Accept every connection waiting on the listener. One wakeup per connection would let
+// a reconnect storm overflow the backlog, so the queue is drained until it is empty
 void accept_new_peer(struct RegistryContext* reg_context)
 {
-    struct sockaddr_in peer_addr;
-    socklen_t addr_len = sizeof(peer_addr);
-    int peer_socket = accept(reg_context->registry_socket, (struct sockaddr*)&peer_addr, &addr_len);
+    while (1)
+    {
+        struct sockaddr_storage peer_addr;
+        socklen_t addr_len = sizeof(peer_addr);
+        int peer_socket = accept4(reg_context->registry_socket, (struct sockaddr*)&peer_addr, &addr_len, SOCK_CLOEXEC);
+
+        if (peer_socket < 0)
+        {
+            // A connection reset while it waited is simply skipped
+            if (errno == ECONNABORTED || errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("Failed to accept connection");
+            }
+            return;
+        }
+
+        admit_peer(reg_context, peer_socket, &peer_addr);
+    }
+}
+
+// Give a new connection a peer slot, or turn it away with a BUSY frame when the accept
+// rate limit is exhausted or every slot is taken. With TLS the connection is only
+// closed: a BUSY frame could not be sent before a handshake, and handshaking with
+// connections that are being turned away would cost the most when load is highest
+void admit_peer(struct RegistryContext* reg_context, int peer_socket, struct sockaddr_storage* peer_addr)
+{
+    uint32_t retry_ms = admission_delay(reg_context);
+    if (retry_ms > 0)
+    {
+        if (reg_context->tls != NULL)
+        {
+            close(peer_socket);
+            return;
+        }
+        reject_peer(peer_socket, retry_ms);
+        return;
+    }
+
+    int slot = add_peer(reg_context, peer_socket, peer_addr);
+    if (slot < 0)
+    {
+        // Reject connection if the max number of peers is reached
+        printf("Reached max peer limit\n");
+        if (reg_context->tls != NULL)
+        {
+            close(peer_socket);
+            return;
+        }
+        reject_peer(peer_socket, BUSY_RETRY_MS);
+        return;
+    }
+
+    watch_peer(reg_context, slot);
+    if (reg_context->tls != NULL && tls_accept(reg_context, &reg_context->peers[slot]) < 0)
+    {
+        fprintf(stderr, "Failed to start TLS\n");
+        drop_peer(reg_context, &reg_context->peers[slot]);
+    }
+}
+
+// Token bucket behind -a: returns 0 and takes a token when a connection may be admitted
+// now, otherwise the milliseconds it should wait before reconnecting
+uint32_t admission_delay(struct RegistryContext* reg_context)
+{
+    if (reg_context->accept_rate == 0)
+    {
+        return 0;
+    }
+
+    double now = monotonic_seconds();
+    double rate = reg_context->accept_rate;
+
+    // The bucket starts full and holds at most one second of admissions
+    if (reg_context->accept_refilled == 0)
+    {
+        reg_context->accept_tokens = rate;
+    }
+    else
+    {
+        reg_context->accept_tokens += (now - reg_context->accept_refilled) * rate;
+        if (reg_context->accept_tokens > rate)
+        {
+            reg_context->accept_tokens = rate;
+        }
+    }
+    reg_context->accept_refilled = now;
+
+    if (reg_context->accept_tokens >= 1)
+    {
+        reg_context->accept_tokens -= 1;
+        return 0;
+    }
+
+    // Hand out consecutive admission slots, so a burst of rejected peers does not come
+    // back all at once and get rejected again
+    if (reg_context->accept_next_retry < now)
+    {
+        reg_context->accept_next_retry = now + (1 - reg_context->accept_tokens) / rate;
+    }
+    else
+    {
+        reg_context->accept_next_retry += 1 / rate;
+    }
+    double wait_ms = (reg_context->accept_next_retry - now) * 1000;
+    if (wait_ms > ADMISSION_MAX_WAIT_MS)
+    {
+        // Far enough out that the queue of promised slots is not worth extending
+        reg_context->accept_next_retry -= 1 / rate;
+        wait_ms = ADMISSION_MAX_WAIT_MS;
+    }
+    return wait_ms < 1 ? 1 : (uint32_t)wait_ms;
+}
+
+// Tell a connection that was never given a slot when to come back, then close it. The
+// frame is tiny and goes into an empty socket buffer, so a non-blocking send suffices;
+// v1 peers, which do not know the frame, just see the connection close
+void reject_peer(int peer_socket, uint32_t retry_ms)
+{
+    uint8_t frame[V2_HEADER_LEN + sizeof(uint32_t)];
+    uint32_t net_retry = htonl(retry_ms);
 
-    if (peer_socket < 0)
+    p2p_frame_header_encode(frame, ACTION_BUSY, V2_FLAG_RESPONSE | V2_FLAG_ERROR, sizeof(net_retry));
+    memcpy(frame + V2_HEADER_LEN, &net_retry, sizeof(net_retry));
+    send(peer_socket, frame, sizeof(frame), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(peer_socket);
+}
+
+// Start monitoring a peer slot's socket with the active backend
+void watch_peer(struct RegistryContext* reg_context, int slot)
+{
+    int peer_socket = reg_context->peers[slot].peer_socket;
+
+    if (reg_context->backend == BACKEND_URING)
     {
-        perror("Failed to accept connection");
+        uring_watch_peer(reg_context, slot);
         return;
     }
 
+    // Add the new socket to the set of active sockets for monitoring
+    FD_SET(peer_socket, &reg_context->active_sockets);
+
+    // Update the maximum socket descriptor if the new socket is higher
+    if (peer_socket > reg_context->max_socket)
+    {
+        reg_context->max_socket = peer_socket;
+    }
+}
+
+// Record a newly accepted connection in a free peer slot. Returns the slot index or -1 if full
+int add_peer(struct RegistryContext* reg_context, int peer_socket, struct sockaddr_storage* peer_addr)
+{
     // Find an empty slot for the new peer
     for (int i = 0; i < MAX_PEERS; i++)
     {
@@ -193,51 +482,74 @@ void accept_new_peer(struct RegistryContext* reg_context)
             // Assign the new peer's socket descriptor
             reg_context->peers[i].peer_socket = peer_socket;
             // Store the new peer's network address
-            reg_context->peers[i].peer_addr = peer_addr;
-            // Initialize the peer's file list and attributes
-             // No files published yet
-            reg_context->peers[i].files = NULL;
-            // No files have been published
-            reg_context->peers[i].file_count = 0;
+            reg_context->peers[i].peer_addr = *peer_addr;
+            normalize_addr(&reg_context->peers[i].peer_addr);
+            // Nothing advertised until the peer sends HELLO
+            reg_context->peers[i].endpoint_count = 0;
+            // Not a cluster link until it sends NODE_HELLO
+            reg_context->peers[i].link_node = -1;
+            reg_context->peers[i].link_accepted = false;
+            reg_context->peers[i].home_node = -1;
+            reg_context->peers[i].awaiting_forward = false;
+            reg_context->peers[i].replica_link = false;
+            // No load reported or observed yet
+            reg_context->peers[i].active_uploads = 0;
+            reg_context->peers[i].recent_hits = 0;
+            reg_context->peers[i].hits_updated = time(NULL);
+            // The slot's catalog record starts without files
+            reg_context->peers[i].record = i;
+            catalog_clear(reg_context, &reg_context->peers[i]);
             // Peer has not joined yet
             reg_context->peers[i].state = CLIENT_UNKNOWN;
-            
-            // Add the new socket to the set of active sockets for monitoring
-            FD_SET(peer_socket, &reg_context->active_sockets);
+            // Peers speak v1 until they negotiate otherwise
+            reg_context->peers[i].version = 1;
+            // Input buffer is allocated on the first receive
+            reg_context->peers[i].in_buf = NULL;
+            reg_context->peers[i].in_len = 0;
+            reg_context->peers[i].in_cap = 0;
+            // Nothing waiting to be sent
+            reg_context->peers[i].out_head = NULL;
+            reg_context->peers[i].out_tail = NULL;
+            reg_context->peers[i].out_bytes = 0;
+            reg_context->peers[i].input_paused = false;
+            reg_context->peers[i].output_failed = false;
+            reg_context->peers[i].tls = NULL;
 
-            // Update the maximum socket descriptor if the new socket is higher
-            if (peer_socket > reg_context->max_socket)
-            {
-                reg_context->max_socket = peer_socket;
-            }
             // Log that a new peer connection has been accepted
             printf("Accepted new peer connection\n");
-            return;
+            record_connect(reg_context, i);
+            return i;
         }
     }
 
-    // Reject connection if the max number of peers is reached
-    printf("Reached max peer limit\n");
-    close(peer_socket);
+    return -1;
 }
 
-void cleanup_peer(struct PeerData* peer)
+// Find the peer that owns a socket, or NULL if none does
+struct PeerData* find_peer(struct RegistryContext* reg_context, int peer_socket)
 {
-    // Check if the peer has allocated memory for files
-    if (peer->files != NULL)
+    for (int i = 0; i < MAX_PEERS; i++)
     {
-        // Free each filename in the files array
-        for (int i = 0; i < peer->file_count; i++)
+        if (reg_context->peers[i].peer_socket == peer_socket)
         {
-            free(peer->files[i]);
+            return &reg_context->peers[i];
         }
-        // Free the array holding the file pointers
-        free(peer->files);
     }
-    // Set the files pointer to NULL to avoid dangling references
-    peer->files = NULL;
-    // Reset the file count to 0 since the files have been cleared
-    peer->file_count = 0;
+    return NULL;
+}
+
+void cleanup_peer(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    // Forget the files the peer published
+    catalog_clear(reg_context, peer);
+    // Free its ID for the next peer to join with it
+    peer_index_remove(reg_context, peer);
+    // Release any partially received message
+    free(peer->in_buf);
+    peer->in_buf = NULL;
+    peer->in_len = 0;
+    peer->in_cap = 0;
+    peer->version = 1;
     // Reset the peer's state to CLIENT_UNKNOWN, marking it as unregistered
     peer->state = CLIENT_UNKNOWN;
     // Reset the peer's unique ID
@@ -246,14 +558,55 @@ void cleanup_peer(struct PeerData* peer)
     peer->peer_socket = 0;
     // Clear the peer's network address structure
     memset(&peer->peer_addr, 0, sizeof(peer->peer_addr));
+    // Forget the advertised listen endpoints
+    peer->endpoint_count = 0;
+    peer->link_node = -1;
+    peer->awaiting_forward = false;
+    peer->replica_link = false;
 }
 
-// Process a message from a peer and handle its command
+// Receive whatever a peer has sent and handle every complete message in it
 void process_peer_message(struct RegistryContext* reg_context, int peer_socket)
 {
-    uint8_t command;
-    // Read the command byte from the peer's socket
-    ssize_t bytes_received = recv(peer_socket, &command, sizeof(command), 0);
+    // Locate the peer that owns this socket
+    struct PeerData* peer = find_peer(reg_context, peer_socket);
+
+    if (peer == NULL)
+    {
+        fprintf(stderr, "process_peer_message: peer not found\n");
+        close(peer_socket);
+        FD_CLR(peer_socket, &reg_context->active_sockets);
+        return;
+    }
+    // Its responses stopped going out while a request was being handled
+    if (peer->output_failed)
+    {
+        drop_peer(reg_context, peer);
+        return;
+    }
+    // Paused during this select() round; the socket is read again once output drains
+    if (peer->input_paused)
+    {
+        return;
+    }
+
+    if (!reserve_peer_input(reg_context, peer))
+    {
+        return;
+    }
+
+    // Read as much as is available; one receive usually holds one or more whole messages.
+    // TLS connections receive ciphertext, which tls_input() decrypts into in_buf
+    uint8_t ciphertext[BUFFER_SIZE * 4];
+    ssize_t bytes_received;
+    if (peer->tls != NULL)
+    {
+        bytes_received = recv(peer_socket, ciphertext, sizeof(ciphertext), 0);
+    }
+    else
+    {
+        bytes_received = recv(peer_socket, peer->in_buf + peer->in_len, peer->in_cap - peer->in_len, 0);
+    }
 
     // Handle socket closure or errors during receive
     if (bytes_received <= 0)
@@ -266,320 +619,995 @@ void process_peer_message(struct RegistryContext* reg_context, int peer_socket)
         {
             printf("Peer disconnnected\n");
         }
-        close(peer_socket);
-        FD_CLR(peer_socket, &reg_context->active_sockets);
+        drop_peer(reg_context, peer);
         return;
     }
-
-    // Locate the peer and process the command
-    for (int i = 0; i < MAX_PEERS; i++) 
+    if (peer->tls != NULL)
     {
-        if (reg_context->peers[i].peer_socket == peer_socket) 
-        {
-            // Ensure the peer has joined before processing non-JOIN commands
-            if (reg_context->peers[i].state == CLIENT_UNKNOWN && command != 0) 
-            {
-                printf("Error: Peer must JOIN before other actions\n");
-                return;
-            }
+        tls_input(reg_context, peer, ciphertext, bytes_received);
+        return;
+    }
+    record_input(reg_context, peer - reg_context->peers, peer->in_buf + peer->in_len, bytes_received);
+    peer->in_len += bytes_received;
 
-            // Handle commands from the peer
-            switch (command)
-            {
-                // JOIN
-                case 0:
-                {
-                    uint32_t peer_id;
-                    // Read the peer ID from the socket
-                    if (recv(peer_socket, &peer_id, sizeof(peer_id), 0) <= 0) 
-                    {
-                        perror("Error receiving JOIN data");
-                        close(peer_socket);
-                        FD_CLR(peer_socket, &reg_context->active_sockets);
-                        return;
-                    }
-                    handle_join(reg_context, peer_socket, ntohl(peer_id));
-                    break;
-                }
-                // PUBLISH
-                case 1:
-                {
-                    if (reg_context->peers[i].state != CLIENT_JOINED) 
-                    {
-                        printf("Error: Peer must JOIN before publishing\n");
-                        return;
-                    }                 
-                    
-                    int file_count;
-                    // Read the number of files to be published
-                    if (recv(peer_socket, &file_count, sizeof(file_count), 0) <= 0) 
-                    {
-                        perror("Error receiving PUBLISH file count");
-                        close(peer_socket);
-                        FD_CLR(peer_socket, &reg_context->active_sockets);
-                        return;
-                    }
-                    file_count = ntohl(file_count);
-                    // Buffer to hold filenames
-                    char files[MAX_FILES][MAX_FILENAME_LEN];
-                    // Temporary buffer for received data
-                    char temp_buffer[BUFFER_SIZE];
-                    int total_received = 0;
-                    int filenames_parsed = 0;
-
-                    // Continue receiving and parsing filenames until all are received
-                    while (filenames_parsed < file_count)
-                    {
-                        int bytes_received = recv(peer_socket, temp_buffer + total_received, BUFFER_SIZE - total_received, 0);
-
-                        if (bytes_received <= 0)
-                        {
-                            perror("Error reveiving PUBLISH file names");
-                            close(peer_socket);
-                            FD_CLR(peer_socket, &reg_context->active_sockets);
-                            return;
-                        }
-
-                        total_received += bytes_received;
-                        // Tracks the current position in the buffer
-                        int offset = 0;
-                        while (offset < total_received && filenames_parsed < file_count)
-                        {
-                            // Look for a null terminator to mark the end of a filename
-                            char* null_pos = memchr(temp_buffer + offset, '\0', total_received - offset);
-                            if (null_pos != NULL)
-                            {
-                                // Calculate the length of the filename
-                                int filename_len = null_pos - (temp_buffer + offset);
-                                if (filename_len >= MAX_FILENAME_LEN)
-                                {
-                                    fprintf(stderr, "Filename exceeds maximum allowed length\n");
-                                    close(peer_socket);
-                                    FD_CLR(peer_socket, &reg_context->active_sockets);
-                                    return;
-                                }
-                                // Copy the filename into the files array
-                                strncpy(files[filenames_parsed], temp_buffer + offset, filename_len);
-                                files[filenames_parsed][filename_len] = '\0';
-                                filenames_parsed++;
-
-                                // Move the offset past the null terminator
-                                offset += filename_len + 1;
-                            }
-                            else
-                            {
-                                // Shift unprocessed data to the start of the buffer
-                                memmove(temp_buffer, temp_buffer + offset, total_received - offset);
-                                // Adjust total_received to reflect remaining data
-                                total_received -= offset;
-                                break;
-                            }
-                        }
-                    }
-                    printf("Finished collecting peer files\n");
-                    handle_publish(reg_context, peer_socket, files, file_count);
-                    break;
-                }
-                //SEARCH
-                case 2:
-                {
-                    if (reg_context->peers[i].state != CLIENT_REGISTERED) 
-                    {
-                        printf("Error: Peer must publish files before searching\n");
-                        return;
-                    }
+    consume_peer_input(reg_context, peer);
+}
 
-                    char search_file[MAX_FILENAME_LEN];
-                    // Read the filename to search for
-                    if (recv(peer_socket, search_file, MAX_FILENAME_LEN, 0) <= 0) 
-                    {
-                        perror("Error receiving SEARCH file name");
-                        close(peer_socket);
-                        FD_CLR(peer_socket, &reg_context->active_sockets);
-                        return;
-                    }
-                    handle_search(reg_context, peer_socket, search_file);
-                    break;
-                }
-                default:
-                    printf("Unknown command received\n");
-                    break;
-            }
-            break;
-        }
+// Make room for more input by growing the peer's buffer when it is full, up to the
+// largest legal message. Returns false (after dropping the peer) if that is impossible
+bool reserve_peer_input(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    if (peer->in_len < peer->in_cap)
+    {
+        return true;
+    }
+
+    // Many complete requests may be waiting while the peer is paused
+    size_t limit = peer->input_paused ? MAX_PAUSED_INPUT : MAX_MESSAGE_LEN;
+    size_t new_cap = peer->in_cap == 0 ? BUFFER_SIZE : peer->in_cap * 2;
+    if (new_cap > limit)
+    {
+        new_cap = limit;
+    }
+    if (new_cap <= peer->in_cap)
+    {
+        fprintf(stderr, "Error: Message exceeds maximum length\n");
+        drop_peer(reg_context, peer);
+        return false;
+    }
+    uint8_t* grown = realloc(peer->in_buf, new_cap);
+    if (grown == NULL)
+    {
+        perror("Failed to allocate input buffer");
+        drop_peer(reg_context, peer);
+        return false;
     }
+    peer->in_buf = grown;
+    peer->in_cap = new_cap;
+    return true;
 }
 
-// Handle the JOIN command from a peer
-void handle_join(struct RegistryContext* reg_context, int peer_socket, uint32_t peer_id)
+// Handle each complete message in the peer's buffer, keeping a trailing partial one
+void consume_peer_input(struct RegistryContext* reg_context, struct PeerData* peer)
 {
-    // Iterate through the peers array to locate the requesting peer
-    for (int i = 0; i < MAX_PEERS; i++)
+    size_t offset = 0;
+    uint32_t generation = peer->generation;
+    // Input after a forwarded SEARCH waits so responses stay in request order, and input
+    // from a peer that is not reading its responses waits until they drain
+    while (offset < peer->in_len && !peer->awaiting_forward && !peer->input_paused && !peer->output_failed)
     {
-        // Check if this peer's socket matches the requesting peer's socket
-       if (reg_context->peers[i].peer_socket == peer_socket)
-       {
-            // Assign the provided peer ID to the peer
-            reg_context->peers[i].peer_id = peer_id;
-            // Update the peer's state to CLIENT_JOINED
-            reg_context->peers[i].state = CLIENT_JOINED;
+        struct RegistryRequest request;
+        ssize_t used = parse_message(peer->in_buf + offset, peer->in_len - offset, &request);
 
-            printf("TEST] JOIN %u\n", peer_id);
-
-            printf("Peer %d joined with ID %u\n", peer_socket, peer_id);
+        if (used < 0)
+        {
+            fprintf(stderr, "Error: %s\n", request.error);
+            drop_peer(reg_context, peer);
+            return;
+        }
+        if (used == 0)
+        {
+            break;
+        }
+        offset += used;
+        dispatch_request(reg_context, peer, &request);
+        // A rejected v1 JOIN drops the connection
+        if (peer->generation != generation)
+        {
             return;
-       } 
+        }
     }
+
+    memmove(peer->in_buf, peer->in_buf + offset, peer->in_len - offset);
+    peer->in_len -= offset;
 }
 
-// Handle the PUBLISH command from a peer
-void handle_publish(struct RegistryContext* reg_context, int peer_socket, char files[][MAX_FILENAME_LEN], int file_count)
+// Close a peer's connection and stop monitoring its socket
+void drop_peer(struct RegistryContext* reg_context, struct PeerData* peer)
 {
-    
-    printf("Handling Publish\n");
+    // Other nodes stop answering SEARCHes with this peer's files
+    if (reg_context->cluster != NULL && peer->link_node < 0 && peer->state == CLIENT_REGISTERED)
+    {
+        cluster_unpublish(reg_context, peer);
+    }
+    // Neither may cached answers here
+    if (peer->state == CLIENT_REGISTERED)
+    {
+        search_cache_invalidate_peer(reg_context, peer);
+    }
+    // Nor may followers
+    if (reg_context->replica != NULL)
+    {
+        replica_peer_dropped(reg_context, peer);
+    }
+
+    if (reg_context->backend == BACKEND_URING)
+    {
+        // Completes the peer's armed multishot recv, which holds its own file reference
+        uring_close_peer(reg_context, peer - reg_context->peers);
+    }
+    else
+    {
+        FD_CLR(peer->peer_socket, &reg_context->active_sockets);
+    }
+    record_close(reg_context, peer - reg_context->peers);
+    // Responses it will never read
+    output_discard(reg_context, peer);
+    tls_close(peer);
+    close(peer->peer_socket);
+    // The descriptor number may be handed to a connection opened while the slot is
+    // being torn down (a cluster link for a retried SEARCH), which must not find it here
+    peer->peer_socket = -1;
+    // Completions still in flight for this connection are now stale
+    peer->generation++;
+
+    if (peer->link_node >= 0)
+    {
+        cluster_link_dropped(reg_context, peer);
+    }
+    // Remove the peer's catalog record (in time proportional to its own file count) so
+    // its files stop being offered, and free the slot for the next connection
+    cleanup_peer(reg_context, peer);
+}
+
+// Check that the peer's state allows an action, reporting why not if it doesn't
+bool action_allowed(struct RegistryContext* reg_context, struct PeerData* peer, uint8_t action)
+{
+    // Ensure the peer has joined before processing non-JOIN commands
+    if (peer->state == CLIENT_UNKNOWN && action != ACTION_JOIN)
+    {
+        printf("Error: Peer must JOIN before other actions\n");
+        return false;
+    }
+    // A follower only serves reads, so its clients search without publishing first
+    if (replica_read_only(reg_context))
+    {
+        if (action == ACTION_PUBLISH || action == ACTION_PUBLISH_SUMMARY)
+        {
+            printf("Error: This registry is a read-only follower, publish to the leader\n");
+            return false;
+        }
+        return true;
+    }
+    if (action == ACTION_SEARCH && peer->state != CLIENT_REGISTERED)
+    {
+        printf("Error: Peer must publish files before searching\n");
+        return false;
+    }
+    return true;
+}
+
+// Handle one decoded request. Every v2 request gets exactly one response frame; v1
+// requests are answered the v1 way, PUBLISH not at all
+void dispatch_request(struct RegistryContext* reg_context, struct PeerData* peer, struct RegistryRequest* request)
+{
+    if (request->version == 2)
+    {
+        dispatch_v2_request(reg_context, peer, request);
+        return;
+    }
+
+    switch (request->action)
+    {
+        case ACTION_JOIN:
+            // v1 has no JOIN reply to refuse the ID with, so the connection is closed
+            if (handle_join(reg_context, peer, request->peer_id) < 0)
+            {
+                drop_peer(reg_context, peer);
+                break;
+            }
+            replica_publish(reg_context, peer);
+            break;
+        case ACTION_PUBLISH:
+            printf("Finished collecting peer files\n");
+            if (action_allowed(reg_context, peer, request->action))
+            {
+                handle_publish(reg_context, peer->peer_socket, request->files, request->file_count);
+            }
+            break;
+        case ACTION_SEARCH:
+            if (action_allowed(reg_context, peer, request->action))
+            {
+                handle_search(reg_context, peer->peer_socket, request->search_file);
+            }
+            break;
+        default:
+            printf("Unknown command received\n");
+            break;
+    }
+}
+
+// Handle one decoded v2 frame
+void dispatch_v2_request(struct RegistryContext* reg_context, struct PeerData* peer, struct RegistryRequest* request)
+{
+    uint8_t action = request->action;
+
+    // Registry-to-registry traffic is handled by the cluster and replication modules
+    if (action >= ACTION_REPL_HELLO && action <= ACTION_REPL_PING && reg_context->replica != NULL)
+    {
+        replica_handle_frame(reg_context, peer, action, request->flags, request->payload, request->payload_len);
+        return;
+    }
+    if (action >= ACTION_NODE_HELLO && reg_context->cluster != NULL)
+    {
+        cluster_handle_frame(reg_context, peer, action, request->flags, request->payload, request->payload_len);
+        return;
+    }
+
+    // Requests never carry flags; anything else is rejected but the framing stays intact
+    if (request->flags != 0 || !action_allowed(reg_context, peer, action))
+    {
+        send_v2_frame(reg_context, peer->peer_socket, action, V2_FLAG_RESPONSE | V2_FLAG_ERROR, NULL, 0);
+        return;
+    }
+    if (request->error != NULL)
+    {
+        fprintf(stderr, "Error: %s\n", request->error);
+        send_v2_frame(reg_context, peer->peer_socket, action, V2_FLAG_RESPONSE | V2_FLAG_ERROR, NULL, 0);
+        return;
+    }
+
+    switch (action)
+    {
+        case ACTION_JOIN:
+        {
+            if (handle_join(reg_context, peer, request->peer_id) < 0)
+            {
+                break;
+            }
+
+            // Cached SEARCH answers naming this peer carry its old endpoints
+            search_cache_invalidate_peer(reg_context, peer);
+
+            // An unspecified address means "the address you see me connecting from"
+            peer->endpoint_count = 0;
+            for (uint8_t e = 0; e < request->endpoint_count; e++)
+            {
+                struct sockaddr_storage* ep = &request->endpoints[e];
+                bool unspecified = (ep->ss_family == AF_INET && ((struct sockaddr_in*)ep)->sin_addr.s_addr == INADDR_ANY) ||
+                                   (ep->ss_family == AF_INET6 && IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6*)ep)->sin6_addr));
+                if (unspecified)
+                {
+                    if (ep->ss_family != peer->peer_addr.ss_family)
+                    {
+                        continue;
+                    }
+                    if (ep->ss_family == AF_INET)
+                    {
+                        ((struct sockaddr_in*)ep)->sin_addr = ((struct sockaddr_in*)&peer->peer_addr)->sin_addr;
+                    }
+                    else
+                    {
+                        ((struct sockaddr_in6*)ep)->sin6_addr = ((struct sockaddr_in6*)&peer->peer_addr)->sin6_addr;
+                    }
+                }
+                peer->endpoints[peer->endpoint_count++] = *ep;
+            }
+
+            // Followers learn the peer with the endpoints it advertised
+            replica_publish(reg_context, peer);
+
+            // 2 is the newest version this registry speaks
+            uint8_t chosen = 2;
+            peer->version = chosen;
+            send_v2_frame(reg_context, peer->peer_socket, ACTION_JOIN, V2_FLAG_RESPONSE, &chosen, sizeof(chosen));
+            return;
+        }
+        case ACTION_PUBLISH:
+        {
+            if (handle_publish(reg_context, peer->peer_socket, request->files, request->file_count) < 0)
+            {
+                break;
+            }
+            send_v2_frame(reg_context, peer->peer_socket, ACTION_PUBLISH, V2_FLAG_RESPONSE, NULL, 0);
+            return;
+        }
+        // One chunk of a Bloom summary, acknowledged like PUBLISH
+        case ACTION_PUBLISH_SUMMARY:
+        {
+            if (handle_publish_summary(reg_context, peer, request) < 0)
+            {
+                break;
+            }
+            send_v2_frame(reg_context, peer->peer_socket, ACTION_PUBLISH_SUMMARY, V2_FLAG_RESPONSE, NULL, 0);
+            return;
+        }
+        case ACTION_SEARCH:
+        {
+            handle_search(reg_context, peer->peer_socket, request->search_file);
+            return;
+        }
+        case ACTION_HEARTBEAT:
+        {
+            peer->active_uploads = request->active_uploads;
+            send_v2_frame(reg_context, peer->peer_socket, ACTION_HEARTBEAT, V2_FLAG_RESPONSE, NULL, 0);
+            return;
+        }
+        case ACTION_LOOKUP_PEER:
+        {
+            if (reg_context->replica != NULL && replica_defer_read(reg_context, peer, action, NULL, request->peer_id))
+            {
+                return;
+            }
+            handle_lookup_peer(reg_context, peer, request->peer_id);
+            return;
+        }
+        default:
+            printf("Unknown command received\n");
+            break;
+    }
+
+    send_v2_frame(reg_context, peer->peer_socket, action, V2_FLAG_RESPONSE | V2_FLAG_ERROR, NULL, 0);
+}
+
+// Handle the JOIN command from a peer. Returns 0 on success or -1 if the ID was refused
+int handle_join(struct RegistryContext* reg_context, struct PeerData* peer, uint32_t peer_id)
+{
+    // 0 is the ID a SEARCH reply carries for "not found", so no peer may hold it
+    if (peer_id == 0)
+    {
+        fprintf(stderr, "Error: Peer ID 0 is reserved\n");
+        return -1;
+    }
+    // A follower's index holds the leader's peers; its own clients only read, and the
+    // same peer may well be joined at the leader under the same ID
+    if (replica_read_only(reg_context))
+    {
+        peer->peer_id = peer_id;
+        peer->state = CLIENT_JOINED;
+        printf("Peer %d joined with ID %u\n", peer->peer_socket, peer_id);
+        return 0;
+    }
+    // A peer keeps the ID it joined with; its catalog records (and their replicas on
+    // other nodes) are filed under it. Joining again with the same ID changes nothing
+    if (peer->state != CLIENT_UNKNOWN)
+    {
+        if (peer_id != peer->peer_id)
+        {
+            fprintf(stderr, "Error: Peer %d already joined with ID %u\n", peer->peer_socket, peer->peer_id);
+            return -1;
+        }
+        return 0;
+    }
+
+    struct PeerData* holder = peer_index_find(reg_context, peer_id);
+    if (holder != NULL)
+    {
+        // The same host joining with its ID again may have lost its old connection
+        // without the registry noticing yet (a crash or a dropped link); the new
+        // connection only takes the ID over once the old one is seen to be gone. Anyone
+        // else, including a second client on the same host, has picked an ID in use
+        if (!same_host(&holder->peer_addr, &peer->peer_addr) || !connection_lost(holder))
+        {
+            fprintf(stderr, "Error: Peer ID %u is already in use\n", peer_id);
+            return -1;
+        }
+        printf("Peer %d takes over ID %u from peer %d\n", peer->peer_socket, peer_id, holder->peer_socket);
+        drop_peer(reg_context, holder);
+    }
+
+    // Assign the provided peer ID to the peer
+    peer->peer_id = peer_id;
+    peer_index_add(reg_context, peer);
+    // Update the peer's state to CLIENT_JOINED
+    peer->state = CLIENT_JOINED;
+
+    printf("TEST] JOIN %u\n", peer_id);
+
+    printf("Peer %d joined with ID %u\n", peer->peer_socket, peer_id);
+    return 0;
+}
+
+// Handle LOOKUP_PEER: reply with the ID and endpoints of the local peer that joined with
+// peer_id, in the same encoding as a SEARCH result
+void handle_lookup_peer(struct RegistryContext* reg_context, struct PeerData* requester, uint32_t peer_id)
+{
+    struct PeerData* peer = peer_index_find(reg_context, peer_id);
+    uint8_t result[4 + 1 + MAX_ENDPOINTS * MAX_ENDPOINT_LEN];
+    size_t result_len = encode_search_result(result, peer);
+
+    send_v2_frame(reg_context, requester->peer_socket, ACTION_LOOKUP_PEER, V2_FLAG_RESPONSE, result, result_len);
+}
+
+// Handle the PUBLISH command from a peer. Returns 0 on success or -1 if it was rejected
+int handle_publish(struct RegistryContext* reg_context, int peer_socket, char files[][MAX_FILENAME_LEN], uint32_t file_count)
+{
+    
+    printf("Handling Publish\n");
 
     for (int i = 0; i < MAX_PEERS; i++) 
     {
         if (reg_context->peers[i].peer_socket == peer_socket)
         {
-            if (reg_context->peers[i].state != CLIENT_JOINED) 
+            if (reg_context->peers[i].state == CLIENT_UNKNOWN) 
             {
                 fprintf(stderr, "Error: Peer must JOIN before publishing files\n");
-                return;
+                return -1;
             }
 
             if (file_count > MAX_FILES)
             {
                 fprintf(stderr, "Error: Too many files, max allowed is %d\n", MAX_FILES);
-                return;
+                return -1;
             }
-            // Free previously published files (if any)
-            if (reg_context->peers[i].files != NULL)
+            // A registered peer publishing again replaces its list; answers cached for
+            // the names it published before must go too
+            bool republish = reg_context->peers[i].state == CLIENT_REGISTERED;
+            if (republish)
             {
-                for (int j = 0; j < reg_context->peers[i].file_count; j++)
-                {
-                    free(reg_context->peers[i].files[j]);
-                }
-                free(reg_context->peers[i].files);
+                search_cache_invalidate_peer(reg_context, &reg_context->peers[i]);
             }
-            // Allocate memory for new files
-            reg_context->peers[i].files = calloc(file_count, sizeof(char*));
-            if (reg_context->peers[i].files == NULL)
+            // Store the names in the catalog, replacing any earlier list
+            if (catalog_set_files(reg_context, &reg_context->peers[i], files, file_count) < 0)
             {
                 perror("Failed to allocate memory for files");
-                return;
+                return -1;
             }
 
-            reg_context->peers[i].file_count = file_count;
+            reg_context->peers[i].state = CLIENT_REGISTERED;
+
+            // Cached answers for these names no longer list every holder
+            search_cache_invalidate_peer(reg_context, &reg_context->peers[i]);
+            replica_publish(reg_context, &reg_context->peers[i]);
 
-            // Copy file names to the peer's file list
-            for (int j = 0; j < file_count; j++)
+            // Replicate the new records to the nodes that own their partitions, after
+            // withdrawing the old ones
+            if (reg_context->cluster != NULL)
             {
-                reg_context->peers[i].files[j] = strdup(files[j]);
-                if (reg_context->peers[i].files[j] == NULL)
+                if (republish)
                 {
-                    perror("Failed to allocate memory for file name");
-                    for (int k = 0; k < j; k++)
-                    {
-                        free(reg_context->peers[i].files[k]);
-                    }
-                    free(reg_context->peers[i].files);
-                    reg_context->peers[i].files = NULL;
-                    return;
+                    cluster_unpublish(reg_context, &reg_context->peers[i]);
                 }
+                cluster_publish(reg_context, &reg_context->peers[i]);
             }
-
-            reg_context->peers[i].state = CLIENT_REGISTERED;
             
             // Generate the exact output expected by the test script
-            printf("TEST] PUBLISH %d", file_count);
-            for (int j = 0; j < file_count; j++) 
+            printf("TEST] PUBLISH %u", file_count);
+            for (uint32_t j = 0; j < file_count; j++) 
             {
-                printf(" %s", reg_context->peers[i].files[j]);
+                printf(" %s", files[j]);
             }
             // Ensure only one newline at the end of the output
             printf("\n");  
+            catalog_report(reg_context);
 
-            return;
+            return 0;
         }
     }
     fprintf(stderr, "handle_publish: peer not found\n");
+    return -1;
+}
+
+// Handle one PUBLISH_SUMMARY chunk: name count, hash count, total blocks, first block,
+// then whole blocks. The peer is registered once the last chunk arrives. Returns 0 on
+// success or -1 if the chunk was rejected
+int handle_publish_summary(struct RegistryContext* reg_context, struct PeerData* peer, const struct RegistryRequest* request)
+{
+    uint32_t name_count = request->summary.name_count;
+    uint8_t hashes = request->summary.hashes;
+    uint32_t total_blocks = request->summary.total_blocks;
+    uint32_t first_block = request->summary.first_block;
+
+    // Summaries cannot be split by name across the nodes that own each partition
+    if (reg_context->cluster != NULL)
+    {
+        fprintf(stderr, "Error: Summaries are not supported in cluster mode\n");
+        return -1;
+    }
+    if (hashes == 0 || hashes > SUMMARY_MAX_HASHES || total_blocks == 0 || total_blocks > SUMMARY_MAX_BLOCKS)
+    {
+        fprintf(stderr, "Error: Unsupported summary of %u blocks with %u hashes\n", total_blocks, hashes);
+        return -1;
+    }
+
+    // A new summary replaces what a registered peer published before
+    if (first_block == 0 && peer->state == CLIENT_REGISTERED)
+    {
+        search_cache_invalidate_peer(reg_context, peer);
+    }
+
+    int result = catalog_summary_chunk(reg_context, peer, name_count, hashes, total_blocks, first_block, request->summary.blocks, request->summary.block_count);
+    if (result < 0)
+    {
+        fprintf(stderr, "Error: Summary chunk at block %u rejected\n", first_block);
+        return -1;
+    }
+    if (result > 0)
+    {
+        peer->state = CLIENT_REGISTERED;
+        printf("Summary of %u files from peer %u (%u blocks, %u hashes)\n", name_count, peer->peer_id, total_blocks, hashes);
+        catalog_report(reg_context);
+    }
+    return 0;
 }
 
 // Handle the SEARCH command from a peer
 void handle_search(struct RegistryContext* reg_context, int peer_socket, char* search_file)
 {
-    // Iterate through the peers array to locate the requesting peer
-    for (int i = 0; i < MAX_PEERS; i++)
+    // Locate the requesting peer
+    struct PeerData* requester = find_peer(reg_context, peer_socket);
+    if (requester == NULL)
     {
-       // Check if this peer's socket matches the requesting peer's socket
-       if (reg_context->peers[i].peer_socket == peer_socket) 
-       {
-            // Ensure the requesting peer has published files (registered)
-            if (reg_context->peers[i].state != CLIENT_REGISTERED) 
-            {
-                fprintf(stderr, "Error: Peer must publish files before searching\n");
-                return;
-            }
-            // Search through all registered peers for the requested file
-            for (int j = 0; j < MAX_PEERS; j++) 
+        fprintf(stderr, "handle_search: peer not found\n");
+        return;
+    }
+    // Ensure the requesting peer has published files (registered); a follower's clients
+    // publish at the leader
+    if (requester->state != CLIENT_REGISTERED && !replica_read_only(reg_context))
+    {
+        fprintf(stderr, "Error: Peer must publish files before searching\n");
+        return;
+    }
+
+    // In a cluster, names owned by another node are answered there
+    if (reg_context->cluster != NULL && cluster_forward_search(reg_context, requester, search_file))
+    {
+        return;
+    }
+    // A follower whose copy is too old waits for the leader first
+    if (reg_context->replica != NULL && replica_defer_read(reg_context, requester, ACTION_SEARCH, search_file, 0))
+    {
+        return;
+    }
+    answer_search(reg_context, requester, search_file);
+}
+
+// Answer a SEARCH from this registry's catalog
+void answer_search(struct RegistryContext* reg_context, struct PeerData* requester, const char* search_file)
+{
+    struct PeerData* candidates[MAX_HOLDERS];
+    int candidate_count = -1;
+
+    // Popular names are answered from pre-encoded responses. A name the cache looked up
+    // but could not keep comes back with its holders, so they are not collected twice
+    if (reg_context->search_cache != NULL && search_cache_answer(reg_context, requester, search_file, candidates, &candidate_count))
+    {
+        return;
+    }
+
+    // v1 responses can only carry an IPv4 address, so v1 requesters skip IPv6-only holders
+    bool need_ipv4 = requester->version < 2;
+    struct PeerData* holder = candidate_count < 0 ? find_holder(reg_context, requester, search_file, need_ipv4)
+                                                  : choose_holder(reg_context, requester, search_file, need_ipv4, candidates, candidate_count);
+    uint8_t result[4 + 1 + MAX_ENDPOINTS * MAX_ENDPOINT_LEN];
+    size_t result_len = encode_search_result(result, holder);
+
+    // Send search result with the chosen peer's ID and addresses, or "not found"
+    send_search_result(reg_context, requester, result, result_len, holder != NULL && catalog_is_summary(reg_context, holder));
+    print_search_result(search_file, result, result_len);
+}
+
+// Choose the holder of search_file that should answer a SEARCH, or NULL if nobody has it.
+// requester (NULL for SEARCHes forwarded by another node) is only used for locality
+struct PeerData* find_holder(struct RegistryContext* reg_context, struct PeerData* requester, const char* search_file, bool need_ipv4)
+{
+    struct PeerData* candidates[MAX_HOLDERS];
+    int candidate_count = collect_holders(reg_context, search_file, candidates);
+
+    return choose_holder(reg_context, requester, search_file, need_ipv4, candidates, candidate_count);
+}
+
+// find_holder for a name whose exact holders collect_holders has already put into
+// candidates (room for MAX_HOLDERS, reused for the summary holders)
+struct PeerData* choose_holder(struct RegistryContext* reg_context, struct PeerData* requester, const char* search_file, bool need_ipv4, struct PeerData** candidates, int candidate_count)
+{
+    if (need_ipv4)
+    {
+        candidate_count = keep_ipv4_holders(candidates, candidate_count);
+    }
+    // Peers that only published a summary may not have the file after all, so they are
+    // offered only when no peer lists it exactly
+    if (candidate_count == 0)
+    {
+        candidate_count = collect_summary_holders(reg_context, search_file, candidates);
+        if (need_ipv4)
+        {
+            candidate_count = keep_ipv4_holders(candidates, candidate_count);
+        }
+    }
+
+    if (candidate_count == 0)
+    {
+        return NULL;
+    }
+
+    struct PeerData* holder = select_holder(reg_context, requester, candidates, candidate_count);
+    holder->recent_hits++;
+    return holder;
+}
+
+// Keep only the candidates with an IPv4 endpoint, in order. Returns how many are left
+int keep_ipv4_holders(struct PeerData** candidates, int count)
+{
+    struct sockaddr_in v4_endpoint;
+    int kept = 0;
+
+    for (int c = 0; c < count; c++)
+    {
+        if (peer_ipv4_endpoint(candidates[c], &v4_endpoint))
+        {
+            candidates[kept++] = candidates[c];
+        }
+    }
+    return kept;
+}
+
+// Collect every registered peer that holds search_file, local or (in a cluster) known
+// through catalog replication. out must have room for MAX_HOLDERS. Returns the count
+int collect_holders(struct RegistryContext* reg_context, const char* search_file, struct PeerData** out)
+{
+    int candidate_count = 0;
+    int count = catalog_holders(reg_context, search_file, out);
+
+    // Only consider peers that have registered files
+    for (int j = 0; j < count; j++)
+    {
+        if (out[j]->state == CLIENT_REGISTERED)
+        {
+            out[candidate_count++] = out[j];
+        }
+    }
+    return candidate_count;
+}
+
+// Collect every registered peer whose Bloom summary may contain search_file. out must
+// have room for MAX_HOLDERS. Returns the count
+int collect_summary_holders(struct RegistryContext* reg_context, const char* search_file, struct PeerData** out)
+{
+    int candidate_count = 0;
+    int count = catalog_summary_holders(reg_context, search_file, out);
+
+    for (int j = 0; j < count; j++)
+    {
+        if (out[j]->state == CLIENT_REGISTERED)
+        {
+            out[candidate_count++] = out[j];
+        }
+    }
+    return candidate_count;
+}
+
+// Choose which holder answers a SEARCH. Holders in the requester's subnet are preferred
+// when prefer_local is set; among the rest, two are picked at random and the less loaded
+// one wins (power of two choices), which spreads downloads without global coordination
+struct PeerData* select_holder(struct RegistryContext* reg_context, struct PeerData* requester, struct PeerData** candidates, int count)
+{
+    if (reg_context->prefer_local && requester != NULL)
+    {
+        int local = 0;
+        for (int c = 0; c < count; c++)
+        {
+            if (same_subnet(&candidates[c]->peer_addr, &requester->peer_addr))
             {
-                // Only consider peers that have registered files
-                if (reg_context->peers[j].state == CLIENT_REGISTERED) 
-                {
-                    // Check each file published by the current peer
-                    for (int k = 0; k < reg_context->peers[j].file_count; k++) 
-                    {
-                        // If the file matches the search query, send the result
-                        if (strcmp(reg_context->peers[j].files[k], search_file) == 0) 
-                        {
-                            // Send search result with matching peer's ID and address
-                            send_search(peer_socket, reg_context->peers[j].peer_id, &reg_context->peers[j].peer_addr);
-                            printf("TEST] SEARCH %s %u %s:%d\n", search_file, reg_context->peers[j].peer_id,
-                                   inet_ntoa(reg_context->peers[j].peer_addr.sin_addr),
-                                   ntohs(reg_context->peers[j].peer_addr.sin_port));
-                            return;
-                        }
-                    }
-                }
+                struct PeerData* tmp = candidates[local];
+                candidates[local++] = candidates[c];
+                candidates[c] = tmp;
             }
+        }
+        if (local > 0)
+        {
+            count = local;
+        }
+    }
 
-            // If no match is found, send a "not found" response
-            send_search(peer_socket, 0, NULL);
-            printf("TEST] SEARCH %s 0 0.0.0.0:0\n", search_file);
-            return;
-       }
+    if (count == 1)
+    {
+        return candidates[0];
+    }
+
+    int first = rand() % count;
+    int second = rand() % (count - 1);
+    if (second >= first)
+    {
+        second++;
     }
-    fprintf(stderr, "handle_search: peer not found\n");
+    return peer_load(candidates[second]) < peer_load(candidates[first]) ? candidates[second] : candidates[first];
 }
 
-void send_search(int peer_socket, uint32_t peer_id, struct sockaddr_in* addr)
+// Load score used to compare holders: reported uploads dominate, recent SEARCH answers
+// break ties and cover peers that never send heartbeats
+uint32_t peer_load(struct PeerData* peer)
 {
-    // Buffer to hold the response message (10 bytes)
-    uint8_t response[10] = {0};
+    time_t now = time(NULL);
+    time_t elapsed = now - peer->hits_updated;
+
+    // Decay recent hits by half for every second since they were last updated
+    if (elapsed > 0)
+    {
+        peer->recent_hits = elapsed >= 32 ? 0 : peer->recent_hits >> elapsed;
+        peer->hits_updated = now;
+    }
+    return peer->active_uploads * 16 + peer->recent_hits;
+}
+
+// True if two addresses share an IPv4 /24 or an IPv6 /64
+bool same_subnet(const struct sockaddr_storage* a, const struct sockaddr_storage* b)
+{
+    if (a->ss_family != b->ss_family)
+    {
+        return false;
+    }
+    if (a->ss_family == AF_INET)
+    {
+        const uint8_t* a4 = (const uint8_t*)&((const struct sockaddr_in*)a)->sin_addr;
+        const uint8_t* b4 = (const uint8_t*)&((const struct sockaddr_in*)b)->sin_addr;
+        return memcmp(a4, b4, 3) == 0;
+    }
+    return memcmp(&((const struct sockaddr_in6*)a)->sin6_addr, &((const struct sockaddr_in6*)b)->sin6_addr, 8) == 0;
+}
 
-    // If a valid peer ID and address are provided, populate the response
-    if (peer_id != 0 && addr != NULL)
+// True if two addresses are the same host, whatever their ports
+bool same_host(const struct sockaddr_storage* a, const struct sockaddr_storage* b)
+{
+    if (a->ss_family != b->ss_family)
     {
-        // Convert peer ID to network byte order
-        uint32_t net_id = htonl(peer_id);
-        // Get the peer's IP address
-        uint32_t net_addr = addr->sin_addr.s_addr;
-        // Get the peer's port number
-        uint16_t net_port = addr->sin_port;
+        return false;
+    }
+    if (a->ss_family == AF_INET)
+    {
+        return ((const struct sockaddr_in*)a)->sin_addr.s_addr == ((const struct sockaddr_in*)b)->sin_addr.s_addr;
+    }
+    return memcmp(&((const struct sockaddr_in6*)a)->sin6_addr, &((const struct sockaddr_in6*)b)->sin6_addr, 16) == 0;
+}
+
+// True if a local peer's connection is known to be gone: its socket has a pending
+// error, or the peer has closed or reset it. Only asks the kernel, so a connection whose
+// other end vanished without a FIN or RST still counts as alive
+bool connection_lost(struct PeerData* peer)
+{
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    uint8_t byte;
 
-        // Copy the data into the response buffer
-        // First 4 bytes: Peer ID
-        memcpy(response, &net_id, sizeof(net_id));
-        // Next 4 bytes: Peer IP address
-        memcpy(response + 4, &net_addr, sizeof(net_addr));
-        // Last 2 bytes: Peer port number
-        memcpy(response + 8, &net_port, sizeof(net_port)); 
+    // Records replicated from another node have no connection here to look at
+    if (peer->home_node >= 0)
+    {
+        return false;
+    }
+    if (getsockopt(peer->peer_socket, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0)
+    {
+        return true;
     }
+    // A zero-byte peek is end of file; unread requests mean the peer is still talking
+    ssize_t peeked = recv(peer->peer_socket, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+    if (peeked == 0)
+    {
+        return true;
+    }
+    return peeked < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+}
+
+// Encode a SEARCH result in v2 form: peer ID (0 if not found), endpoint count and every
+// endpoint the holder can be reached on. Returns the encoded length
+size_t encode_search_result(uint8_t* out, struct PeerData* holder)
+{
+    size_t len = 4 + 1;
+
+    memset(out, 0, len);
+    if (holder != NULL)
+    {
+        struct sockaddr_storage endpoints[MAX_ENDPOINTS];
+        int count = peer_endpoints(holder, endpoints);
+        uint32_t net_id = htonl(holder->peer_id);
+
+        memcpy(out, &net_id, sizeof(net_id));
+        out[4] = count;
+        for (int e = 0; e < count; e++)
+        {
+            len += p2p_endpoint_encode(out + len, &endpoints[e]);
+        }
+    }
+    return len;
+}
+
+// Send an encoded SEARCH result in the requester's protocol. v2 peers get it as is,
+// flagged if the holder is only a candidate; v1 peers get 10 bytes: peer ID, the first
+// IPv4 endpoint's address and its port
+void send_search_result(struct RegistryContext* reg_context, struct PeerData* requester, const uint8_t* result, size_t result_len, bool candidate)
+{
+    if (requester->version >= 2)
+    {
+        send_v2_frame(reg_context, requester->peer_socket, ACTION_SEARCH, V2_FLAG_RESPONSE | (candidate ? V2_FLAG_CANDIDATE : 0), result, result_len);
+        return;
+    }
+
+    // Buffer to hold the response message (10 bytes)
+    uint8_t response[V1_SEARCH_REPLY_LEN];
+    encode_v1_search_result(response, result, result_len);
 
     // Send the response back to the peer
-    if (send(peer_socket, response, sizeof(response), 0) < 0)
+    send_to_peer(reg_context, requester->peer_socket, response, sizeof(response));
+}
+
+// Convert an encoded SEARCH result to the 10-byte v1 reply: peer ID, then the address
+// and port of its first IPv4 endpoint. Holders without one read as "not found"
+void encode_v1_search_result(uint8_t* response, const uint8_t* result, size_t result_len)
+{
+    size_t offset = 4 + 1;
+
+    memset(response, 0, V1_SEARCH_REPLY_LEN);
+    // Find the first IPv4 endpoint, if there is one
+    for (int e = 0; e < result[4]; e++)
+    {
+        struct sockaddr_storage addr;
+        ssize_t used = p2p_endpoint_decode(result + offset, result_len - offset, &addr);
+        if (used < 0)
+        {
+            break;
+        }
+        if (addr.ss_family == AF_INET)
+        {
+            struct sockaddr_in* addr4 = (struct sockaddr_in*)&addr;
+            // First 4 bytes: Peer ID
+            memcpy(response, result, 4);
+            // Next 4 bytes: Peer IP address
+            memcpy(response + 4, &addr4->sin_addr, 4);
+            // Last 2 bytes: Peer port number
+            memcpy(response + 8, &addr4->sin_port, 2);
+            break;
+        }
+        offset += used;
+    }
+}
+
+// Log a SEARCH result in the format the test scripts expect
+void print_search_result(const char* search_file, const uint8_t* result, size_t result_len)
+{
+    uint32_t peer_id;
+    struct sockaddr_storage addr;
+    char endpoint_str[INET6_ADDRSTRLEN + 8];
+
+    memcpy(&peer_id, result, sizeof(peer_id));
+    if (peer_id == 0 || result[4] == 0 || p2p_endpoint_decode(result + 5, result_len - 5, &addr) < 0)
+    {
+        printf("TEST] SEARCH %s 0 0.0.0.0:0\n", search_file);
+        return;
+    }
+    format_endpoint(&addr, endpoint_str, sizeof(endpoint_str));
+    printf("TEST] SEARCH %s %u %s\n", search_file, ntohl(peer_id), endpoint_str);
+}
+
+// Turn an IPv4-mapped IPv6 address (from the dual-stack listener) back into plain IPv4
+void normalize_addr(struct sockaddr_storage* addr)
+{
+    struct sockaddr_in6* addr6 = (struct sockaddr_in6*)addr;
+    if (addr->ss_family != AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr))
+    {
+        return;
+    }
+
+    struct sockaddr_in addr4;
+    memset(&addr4, 0, sizeof(addr4));
+    addr4.sin_family = AF_INET;
+    addr4.sin_port = addr6->sin6_port;
+    memcpy(&addr4.sin_addr, &addr6->sin6_addr.s6_addr[12], sizeof(addr4.sin_addr));
+    memset(addr, 0, sizeof(*addr));
+    memcpy(addr, &addr4, sizeof(addr4));
+}
+
+// Collect the endpoints a peer can be reached on: the advertised ones, or for peers that
+// advertised nothing, the source address of their registry connection. Returns the count
+int peer_endpoints(const struct PeerData* peer, struct sockaddr_storage* out)
+{
+    if (peer->endpoint_count == 0)
+    {
+        out[0] = peer->peer_addr;
+        return 1;
+    }
+    memcpy(out, peer->endpoints, peer->endpoint_count * sizeof(out[0]));
+    return peer->endpoint_count;
+}
+
+// Find an IPv4 endpoint for a peer, for v1 responses. Returns false if it has none
+bool peer_ipv4_endpoint(const struct PeerData* peer, struct sockaddr_in* out)
+{
+    struct sockaddr_storage endpoints[MAX_ENDPOINTS];
+    int count = peer_endpoints(peer, endpoints);
+
+    for (int e = 0; e < count; e++)
     {
-        perror("Error sending search response");
+        if (endpoints[e].ss_family == AF_INET)
+        {
+            memcpy(out, &endpoints[e], sizeof(*out));
+            return true;
+        }
+    }
+    return false;
+}
+
+// Format an endpoint as "a.b.c.d:port" or "[v6]:port"
+void format_endpoint(const struct sockaddr_storage* addr, char* out, size_t out_len)
+{
+    char host[INET6_ADDRSTRLEN];
+
+    if (addr->ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)addr;
+        inet_ntop(AF_INET6, &addr6->sin6_addr, host, sizeof(host));
+        snprintf(out, out_len, "[%s]:%u", host, ntohs(addr6->sin6_port));
+        return;
+    }
+
+    const struct sockaddr_in* addr4 = (const struct sockaddr_in*)addr;
+    inet_ntop(AF_INET, &addr4->sin_addr, host, sizeof(host));
+    snprintf(out, out_len, "%s:%u", host, ntohs(addr4->sin_port));
+}
+
+
+// Send one v2 frame: 8-byte header followed by the payload, in a single send
+void send_v2_frame(struct RegistryContext* reg_context, int peer_socket, uint8_t action, uint16_t flags, const void* payload, uint32_t payload_len)
+{
+    uint8_t frame[V2_HEADER_LEN + BUFFER_SIZE];
+
+    if (payload_len > BUFFER_SIZE)
+    {
+        fprintf(stderr, "send_v2_frame: payload too large\n");
+        return;
+    }
+
+    p2p_frame_header_encode(frame, action, flags, payload_len);
+    if (payload_len > 0)
+    {
+        memcpy(frame + V2_HEADER_LEN, payload, payload_len);
+    }
+
+    send_to_peer(reg_context, peer_socket, frame, V2_HEADER_LEN + payload_len);
+}
+
+// Send a complete response to a peer through the active backend
+void send_to_peer(struct RegistryContext* reg_context, int peer_socket, const void* data, size_t len)
+{
+    // Encrypted connections pass the ciphertext on instead
+    if (reg_context->tls != NULL)
+    {
+        struct PeerData* peer = find_peer(reg_context, peer_socket);
+        if (peer != NULL && peer->tls != NULL)
+        {
+            tls_send(reg_context, peer, data, len);
+            return;
+        }
     }
+    send_to_socket(reg_context, peer_socket, data, len);
+}
+
+// Send bytes exactly as given (ciphertext on TLS connections) through the active backend
+void send_to_socket(struct RegistryContext* reg_context, int peer_socket, const void* data, size_t len)
+{
+    if (reg_context->backend == BACKEND_URING)
+    {
+        // Queued and submitted together with the rest of this event batch
+        uring_queue_send(reg_context, peer_socket, data, len);
+        return;
+    }
+
+    // Whatever the socket cannot take now is queued behind the peer's earlier responses
+    struct PeerData* peer = find_peer(reg_context, peer_socket);
+    if (peer != NULL)
+    {
+        output_send(reg_context, peer, data, len);
+    }
+}
+
+// Set by a signal handler to end the event loop, after which main() returns normally
+volatile sig_atomic_t registry_stop = 0;
+
+#ifdef REGISTRY_PGO_TRAINING
+static void stop_on_sigterm(int signum)
+{
+    (void)signum;
+    registry_stop = 1;
+}
+
+// A profile-generating build (make pgo) is stopped with SIGTERM after its training run,
+// and only a normal exit writes the profile. Installed outside main() so that main()
+// compiles the same in the training build and in the build that uses the profile
+__attribute__((constructor)) static void stop_on_sigterm_install(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_on_sigterm;
+    sigemptyset(&action.sa_mask);
+    // Without SA_RESTART, so the loop's wait returns EINTR and sees the flag
+    sigaction(SIGTERM, &action, NULL);
 }
+#endif
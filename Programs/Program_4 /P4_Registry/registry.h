@@ -0,0 +1,428 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <netdb.h>
+#include <time.h>
+
+#include "p2pnet.h"
+
+// Default listen backlog, so a reconnect storm waits in the kernel instead of being
+// refused; -q overrides it and the kernel caps it at net.core.somaxconn
+#define DEFAULT_BACKLOG 4096
+// Retry delay suggested to connections turned away because every slot is taken
+#define BUSY_RETRY_MS 1000
+// Longest retry delay the accept rate limit hands out
+#define ADMISSION_MAX_WAIT_MS 30000
+// Maximum number of connections (peers and cluster links) allowed
+#ifndef MAX_PEERS
+#define MAX_PEERS 64
+#endif
+// Maximum number of files a peer can publish
+#define MAX_FILES 10             
+// Maximum length of a filename
+#define MAX_FILENAME_LEN 128     
+// Buffer size for receiving data
+#define BUFFER_SIZE 1024         
+// Largest v2 payload the registry accepts (the frame format itself is in p2pnet.h)
+#define V2_MAX_PAYLOAD 65536
+// Largest message buffered for one peer: a full v2 frame or a v1 PUBLISH
+#define MAX_MESSAGE_LEN (V2_HEADER_LEN + V2_MAX_PAYLOAD)
+// Input buffered for a peer whose reading is paused: io_uring may still deliver every
+// provided receive buffer (64 of 4096 bytes) before the cancelled recv stops
+#define MAX_PAUSED_INPUT (MAX_MESSAGE_LEN + 64 * 4096)
+// Maximum number of registry nodes in a cluster
+#define MAX_CLUSTER_NODES 16
+// Points each node owns on the consistent-hash ring
+#define CLUSTER_VNODES 64
+// Catalog records replicated here for peers connected to other nodes (or, on a
+// follower, to the leader)
+#define MAX_REMOTE_PEERS 256
+// Buffer sizes for another registry's host and port
+#define NODE_HOST_LEN 256
+#define NODE_PORT_LEN 8
+// Largest peer record sent between registries: peer ID, endpoints and every published
+// name with its length
+#define CATALOG_MAX_PAYLOAD (4 + 1 + MAX_ENDPOINTS * MAX_ENDPOINT_LEN + 4 + MAX_FILES * (2 + MAX_FILENAME_LEN))
+// How old a follower's copy of the catalog may be before reads wait for the leader (-S)
+#define DEFAULT_MAX_STALENESS_MS 2000
+// Forwarded SEARCHes that can wait for another node at once
+#define MAX_FORWARDS 256
+// Length of a v1 SEARCH reply: peer ID, IPv4 address and port
+#define V1_SEARCH_REPLY_LEN 10
+// Upper bound on the holders of one name: every local peer and every replicated record
+#define MAX_HOLDERS (MAX_PEERS + MAX_REMOTE_PEERS)
+// Bloom summaries are split into blocks of 512 bits; every name sets its bits in one block
+#define SUMMARY_BLOCK_LEN 64
+// Largest summary accepted (4 MiB, a few million names), and most bits set per name
+#define SUMMARY_MAX_BLOCKS 65536
+#define SUMMARY_MAX_HASHES 16
+// PUBLISH_SUMMARY header: name count, hash count, total blocks and first block
+#define SUMMARY_HEADER_LEN (4 + 1 + 4 + 4)
+// Session recordings (registry_record.c) start with this magic
+#define RECORD_MAGIC "P2PREC01"
+#define RECORD_MAGIC_LEN 8
+// Recorded event header: type, session, 64-bit microseconds and data length
+#define RECORD_HEADER_LEN (1 + 4 + 8 + 4)
+
+
+// Enumeration representing the states of a peer
+enum client_state
+{
+    // Peer has not joined yet
+    CLIENT_UNKNOWN,      
+    // Peer has joined but not published files
+    CLIENT_JOINED,       
+    // Peer has published files and is fully registered
+    CLIENT_REGISTERED    
+};
+
+// Action codes shared by v1 messages and v2 frames
+enum action_code
+{
+    // v1 JOIN, or HELLO when sent in a v2 frame
+    ACTION_JOIN = 0,
+    ACTION_PUBLISH = 1,
+    ACTION_SEARCH = 2,
+    // v2 only: the peer reports its current number of active uploads
+    ACTION_HEARTBEAT = 4,
+    // v2 only: publish a Bloom summary of the peer's names instead of the list itself,
+    // in one or more chunks of blocks
+    ACTION_PUBLISH_SUMMARY = 5,
+    // v2 only, sent by the registry (6 is the peer-to-peer HAVE): a connection turned
+    // away right after being accepted gets this with the error flag set and a u32 number
+    // of milliseconds to wait before reconnecting, then the registry closes it
+    ACTION_BUSY = 7,
+    // v2 only: look a peer up by ID; payload is the u32 ID and the reply is encoded like
+    // a SEARCH result (ID 0 and no endpoints if no peer joined with it)
+    ACTION_LOOKUP_PEER = 8,
+    // Registry-to-registry actions, only accepted in cluster mode
+    // A node identifies itself on a new link: payload is its node index
+    ACTION_NODE_HELLO = 16,
+    // Replicate one peer's catalog records to a partition owner (one-way)
+    ACTION_CATALOG_ADD = 17,
+    // Remove one peer's replicated records (one-way)
+    ACTION_CATALOG_DEL = 18,
+    // Ask the owning node to answer a SEARCH; it replies with a tagged result
+    ACTION_NODE_SEARCH = 19,
+    // Leader/follower replication, only accepted with -L or -f
+    // A follower attaches to the leader; the reply follows a snapshot of every peer
+    ACTION_REPL_HELLO = 20,
+    // Add or replace one of the leader's peers (one-way, same layout as CATALOG_ADD)
+    ACTION_REPL_PEER = 21,
+    // One of the leader's peers disconnected (one-way): payload is its ID
+    ACTION_REPL_DEL = 22,
+    // The follower asks to be told it is up to date; the reply follows every change the
+    // leader sent before it
+    ACTION_REPL_PING = 23
+};
+
+// Event types in a session recording
+enum record_event_type
+{
+    // A connection was accepted (or a cluster link opened)
+    RECORD_OPEN = 1,
+    // Bytes received on the connection
+    RECORD_INPUT = 2,
+    // The registry dropped the connection or the other end closed it
+    RECORD_CLOSE = 3
+};
+
+// I/O backends the registry can run its event loop on
+enum io_backend
+{
+    // select() readiness loop with one recv/send syscall per operation
+    BACKEND_SELECT,
+    // io_uring with multishot accept/recv and batched sends
+    BACKEND_URING
+};
+
+// Struct to represent peer information
+struct PeerData
+{
+    // Unique ID for the peer
+    uint32_t peer_id;                
+    // Socket descriptor for the peer
+    int peer_socket;                 
+    // Peer network address (source of its registry connection, IPv4 or IPv6)
+    struct sockaddr_storage peer_addr;
+    // Listen endpoints advertised in HELLO; empty for v1 peers
+    struct sockaddr_storage endpoints[MAX_ENDPOINTS];
+    // Number of advertised endpoints
+    uint8_t endpoint_count;
+    // Uploads in progress, as last reported by the peer's heartbeat
+    uint32_t active_uploads;
+    // SEARCH answers that named this peer, halved for every second since hits_updated
+    uint32_t recent_hits;
+    time_t hits_updated;
+    // Catalog record holding the files the peer publishes (registry_catalog.c)
+    int record;
+    // Current state of the peer
+    enum client_state state;         
+    // Protocol version negotiated with the peer (1 until a HELLO is received)
+    uint8_t version;
+    // Bytes received from the peer that do not yet form a complete message
+    uint8_t* in_buf;
+    // Number of buffered bytes
+    size_t in_len;
+    // Allocated size of in_buf, grown up to MAX_MESSAGE_LEN
+    size_t in_cap;
+    // Bumped whenever the connection is dropped so stale completions can be recognized
+    uint32_t generation;
+    // Cluster node at the other end of a registry-to-registry link, -1 for ordinary peers
+    int link_node;
+    // Set on a link the other node opened, once its NODE_HELLO was accepted
+    bool link_accepted;
+    // For catalog records replicated from another node, the node the peer is connected
+    // to; -1 for peers connected here
+    int home_node;
+    // Set while another node answers a SEARCH from this peer, or while a follower waits
+    // for the leader before answering it; its later input waits
+    bool awaiting_forward;
+    // Link between a leader and one of its followers (at either end)
+    bool replica_link;
+    // Responses the socket has not taken yet, oldest first (select backend only)
+    struct OutputChunk* out_head;
+    struct OutputChunk* out_tail;
+    // Bytes waiting to be sent on either backend
+    size_t out_bytes;
+    // Set while reading is paused because too many responses are waiting
+    bool input_paused;
+    // Set once a response could not be sent or queued in full; the connection takes no
+    // more requests and is dropped when select() next reports it
+    bool output_failed;
+    // TLS state when the registry runs with -t/-k, otherwise NULL (registry_tls.c)
+    struct TlsConn* tls;
+};
+
+// One request decoded from a connection's input by parse_message (registry_parse.c).
+// Only the fields of the request's action are set
+struct RegistryRequest
+{
+    // 1 for a v1 message, 2 for a v2 frame
+    uint8_t version;
+    uint8_t action;
+    // v2 header flags (0 for v1)
+    uint16_t flags;
+    // Why the request is malformed, or NULL. A malformed v2 frame is still answered with
+    // an error; a malformed v1 message ends the connection
+    const char* error;
+    // JOIN / HELLO / LOOKUP_PEER: peer ID, and the listen endpoints a v2 HELLO advertised
+    uint32_t peer_id;
+    struct sockaddr_storage endpoints[MAX_ENDPOINTS];
+    uint8_t endpoint_count;
+    // PUBLISH: number of names announced; v1 names past MAX_FILES are not kept
+    uint32_t file_count;
+    char files[MAX_FILES][MAX_FILENAME_LEN];
+    // SEARCH
+    char search_file[MAX_FILENAME_LEN];
+    // HEARTBEAT
+    uint32_t active_uploads;
+    // PUBLISH_SUMMARY: header fields and the chunk's blocks
+    struct
+    {
+        uint32_t name_count;
+        uint8_t hashes;
+        uint32_t total_blocks;
+        uint32_t first_block;
+        const uint8_t* blocks;
+        uint32_t block_count;
+    } summary;
+    // v2 payload as received, for frames decoded elsewhere (cluster actions)
+    const uint8_t* payload;
+    uint32_t payload_len;
+};
+
+// Struct to manage the registry server's state
+struct RegistryContext
+{
+    // Socket descriptor for the registry
+    int registry_socket;              
+    // Array of peer information
+    struct PeerData peers[MAX_PEERS]; 
+    // Set of active sockets for select()
+    fd_set active_sockets;            
+    // Sockets with queued output, watched for writability by select()
+    fd_set write_sockets;
+    // Maximum socket descriptor value
+    int max_socket;                   
+    // Event loop backend in use
+    enum io_backend backend;
+    // io_uring state, only set when backend is BACKEND_URING
+    struct UringState* uring;
+    // Prefer holders in the requester's subnet when choosing a SEARCH answer
+    bool prefer_local;
+    // Cluster membership and replicated catalog; NULL for a standalone registry
+    struct ClusterState* cluster;
+    // Pre-encoded SEARCH responses for popular names; NULL if it could not be allocated
+    struct SearchCache* search_cache;
+    // Published file names of every local and replicated peer
+    struct Catalog* catalog;
+    // Local peers by the ID they joined with
+    struct PeerIndex* peer_index;
+    // Session recording started with -r; NULL when not recording
+    struct SessionRecorder* recorder;
+    // TLS contexts when running with -t/-k; NULL for plaintext connections
+    struct TlsState* tls;
+    // Leader (-L) or follower (-f) replication state; NULL for a registry that does neither
+    struct ReplicaState* replica;
+    // Connections admitted per second, 0 for no limit
+    uint32_t accept_rate;
+    // Admissions the rate limit allows right now, refilled continuously up to accept_rate
+    double accept_tokens;
+    // When accept_tokens was last refilled (monotonic seconds)
+    double accept_refilled;
+    // Time at which the next turned-away connection should retry; every rejection pushes
+    // it one admission further so the retries come back spread at the admitted rate
+    double accept_next_retry;
+};
+
+// Ends the event loop when set (registry.c)
+extern volatile sig_atomic_t registry_stop;
+
+// Function prototypes
+int initialize_registry_socket(int port, int backlog);
+void monitor_connections(struct RegistryContext* reg_context);
+double monotonic_seconds(void);
+int next_deadline_ms(struct RegistryContext* reg_context);
+void expire_deadlines(struct RegistryContext* reg_context);
+void accept_new_peer(struct RegistryContext* reg_context);
+void admit_peer(struct RegistryContext* reg_context, int peer_socket, struct sockaddr_storage* peer_addr);
+uint32_t admission_delay(struct RegistryContext* reg_context);
+void reject_peer(int peer_socket, uint32_t retry_ms);
+int add_peer(struct RegistryContext* reg_context, int peer_socket, struct sockaddr_storage* peer_addr);
+struct PeerData* find_peer(struct RegistryContext* reg_context, int peer_socket);
+void process_peer_message(struct RegistryContext* reg_context, int peer_socket);
+bool reserve_peer_input(struct RegistryContext* reg_context, struct PeerData* peer);
+void consume_peer_input(struct RegistryContext* reg_context, struct PeerData* peer);
+void drop_peer(struct RegistryContext* reg_context, struct PeerData* peer);
+void dispatch_request(struct RegistryContext* reg_context, struct PeerData* peer, struct RegistryRequest* request);
+void dispatch_v2_request(struct RegistryContext* reg_context, struct PeerData* peer, struct RegistryRequest* request);
+bool action_allowed(struct RegistryContext* reg_context, struct PeerData* peer, uint8_t action);
+int handle_join(struct RegistryContext* reg_context, struct PeerData* peer, uint32_t peer_id);
+void handle_lookup_peer(struct RegistryContext* reg_context, struct PeerData* requester, uint32_t peer_id);
+int handle_publish(struct RegistryContext* reg_context, int peer_socket, char files[][MAX_FILENAME_LEN], uint32_t file_count);
+void handle_search(struct RegistryContext* reg_context, int peer_socket, char* search_file);
+void answer_search(struct RegistryContext* reg_context, struct PeerData* requester, const char* search_file);
+struct PeerData* find_holder(struct RegistryContext* reg_context, struct PeerData* requester, const char* search_file, bool need_ipv4);
+struct PeerData* choose_holder(struct RegistryContext* reg_context, struct PeerData* requester, const char* search_file, bool need_ipv4, struct PeerData** candidates, int candidate_count);
+int keep_ipv4_holders(struct PeerData** candidates, int count);
+int collect_holders(struct RegistryContext* reg_context, const char* search_file, struct PeerData** out);
+int collect_summary_holders(struct RegistryContext* reg_context, const char* search_file, struct PeerData** out);
+int handle_publish_summary(struct RegistryContext* reg_context, struct PeerData* peer, const struct RegistryRequest* request);
+size_t encode_search_result(uint8_t* out, struct PeerData* holder);
+void send_search_result(struct RegistryContext* reg_context, struct PeerData* requester, const uint8_t* result, size_t result_len, bool candidate);
+void encode_v1_search_result(uint8_t* response, const uint8_t* result, size_t result_len);
+void print_search_result(const char* search_file, const uint8_t* result, size_t result_len);
+void watch_peer(struct RegistryContext* reg_context, int slot);
+struct PeerData* select_holder(struct RegistryContext* reg_context, struct PeerData* requester, struct PeerData** candidates, int count);
+uint32_t peer_load(struct PeerData* peer);
+bool same_subnet(const struct sockaddr_storage* a, const struct sockaddr_storage* b);
+bool same_host(const struct sockaddr_storage* a, const struct sockaddr_storage* b);
+bool connection_lost(struct PeerData* peer);
+void normalize_addr(struct sockaddr_storage* addr);
+int peer_endpoints(const struct PeerData* peer, struct sockaddr_storage* out);
+bool peer_ipv4_endpoint(const struct PeerData* peer, struct sockaddr_in* out);
+void format_endpoint(const struct sockaddr_storage* addr, char* out, size_t out_len);
+void send_v2_frame(struct RegistryContext* reg_context, int peer_socket, uint8_t action, uint16_t flags, const void* payload, uint32_t payload_len);
+void send_to_peer(struct RegistryContext* reg_context, int peer_socket, const void* data, size_t len);
+void send_to_socket(struct RegistryContext* reg_context, int peer_socket, const void* data, size_t len);
+void cleanup_peer(struct RegistryContext* reg_context, struct PeerData* peer);
+
+// Request decoding (registry_parse.c)
+ssize_t parse_message(const uint8_t* msg, size_t len, struct RegistryRequest* request);
+int parse_catalog_record(const uint8_t* payload, uint32_t payload_len, struct RegistryRequest* request);
+
+// io_uring backend (registry_uring.c)
+bool uring_supported(void);
+int uring_init(struct RegistryContext* reg_context);
+void uring_run(struct RegistryContext* reg_context);
+void uring_queue_send(struct RegistryContext* reg_context, int peer_socket, const void* data, size_t len);
+void uring_watch_peer(struct RegistryContext* reg_context, int slot);
+void uring_pause_recv(struct RegistryContext* reg_context, int slot);
+void uring_resume_recv(struct RegistryContext* reg_context, int slot);
+void uring_close_peer(struct RegistryContext* reg_context, int slot);
+
+// Federated cluster mode (registry_cluster.c)
+int cluster_init(struct RegistryContext* reg_context, const char* node_list, int self);
+void cluster_publish(struct RegistryContext* reg_context, struct PeerData* peer);
+void cluster_unpublish(struct RegistryContext* reg_context, struct PeerData* peer);
+bool cluster_forward_search(struct RegistryContext* reg_context, struct PeerData* requester, const char* search_file);
+void cluster_handle_frame(struct RegistryContext* reg_context, struct PeerData* link, uint8_t action, uint16_t flags, const uint8_t* payload, uint32_t payload_len);
+void cluster_link_dropped(struct RegistryContext* reg_context, struct PeerData* link);
+double cluster_next_deadline(struct RegistryContext* reg_context);
+void cluster_expire(struct RegistryContext* reg_context, double now);
+int parse_node(const char* entry, size_t len, char* host_out, char* port_out);
+int connect_node(const char* host, const char* port, struct sockaddr_storage* addr);
+void send_node_frame(struct RegistryContext* reg_context, struct PeerData* link, uint8_t action, uint16_t flags, const void* payload, size_t payload_len);
+
+// Leader/follower replication (registry_replica.c)
+int replica_init_leader(struct RegistryContext* reg_context);
+int replica_init_follower(struct RegistryContext* reg_context, const char* leader, uint32_t max_staleness_ms);
+bool replica_read_only(struct RegistryContext* reg_context);
+void replica_publish(struct RegistryContext* reg_context, struct PeerData* peer);
+void replica_peer_dropped(struct RegistryContext* reg_context, struct PeerData* peer);
+bool replica_defer_read(struct RegistryContext* reg_context, struct PeerData* requester, uint8_t action, const char* search_file, uint32_t peer_id);
+void replica_handle_frame(struct RegistryContext* reg_context, struct PeerData* link, uint8_t action, uint16_t flags, const uint8_t* payload, uint32_t payload_len);
+double replica_next_deadline(struct RegistryContext* reg_context);
+void replica_expire(struct RegistryContext* reg_context, double now);
+
+// SEARCH response cache (registry_cache.c)
+int search_cache_init(struct RegistryContext* reg_context);
+bool search_cache_answer(struct RegistryContext* reg_context, struct PeerData* requester, const char* search_file, struct PeerData** candidates, int* candidate_count);
+void search_cache_invalidate(struct RegistryContext* reg_context, const char* search_file);
+void search_cache_invalidate_peer(struct RegistryContext* reg_context, struct PeerData* peer);
+
+// File catalog (registry_catalog.c)
+int catalog_init(struct RegistryContext* reg_context);
+int catalog_set_files(struct RegistryContext* reg_context, struct PeerData* peer, char files[][MAX_FILENAME_LEN], uint32_t count);
+void catalog_clear(struct RegistryContext* reg_context, struct PeerData* peer);
+int catalog_file_count(struct RegistryContext* reg_context, const struct PeerData* peer);
+const char* catalog_file(struct RegistryContext* reg_context, const struct PeerData* peer, int index);
+int catalog_holders(struct RegistryContext* reg_context, const char* name, struct PeerData** out);
+void catalog_report(struct RegistryContext* reg_context);
+int catalog_summary_chunk(struct RegistryContext* reg_context, struct PeerData* peer, uint32_t name_count, uint8_t hashes, uint32_t total_blocks, uint32_t first_block, const uint8_t* blocks, uint32_t block_count);
+int catalog_summary_holders(struct RegistryContext* reg_context, const char* name, struct PeerData** out);
+bool catalog_has_summaries(struct RegistryContext* reg_context);
+bool catalog_is_summary(struct RegistryContext* reg_context, const struct PeerData* peer);
+
+// Peer ID index (registry_ids.c)
+int peer_index_init(struct RegistryContext* reg_context);
+struct PeerData* peer_index_find(struct RegistryContext* reg_context, uint32_t peer_id);
+void peer_index_add(struct RegistryContext* reg_context, struct PeerData* peer);
+void peer_index_remove(struct RegistryContext* reg_context, struct PeerData* peer);
+
+// Session recording (registry_record.c)
+int record_open(struct RegistryContext* reg_context, const char* path);
+void record_connect(struct RegistryContext* reg_context, int slot);
+void record_input(struct RegistryContext* reg_context, int slot, const void* data, size_t len);
+void record_close(struct RegistryContext* reg_context, int slot);
+
+// TLS transport (registry_tls.c)
+int tls_init(struct RegistryContext* reg_context, const char* cert_file, const char* key_file, const char* ca_file);
+int tls_accept(struct RegistryContext* reg_context, struct PeerData* peer);
+int tls_connect(struct RegistryContext* reg_context, struct PeerData* peer, const char* host, int node);
+void tls_input(struct RegistryContext* reg_context, struct PeerData* peer, const void* data, size_t len);
+void tls_send(struct RegistryContext* reg_context, struct PeerData* peer, const void* data, size_t len);
+void tls_close(struct PeerData* peer);
+
+// Per-connection output queues and backpressure (registry_output.c)
+void output_send(struct RegistryContext* reg_context, struct PeerData* peer, const void* data, size_t len);
+void output_flush(struct RegistryContext* reg_context, struct PeerData* peer);
+void output_discard(struct RegistryContext* reg_context, struct PeerData* peer);
+void output_queued(struct RegistryContext* reg_context, struct PeerData* peer, size_t len);
+void output_drained(struct RegistryContext* reg_context, struct PeerData* peer, size_t len);
+
+#endif
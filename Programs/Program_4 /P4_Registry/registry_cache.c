@@ -0,0 +1,312 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// SEARCH response cache. A few popular names make up most SEARCH traffic, so for those
+// the registry keeps the holder list together with each holder's response already
+// encoded (the full v2 frame and the 10-byte v1 reply). A hit still picks the holder by
+// load and locality, but then only copies the chosen response into the send path
+// instead of scanning every peer's files and encoding endpoints.
+//
+// The cache is 4-way set associative. Admission follows TinyLFU: a count-min sketch
+// estimates how often each name has been searched recently, and a new name only
+// replaces the least frequent entry of its set if it is searched more often. One-off
+// names therefore cannot flush the popular ones. Entries are invalidated whenever a
+// peer holding the name publishes or goes away. Names without exact holders are not
+// answered from the cache while Bloom summaries are stored, since a summary published
+// later may list them.
+
+#include "registry.h"
+
+// Number of sets (power of two) and entries per set
+#define CACHE_SETS 64
+#define CACHE_WAYS 4
+// Names with more holders than this are not cached
+#define CACHE_MAX_HOLDERS 8
+// Longest cached v2 frame: header, peer ID, endpoint count and endpoints
+#define CACHE_FRAME_LEN (V2_HEADER_LEN + 4 + 1 + MAX_ENDPOINTS * MAX_ENDPOINT_LEN)
+// Count-min sketch rows and counters per row (power of two)
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 2048
+// Counters saturate at this value
+#define SKETCH_MAX 15
+// After this many increments every counter is halved, so old popularity fades
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH)
+
+// Cached answer for one name
+struct CacheEntry
+{
+    bool used;
+    uint64_t hash;
+    char name[MAX_FILENAME_LEN];
+    // Every holder of the name; empty for a cached "not found"
+    int holder_count;
+    struct PeerData* holders[CACHE_MAX_HOLDERS];
+    // Pre-encoded v2 response frame per holder
+    uint8_t frames[CACHE_MAX_HOLDERS][CACHE_FRAME_LEN];
+    uint8_t frame_lens[CACHE_MAX_HOLDERS];
+    // Pre-encoded v1 reply per holder, valid when the holder has an IPv4 endpoint
+    uint8_t v1_replies[CACHE_MAX_HOLDERS][V1_SEARCH_REPLY_LEN];
+    bool has_ipv4[CACHE_MAX_HOLDERS];
+};
+
+struct SearchCache
+{
+    struct CacheEntry entries[CACHE_SETS][CACHE_WAYS];
+    // Frequency sketch over recently searched names
+    uint8_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+    uint32_t sketch_additions;
+    // Responses for names nobody holds
+    uint8_t not_found_frame[V2_HEADER_LEN + 4 + 1];
+    uint8_t not_found_v1[V1_SEARCH_REPLY_LEN];
+};
+
+static uint64_t cache_hash(const char* name);
+static uint32_t sketch_slot(uint64_t hash, int row);
+static void sketch_increment(struct SearchCache* cache, uint64_t hash);
+static uint8_t sketch_estimate(struct SearchCache* cache, uint64_t hash);
+static struct CacheEntry* cache_lookup(struct SearchCache* cache, uint64_t hash, const char* name);
+static struct CacheEntry* cache_admit(struct SearchCache* cache, uint64_t hash);
+static void cache_fill(struct CacheEntry* entry, struct PeerData** holders, int count);
+
+// Allocate the cache. Returns -1 if it cannot be allocated
+int search_cache_init(struct RegistryContext* reg_context)
+{
+    struct SearchCache* cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+    {
+        return -1;
+    }
+
+    // Peer ID 0 and no endpoints; calloc() left the payload zero
+    p2p_frame_header_encode(cache->not_found_frame, ACTION_SEARCH, V2_FLAG_RESPONSE, 4 + 1);
+
+    reg_context->search_cache = cache;
+    return 0;
+}
+
+// Answer a SEARCH from the cache, adding the name if the sketch says it is popular
+// enough. Returns false if the caller must answer it the normal way; if the name's
+// holders were collected on the way, they are left in candidates (room for MAX_HOLDERS)
+// and their number in *candidate_count, which is otherwise left alone
+bool search_cache_answer(struct RegistryContext* reg_context, struct PeerData* requester, const char* search_file, struct PeerData** candidates, int* candidate_count)
+{
+    struct SearchCache* cache = reg_context->search_cache;
+    uint64_t hash = cache_hash(search_file);
+
+    sketch_increment(cache, hash);
+
+    struct CacheEntry* entry = cache_lookup(cache, hash, search_file);
+    if (entry != NULL && entry->holder_count == 0 && catalog_has_summaries(reg_context))
+    {
+        return false;
+    }
+    if (entry == NULL)
+    {
+        int count = collect_holders(reg_context, search_file, candidates);
+        if (count > CACHE_MAX_HOLDERS || (count == 0 && catalog_has_summaries(reg_context)))
+        {
+            *candidate_count = count;
+            return false;
+        }
+        entry = cache_admit(cache, hash);
+        if (entry == NULL)
+        {
+            *candidate_count = count;
+            return false;
+        }
+        entry->hash = hash;
+        strcpy(entry->name, search_file);
+        cache_fill(entry, candidates, count);
+    }
+
+    // v1 requesters can only be given holders with an IPv4 endpoint
+    bool need_ipv4 = requester->version < 2;
+    struct PeerData* eligible[CACHE_MAX_HOLDERS];
+    int eligible_count = 0;
+    for (int h = 0; h < entry->holder_count; h++)
+    {
+        if (!need_ipv4 || entry->has_ipv4[h])
+        {
+            eligible[eligible_count++] = entry->holders[h];
+        }
+    }
+
+    const uint8_t* frame = cache->not_found_frame;
+    size_t frame_len = sizeof(cache->not_found_frame);
+    const uint8_t* v1_reply = cache->not_found_v1;
+    if (eligible_count > 0)
+    {
+        struct PeerData* holder = select_holder(reg_context, requester, eligible, eligible_count);
+        holder->recent_hits++;
+        for (int h = 0; h < entry->holder_count; h++)
+        {
+            if (entry->holders[h] == holder)
+            {
+                frame = entry->frames[h];
+                frame_len = entry->frame_lens[h];
+                v1_reply = entry->v1_replies[h];
+                break;
+            }
+        }
+    }
+
+    if (need_ipv4)
+    {
+        send_to_peer(reg_context, requester->peer_socket, v1_reply, V1_SEARCH_REPLY_LEN);
+    }
+    else
+    {
+        send_to_peer(reg_context, requester->peer_socket, frame, frame_len);
+    }
+    print_search_result(search_file, frame + V2_HEADER_LEN, frame_len - V2_HEADER_LEN);
+    return true;
+}
+
+// Drop the cached answer for a name whose holders changed
+void search_cache_invalidate(struct RegistryContext* reg_context, const char* search_file)
+{
+    if (reg_context->search_cache == NULL)
+    {
+        return;
+    }
+
+    struct CacheEntry* entry = cache_lookup(reg_context->search_cache, cache_hash(search_file), search_file);
+    if (entry != NULL)
+    {
+        entry->used = false;
+    }
+}
+
+// Drop the cached answers for every name a peer publishes
+void search_cache_invalidate_peer(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    for (int k = 0; k < catalog_file_count(reg_context, peer); k++)
+    {
+        search_cache_invalidate(reg_context, catalog_file(reg_context, peer, k));
+    }
+}
+
+// FNV-1a over the name
+static uint64_t cache_hash(const char* name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (const char* c = name; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Counter index of a hash in one sketch row, by double hashing on the two halves
+static uint32_t sketch_slot(uint64_t hash, int row)
+{
+    uint32_t low = (uint32_t)hash;
+    uint32_t high = (uint32_t)(hash >> 32) | 1;
+
+    return (low + row * high) & (SKETCH_WIDTH - 1);
+}
+
+static void sketch_increment(struct SearchCache* cache, uint64_t hash)
+{
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        uint8_t* counter = &cache->sketch[row][sketch_slot(hash, row)];
+        if (*counter < SKETCH_MAX)
+        {
+            (*counter)++;
+        }
+    }
+
+    // Age every counter once enough searches have been sampled
+    if (++cache->sketch_additions == SKETCH_SAMPLE)
+    {
+        for (int row = 0; row < SKETCH_DEPTH; row++)
+        {
+            for (int i = 0; i < SKETCH_WIDTH; i++)
+            {
+                cache->sketch[row][i] >>= 1;
+            }
+        }
+        cache->sketch_additions /= 2;
+    }
+}
+
+// Estimated recent search count: the smallest of the name's counters
+static uint8_t sketch_estimate(struct SearchCache* cache, uint64_t hash)
+{
+    uint8_t estimate = SKETCH_MAX;
+
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        uint8_t counter = cache->sketch[row][sketch_slot(hash, row)];
+        if (counter < estimate)
+        {
+            estimate = counter;
+        }
+    }
+    return estimate;
+}
+
+static struct CacheEntry* cache_lookup(struct SearchCache* cache, uint64_t hash, const char* name)
+{
+    struct CacheEntry* set = cache->entries[hash & (CACHE_SETS - 1)];
+
+    for (int way = 0; way < CACHE_WAYS; way++)
+    {
+        if (set[way].used && set[way].hash == hash && strcmp(set[way].name, name) == 0)
+        {
+            return &set[way];
+        }
+    }
+    return NULL;
+}
+
+// Find room for a name: a free way, or the least frequent entry of the set if the new
+// name is searched more often than it. Returns NULL if the name is not admitted
+static struct CacheEntry* cache_admit(struct SearchCache* cache, uint64_t hash)
+{
+    struct CacheEntry* set = cache->entries[hash & (CACHE_SETS - 1)];
+    struct CacheEntry* victim = NULL;
+    uint8_t victim_frequency = SKETCH_MAX + 1;
+
+    for (int way = 0; way < CACHE_WAYS; way++)
+    {
+        if (!set[way].used)
+        {
+            set[way].used = true;
+            return &set[way];
+        }
+        uint8_t frequency = sketch_estimate(cache, set[way].hash);
+        if (frequency < victim_frequency)
+        {
+            victim = &set[way];
+            victim_frequency = frequency;
+        }
+    }
+
+    if (sketch_estimate(cache, hash) <= victim_frequency)
+    {
+        return NULL;
+    }
+    return victim;
+}
+
+// Encode every holder's responses into an entry
+static void cache_fill(struct CacheEntry* entry, struct PeerData** holders, int count)
+{
+    entry->holder_count = count;
+    for (int h = 0; h < count; h++)
+    {
+        uint8_t* frame = entry->frames[h];
+        size_t result_len = encode_search_result(frame + V2_HEADER_LEN, holders[h]);
+        struct sockaddr_in v4_endpoint;
+
+        p2p_frame_header_encode(frame, ACTION_SEARCH, V2_FLAG_RESPONSE, result_len);
+        entry->frame_lens[h] = V2_HEADER_LEN + result_len;
+
+        encode_v1_search_result(entry->v1_replies[h], frame + V2_HEADER_LEN, result_len);
+        entry->has_ipv4[h] = peer_ipv4_endpoint(holders[h], &v4_endpoint);
+        entry->holders[h] = holders[h];
+    }
+}
@@ -0,0 +1,625 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// File catalog: who publishes which names, for local peers and (in a cluster) the
+// records replicated from other nodes alike. Each of them owns one catalog record,
+// numbered by PeerData.record.
+//
+// The layout is for lookup speed. Names are interned in one shared string heap and
+// referred to by their offset in it, so a name is hashed and compared once rather than
+// per holder, and a name published by many peers is stored once. Each name keeps a
+// posting list of the records publishing it, so answering a SEARCH is one hash lookup
+// followed by a walk over exactly its holders, however many records the catalog has. A
+// name nobody publishes is not in the table at all. Each record's file list is a row of
+// MAX_FILES offsets in tables sized for MAX_HOLDERS records, reserved whether or not the
+// record publishes anything; catalog_report() shows those tables apart from the storage
+// that grows with the catalog.
+//
+// The heap is append-only; names whose last publisher went away leave garbage that is
+// compacted away once it makes up half of the heap.
+//
+// A peer with a very large share can publish a blocked Bloom filter of its names
+// instead (about 10 bits per name rather than the names themselves). Such records are
+// only consulted when no record lists a name exactly, and holders found through them
+// are candidates: the filter can match names the peer does not have.
+
+#include "registry.h"
+
+// Initial size of the name table (power of two); it doubles at half load
+#define CATALOG_MIN_NAMES 256
+// Initial heap size
+#define CATALOG_MIN_HEAP 4096
+// Garbage below this many bytes is never worth compacting
+#define CATALOG_MIN_GARBAGE 4096
+
+// Posting lists start with room for this many records and double when full
+#define CATALOG_MIN_POSTINGS 4
+
+// One interned name; refs is 0 for an empty slot. refs counts every occurrence of the
+// name in file lists, records lists each record publishing it once, in the order they
+// published it
+struct CatalogName
+{
+    uint32_t offset;
+    uint32_t refs;
+    uint32_t hash;
+    uint16_t record_count;
+    uint16_t record_cap;
+    uint16_t* records;
+};
+
+// Bloom summary published in place of a file list
+struct CatalogSummary
+{
+    uint32_t name_count;
+    uint32_t block_count;
+    // Blocks received so far; the summary is only searched once all have arrived
+    uint32_t received;
+    uint8_t hashes;
+    uint8_t* blocks;
+};
+
+struct Catalog
+{
+    // Per record: number of published files and their names as heap offsets
+    uint8_t file_counts[MAX_HOLDERS];
+    uint32_t files[MAX_HOLDERS][MAX_FILES];
+    // Peer each record belongs to
+    struct PeerData* owners[MAX_HOLDERS];
+    // Interned names, NUL-terminated
+    char* heap;
+    size_t heap_len;
+    size_t heap_cap;
+    // Bytes of names nobody publishes any more
+    size_t heap_garbage;
+    // Open-addressing (linear probing) table of the interned names
+    struct CatalogName* names;
+    size_t name_cap;
+    size_t name_count;
+    // Records with files and files over all records
+    size_t record_count;
+    size_t file_total;
+    // Summaries, by record, and totals over the complete ones
+    struct CatalogSummary* summaries[MAX_HOLDERS];
+    size_t summary_count;
+    size_t summary_names;
+    size_t summary_bytes;
+};
+
+static uint32_t name_hash(const char* name);
+static uint64_t summary_hash(const char* name);
+static bool summary_contains(const struct CatalogSummary* summary, uint64_t hash);
+static struct CatalogName* find_name(struct Catalog* catalog, const char* name, uint32_t hash);
+static int intern_name(struct Catalog* catalog, const char* name, uint32_t* offset);
+static void release_name(struct Catalog* catalog, uint32_t offset);
+static struct CatalogName* offset_name(struct Catalog* catalog, uint32_t offset);
+static int reserve_posting(struct CatalogName* entry);
+static void add_posting(struct CatalogName* entry, uint16_t record);
+static void remove_posting(struct CatalogName* entry, uint16_t record);
+static void clear_record(struct Catalog* catalog, int record);
+static int grow_names(struct Catalog* catalog);
+static void maybe_compact(struct Catalog* catalog);
+static void compact_heap(struct Catalog* catalog);
+
+// Allocate the catalog. Returns -1 if it cannot be allocated
+int catalog_init(struct RegistryContext* reg_context)
+{
+    struct Catalog* catalog = calloc(1, sizeof(*catalog));
+    if (catalog == NULL)
+    {
+        return -1;
+    }
+    catalog->heap = malloc(CATALOG_MIN_HEAP);
+    catalog->names = calloc(CATALOG_MIN_NAMES, sizeof(*catalog->names));
+    if (catalog->heap == NULL || catalog->names == NULL)
+    {
+        free(catalog->heap);
+        free(catalog->names);
+        free(catalog);
+        return -1;
+    }
+    catalog->heap_cap = CATALOG_MIN_HEAP;
+    catalog->name_cap = CATALOG_MIN_NAMES;
+
+    reg_context->catalog = catalog;
+    return 0;
+}
+
+// Replace the files a peer publishes. Returns -1 (keeping the old list) if the names
+// cannot be stored
+int catalog_set_files(struct RegistryContext* reg_context, struct PeerData* peer, char files[][MAX_FILENAME_LEN], uint32_t count)
+{
+    struct Catalog* catalog = reg_context->catalog;
+    uint32_t offsets[MAX_FILES];
+
+    // Intern the new names before releasing the old ones, so names published again
+    // keep their place in the heap
+    for (uint32_t j = 0; j < count; j++)
+    {
+        if (intern_name(catalog, files[j], &offsets[j]) < 0)
+        {
+            while (j > 0)
+            {
+                release_name(catalog, offsets[--j]);
+            }
+            return -1;
+        }
+    }
+    // Make room in every posting list first too; clearing the old record only shrinks
+    // them, so adding this record afterwards cannot fail
+    for (uint32_t j = 0; j < count; j++)
+    {
+        if (reserve_posting(offset_name(catalog, offsets[j])) < 0)
+        {
+            for (uint32_t k = 0; k < count; k++)
+            {
+                release_name(catalog, offsets[k]);
+            }
+            return -1;
+        }
+    }
+
+    clear_record(catalog, peer->record);
+    for (uint32_t j = 0; j < count; j++)
+    {
+        add_posting(offset_name(catalog, offsets[j]), peer->record);
+    }
+    memcpy(catalog->files[peer->record], offsets, count * sizeof(offsets[0]));
+    catalog->file_counts[peer->record] = count;
+    catalog->owners[peer->record] = peer;
+    catalog->file_total += count;
+    catalog->record_count += count > 0;
+    maybe_compact(catalog);
+    return 0;
+}
+
+// Forget every file a peer publishes
+void catalog_clear(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    clear_record(reg_context->catalog, peer->record);
+    maybe_compact(reg_context->catalog);
+}
+
+int catalog_file_count(struct RegistryContext* reg_context, const struct PeerData* peer)
+{
+    return reg_context->catalog->file_counts[peer->record];
+}
+
+// Name of one of a peer's files. Only valid until the catalog next changes
+const char* catalog_file(struct RegistryContext* reg_context, const struct PeerData* peer, int index)
+{
+    return reg_context->catalog->heap + reg_context->catalog->files[peer->record][index];
+}
+
+// Collect every peer publishing name into out (room for MAX_HOLDERS). Returns the count
+int catalog_holders(struct RegistryContext* reg_context, const char* name, struct PeerData** out)
+{
+    struct Catalog* catalog = reg_context->catalog;
+    struct CatalogName* entry = find_name(catalog, name, name_hash(name));
+
+    if (entry == NULL)
+    {
+        return 0;
+    }
+    for (int p = 0; p < entry->record_count; p++)
+    {
+        out[p] = catalog->owners[entry->records[p]];
+    }
+    return entry->record_count;
+}
+
+// Print the catalog's size: the fixed per-record tables, and the storage that grows with
+// it (heap, name table, posting lists and summaries) per publishing peer and per file
+void catalog_report(struct RegistryContext* reg_context)
+{
+    struct Catalog* catalog = reg_context->catalog;
+    size_t bytes = catalog->heap_cap + catalog->name_cap * sizeof(*catalog->names) + catalog->summary_bytes;
+
+    for (size_t n = 0; n < catalog->name_cap; n++)
+    {
+        bytes += catalog->names[n].record_cap * sizeof(uint16_t);
+    }
+    size_t peers = catalog->record_count + catalog->summary_count;
+    size_t files = catalog->file_total + catalog->summary_names;
+
+    printf("Catalog: %zu peers (%zu summarized), %zu files, %zu names, %zu bytes fixed + %zu bytes (%zu per peer, %zu per file)\n",
+           peers, catalog->summary_count, files, catalog->name_count, sizeof(*catalog), bytes,
+           peers > 0 ? bytes / peers : 0, files > 0 ? bytes / files : 0);
+}
+
+// Store one chunk of a peer's Bloom summary; a chunk starting at block 0 begins a new
+// summary, replacing whatever the peer published before. Chunks must arrive in order.
+// Returns 1 once the summary is complete, 0 if more chunks are expected, or -1 if the
+// chunk does not fit the summary or cannot be stored
+int catalog_summary_chunk(struct RegistryContext* reg_context, struct PeerData* peer, uint32_t name_count, uint8_t hashes, uint32_t total_blocks, uint32_t first_block, const uint8_t* blocks, uint32_t block_count)
+{
+    struct Catalog* catalog = reg_context->catalog;
+    struct CatalogSummary* summary = catalog->summaries[peer->record];
+
+    if (first_block == 0)
+    {
+        clear_record(catalog, peer->record);
+        maybe_compact(catalog);
+        summary = calloc(1, sizeof(*summary));
+        if (summary == NULL || (summary->blocks = malloc((size_t)total_blocks * SUMMARY_BLOCK_LEN)) == NULL)
+        {
+            free(summary);
+            return -1;
+        }
+        summary->name_count = name_count;
+        summary->block_count = total_blocks;
+        summary->hashes = hashes;
+        catalog->summaries[peer->record] = summary;
+    }
+    else if (summary == NULL || summary->received != first_block || summary->block_count != total_blocks ||
+             summary->hashes != hashes || summary->name_count != name_count)
+    {
+        return -1;
+    }
+    if (block_count > summary->block_count - summary->received)
+    {
+        return -1;
+    }
+
+    memcpy(summary->blocks + (size_t)summary->received * SUMMARY_BLOCK_LEN, blocks, (size_t)block_count * SUMMARY_BLOCK_LEN);
+    summary->received += block_count;
+    if (summary->received < summary->block_count)
+    {
+        return 0;
+    }
+
+    catalog->owners[peer->record] = peer;
+    catalog->summary_count++;
+    catalog->summary_names += summary->name_count;
+    catalog->summary_bytes += sizeof(*summary) + (size_t)summary->block_count * SUMMARY_BLOCK_LEN;
+    return 1;
+}
+
+// Collect every peer whose summary may contain name into out (room for MAX_HOLDERS).
+// Returns the count
+int catalog_summary_holders(struct RegistryContext* reg_context, const char* name, struct PeerData** out)
+{
+    struct Catalog* catalog = reg_context->catalog;
+    int count = 0;
+
+    if (catalog->summary_count == 0)
+    {
+        return 0;
+    }
+    uint64_t hash = summary_hash(name);
+    for (int r = 0; r < MAX_HOLDERS; r++)
+    {
+        struct CatalogSummary* summary = catalog->summaries[r];
+        if (summary != NULL && summary->received == summary->block_count && summary_contains(summary, hash))
+        {
+            out[count++] = catalog->owners[r];
+        }
+    }
+    return count;
+}
+
+// Whether any complete summary is stored, i.e. whether a name without exact holders may
+// still have candidates
+bool catalog_has_summaries(struct RegistryContext* reg_context)
+{
+    return reg_context->catalog->summary_count > 0;
+}
+
+bool catalog_is_summary(struct RegistryContext* reg_context, const struct PeerData* peer)
+{
+    return reg_context->catalog->summaries[peer->record] != NULL;
+}
+
+// FNV-1a over the name
+static uint32_t name_hash(const char* name)
+{
+    uint32_t hash = 2166136261u;
+
+    for (const char* c = name; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Hash shared with the peers that build summaries: 64-bit FNV-1a over the name,
+// finished with the MurmurHash3 mixer so every bit depends on the whole name
+static uint64_t summary_hash(const char* name)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (const char* c = name; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// The low half of the hash picks the block and the high half the bits within it, by
+// double hashing: bit i is (high + i * step) mod 512
+static bool summary_contains(const struct CatalogSummary* summary, uint64_t hash)
+{
+    const uint8_t* block = summary->blocks + (((hash & 0xffffffff) * summary->block_count) >> 32) * SUMMARY_BLOCK_LEN;
+    uint32_t high = hash >> 32;
+    uint32_t step = (high >> 16) | 1;
+
+    for (uint32_t i = 0; i < summary->hashes; i++)
+    {
+        uint32_t bit = (high + i * step) % (SUMMARY_BLOCK_LEN * 8);
+        if (!(block[bit / 8] & (1 << (bit % 8))))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static struct CatalogName* find_name(struct Catalog* catalog, const char* name, uint32_t hash)
+{
+    size_t mask = catalog->name_cap - 1;
+
+    for (size_t i = hash & mask; catalog->names[i].refs != 0; i = (i + 1) & mask)
+    {
+        struct CatalogName* entry = &catalog->names[i];
+        if (entry->hash == hash && strcmp(catalog->heap + entry->offset, name) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Take a reference to name, adding it to the heap if it is new. Returns -1 if out of memory
+static int intern_name(struct Catalog* catalog, const char* name, uint32_t* offset)
+{
+    uint32_t hash = name_hash(name);
+    struct CatalogName* entry = find_name(catalog, name, hash);
+
+    if (entry != NULL)
+    {
+        entry->refs++;
+        *offset = entry->offset;
+        return 0;
+    }
+
+    if ((catalog->name_count + 1) * 2 > catalog->name_cap && grow_names(catalog) < 0)
+    {
+        return -1;
+    }
+    size_t len = strlen(name) + 1;
+    if (catalog->heap_len + len > catalog->heap_cap)
+    {
+        size_t cap = catalog->heap_cap * 2;
+        while (cap < catalog->heap_len + len)
+        {
+            cap *= 2;
+        }
+        char* grown = realloc(catalog->heap, cap);
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        catalog->heap = grown;
+        catalog->heap_cap = cap;
+    }
+    memcpy(catalog->heap + catalog->heap_len, name, len);
+
+    size_t mask = catalog->name_cap - 1;
+    size_t i = hash & mask;
+    while (catalog->names[i].refs != 0)
+    {
+        i = (i + 1) & mask;
+    }
+    catalog->names[i].offset = catalog->heap_len;
+    catalog->names[i].refs = 1;
+    catalog->names[i].hash = hash;
+    catalog->names[i].record_count = 0;
+    catalog->names[i].record_cap = 0;
+    catalog->names[i].records = NULL;
+    catalog->name_count++;
+    catalog->heap_len += len;
+    *offset = catalog->names[i].offset;
+    return 0;
+}
+
+// Drop a reference to the name at offset, removing it once nobody publishes it
+static void release_name(struct Catalog* catalog, uint32_t offset)
+{
+    const char* name = catalog->heap + offset;
+    struct CatalogName* entry = find_name(catalog, name, name_hash(name));
+
+    if (entry == NULL || --entry->refs > 0)
+    {
+        return;
+    }
+    catalog->heap_garbage += strlen(name) + 1;
+    catalog->name_count--;
+    free(entry->records);
+    entry->records = NULL;
+    entry->record_count = 0;
+    entry->record_cap = 0;
+
+    // Shift later entries of the probe run back so lookups never hit a hole
+    size_t mask = catalog->name_cap - 1;
+    size_t hole = entry - catalog->names;
+    for (size_t i = (hole + 1) & mask; catalog->names[i].refs != 0; i = (i + 1) & mask)
+    {
+        size_t home = catalog->names[i].hash & mask;
+        // Move the entry if its home slot is not between the hole and its position
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            catalog->names[hole] = catalog->names[i];
+            catalog->names[i].refs = 0;
+            catalog->names[i].records = NULL;
+            hole = i;
+        }
+    }
+    catalog->names[hole].refs = 0;
+}
+
+// Release a record's names. Leaves compaction to the caller, since it moves offsets the
+// caller may still hold
+static void clear_record(struct Catalog* catalog, int record)
+{
+    int count = catalog->file_counts[record];
+    struct CatalogSummary* summary = catalog->summaries[record];
+
+    for (int k = 0; k < count; k++)
+    {
+        remove_posting(offset_name(catalog, catalog->files[record][k]), record);
+        release_name(catalog, catalog->files[record][k]);
+    }
+    if (summary != NULL)
+    {
+        if (summary->received == summary->block_count)
+        {
+            catalog->summary_count--;
+            catalog->summary_names -= summary->name_count;
+            catalog->summary_bytes -= sizeof(*summary) + (size_t)summary->block_count * SUMMARY_BLOCK_LEN;
+        }
+        free(summary->blocks);
+        free(summary);
+        catalog->summaries[record] = NULL;
+    }
+    catalog->file_counts[record] = 0;
+    catalog->owners[record] = NULL;
+    catalog->file_total -= count;
+    catalog->record_count -= count > 0;
+}
+
+// Table entry of a name already in the heap
+static struct CatalogName* offset_name(struct Catalog* catalog, uint32_t offset)
+{
+    const char* name = catalog->heap + offset;
+    return find_name(catalog, name, name_hash(name));
+}
+
+// Make sure one more record fits in a name's posting list. Returns -1 if out of memory
+static int reserve_posting(struct CatalogName* entry)
+{
+    if (entry->record_count < entry->record_cap)
+    {
+        return 0;
+    }
+    uint16_t cap = entry->record_cap == 0 ? CATALOG_MIN_POSTINGS : entry->record_cap * 2;
+    uint16_t* grown = realloc(entry->records, cap * sizeof(*grown));
+    if (grown == NULL)
+    {
+        return -1;
+    }
+    entry->records = grown;
+    entry->record_cap = cap;
+    return 0;
+}
+
+// Add record to a name's posting list, which has room reserved for it. A record listing
+// the name more than once is posted once; its occurrences are added back to back
+static void add_posting(struct CatalogName* entry, uint16_t record)
+{
+    if (entry->record_count > 0 && entry->records[entry->record_count - 1] == record)
+    {
+        return;
+    }
+    entry->records[entry->record_count++] = record;
+}
+
+// Take record off a name's posting list, keeping the others in order
+static void remove_posting(struct CatalogName* entry, uint16_t record)
+{
+    for (int p = 0; p < entry->record_count; p++)
+    {
+        if (entry->records[p] == record)
+        {
+            memmove(&entry->records[p], &entry->records[p + 1], (entry->record_count - p - 1) * sizeof(*entry->records));
+            entry->record_count--;
+            return;
+        }
+    }
+}
+
+static int grow_names(struct Catalog* catalog)
+{
+    size_t cap = catalog->name_cap * 2;
+    struct CatalogName* names = calloc(cap, sizeof(*names));
+    if (names == NULL)
+    {
+        return -1;
+    }
+    for (size_t n = 0; n < catalog->name_cap; n++)
+    {
+        if (catalog->names[n].refs != 0)
+        {
+            size_t i = catalog->names[n].hash & (cap - 1);
+            while (names[i].refs != 0)
+            {
+                i = (i + 1) & (cap - 1);
+            }
+            names[i] = catalog->names[n];
+        }
+    }
+    free(catalog->names);
+    catalog->names = names;
+    catalog->name_cap = cap;
+    return 0;
+}
+
+static void maybe_compact(struct Catalog* catalog)
+{
+    if (catalog->heap_garbage > CATALOG_MIN_GARBAGE && catalog->heap_garbage * 2 > catalog->heap_len)
+    {
+        compact_heap(catalog);
+    }
+}
+
+// Copy the live names into a fresh heap and move every offset that refers to them
+static void compact_heap(struct Catalog* catalog)
+{
+    size_t live = catalog->heap_len - catalog->heap_garbage;
+    size_t cap = CATALOG_MIN_HEAP;
+    while (cap < live)
+    {
+        cap *= 2;
+    }
+    char* heap = malloc(cap);
+    if (heap == NULL)
+    {
+        // Compaction only saves memory; try again on a later removal
+        return;
+    }
+
+    // Move the names first, remembering where each record's names went by looking the
+    // old string up again afterwards
+    char* old_heap = catalog->heap;
+    size_t len = 0;
+    for (size_t n = 0; n < catalog->name_cap; n++)
+    {
+        struct CatalogName* entry = &catalog->names[n];
+        if (entry->refs != 0)
+        {
+            size_t name_len = strlen(old_heap + entry->offset) + 1;
+            memcpy(heap + len, old_heap + entry->offset, name_len);
+            entry->offset = len;
+            len += name_len;
+        }
+    }
+    catalog->heap = heap;
+    catalog->heap_len = len;
+    catalog->heap_cap = cap;
+    catalog->heap_garbage = 0;
+
+    for (int r = 0; r < MAX_HOLDERS; r++)
+    {
+        for (int k = 0; k < catalog->file_counts[r]; k++)
+        {
+            const char* name = old_heap + catalog->files[r][k];
+            catalog->files[r][k] = find_name(catalog, name, name_hash(name))->offset;
+        }
+    }
+    free(old_heap);
+}
@@ -0,0 +1,985 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Federated cluster mode. Every node is started with the same list of nodes and places
+// them on a consistent-hash ring; each filename belongs to the first node clockwise of
+// its hash (the owner) and is also kept by the next distinct node (the replica). When a
+// peer publishes, its home node sends the peer's records to the owner and replica of
+// each name, so those two nodes can answer a SEARCH for it from any peer in the cluster.
+// A SEARCH that arrives at a node which is neither owner nor replica is forwarded to the
+// owner (or the replica if the owner is unreachable) and the answer is relayed back.
+// Nodes talk to each other with v2 frames over ordinary registry connections.
+//
+// Links are opened without blocking: frames sent on a link that is still connecting wait
+// in its output queue, and the backend sends them once it is up. A link that is not up
+// after CLUSTER_CONNECT_TIMEOUT_MS is dropped. A forwarded SEARCH goes to whichever of
+// owner and replica already has a connected link, the owner if both or neither do, and
+// moves on to the other one when its link drops, it answers with an error or it has not
+// answered after CLUSTER_FORWARD_TIMEOUT_MS. Only once both have failed is it answered
+// from this node's own catalog (so usually "not found"); a dead or hung node never holds
+// a requester up for long.
+//
+// A connection becomes a link by sending NODE_HELLO with its node index. That is only
+// accepted from an address the node's -c host resolves to, and only while no other link
+// accepted from that node is still connected, so an ordinary client cannot pose as a
+// node and feed the catalog or take over a node's forwarded SEARCHes.
+
+#include "registry.h"
+
+#include <errno.h>
+
+// Seconds between connection attempts to an unreachable node
+#define CLUSTER_RETRY_SECONDS 1
+// How long to wait for a connection to another node before giving up
+#define CLUSTER_CONNECT_TIMEOUT_MS 500
+// How long a forwarded SEARCH waits for the other node's answer
+#define CLUSTER_FORWARD_TIMEOUT_MS 2000
+
+// One node from the -c list
+struct ClusterNode
+{
+    char host[NODE_HOST_LEN];
+    char port[NODE_PORT_LEN];
+    // Peer slot of the link to this node, -1 while there is none
+    int link_slot;
+    // When the last outgoing connection was attempted
+    time_t last_attempt;
+    // Monotonic time by which the link being opened must be connected, 0 when none is
+    double connect_deadline;
+};
+
+// One point on the hash ring
+struct RingPoint
+{
+    uint64_t hash;
+    int node;
+};
+
+// A SEARCH waiting for another node's answer
+struct ClusterForward
+{
+    bool used;
+    uint32_t tag;
+    // Nodes to ask, in order, and the index of the one asked now
+    int targets[2];
+    int attempt;
+    // Whether the requester needs a holder with an IPv4 endpoint (v1)
+    bool need_ipv4;
+    // Peer slot of the link the SEARCH was sent on; the answer comes back on it
+    int link_slot;
+    // Requesting peer; the generation detects that it disconnected meanwhile
+    int client_slot;
+    uint32_t client_generation;
+    // Monotonic time after which the current target counts as failed
+    double deadline;
+    char name[MAX_FILENAME_LEN];
+};
+
+struct ClusterState
+{
+    // Index of this node in nodes
+    int self;
+    int node_count;
+    struct ClusterNode nodes[MAX_CLUSTER_NODES];
+    // Sorted ring, CLUSTER_VNODES points per node
+    struct RingPoint ring[MAX_CLUSTER_NODES * CLUSTER_VNODES];
+    int ring_len;
+    // Records of peers connected to other nodes, for names this node owns or replicates.
+    // Their peer_socket is -1 and home_node says where the peer is connected
+    struct PeerData remote_peers[MAX_REMOTE_PEERS];
+    struct ClusterForward forwards[MAX_FORWARDS];
+    uint32_t next_tag;
+};
+
+static uint64_t ring_hash(const char* data, size_t len);
+static int compare_points(const void* a, const void* b);
+static void file_nodes(struct ClusterState* cluster, const char* name, int* owner, int* replica);
+static int cluster_link(struct RegistryContext* reg_context, int node);
+static struct PeerData* linked_peer(struct RegistryContext* reg_context, int node);
+static bool link_connected(struct RegistryContext* reg_context, int node);
+static bool send_forward(struct RegistryContext* reg_context, struct ClusterForward* forward);
+static void retry_forward(struct RegistryContext* reg_context, struct ClusterForward* forward);
+static void send_catalog(struct RegistryContext* reg_context, int node, struct PeerData* peer);
+static bool node_host(struct ClusterState* cluster, int node, const struct sockaddr_storage* addr);
+static void handle_node_hello(struct RegistryContext* reg_context, struct PeerData* link, const uint8_t* payload, uint32_t payload_len);
+static void handle_catalog_add(struct RegistryContext* reg_context, struct PeerData* link, const uint8_t* payload, uint32_t payload_len);
+static void handle_catalog_del(struct RegistryContext* reg_context, struct PeerData* link, const uint8_t* payload, uint32_t payload_len);
+static void handle_node_search(struct RegistryContext* reg_context, struct PeerData* link, const uint8_t* payload, uint32_t payload_len);
+static void handle_node_result(struct RegistryContext* reg_context, struct PeerData* link, uint16_t flags, const uint8_t* payload, uint32_t payload_len);
+static void finish_forward(struct RegistryContext* reg_context, struct ClusterForward* forward, const uint8_t* result, size_t result_len);
+static struct PeerData* find_remote(struct ClusterState* cluster, int home_node, uint32_t peer_id);
+static void remove_remote(struct RegistryContext* reg_context, struct PeerData* record);
+
+// Set up cluster mode from a comma-separated list of host:port (or [v6]:port) entries,
+// identical on every node, where self is this node's index. Returns -1 on a bad list
+int cluster_init(struct RegistryContext* reg_context, const char* node_list, int self)
+{
+    struct ClusterState* cluster = calloc(1, sizeof(*cluster));
+    if (cluster == NULL)
+    {
+        perror("Failed to allocate cluster state");
+        return -1;
+    }
+
+    const char* entry = node_list;
+    while (*entry != '\0')
+    {
+        size_t len = strcspn(entry, ",");
+        if (cluster->node_count == MAX_CLUSTER_NODES)
+        {
+            fprintf(stderr, "Error: At most %d cluster nodes are supported\n", MAX_CLUSTER_NODES);
+            free(cluster);
+            return -1;
+        }
+        if (parse_node(entry, len, cluster->nodes[cluster->node_count].host, cluster->nodes[cluster->node_count].port) < 0)
+        {
+            fprintf(stderr, "Error: Invalid cluster node '%.*s'\n", (int)len, entry);
+            free(cluster);
+            return -1;
+        }
+        cluster->node_count++;
+        entry += len;
+        if (*entry == ',')
+        {
+            entry++;
+        }
+    }
+    if (self < 0 || self >= cluster->node_count)
+    {
+        fprintf(stderr, "Error: -i must name one of the %d cluster nodes\n", cluster->node_count);
+        free(cluster);
+        return -1;
+    }
+    cluster->self = self;
+
+    // Points are derived from the node's address rather than its index, so adding a node
+    // only moves the names that now hash to it
+    for (int n = 0; n < cluster->node_count; n++)
+    {
+        for (int v = 0; v < CLUSTER_VNODES; v++)
+        {
+            char label[300];
+            int label_len = snprintf(label, sizeof(label), "%s:%s#%d", cluster->nodes[n].host, cluster->nodes[n].port, v);
+            cluster->ring[cluster->ring_len].hash = ring_hash(label, label_len);
+            cluster->ring[cluster->ring_len].node = n;
+            cluster->ring_len++;
+        }
+        cluster->nodes[n].link_slot = -1;
+    }
+    qsort(cluster->ring, cluster->ring_len, sizeof(cluster->ring[0]), compare_points);
+
+    for (int r = 0; r < MAX_REMOTE_PEERS; r++)
+    {
+        cluster->remote_peers[r].peer_socket = -1;
+        cluster->remote_peers[r].link_node = -1;
+        cluster->remote_peers[r].home_node = -1;
+        cluster->remote_peers[r].record = MAX_PEERS + r;
+    }
+    reg_context->cluster = cluster;
+
+    printf("Cluster node %d of %d\n", self, cluster->node_count);
+
+    // Nodes that are not up yet connect to us when they start
+    for (int n = 0; n < cluster->node_count; n++)
+    {
+        if (n != self)
+        {
+            cluster_link(reg_context, n);
+        }
+    }
+    return 0;
+}
+
+// Send a newly registered peer's records to the owner and replica of each of its names
+void cluster_publish(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    for (int n = 0; n < reg_context->cluster->node_count; n++)
+    {
+        if (n != reg_context->cluster->self)
+        {
+            send_catalog(reg_context, n, peer);
+        }
+    }
+}
+
+// Tell every linked node that a local peer is gone
+void cluster_unpublish(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    uint32_t net_id = htonl(peer->peer_id);
+
+    for (int n = 0; n < reg_context->cluster->node_count; n++)
+    {
+        struct PeerData* link = linked_peer(reg_context, n);
+        if (link != NULL)
+        {
+            send_node_frame(reg_context, link, ACTION_CATALOG_DEL, 0, &net_id, sizeof(net_id));
+        }
+    }
+}
+
+// Forward a SEARCH to the node that owns the name, or its replica. Returns false if this
+// node should answer it itself: it owns or replicates the name, or neither of those
+// nodes is reachable
+bool cluster_forward_search(struct RegistryContext* reg_context, struct PeerData* requester, const char* search_file)
+{
+    struct ClusterState* cluster = reg_context->cluster;
+    int targets[2];
+
+    file_nodes(cluster, search_file, &targets[0], &targets[1]);
+    if (targets[0] == cluster->self || targets[1] == cluster->self)
+    {
+        return false;
+    }
+    // A node whose link is already up answers sooner than one still being connected to
+    // (or being retried after failing), so it goes first
+    if (!link_connected(reg_context, targets[0]) && link_connected(reg_context, targets[1]))
+    {
+        int first = targets[1];
+        targets[1] = targets[0];
+        targets[0] = first;
+    }
+
+    struct ClusterForward* forward = NULL;
+    for (int f = 0; f < MAX_FORWARDS; f++)
+    {
+        if (!reg_context->cluster->forwards[f].used)
+        {
+            forward = &reg_context->cluster->forwards[f];
+            break;
+        }
+    }
+    if (forward == NULL)
+    {
+        return false;
+    }
+
+    forward->tag = ++cluster->next_tag;
+    forward->targets[0] = targets[0];
+    forward->targets[1] = targets[1];
+    forward->attempt = 0;
+    forward->need_ipv4 = requester->version < 2;
+    forward->client_slot = requester - reg_context->peers;
+    forward->client_generation = requester->generation;
+    strcpy(forward->name, search_file);
+    if (!send_forward(reg_context, forward))
+    {
+        return false;
+    }
+    forward->used = true;
+    requester->awaiting_forward = true;
+    return true;
+}
+
+// Handle a registry-to-registry frame received on a connection
+void cluster_handle_frame(struct RegistryContext* reg_context, struct PeerData* link, uint8_t action, uint16_t flags, const uint8_t* payload, uint32_t payload_len)
+{
+    if (action == ACTION_NODE_HELLO && link->link_node < 0 && link->state == CLIENT_UNKNOWN)
+    {
+        handle_node_hello(reg_context, link, payload, payload_len);
+        return;
+    }
+    // Only identified nodes may touch the catalog
+    if (link->link_node < 0)
+    {
+        send_v2_frame(reg_context, link->peer_socket, action, V2_FLAG_RESPONSE | V2_FLAG_ERROR, NULL, 0);
+        return;
+    }
+
+    switch (action)
+    {
+        case ACTION_CATALOG_ADD:
+            handle_catalog_add(reg_context, link, payload, payload_len);
+            break;
+        case ACTION_CATALOG_DEL:
+            handle_catalog_del(reg_context, link, payload, payload_len);
+            break;
+        case ACTION_NODE_SEARCH:
+            if (flags & V2_FLAG_RESPONSE)
+            {
+                handle_node_result(reg_context, link, flags, payload, payload_len);
+            }
+            else
+            {
+                handle_node_search(reg_context, link, payload, payload_len);
+            }
+            break;
+        default:
+            fprintf(stderr, "Unknown cluster action %u from node %d\n", action, link->link_node);
+            break;
+    }
+}
+
+// A link to another node closed: unless another link to the same node remains, forget
+// the records that node sent (they are sent again when it reconnects), then send the
+// SEARCHes waiting on the link to their other target
+void cluster_link_dropped(struct RegistryContext* reg_context, struct PeerData* link)
+{
+    struct ClusterState* cluster = reg_context->cluster;
+    int node = link->link_node;
+
+    printf("Cluster link to node %d closed\n", node);
+    cluster->nodes[node].link_slot = -1;
+    for (int i = 0; i < MAX_PEERS; i++)
+    {
+        if (&reg_context->peers[i] != link && reg_context->peers[i].link_node == node)
+        {
+            cluster->nodes[node].link_slot = i;
+            break;
+        }
+    }
+    if (cluster->nodes[node].link_slot < 0)
+    {
+        for (int r = 0; r < MAX_REMOTE_PEERS; r++)
+        {
+            if (cluster->remote_peers[r].state == CLIENT_REGISTERED && cluster->remote_peers[r].home_node == node)
+            {
+                remove_remote(reg_context, &cluster->remote_peers[r]);
+            }
+        }
+    }
+
+    for (int f = 0; f < MAX_FORWARDS; f++)
+    {
+        struct ClusterForward* forward = &cluster->forwards[f];
+        if (forward->used && forward->link_slot == link - reg_context->peers)
+        {
+            retry_forward(reg_context, forward);
+        }
+    }
+}
+
+// The earliest connect or forward deadline in monotonic seconds, or 0 if none is set
+double cluster_next_deadline(struct RegistryContext* reg_context)
+{
+    struct ClusterState* cluster = reg_context->cluster;
+    double next = 0;
+
+    for (int n = 0; n < cluster->node_count; n++)
+    {
+        double deadline = cluster->nodes[n].connect_deadline;
+        if (deadline > 0 && (next == 0 || deadline < next))
+        {
+            next = deadline;
+        }
+    }
+    for (int f = 0; f < MAX_FORWARDS; f++)
+    {
+        double deadline = cluster->forwards[f].deadline;
+        if (cluster->forwards[f].used && (next == 0 || deadline < next))
+        {
+            next = deadline;
+        }
+    }
+    return next;
+}
+
+// Drop links that did not connect in time, and answer forwarded SEARCHes that waited too
+// long for the other node
+void cluster_expire(struct RegistryContext* reg_context, double now)
+{
+    struct ClusterState* cluster = reg_context->cluster;
+
+    for (int n = 0; n < cluster->node_count; n++)
+    {
+        struct ClusterNode* node = &cluster->nodes[n];
+        if (node->connect_deadline == 0 || node->connect_deadline > now)
+        {
+            continue;
+        }
+        node->connect_deadline = 0;
+
+        // A socket that is still connecting has no peer address yet
+        struct PeerData* link = linked_peer(reg_context, n);
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        if (link != NULL && getpeername(link->peer_socket, (struct sockaddr*)&addr, &addr_len) < 0)
+        {
+            printf("Timed out connecting to node %d\n", n);
+            drop_peer(reg_context, link);
+        }
+    }
+
+    for (int f = 0; f < MAX_FORWARDS; f++)
+    {
+        struct ClusterForward* forward = &cluster->forwards[f];
+        if (forward->used && forward->deadline <= now)
+        {
+            printf("Node %d did not answer a forwarded SEARCH in time\n", forward->targets[forward->attempt]);
+            retry_forward(reg_context, forward);
+        }
+    }
+}
+
+// FNV-1a, followed by a 64-bit finalizer so similar names land far apart on the ring
+static uint64_t ring_hash(const char* data, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static int compare_points(const void* a, const void* b)
+{
+    const struct RingPoint* pa = a;
+    const struct RingPoint* pb = b;
+
+    if (pa->hash != pb->hash)
+    {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    return pa->node - pb->node;
+}
+
+// Split "host:port" or "[v6]:port" into host (NODE_HOST_LEN bytes) and port
+// (NODE_PORT_LEN bytes). Returns -1 if it is malformed
+int parse_node(const char* entry, size_t len, char* host_out, char* port_out)
+{
+    const char* host = entry;
+    size_t host_len;
+    const char* port;
+
+    if (len > 0 && entry[0] == '[')
+    {
+        const char* close_bracket = memchr(entry, ']', len);
+        if (close_bracket == NULL || close_bracket + 1 >= entry + len || close_bracket[1] != ':')
+        {
+            return -1;
+        }
+        host = entry + 1;
+        host_len = close_bracket - host;
+        port = close_bracket + 2;
+    }
+    else
+    {
+        const char* colon = NULL;
+        for (size_t i = 0; i < len; i++)
+        {
+            if (entry[i] == ':')
+            {
+                colon = entry + i;
+            }
+        }
+        if (colon == NULL)
+        {
+            return -1;
+        }
+        host_len = colon - entry;
+        port = colon + 1;
+    }
+
+    size_t port_len = entry + len - port;
+    if (host_len == 0 || host_len >= NODE_HOST_LEN || port_len == 0 || port_len >= NODE_PORT_LEN)
+    {
+        return -1;
+    }
+    memcpy(host_out, host, host_len);
+    host_out[host_len] = '\0';
+    memcpy(port_out, port, port_len);
+    port_out[port_len] = '\0';
+    return atoi(port_out) > 0 ? 0 : -1;
+}
+
+// Find the owner of a name and its replica (the next distinct node clockwise). With a
+// single node both are that node
+static void file_nodes(struct ClusterState* cluster, const char* name, int* owner, int* replica)
+{
+    uint64_t hash = ring_hash(name, strlen(name));
+    int low = 0;
+    int high = cluster->ring_len;
+
+    // First point at or after the name's hash, wrapping past the end of the ring
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (cluster->ring[mid].hash < hash)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    int start = low % cluster->ring_len;
+
+    *owner = cluster->ring[start].node;
+    *replica = *owner;
+    for (int i = 1; i < cluster->ring_len; i++)
+    {
+        int node = cluster->ring[(start + i) % cluster->ring_len].node;
+        if (node != *owner)
+        {
+            *replica = node;
+            break;
+        }
+    }
+}
+
+// Return the peer slot of the link to a node, connecting if there is none and the last
+// attempt was long enough ago. Returns -1 if the node cannot be reached
+static int cluster_link(struct RegistryContext* reg_context, int node)
+{
+    struct ClusterState* cluster = reg_context->cluster;
+    struct ClusterNode* target = &cluster->nodes[node];
+
+    if (linked_peer(reg_context, node) != NULL)
+    {
+        return target->link_slot;
+    }
+
+    time_t now = time(NULL);
+    if (target->last_attempt != 0 && now - target->last_attempt < CLUSTER_RETRY_SECONDS)
+    {
+        return -1;
+    }
+    target->last_attempt = now;
+
+    struct sockaddr_storage addr;
+    int sock = connect_node(target->host, target->port, &addr);
+    if (sock < 0)
+    {
+        return -1;
+    }
+    target->connect_deadline = monotonic_seconds() + CLUSTER_CONNECT_TIMEOUT_MS / 1000.0;
+
+    int slot = add_peer(reg_context, sock, &addr);
+    if (slot < 0)
+    {
+        printf("Reached max peer limit\n");
+        close(sock);
+        return -1;
+    }
+    struct PeerData* link = &reg_context->peers[slot];
+    link->link_node = node;
+    link->version = 2;
+    target->link_slot = slot;
+    watch_peer(reg_context, slot);
+    if (reg_context->tls != NULL && tls_connect(reg_context, link, target->host, node) < 0)
+    {
+        fprintf(stderr, "Failed to start TLS on the link to node %d\n", node);
+        drop_peer(reg_context, link);
+        return -1;
+    }
+
+    uint8_t self = cluster->self;
+    send_node_frame(reg_context, link, ACTION_NODE_HELLO, 0, &self, sizeof(self));
+    printf("Cluster link to node %d (%s:%s) opened\n", node, target->host, target->port);
+
+    // The other node may have restarted, so give it everything it should hold
+    for (int i = 0; i < MAX_PEERS; i++)
+    {
+        if (reg_context->peers[i].state == CLIENT_REGISTERED && reg_context->peers[i].link_node < 0)
+        {
+            send_catalog(reg_context, node, &reg_context->peers[i]);
+        }
+    }
+    return slot;
+}
+
+// Start a non-blocking connection to another registry, storing its address in addr.
+// Returns the socket, still connecting, or -1. The backend sends whatever is queued on
+// it once it is up, and drops it if the attempt fails
+int connect_node(const char* host, const char* port, struct sockaddr_storage* addr)
+{
+    return p2p_connect_start_addr(host, port, AF_UNSPEC, addr);
+}
+
+// The live link to a node, or NULL if there is none
+static struct PeerData* linked_peer(struct RegistryContext* reg_context, int node)
+{
+    int slot = reg_context->cluster->nodes[node].link_slot;
+
+    if (slot < 0 || reg_context->peers[slot].link_node != node)
+    {
+        return NULL;
+    }
+    return &reg_context->peers[slot];
+}
+
+// Send a v2 frame to another registry. Catalog frames can exceed what send_v2_frame allows
+void send_node_frame(struct RegistryContext* reg_context, struct PeerData* link, uint8_t action, uint16_t flags, const void* payload, size_t payload_len)
+{
+    uint8_t frame[V2_HEADER_LEN + CATALOG_MAX_PAYLOAD];
+
+    p2p_frame_header_encode(frame, action, flags, payload_len);
+    if (payload_len > 0)
+    {
+        memcpy(frame + V2_HEADER_LEN, payload, payload_len);
+    }
+
+    send_to_peer(reg_context, link->peer_socket, frame, V2_HEADER_LEN + payload_len);
+}
+
+// Send a node the records of a local peer for the names it owns or replicates, if any:
+// peer ID, endpoint count, endpoints, file count, then each name as length and bytes
+static void send_catalog(struct RegistryContext* reg_context, int node, struct PeerData* peer)
+{
+    uint8_t payload[CATALOG_MAX_PAYLOAD];
+    struct sockaddr_storage endpoints[MAX_ENDPOINTS];
+    int count = peer_endpoints(peer, endpoints);
+    uint32_t net_id = htonl(peer->peer_id);
+    size_t offset = 0;
+
+    memcpy(payload, &net_id, sizeof(net_id));
+    offset += sizeof(net_id);
+    payload[offset++] = count;
+    for (int e = 0; e < count; e++)
+    {
+        offset += p2p_endpoint_encode(payload + offset, &endpoints[e]);
+    }
+    size_t count_offset = offset;
+    offset += sizeof(uint32_t);
+
+    uint32_t file_count = 0;
+    for (int k = 0; k < catalog_file_count(reg_context, peer); k++)
+    {
+        const char* name = catalog_file(reg_context, peer, k);
+        int owner;
+        int replica;
+        file_nodes(reg_context->cluster, name, &owner, &replica);
+        if (owner != node && replica != node)
+        {
+            continue;
+        }
+        uint16_t name_len = strlen(name);
+        uint16_t net_name_len = htons(name_len);
+        memcpy(payload + offset, &net_name_len, sizeof(net_name_len));
+        memcpy(payload + offset + sizeof(net_name_len), name, name_len);
+        offset += sizeof(net_name_len) + name_len;
+        file_count++;
+    }
+    if (file_count == 0)
+    {
+        return;
+    }
+    uint32_t net_count = htonl(file_count);
+    memcpy(payload + count_offset, &net_count, sizeof(net_count));
+
+    int slot = cluster_link(reg_context, node);
+    if (slot >= 0)
+    {
+        send_node_frame(reg_context, &reg_context->peers[slot], ACTION_CATALOG_ADD, 0, payload, offset);
+    }
+}
+
+// NODE_HELLO: the other end of a new connection is node payload[0]
+static void handle_node_hello(struct RegistryContext* reg_context, struct PeerData* link, const uint8_t* payload, uint32_t payload_len)
+{
+    struct ClusterState* cluster = reg_context->cluster;
+
+    if (payload_len != 1 || payload[0] >= cluster->node_count || payload[0] == cluster->self)
+    {
+        fprintf(stderr, "Error: Invalid NODE_HELLO\n");
+        return;
+    }
+
+    int node = payload[0];
+    if (!node_host(cluster, node, &link->peer_addr))
+    {
+        char endpoint_str[INET6_ADDRSTRLEN + 8];
+        format_endpoint(&link->peer_addr, endpoint_str, sizeof(endpoint_str));
+        fprintf(stderr, "Error: NODE_HELLO for node %d from %s, which is not its host\n", node, endpoint_str);
+        drop_peer(reg_context, link);
+        return;
+    }
+    // The node links to us once; a second link claiming it is refused unless the first
+    // is already gone (the node restarted and its close has not been read yet)
+    for (int i = 0; i < MAX_PEERS; i++)
+    {
+        struct PeerData* other = &reg_context->peers[i];
+        if (other == link || other->link_node != node || !other->link_accepted)
+        {
+            continue;
+        }
+        if (!connection_lost(other))
+        {
+            fprintf(stderr, "Error: NODE_HELLO for node %d, which is already linked\n", node);
+            drop_peer(reg_context, link);
+            return;
+        }
+        drop_peer(reg_context, other);
+    }
+
+    link->link_node = node;
+    link->link_accepted = true;
+    link->version = 2;
+    cluster->nodes[node].link_slot = link - reg_context->peers;
+    printf("Cluster link from node %d accepted\n", node);
+
+    for (int i = 0; i < MAX_PEERS; i++)
+    {
+        if (reg_context->peers[i].state == CLIENT_REGISTERED && reg_context->peers[i].link_node < 0)
+        {
+            send_catalog(reg_context, node, &reg_context->peers[i]);
+        }
+    }
+}
+
+// True if addr is one of the addresses the node's host from the -c list resolves to. Only
+// the host is compared: the other node connects from an ephemeral port
+static bool node_host(struct ClusterState* cluster, int node, const struct sockaddr_storage* addr)
+{
+    struct addrinfo hints;
+    struct addrinfo* results;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(cluster->nodes[node].host, cluster->nodes[node].port, &hints, &results) != 0)
+    {
+        return false;
+    }
+
+    bool match = false;
+    for (struct addrinfo* rp = results; rp != NULL && !match; rp = rp->ai_next)
+    {
+        struct sockaddr_storage candidate;
+        memset(&candidate, 0, sizeof(candidate));
+        memcpy(&candidate, rp->ai_addr, rp->ai_addrlen);
+        normalize_addr(&candidate);
+        match = same_host(&candidate, addr);
+    }
+    freeaddrinfo(results);
+    return match;
+}
+
+// CATALOG_ADD: store (or replace) a remote peer's records
+static void handle_catalog_add(struct RegistryContext* reg_context, struct PeerData* link, const uint8_t* payload, uint32_t payload_len)
+{
+    struct ClusterState* cluster = reg_context->cluster;
+    struct RegistryRequest entry;
+
+    // Only peers with files in this node's partitions are sent
+    if (parse_catalog_record(payload, payload_len, &entry) < 0 || entry.file_count == 0)
+    {
+        fprintf(stderr, "Error: Malformed CATALOG_ADD\n");
+        return;
+    }
+    uint32_t peer_id = entry.peer_id;
+    uint32_t file_count = entry.file_count;
+
+    struct PeerData* record = find_remote(cluster, link->link_node, peer_id);
+    if (record == NULL)
+    {
+        record = find_remote(cluster, -1, 0);
+        if (record == NULL)
+        {
+            fprintf(stderr, "Error: Remote catalog is full\n");
+            return;
+        }
+    }
+    remove_remote(reg_context, record);
+
+    if (catalog_set_files(reg_context, record, entry.files, file_count) < 0)
+    {
+        perror("Failed to allocate memory for files");
+        return;
+    }
+    record->peer_id = peer_id;
+    record->home_node = link->link_node;
+    memcpy(record->endpoints, entry.endpoints, entry.endpoint_count * sizeof(entry.endpoints[0]));
+    record->endpoint_count = entry.endpoint_count;
+    // Locality checks compare against the peer's first endpoint
+    record->peer_addr = entry.endpoints[0];
+    record->hits_updated = time(NULL);
+    record->state = CLIENT_REGISTERED;
+    search_cache_invalidate_peer(reg_context, record);
+
+    printf("Cluster catalog: %u files of peer %u from node %d\n", file_count, peer_id, link->link_node);
+    catalog_report(reg_context);
+}
+
+// CATALOG_DEL: a remote peer disconnected
+static void handle_catalog_del(struct RegistryContext* reg_context, struct PeerData* link, const uint8_t* payload, uint32_t payload_len)
+{
+    uint32_t peer_id;
+
+    if (payload_len != sizeof(peer_id))
+    {
+        fprintf(stderr, "Error: Malformed CATALOG_DEL\n");
+        return;
+    }
+    memcpy(&peer_id, payload, sizeof(peer_id));
+
+    struct PeerData* record = find_remote(reg_context->cluster, link->link_node, ntohl(peer_id));
+    if (record != NULL)
+    {
+        remove_remote(reg_context, record);
+    }
+}
+
+// NODE_SEARCH request: answer from this node's view and echo the tag back
+static void handle_node_search(struct RegistryContext* reg_context, struct PeerData* link, const uint8_t* payload, uint32_t payload_len)
+{
+    char search_file[MAX_FILENAME_LEN];
+    uint8_t response[4 + 4 + 1 + MAX_ENDPOINTS * MAX_ENDPOINT_LEN];
+
+    if (payload_len < 4 + 1 + 1 || payload_len - 5 >= MAX_FILENAME_LEN)
+    {
+        send_node_frame(reg_context, link, ACTION_NODE_SEARCH, V2_FLAG_RESPONSE | V2_FLAG_ERROR, payload, payload_len >= 4 ? 4 : 0);
+        return;
+    }
+    memcpy(search_file, payload + 5, payload_len - 5);
+    search_file[payload_len - 5] = '\0';
+
+    struct PeerData* holder = find_holder(reg_context, NULL, search_file, payload[4] != 0);
+    memcpy(response, payload, 4);
+    size_t result_len = encode_search_result(response + 4, holder);
+    send_node_frame(reg_context, link, ACTION_NODE_SEARCH, V2_FLAG_RESPONSE, response, 4 + result_len);
+
+    printf("Cluster SEARCH %s for node %d\n", search_file, link->link_node);
+}
+
+// NODE_SEARCH response: relay the answer to the peer that asked
+static void handle_node_result(struct RegistryContext* reg_context, struct PeerData* link, uint16_t flags, const uint8_t* payload, uint32_t payload_len)
+{
+    uint32_t tag;
+
+    if (payload_len < sizeof(tag))
+    {
+        fprintf(stderr, "Error: Malformed NODE_SEARCH response\n");
+        return;
+    }
+    memcpy(&tag, payload, sizeof(tag));
+    tag = ntohl(tag);
+
+    for (int f = 0; f < MAX_FORWARDS; f++)
+    {
+        struct ClusterForward* forward = &reg_context->cluster->forwards[f];
+        if (!forward->used || forward->tag != tag || forward->link_slot != link - reg_context->peers)
+        {
+            continue;
+        }
+
+        // A rejected or malformed answer counts as a failed target
+        uint8_t result[4 + 1 + MAX_ENDPOINTS * MAX_ENDPOINT_LEN];
+        size_t result_len = payload_len - sizeof(tag);
+        if ((flags & V2_FLAG_ERROR) || result_len < 4 + 1 || result_len > sizeof(result))
+        {
+            retry_forward(reg_context, forward);
+            return;
+        }
+        memcpy(result, payload + sizeof(tag), result_len);
+        finish_forward(reg_context, forward, result, result_len);
+        return;
+    }
+}
+
+// Whether the link to a node is connected, rather than missing or still connecting (a
+// socket that is still connecting has no peer address yet)
+static bool link_connected(struct RegistryContext* reg_context, int node)
+{
+    struct PeerData* link = linked_peer(reg_context, node);
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+
+    return link != NULL && getpeername(link->peer_socket, (struct sockaddr*)&addr, &addr_len) == 0;
+}
+
+// Send a forwarded SEARCH to its current target or, if that node cannot be reached, the
+// next one. Returns false once no target is left
+static bool send_forward(struct RegistryContext* reg_context, struct ClusterForward* forward)
+{
+    // Not waiting on any link while another one is opened
+    forward->link_slot = -1;
+    for (; forward->attempt < 2; forward->attempt++)
+    {
+        int slot = cluster_link(reg_context, forward->targets[forward->attempt]);
+        if (slot < 0)
+        {
+            continue;
+        }
+
+        // Tag, whether the requester needs an IPv4 holder, and the name
+        size_t name_len = strlen(forward->name);
+        uint8_t payload[4 + 1 + MAX_FILENAME_LEN];
+        uint32_t net_tag = htonl(forward->tag);
+        memcpy(payload, &net_tag, sizeof(net_tag));
+        payload[4] = forward->need_ipv4;
+        memcpy(payload + 5, forward->name, name_len);
+        send_node_frame(reg_context, &reg_context->peers[slot], ACTION_NODE_SEARCH, 0, payload, 5 + name_len);
+
+        forward->link_slot = slot;
+        forward->deadline = monotonic_seconds() + CLUSTER_FORWARD_TIMEOUT_MS / 1000.0;
+        return true;
+    }
+    return false;
+}
+
+// The node a forwarded SEARCH was sent to failed it: ask the other target, and once both
+// have failed answer from this node's own catalog, which is usually "not found"
+static void retry_forward(struct RegistryContext* reg_context, struct ClusterForward* forward)
+{
+    struct PeerData* client = &reg_context->peers[forward->client_slot];
+
+    if (client->generation != forward->client_generation || !client->awaiting_forward)
+    {
+        forward->used = false;
+        return;
+    }
+    forward->attempt++;
+    if (send_forward(reg_context, forward))
+    {
+        printf("Forwarded SEARCH %s moved to node %d\n", forward->name, forward->targets[forward->attempt]);
+        return;
+    }
+
+    uint8_t result[4 + 1 + MAX_ENDPOINTS * MAX_ENDPOINT_LEN];
+    size_t result_len = encode_search_result(result, find_holder(reg_context, client, forward->name, forward->need_ipv4));
+    finish_forward(reg_context, forward, result, result_len);
+}
+
+// Deliver a forwarded SEARCH's answer and resume the requester's queued input
+static void finish_forward(struct RegistryContext* reg_context, struct ClusterForward* forward, const uint8_t* result, size_t result_len)
+{
+    struct PeerData* client = &reg_context->peers[forward->client_slot];
+
+    forward->used = false;
+    if (client->generation != forward->client_generation || !client->awaiting_forward)
+    {
+        return;
+    }
+
+    send_search_result(reg_context, client, result, result_len, false);
+    print_search_result(forward->name, result, result_len);
+    client->awaiting_forward = false;
+    if (client->in_len > 0)
+    {
+        consume_peer_input(reg_context, client);
+    }
+}
+
+// Find the record of a remote peer; home_node -1 finds a free record
+static struct PeerData* find_remote(struct ClusterState* cluster, int home_node, uint32_t peer_id)
+{
+    for (int r = 0; r < MAX_REMOTE_PEERS; r++)
+    {
+        struct PeerData* record = &cluster->remote_peers[r];
+        if (home_node < 0 ? record->state != CLIENT_REGISTERED : (record->state == CLIENT_REGISTERED && record->home_node == home_node && record->peer_id == peer_id))
+        {
+            return record;
+        }
+    }
+    return NULL;
+}
+
+// Free a remote record so it can be reused
+static void remove_remote(struct RegistryContext* reg_context, struct PeerData* record)
+{
+    if (record->state == CLIENT_REGISTERED)
+    {
+        search_cache_invalidate_peer(reg_context, record);
+    }
+    cleanup_peer(reg_context, record);
+    record->peer_socket = -1;
+    record->home_node = -1;
+}
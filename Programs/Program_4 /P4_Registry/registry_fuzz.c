@@ -0,0 +1,136 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Fuzz harness for the request decoder (registry_parse.c). Each input is treated as the
+// byte stream of one connection: it is decoded message by message, exactly as
+// consume_peer_input does, and every decoded request is checked against the guarantees
+// the handlers rely on. A broken guarantee aborts, so fuzzers report it as a crash.
+//
+// Built with "make fuzz" it is a libFuzzer target (clang). "make fuzz-standalone" builds
+// a driver that runs every file named on the command line, or stdin, through the same
+// function; that one works under AFL (afl-cc, with @@ as the file) and replays crashing
+// inputs without a fuzzer.
+
+#include "registry.h"
+
+#include <assert.h>
+
+// Check one decoded request; only the fields of its action are meaningful
+static void check_request(const struct RegistryRequest* request, const uint8_t* msg, ssize_t used)
+{
+    if (request->version == 2)
+    {
+        assert(used == (ssize_t)(V2_HEADER_LEN + request->payload_len));
+        assert(request->payload == msg + V2_HEADER_LEN);
+        if (request->error != NULL)
+        {
+            return;
+        }
+    }
+
+    switch (request->action)
+    {
+        case ACTION_JOIN:
+            assert(request->version == 1 || request->endpoint_count <= MAX_ENDPOINTS);
+            for (uint8_t e = 0; request->version == 2 && e < request->endpoint_count; e++)
+            {
+                sa_family_t family = request->endpoints[e].ss_family;
+                assert(family == AF_INET || family == AF_INET6);
+            }
+            break;
+        case ACTION_PUBLISH:
+        {
+            uint32_t kept = request->file_count < MAX_FILES ? request->file_count : MAX_FILES;
+            assert(request->version == 1 || request->file_count <= MAX_FILES);
+            for (uint32_t j = 0; j < kept; j++)
+            {
+                assert(memchr(request->files[j], '\0', MAX_FILENAME_LEN) != NULL);
+            }
+            break;
+        }
+        case ACTION_SEARCH:
+            assert(memchr(request->search_file, '\0', MAX_FILENAME_LEN) != NULL);
+            break;
+        case ACTION_PUBLISH_SUMMARY:
+            if (request->version == 2)
+            {
+                const uint8_t* end = request->payload + request->payload_len;
+                assert(request->summary.blocks + (size_t)request->summary.block_count * SUMMARY_BLOCK_LEN == end);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    size_t offset = 0;
+    while (offset < size)
+    {
+        struct RegistryRequest request;
+        ssize_t used = parse_message(data + offset, size - offset, &request);
+        if (used <= 0)
+        {
+            assert(used == 0 || request.error != NULL);
+            break;
+        }
+        assert((size_t)used <= size - offset);
+        check_request(&request, data + offset, used);
+        offset += used;
+    }
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+// Run one file (or stdin) through the harness
+static int run_file(FILE* in)
+{
+    size_t cap = BUFFER_SIZE;
+    size_t len = 0;
+    uint8_t* data = malloc(cap);
+    while (data != NULL)
+    {
+        len += fread(data + len, 1, cap - len, in);
+        if (len < cap)
+        {
+            break;
+        }
+        uint8_t* grown = realloc(data, cap * 2);
+        if (grown == NULL)
+        {
+            free(data);
+            data = NULL;
+            break;
+        }
+        data = grown;
+        cap *= 2;
+    }
+    if (data == NULL)
+    {
+        perror("Failed to read input");
+        return -1;
+    }
+    LLVMFuzzerTestOneInput(data, len);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        return run_file(stdin) < 0;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        FILE* in = fopen(argv[i], "rb");
+        if (in == NULL || run_file(in) < 0)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+        fclose(in);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,115 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Peer ID index: maps the ID each connected peer joined with to its record, so JOIN can
+// tell whether an ID is taken and LOOKUP_PEER can answer without scanning every slot.
+// Only peers connected to this registry are indexed; catalog records replicated from
+// other cluster nodes are not. A follower (registry_replica.c) indexes the leader's
+// peers it replicates instead of its own clients.
+//
+// The table is open-addressed with linear probing and sized at init to at least twice
+// MAX_HOLDERS, every record the registry can hold, so it never fills and never grows.
+// ID 0 is reserved (it means "not found" in SEARCH replies) and marks an empty slot.
+
+#include "registry.h"
+
+struct PeerIndexEntry
+{
+    uint32_t peer_id;
+    struct PeerData* peer;
+};
+
+struct PeerIndex
+{
+    struct PeerIndexEntry* entries;
+    size_t mask;
+};
+
+static size_t id_home(const struct PeerIndex* index, uint32_t peer_id);
+static struct PeerIndexEntry* find_entry(struct PeerIndex* index, uint32_t peer_id);
+
+// Allocate the index. Returns -1 if it cannot be allocated
+int peer_index_init(struct RegistryContext* reg_context)
+{
+    struct PeerIndex* index = calloc(1, sizeof(*index));
+    size_t cap = 16;
+
+    while (cap < 2 * MAX_HOLDERS)
+    {
+        cap *= 2;
+    }
+    if (index == NULL || (index->entries = calloc(cap, sizeof(*index->entries))) == NULL)
+    {
+        free(index);
+        return -1;
+    }
+    index->mask = cap - 1;
+
+    reg_context->peer_index = index;
+    return 0;
+}
+
+// The peer that joined with peer_id, or NULL if none did
+struct PeerData* peer_index_find(struct RegistryContext* reg_context, uint32_t peer_id)
+{
+    struct PeerIndexEntry* entry = peer_id != 0 ? find_entry(reg_context->peer_index, peer_id) : NULL;
+    return entry != NULL ? entry->peer : NULL;
+}
+
+// Index a peer under its peer_id, which no other peer may hold
+void peer_index_add(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    struct PeerIndex* index = reg_context->peer_index;
+    size_t i = id_home(index, peer->peer_id);
+
+    while (index->entries[i].peer_id != 0)
+    {
+        i = (i + 1) & index->mask;
+    }
+    index->entries[i].peer_id = peer->peer_id;
+    index->entries[i].peer = peer;
+}
+
+// Remove a peer from the index. Records that were never indexed (peers that did not
+// join, cluster records) are left alone
+void peer_index_remove(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    struct PeerIndex* index = reg_context->peer_index;
+    struct PeerIndexEntry* entry = peer->peer_id != 0 ? find_entry(index, peer->peer_id) : NULL;
+
+    if (entry == NULL || entry->peer != peer)
+    {
+        return;
+    }
+
+    // Shift later entries of the probe run back so lookups never hit a hole
+    size_t hole = entry - index->entries;
+    for (size_t i = (hole + 1) & index->mask; index->entries[i].peer_id != 0; i = (i + 1) & index->mask)
+    {
+        size_t home = id_home(index, index->entries[i].peer_id);
+        // Move the entry if its home slot is not between the hole and its position
+        if (((i - home) & index->mask) >= ((i - hole) & index->mask))
+        {
+            index->entries[hole] = index->entries[i];
+            hole = i;
+        }
+    }
+    index->entries[hole].peer_id = 0;
+}
+
+// Fibonacci hashing spreads sequential IDs, the common case, across the table
+static size_t id_home(const struct PeerIndex* index, uint32_t peer_id)
+{
+    return (size_t)((peer_id * 0x9E3779B97F4A7C15ull) >> 32) & index->mask;
+}
+
+static struct PeerIndexEntry* find_entry(struct PeerIndex* index, uint32_t peer_id)
+{
+    for (size_t i = id_home(index, peer_id); index->entries[i].peer_id != 0; i = (i + 1) & index->mask)
+    {
+        if (index->entries[i].peer_id == peer_id)
+        {
+            return &index->entries[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,277 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Per-connection output queues. A response the socket cannot take right away is never
+// dropped or waited for: the select() backend sends without blocking and keeps the rest
+// in a chain of fixed-size chunks, which is written out with one vectored send whenever
+// select() reports the socket writable again. The io_uring backend keeps its own send
+// buffers but reports the same byte counts here.
+//
+// Both backends share the backpressure policy. Once a connection has more than
+// OUTPUT_HIGH_WATER bytes queued, the registry stops reading and parsing its requests;
+// they resume when the queue drains below OUTPUT_LOW_WATER. A client that does not read
+// its responses therefore only holds about one high-water mark of memory and never
+// stalls the other connections, and TCP flow control pushes back on it.
+
+#include "registry.h"
+
+#include <errno.h>
+#include <sys/uio.h>
+
+// Bytes held by one chunk of a queue
+#define OUTPUT_CHUNK_SIZE 4096
+// Chunks written by one vectored send
+#define OUTPUT_MAX_IOV 64
+// Queue sizes at which reading a connection pauses and resumes
+#define OUTPUT_HIGH_WATER (64 * 1024)
+#define OUTPUT_LOW_WATER (16 * 1024)
+
+// One link of a connection's output queue; data[start, end) is still unsent
+struct OutputChunk
+{
+    struct OutputChunk* next;
+    size_t start;
+    size_t end;
+    uint8_t data[OUTPUT_CHUNK_SIZE];
+};
+
+static bool output_append(struct PeerData* peer, const uint8_t* data, size_t len);
+static void output_pause(struct RegistryContext* reg_context, struct PeerData* peer);
+static void output_fail(struct RegistryContext* reg_context, struct PeerData* peer);
+
+// Send a response on the select() backend, queueing whatever the socket cannot take now
+void output_send(struct RegistryContext* reg_context, struct PeerData* peer, const void* data, size_t len)
+{
+    const uint8_t* bytes = data;
+
+    if (peer->output_failed)
+    {
+        return;
+    }
+    // Anything already queued must go first, so only an empty queue may send directly
+    if (peer->out_head == NULL)
+    {
+        ssize_t sent = send(peer->peer_socket, bytes, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("Error sending response");
+            output_fail(reg_context, peer);
+            return;
+        }
+        if (sent > 0)
+        {
+            bytes += sent;
+            len -= sent;
+        }
+        if (len == 0)
+        {
+            return;
+        }
+    }
+
+    if (!output_append(peer, bytes, len))
+    {
+        // Part of the response may be queued already, and the rest of it must not
+        // follow the next one
+        perror("Failed to queue response");
+        output_fail(reg_context, peer);
+        return;
+    }
+    FD_SET(peer->peer_socket, &reg_context->write_sockets);
+    output_queued(reg_context, peer, len);
+}
+
+// Write as much of a connection's queue as the socket takes; called when select()
+// reports it writable
+void output_flush(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    uint32_t generation = peer->generation;
+
+    while (peer->out_head != NULL)
+    {
+        struct iovec iov[OUTPUT_MAX_IOV];
+        int iov_count = 0;
+        for (struct OutputChunk* chunk = peer->out_head; chunk != NULL && iov_count < OUTPUT_MAX_IOV; chunk = chunk->next)
+        {
+            iov[iov_count].iov_base = chunk->data + chunk->start;
+            iov[iov_count].iov_len = chunk->end - chunk->start;
+            iov_count++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+        ssize_t sent = sendmsg(peer->peer_socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            perror("Error sending response");
+            // The caller checks the generation before using the peer again
+            drop_peer(reg_context, peer);
+            return;
+        }
+
+        // Release every chunk that went out completely
+        size_t remaining = sent;
+        while (remaining > 0)
+        {
+            struct OutputChunk* chunk = peer->out_head;
+            size_t chunk_len = chunk->end - chunk->start;
+            if (remaining < chunk_len)
+            {
+                chunk->start += remaining;
+                break;
+            }
+            remaining -= chunk_len;
+            peer->out_head = chunk->next;
+            free(chunk);
+        }
+        if (peer->out_head == NULL)
+        {
+            peer->out_tail = NULL;
+        }
+        output_drained(reg_context, peer, sent);
+        // The peer may have been dropped while its paused input was handled
+        if (peer->generation != generation)
+        {
+            return;
+        }
+    }
+
+    if (peer->out_head == NULL)
+    {
+        FD_CLR(peer->peer_socket, &reg_context->write_sockets);
+    }
+}
+
+// Free a connection's queue, when it is dropped or its socket has failed
+void output_discard(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    while (peer->out_head != NULL)
+    {
+        struct OutputChunk* chunk = peer->out_head;
+        peer->out_head = chunk->next;
+        free(chunk);
+    }
+    peer->out_tail = NULL;
+    peer->out_bytes = 0;
+    peer->input_paused = false;
+    if (reg_context->backend == BACKEND_SELECT && peer->peer_socket != 0)
+    {
+        FD_CLR(peer->peer_socket, &reg_context->write_sockets);
+    }
+}
+
+// Give up on a connection whose response could not be sent or queued in full. The
+// request that produced it is still being handled and may keep using the peer, so it is
+// dropped from the loop instead: shutting the socket down makes select() report it
+// readable, even if its input was paused
+static void output_fail(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    output_discard(reg_context, peer);
+    peer->output_failed = true;
+    shutdown(peer->peer_socket, SHUT_RDWR);
+    FD_SET(peer->peer_socket, &reg_context->active_sockets);
+}
+
+// Account for len bytes a backend could not send yet, pausing the connection's input
+// once too much is waiting
+void output_queued(struct RegistryContext* reg_context, struct PeerData* peer, size_t len)
+{
+    peer->out_bytes += len;
+    if (!peer->input_paused && peer->out_bytes > OUTPUT_HIGH_WATER)
+    {
+        output_pause(reg_context, peer);
+    }
+}
+
+// Account for len queued bytes that were sent. Once the queue is short again, reading
+// resumes and requests that arrived meanwhile are handled
+void output_drained(struct RegistryContext* reg_context, struct PeerData* peer, size_t len)
+{
+    peer->out_bytes -= len < peer->out_bytes ? len : peer->out_bytes;
+    if (!peer->input_paused || peer->out_bytes > OUTPUT_LOW_WATER)
+    {
+        return;
+    }
+
+    // Requests already buffered come first; the socket is only read again once they
+    // have all been answered without filling the queue again
+    uint32_t generation = peer->generation;
+    peer->input_paused = false;
+    consume_peer_input(reg_context, peer);
+    // TLS connections may also hold ciphertext that was not decrypted yet
+    if (peer->generation == generation && !peer->input_paused && peer->tls != NULL)
+    {
+        tls_input(reg_context, peer, NULL, 0);
+    }
+    if (peer->generation != generation || peer->input_paused)
+    {
+        return;
+    }
+    if (reg_context->backend == BACKEND_URING)
+    {
+        uring_resume_recv(reg_context, peer - reg_context->peers);
+    }
+    else
+    {
+        FD_SET(peer->peer_socket, &reg_context->active_sockets);
+    }
+}
+
+// Copy bytes to the end of a connection's queue, filling its last chunk first
+static bool output_append(struct PeerData* peer, const uint8_t* data, size_t len)
+{
+    while (len > 0)
+    {
+        struct OutputChunk* tail = peer->out_tail;
+        if (tail == NULL || tail->end == OUTPUT_CHUNK_SIZE)
+        {
+            tail = malloc(sizeof(*tail));
+            if (tail == NULL)
+            {
+                return false;
+            }
+            tail->next = NULL;
+            tail->start = 0;
+            tail->end = 0;
+            if (peer->out_tail != NULL)
+            {
+                peer->out_tail->next = tail;
+            }
+            else
+            {
+                peer->out_head = tail;
+            }
+            peer->out_tail = tail;
+        }
+
+        size_t chunk = OUTPUT_CHUNK_SIZE - tail->end;
+        if (chunk > len)
+        {
+            chunk = len;
+        }
+        memcpy(tail->data + tail->end, data, chunk);
+        tail->end += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+// Stop reading a connection until its queue drains
+static void output_pause(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    peer->input_paused = true;
+    if (reg_context->backend == BACKEND_URING)
+    {
+        uring_pause_recv(reg_context, peer - reg_context->peers);
+    }
+    else
+    {
+        FD_CLR(peer->peer_socket, &reg_context->active_sockets);
+    }
+}
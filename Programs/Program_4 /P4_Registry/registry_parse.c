@@ -0,0 +1,366 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Decoding of peer input. parse_message() turns the bytes at the front of a
+// connection's buffer into a RegistryRequest and nothing else: it touches no sockets,
+// peers or catalog, never reads past the bytes it is given and always leaves every
+// name NUL-terminated within MAX_FILENAME_LEN. The registry hands the decoded request
+// to dispatch_request(), and the fuzz harness (registry_fuzz.c) drives this file on its
+// own.
+
+#include "registry.h"
+
+static ssize_t parse_v1_message(const uint8_t* msg, size_t len, struct RegistryRequest* request);
+static ssize_t parse_v2_message(const uint8_t* msg, size_t len, struct RegistryRequest* request);
+static ssize_t parse_v1_name(const uint8_t* msg, size_t len, char* name);
+static void parse_v2_hello(const uint8_t* payload, uint32_t payload_len, struct RegistryRequest* request);
+static void parse_v2_publish(const uint8_t* payload, uint32_t payload_len, struct RegistryRequest* request);
+static void parse_v2_summary(const uint8_t* payload, uint32_t payload_len, struct RegistryRequest* request);
+
+// Decode one message from the front of msg. Returns the number of bytes it takes up,
+// 0 if it is not complete yet, or -1 if the stream can no longer be trusted (the
+// reason is left in request->error)
+ssize_t parse_message(const uint8_t* msg, size_t len, struct RegistryRequest* request)
+{
+    request->error = NULL;
+    request->payload = NULL;
+    request->payload_len = 0;
+    if (len == 0)
+    {
+        return 0;
+    }
+    if (msg[0] == PROTO_V2)
+    {
+        request->version = 2;
+        return parse_v2_message(msg, len, request);
+    }
+    request->version = 1;
+    request->flags = 0;
+    return parse_v1_message(msg, len, request);
+}
+
+// v1: an action byte followed by fixed fields and NUL-terminated names
+static ssize_t parse_v1_message(const uint8_t* msg, size_t len, struct RegistryRequest* request)
+{
+    request->action = msg[0];
+
+    switch (request->action)
+    {
+        // JOIN: peer ID
+        case ACTION_JOIN:
+        {
+            if (len < 1 + sizeof(request->peer_id))
+            {
+                return 0;
+            }
+            memcpy(&request->peer_id, msg + 1, sizeof(request->peer_id));
+            request->peer_id = ntohl(request->peer_id);
+            return 1 + sizeof(request->peer_id);
+        }
+        // PUBLISH: file count, then each name. Names past MAX_FILES are only skipped, and
+        // the count is kept so the handler can reject the list as a whole
+        case ACTION_PUBLISH:
+        {
+            if (len < 1 + sizeof(request->file_count))
+            {
+                return 0;
+            }
+            memcpy(&request->file_count, msg + 1, sizeof(request->file_count));
+            request->file_count = ntohl(request->file_count);
+
+            size_t offset = 1 + sizeof(request->file_count);
+            char skipped[MAX_FILENAME_LEN];
+            for (uint32_t j = 0; j < request->file_count; j++)
+            {
+                char* name = j < MAX_FILES ? request->files[j] : skipped;
+                ssize_t used = parse_v1_name(msg + offset, len - offset, name);
+                if (used <= 0)
+                {
+                    if (used < 0)
+                    {
+                        request->error = "Filename exceeds maximum allowed length";
+                    }
+                    return used;
+                }
+                offset += used;
+            }
+            return offset;
+        }
+        // SEARCH: the name
+        case ACTION_SEARCH:
+        {
+            ssize_t used = parse_v1_name(msg + 1, len - 1, request->search_file);
+            if (used < 0)
+            {
+                request->error = "Search name exceeds maximum allowed length";
+                return -1;
+            }
+            return used == 0 ? 0 : 1 + used;
+        }
+        // Anything else is a single unknown byte
+        default:
+            return 1;
+    }
+}
+
+// Copy one NUL-terminated v1 name into name. Returns the bytes it takes up including
+// the terminator, 0 if it is incomplete, or -1 if it is too long to ever be valid
+static ssize_t parse_v1_name(const uint8_t* msg, size_t len, char* name)
+{
+    const uint8_t* null_pos = memchr(msg, '\0', len < MAX_FILENAME_LEN ? len : MAX_FILENAME_LEN);
+    if (null_pos == NULL)
+    {
+        return len >= MAX_FILENAME_LEN ? -1 : 0;
+    }
+    size_t name_len = null_pos - msg;
+    memcpy(name, msg, name_len + 1);
+    return name_len + 1;
+}
+
+// v2: 8-byte header and a payload. A malformed payload still takes up its frame and
+// only sets request->error, so the request can be answered with an error
+static ssize_t parse_v2_message(const uint8_t* msg, size_t len, struct RegistryRequest* request)
+{
+    struct P2pFrameHeader header;
+
+    if (len < V2_HEADER_LEN)
+    {
+        return 0;
+    }
+    if (p2p_frame_header_decode(msg, &header) < 0)
+    {
+        request->error = "Not a v2 frame";
+        return -1;
+    }
+    request->action = header.action;
+    request->flags = header.flags;
+    uint32_t payload_len = header.payload_len;
+
+    if (payload_len > V2_MAX_PAYLOAD)
+    {
+        request->error = "v2 payload exceeds limit";
+        return -1;
+    }
+    if (len < V2_HEADER_LEN + payload_len)
+    {
+        return 0;
+    }
+
+    const uint8_t* payload = msg + V2_HEADER_LEN;
+    request->payload = payload;
+    request->payload_len = payload_len;
+
+    switch (request->action)
+    {
+        case ACTION_JOIN:
+            parse_v2_hello(payload, payload_len, request);
+            break;
+        case ACTION_PUBLISH:
+            parse_v2_publish(payload, payload_len, request);
+            break;
+        case ACTION_PUBLISH_SUMMARY:
+            parse_v2_summary(payload, payload_len, request);
+            break;
+        // SEARCH: the payload is the filename itself
+        case ACTION_SEARCH:
+            if (payload_len == 0 || payload_len >= MAX_FILENAME_LEN)
+            {
+                request->error = "Malformed v2 SEARCH";
+                break;
+            }
+            memcpy(request->search_file, payload, payload_len);
+            request->search_file[payload_len] = '\0';
+            break;
+        // HEARTBEAT: the peer's current number of active uploads
+        case ACTION_HEARTBEAT:
+            if (payload_len != sizeof(request->active_uploads))
+            {
+                request->error = "Malformed v2 HEARTBEAT";
+                break;
+            }
+            memcpy(&request->active_uploads, payload, sizeof(request->active_uploads));
+            request->active_uploads = ntohl(request->active_uploads);
+            break;
+        // LOOKUP_PEER: the ID to look up
+        case ACTION_LOOKUP_PEER:
+            if (payload_len != sizeof(request->peer_id))
+            {
+                request->error = "Malformed v2 LOOKUP_PEER";
+                break;
+            }
+            memcpy(&request->peer_id, payload, sizeof(request->peer_id));
+            request->peer_id = ntohl(request->peer_id);
+            break;
+        // Unknown actions and cluster frames keep only their raw payload
+        default:
+            break;
+    }
+    return V2_HEADER_LEN + payload_len;
+}
+
+// HELLO: peer ID, the highest protocol version the peer speaks and, optionally, a
+// count of listen endpoints followed by the endpoints themselves
+static void parse_v2_hello(const uint8_t* payload, uint32_t payload_len, struct RegistryRequest* request)
+{
+    request->endpoint_count = 0;
+    if (payload_len < sizeof(request->peer_id) + 1 || payload[sizeof(request->peer_id)] < 2)
+    {
+        request->error = "Malformed v2 HELLO";
+        return;
+    }
+    memcpy(&request->peer_id, payload, sizeof(request->peer_id));
+    request->peer_id = ntohl(request->peer_id);
+
+    size_t offset = sizeof(request->peer_id) + 1;
+    if (offset == payload_len)
+    {
+        return;
+    }
+    uint8_t endpoint_count = payload[offset++];
+    if (endpoint_count > MAX_ENDPOINTS)
+    {
+        request->error = "Malformed v2 HELLO";
+        return;
+    }
+    for (uint8_t e = 0; e < endpoint_count; e++)
+    {
+        ssize_t used = p2p_endpoint_decode(payload + offset, payload_len - offset, &request->endpoints[e]);
+        if (used < 0)
+        {
+            request->error = "Malformed v2 HELLO";
+            return;
+        }
+        offset += used;
+    }
+    if (offset != payload_len)
+    {
+        request->error = "Malformed v2 HELLO";
+        return;
+    }
+    request->endpoint_count = endpoint_count;
+}
+
+// PUBLISH: file count, then each name as a 16-bit length and its bytes
+static void parse_v2_publish(const uint8_t* payload, uint32_t payload_len, struct RegistryRequest* request)
+{
+    if (payload_len < sizeof(request->file_count))
+    {
+        request->error = "Malformed v2 PUBLISH";
+        return;
+    }
+    memcpy(&request->file_count, payload, sizeof(request->file_count));
+    request->file_count = ntohl(request->file_count);
+    if (request->file_count > MAX_FILES)
+    {
+        request->error = "Too many files in v2 PUBLISH";
+        return;
+    }
+
+    size_t offset = sizeof(request->file_count);
+    for (uint32_t j = 0; j < request->file_count; j++)
+    {
+        uint16_t name_len;
+        if (payload_len - offset < sizeof(name_len))
+        {
+            request->error = "Malformed v2 PUBLISH";
+            return;
+        }
+        memcpy(&name_len, payload + offset, sizeof(name_len));
+        name_len = ntohs(name_len);
+        offset += sizeof(name_len);
+        if (name_len >= MAX_FILENAME_LEN || payload_len - offset < name_len)
+        {
+            request->error = "Malformed v2 PUBLISH";
+            return;
+        }
+        memcpy(request->files[j], payload + offset, name_len);
+        request->files[j][name_len] = '\0';
+        offset += name_len;
+    }
+    if (offset != payload_len)
+    {
+        request->error = "Malformed v2 PUBLISH";
+    }
+}
+
+// PUBLISH_SUMMARY: name count, hash count, total blocks, first block, then whole blocks
+static void parse_v2_summary(const uint8_t* payload, uint32_t payload_len, struct RegistryRequest* request)
+{
+    if (payload_len < SUMMARY_HEADER_LEN || (payload_len - SUMMARY_HEADER_LEN) % SUMMARY_BLOCK_LEN != 0)
+    {
+        request->error = "Malformed v2 PUBLISH_SUMMARY";
+        return;
+    }
+    memcpy(&request->summary.name_count, payload, sizeof(request->summary.name_count));
+    request->summary.hashes = payload[4];
+    memcpy(&request->summary.total_blocks, payload + 5, sizeof(request->summary.total_blocks));
+    memcpy(&request->summary.first_block, payload + 9, sizeof(request->summary.first_block));
+    request->summary.name_count = ntohl(request->summary.name_count);
+    request->summary.total_blocks = ntohl(request->summary.total_blocks);
+    request->summary.first_block = ntohl(request->summary.first_block);
+    request->summary.blocks = payload + SUMMARY_HEADER_LEN;
+    request->summary.block_count = (payload_len - SUMMARY_HEADER_LEN) / SUMMARY_BLOCK_LEN;
+}
+
+// Decode a peer record sent between registries (CATALOG_ADD, REPL_PEER): peer ID,
+// endpoint count, endpoints, file count, then each name as a 16-bit length and its
+// bytes. Fills peer_id, endpoints and files. Returns 0, or -1 if it is malformed
+int parse_catalog_record(const uint8_t* payload, uint32_t payload_len, struct RegistryRequest* request)
+{
+    size_t offset = 0;
+
+    if (payload_len < sizeof(request->peer_id) + 1)
+    {
+        return -1;
+    }
+    memcpy(&request->peer_id, payload, sizeof(request->peer_id));
+    request->peer_id = ntohl(request->peer_id);
+    offset += sizeof(request->peer_id);
+
+    request->endpoint_count = payload[offset++];
+    if (request->endpoint_count == 0 || request->endpoint_count > MAX_ENDPOINTS)
+    {
+        return -1;
+    }
+    for (uint8_t e = 0; e < request->endpoint_count; e++)
+    {
+        ssize_t used = p2p_endpoint_decode(payload + offset, payload_len - offset, &request->endpoints[e]);
+        if (used < 0)
+        {
+            return -1;
+        }
+        offset += used;
+    }
+
+    if (payload_len - offset < sizeof(request->file_count))
+    {
+        return -1;
+    }
+    memcpy(&request->file_count, payload + offset, sizeof(request->file_count));
+    request->file_count = ntohl(request->file_count);
+    offset += sizeof(request->file_count);
+    if (request->file_count > MAX_FILES)
+    {
+        return -1;
+    }
+
+    for (uint32_t j = 0; j < request->file_count; j++)
+    {
+        uint16_t name_len;
+        if (payload_len - offset < sizeof(name_len))
+        {
+            return -1;
+        }
+        memcpy(&name_len, payload + offset, sizeof(name_len));
+        name_len = ntohs(name_len);
+        offset += sizeof(name_len);
+        if (name_len == 0 || name_len >= MAX_FILENAME_LEN || payload_len - offset < name_len)
+        {
+            return -1;
+        }
+        memcpy(request->files[j], payload + offset, name_len);
+        request->files[j][name_len] = '\0';
+        offset += name_len;
+    }
+    return 0;
+}
+
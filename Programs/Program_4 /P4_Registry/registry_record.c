@@ -0,0 +1,124 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Session recorder (-r file). Every connection the registry handles is written to the
+// file as it happens: when it opens, each block of bytes received on it, and when it
+// closes. registry_replay plays such a file back against a registry at full speed,
+// which reproduces a crash from the exact input that caused it and doubles as a
+// regression and throughput test on real traffic.
+//
+// The file starts with the 8-byte RECORD_MAGIC. Each event is a 1-byte type, the 4-byte
+// session number, microseconds since recording started (8 bytes) and a 4-byte length,
+// all in network byte order, followed by that many bytes of input for RECORD_INPUT
+// events. Events are written straight to the file with one writev, so a registry that
+// crashes leaves everything up to the crashing input on disk.
+
+#include "registry.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+// Recording state
+struct SessionRecorder
+{
+    int fd;
+    // Time recording started
+    struct timespec started;
+    // Session number of the connection in each peer slot, 0 if none
+    uint32_t sessions[MAX_PEERS];
+    // Last session number handed out
+    uint32_t last_session;
+};
+
+static void record_event(struct RegistryContext* reg_context, uint8_t type, int slot, const void* data, size_t len);
+
+// Start recording every connection to path, replacing the file
+int record_open(struct RegistryContext* reg_context, const char* path)
+{
+    struct SessionRecorder* recorder = calloc(1, sizeof(*recorder));
+    if (recorder == NULL)
+    {
+        return -1;
+    }
+    recorder->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (recorder->fd < 0 || write(recorder->fd, RECORD_MAGIC, RECORD_MAGIC_LEN) != RECORD_MAGIC_LEN)
+    {
+        if (recorder->fd >= 0)
+        {
+            close(recorder->fd);
+        }
+        free(recorder);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &recorder->started);
+    reg_context->recorder = recorder;
+    return 0;
+}
+
+// A connection was given a peer slot
+void record_connect(struct RegistryContext* reg_context, int slot)
+{
+    struct SessionRecorder* recorder = reg_context->recorder;
+    if (recorder == NULL)
+    {
+        return;
+    }
+    recorder->sessions[slot] = ++recorder->last_session;
+    record_event(reg_context, RECORD_OPEN, slot, NULL, 0);
+}
+
+// Bytes arrived on a connection, before any of them are parsed
+void record_input(struct RegistryContext* reg_context, int slot, const void* data, size_t len)
+{
+    if (reg_context->recorder != NULL)
+    {
+        record_event(reg_context, RECORD_INPUT, slot, data, len);
+    }
+}
+
+// A connection is being dropped
+void record_close(struct RegistryContext* reg_context, int slot)
+{
+    struct SessionRecorder* recorder = reg_context->recorder;
+    if (recorder == NULL || recorder->sessions[slot] == 0)
+    {
+        return;
+    }
+    record_event(reg_context, RECORD_CLOSE, slot, NULL, 0);
+    recorder->sessions[slot] = 0;
+}
+
+static void record_event(struct RegistryContext* reg_context, uint8_t type, int slot, const void* data, size_t len)
+{
+    struct SessionRecorder* recorder = reg_context->recorder;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t micros = (uint64_t)(now.tv_sec - recorder->started.tv_sec) * 1000000 + (now.tv_nsec - recorder->started.tv_nsec) / 1000;
+
+    uint8_t header[RECORD_HEADER_LEN];
+    uint32_t net_session = htonl(recorder->sessions[slot]);
+    uint32_t net_high = htonl((uint32_t)(micros >> 32));
+    uint32_t net_low = htonl((uint32_t)micros);
+    uint32_t net_len = htonl(len);
+    header[0] = type;
+    memcpy(header + 1, &net_session, sizeof(net_session));
+    memcpy(header + 5, &net_high, sizeof(net_high));
+    memcpy(header + 9, &net_low, sizeof(net_low));
+    memcpy(header + 13, &net_len, sizeof(net_len));
+
+    struct iovec iov[2] = {{header, sizeof(header)}, {(void*)data, len}};
+    ssize_t written;
+    do
+    {
+        written = writev(recorder->fd, iov, len > 0 ? 2 : 1);
+    }
+    while (written < 0 && errno == EINTR);
+    if (written != (ssize_t)(sizeof(header) + len))
+    {
+        // A partial event would corrupt the rest of the file, so recording stops here
+        perror("Session recording stopped");
+        close(recorder->fd);
+        free(recorder);
+        reg_context->recorder = NULL;
+    }
+}
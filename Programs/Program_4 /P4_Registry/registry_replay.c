@@ -0,0 +1,378 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Plays a session recording (registry -r) back against a running registry as fast as it
+// takes it. Connections are opened, fed and closed in the recorded order, ignoring the
+// recorded timing. Responses are read so the registry never stops on backpressure, and
+// counted but not compared, since holder choice is randomized. After the last pass the
+// registry must still accept a connection, otherwise the replay fails, so a recording
+// of the input that crashed a registry is a regression test for the fix. -n repeats
+// the recording for a throughput measurement.
+
+#include "registry.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+// Milliseconds to wait for a stalled registry before giving up on a connection
+#define REPLAY_STALL_MS 5000
+// Milliseconds to wait for the last responses before closing what is left open
+#define REPLAY_LINGER_MS 200
+// Highest session number accepted; anything above means the file is damaged
+#define REPLAY_MAX_SESSION (1U << 24)
+
+// One event of the recording, pointing into the loaded file
+struct ReplayEvent
+{
+    uint8_t type;
+    uint32_t session;
+    const uint8_t* data;
+    uint32_t len;
+};
+
+// Connections and counters of a replay
+struct Replay
+{
+    const char* host;
+    const char* port;
+    // Socket of every recorded session, -1 while it is not open
+    int* fds;
+    uint32_t max_session;
+    // Scratch space for polling every open session
+    struct pollfd* polls;
+    uint32_t* poll_sessions;
+    uint32_t session_count;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    // Connections the registry refused or closed before the recording did
+    uint32_t refused;
+    uint32_t closed_early;
+};
+
+static int load_recording(const char* path, uint8_t** file, struct ReplayEvent** events, size_t* event_count, uint32_t* max_session);
+static int connect_registry(const char* host, const char* port);
+static void replay_event(struct Replay* replay, const struct ReplayEvent* event);
+static void send_all(struct Replay* replay, uint32_t session, const uint8_t* data, size_t len);
+static void drain(struct Replay* replay, uint32_t session);
+static bool pump(struct Replay* replay, int wait_fd, int timeout_ms);
+static void close_session(struct Replay* replay, uint32_t session);
+static void end_session(struct Replay* replay, uint32_t session);
+
+int main(int argc, char* argv[])
+{
+    int passes = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+            // Play the recording this many times
+            case 'n':
+                passes = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n passes] <recording> <host> <port>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (argc - optind != 3 || passes < 1)
+    {
+        fprintf(stderr, "Usage: %s [-n passes] <recording> <host> <port>\n", argv[0]);
+        exit(1);
+    }
+
+    // Closed connections surface as send errors
+    signal(SIGPIPE, SIG_IGN);
+
+    uint8_t* file;
+    struct ReplayEvent* events;
+    size_t event_count;
+    uint32_t max_session;
+    if (load_recording(argv[optind], &file, &events, &event_count, &max_session) < 0)
+    {
+        exit(1);
+    }
+
+    struct Replay replay;
+    memset(&replay, 0, sizeof(replay));
+    replay.host = argv[optind + 1];
+    replay.port = argv[optind + 2];
+    replay.max_session = max_session;
+    replay.fds = malloc((max_session + 1) * sizeof(*replay.fds));
+    replay.polls = malloc((max_session + 1) * sizeof(*replay.polls));
+    replay.poll_sessions = malloc((max_session + 1) * sizeof(*replay.poll_sessions));
+    if (replay.fds == NULL || replay.polls == NULL || replay.poll_sessions == NULL)
+    {
+        perror("Failed to allocate sessions");
+        exit(1);
+    }
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (uint32_t s = 0; s <= max_session; s++)
+        {
+            replay.fds[s] = -1;
+        }
+        for (size_t e = 0; e < event_count; e++)
+        {
+            replay_event(&replay, &events[e]);
+        }
+        // Sessions the recording left open get their last responses, then are closed
+        while (pump(&replay, -1, REPLAY_LINGER_MS))
+        {
+        }
+        for (uint32_t s = 0; s <= max_session; s++)
+        {
+            end_session(&replay, s);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("Replayed %zu events of %u sessions %d time(s) in %.3f s\n", event_count, replay.session_count / passes, passes, seconds);
+    printf("Sent %llu bytes (%.1f MB/s), received %llu bytes\n", (unsigned long long)replay.bytes_sent, replay.bytes_sent / seconds / 1e6, (unsigned long long)replay.bytes_received);
+    printf("Connections refused: %u, closed by the registry before the recording: %u\n", replay.refused, replay.closed_early);
+
+    int check = connect_registry(replay.host, replay.port);
+    if (check < 0)
+    {
+        printf("Registry is no longer accepting connections\n");
+        return 1;
+    }
+    close(check);
+    free(replay.fds);
+    free(replay.polls);
+    free(replay.poll_sessions);
+    free(events);
+    free(file);
+    return 0;
+}
+
+// Read a recording and index its events. The session numbers it uses run up to
+// max_session
+static int load_recording(const char* path, uint8_t** file, struct ReplayEvent** events, size_t* event_count, uint32_t* max_session)
+{
+    FILE* in = fopen(path, "rb");
+    if (in == NULL)
+    {
+        perror("Failed to open the recording");
+        return -1;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    *file = malloc(size > 0 ? size : 1);
+    if (*file == NULL || size < RECORD_MAGIC_LEN || fread(*file, 1, size, in) != (size_t)size || memcmp(*file, RECORD_MAGIC, RECORD_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "%s is not a session recording\n", path);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+
+    // Every event takes at least a header, which bounds the index
+    size_t capacity = (size - RECORD_MAGIC_LEN) / RECORD_HEADER_LEN;
+    *events = malloc((capacity > 0 ? capacity : 1) * sizeof(**events));
+    if (*events == NULL)
+    {
+        perror("Failed to index the recording");
+        return -1;
+    }
+    *event_count = 0;
+    *max_session = 0;
+
+    size_t offset = RECORD_MAGIC_LEN;
+    while ((size_t)size - offset >= RECORD_HEADER_LEN)
+    {
+        struct ReplayEvent* event = &(*events)[*event_count];
+        const uint8_t* header = *file + offset;
+        event->type = header[0];
+        memcpy(&event->session, header + 1, sizeof(event->session));
+        memcpy(&event->len, header + 13, sizeof(event->len));
+        event->session = ntohl(event->session);
+        event->len = ntohl(event->len);
+        offset += RECORD_HEADER_LEN;
+        if (event->session > REPLAY_MAX_SESSION)
+        {
+            fprintf(stderr, "%s is damaged: session %u\n", path, event->session);
+            return -1;
+        }
+        // A registry that died mid-write can leave a truncated last event
+        if ((size_t)size - offset < event->len)
+        {
+            break;
+        }
+        event->data = *file + offset;
+        offset += event->len;
+        if (event->session > *max_session)
+        {
+            *max_session = event->session;
+        }
+        (*event_count)++;
+    }
+    return 0;
+}
+
+// Open a blocking TCP connection to the registry, or return -1
+static int connect_registry(const char* host, const char* port)
+{
+    return p2p_connect(host, port, AF_UNSPEC);
+}
+
+static void replay_event(struct Replay* replay, const struct ReplayEvent* event)
+{
+    switch (event->type)
+    {
+        case RECORD_OPEN:
+        {
+            end_session(replay, event->session);
+            int sock = connect_registry(replay->host, replay->port);
+            if (sock < 0)
+            {
+                replay->refused++;
+                return;
+            }
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+            replay->fds[event->session] = sock;
+            replay->session_count++;
+            return;
+        }
+        case RECORD_INPUT:
+            send_all(replay, event->session, event->data, event->len);
+            // Keep the registry's output queue for this connection short
+            drain(replay, event->session);
+            return;
+        case RECORD_CLOSE:
+            close_session(replay, event->session);
+            return;
+        default:
+            return;
+    }
+}
+
+// Send one recorded block, reading responses on every connection while the socket is full
+static void send_all(struct Replay* replay, uint32_t session, const uint8_t* data, size_t len)
+{
+    while (len > 0 && replay->fds[session] >= 0)
+    {
+        ssize_t sent = send(replay->fds[session], data, len, MSG_NOSIGNAL);
+        if (sent > 0)
+        {
+            data += sent;
+            len -= sent;
+            replay->bytes_sent += sent;
+            continue;
+        }
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (!pump(replay, replay->fds[session], REPLAY_STALL_MS))
+            {
+                fprintf(stderr, "Registry stalled on session %u\n", session);
+                end_session(replay, session);
+            }
+            continue;
+        }
+        // The registry reset the connection
+        replay->closed_early++;
+        end_session(replay, session);
+    }
+}
+
+// Read whatever responses are waiting on one connection
+static void drain(struct Replay* replay, uint32_t session)
+{
+    uint8_t buf[BUFFER_SIZE * 16];
+    while (replay->fds[session] >= 0)
+    {
+        ssize_t received = recv(replay->fds[session], buf, sizeof(buf), MSG_DONTWAIT);
+        if (received > 0)
+        {
+            replay->bytes_received += received;
+            continue;
+        }
+        if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            replay->closed_early++;
+            end_session(replay, session);
+        }
+        return;
+    }
+}
+
+// Wait until wait_fd (if not -1) can be written or some connection has responses, and
+// read those. Returns false if nothing happened within timeout_ms
+static bool pump(struct Replay* replay, int wait_fd, int timeout_ms)
+{
+    nfds_t count = 0;
+    for (uint32_t s = 0; s <= replay->max_session; s++)
+    {
+        if (replay->fds[s] >= 0)
+        {
+            replay->polls[count].fd = replay->fds[s];
+            replay->polls[count].events = POLLIN | (replay->fds[s] == wait_fd ? POLLOUT : 0);
+            replay->polls[count].revents = 0;
+            replay->poll_sessions[count++] = s;
+        }
+    }
+    if (count == 0 || poll(replay->polls, count, timeout_ms) <= 0)
+    {
+        return false;
+    }
+    for (nfds_t i = 0; i < count; i++)
+    {
+        if (replay->polls[i].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            drain(replay, replay->poll_sessions[i]);
+        }
+    }
+    return true;
+}
+
+// Replay a recorded close: tell the registry no more input is coming and read the rest
+// of its responses until it closes its end too. Its slot is then free again, as it was
+// at this point of the recording
+static void close_session(struct Replay* replay, uint32_t session)
+{
+    int sock = replay->fds[session];
+    if (sock < 0)
+    {
+        return;
+    }
+    shutdown(sock, SHUT_WR);
+
+    uint8_t buf[BUFFER_SIZE * 16];
+    struct pollfd pfd = {sock, POLLIN, 0};
+    while (poll(&pfd, 1, REPLAY_STALL_MS) > 0)
+    {
+        ssize_t received = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+        if (received > 0)
+        {
+            replay->bytes_received += received;
+            continue;
+        }
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            continue;
+        }
+        // The registry closed its end, or reset the connection
+        break;
+    }
+    end_session(replay, session);
+}
+
+// Close a session's connection if it is open
+static void end_session(struct Replay* replay, uint32_t session)
+{
+    if (replay->fds[session] >= 0)
+    {
+        close(replay->fds[session]);
+        replay->fds[session] = -1;
+    }
+}
@@ -0,0 +1,598 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Leader/follower replication, so SEARCH and LOOKUP_PEER traffic can be spread over
+// several registries. Peers JOIN and PUBLISH at the leader (-L). Followers (-f) connect
+// to it like any client, send REPL_HELLO, and receive a snapshot of every joined peer
+// followed by a stream of changes: REPL_PEER when a peer joins or publishes and
+// REPL_DEL when it disconnects. Followers answer reads from their copy and refuse to
+// publish.
+//
+// Staleness itself is bounded without timers. Everything the leader sends travels on one
+// TCP stream, so the reply to a REPL_PING arrives after every change made before the
+// leader saw the ping, and the copy is then known to be at least as fresh as the moment
+// the ping was sent. A read arriving when that moment is more than -S milliseconds ago
+// waits (like a forwarded cluster SEARCH) until the next ping is answered; a copy past
+// half its bound is refreshed in the background, so under steady traffic reads never
+// wait. With the leader unreachable, reads are refused once the bound has passed.
+//
+// The link to the leader is opened without blocking, and its HELLO waits in the output
+// queue until the connection is up. A HELLO or PING the leader has not answered after
+// REPLICA_SYNC_TIMEOUT_MS, whether or not the link ever connected, drops the link, which
+// refuses the reads waiting on it.
+
+#include "registry.h"
+
+// Seconds between connection attempts while the leader is unreachable
+#define REPLICA_RETRY_SECONDS 1
+// How long the leader may take to answer a HELLO or PING, connecting included
+#define REPLICA_SYNC_TIMEOUT_MS 2000
+
+enum replica_role
+{
+    REPLICA_LEADER,
+    REPLICA_FOLLOWER
+};
+
+// A read waiting for the leader to confirm the copy is fresh
+struct ReplicaWait
+{
+    bool used;
+    int client_slot;
+    uint32_t client_generation;
+    uint8_t action;
+    char search_file[MAX_FILENAME_LEN];
+    uint32_t peer_id;
+};
+
+struct ReplicaState
+{
+    enum replica_role role;
+    // Leader: attached followers
+    int follower_count;
+    // Follower: the leader and the link to it (-1 while there is none)
+    char leader_host[NODE_HOST_LEN];
+    char leader_port[NODE_PORT_LEN];
+    int leader_slot;
+    time_t last_attempt;
+    double max_staleness;
+    // Monotonic time the copy was last confirmed to match the leader, 0 if never
+    double fresh_as_of;
+    // Sent time of the HELLO or PING whose reply is outstanding
+    bool sync_pending;
+    double sync_sent;
+    // The leader's peers; record numbers follow the local slots as cluster records do
+    struct PeerData records[MAX_REMOTE_PEERS];
+    struct ReplicaWait waits[MAX_PEERS];
+};
+
+static size_t encode_record(struct RegistryContext* reg_context, struct PeerData* peer, uint8_t* out);
+static void send_snapshot(struct RegistryContext* reg_context, struct PeerData* link);
+static int connect_leader(struct RegistryContext* reg_context);
+static void request_sync(struct RegistryContext* reg_context);
+static void handle_repl_peer(struct RegistryContext* reg_context, const uint8_t* payload, uint32_t payload_len);
+static void handle_repl_del(struct RegistryContext* reg_context, const uint8_t* payload, uint32_t payload_len);
+static void handle_synced(struct RegistryContext* reg_context);
+static void finish_wait(struct RegistryContext* reg_context, struct ReplicaWait* wait, bool answer);
+static void refuse_read(struct RegistryContext* reg_context, struct PeerData* requester, uint8_t action);
+static void remove_record(struct RegistryContext* reg_context, struct PeerData* record);
+
+// Accept followers. Returns -1 if the state cannot be allocated
+int replica_init_leader(struct RegistryContext* reg_context)
+{
+    struct ReplicaState* replica = calloc(1, sizeof(*replica));
+    if (replica == NULL)
+    {
+        perror("Failed to allocate replication state");
+        return -1;
+    }
+    replica->role = REPLICA_LEADER;
+    replica->leader_slot = -1;
+    reg_context->replica = replica;
+    printf("Replication leader, accepting followers\n");
+    return 0;
+}
+
+// Follow the leader at host:port, answering reads from a copy at most max_staleness_ms
+// old. Returns -1 on a bad address
+int replica_init_follower(struct RegistryContext* reg_context, const char* leader, uint32_t max_staleness_ms)
+{
+    struct ReplicaState* replica = calloc(1, sizeof(*replica));
+    if (replica == NULL)
+    {
+        perror("Failed to allocate replication state");
+        return -1;
+    }
+    if (parse_node(leader, strlen(leader), replica->leader_host, replica->leader_port) < 0)
+    {
+        fprintf(stderr, "Error: Invalid leader '%s'\n", leader);
+        free(replica);
+        return -1;
+    }
+    replica->role = REPLICA_FOLLOWER;
+    replica->leader_slot = -1;
+    replica->max_staleness = max_staleness_ms / 1000.0;
+    for (int r = 0; r < MAX_REMOTE_PEERS; r++)
+    {
+        replica->records[r].peer_socket = -1;
+        replica->records[r].link_node = -1;
+        replica->records[r].home_node = -1;
+        replica->records[r].record = MAX_PEERS + r;
+    }
+    reg_context->replica = replica;
+
+    printf("Following the leader at %s:%s\n", replica->leader_host, replica->leader_port);
+    // A leader that is not up yet is retried when the first read arrives
+    connect_leader(reg_context);
+    return 0;
+}
+
+// True on a follower, which takes no JOIN or PUBLISH of its own into the catalog
+bool replica_read_only(struct RegistryContext* reg_context)
+{
+    return reg_context->replica != NULL && reg_context->replica->role == REPLICA_FOLLOWER;
+}
+
+// Leader: a peer joined or published; send its record to every follower
+void replica_publish(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    struct ReplicaState* replica = reg_context->replica;
+    if (replica == NULL || replica->role != REPLICA_LEADER || replica->follower_count == 0)
+    {
+        return;
+    }
+
+    uint8_t payload[CATALOG_MAX_PAYLOAD];
+    size_t payload_len = encode_record(reg_context, peer, payload);
+    for (int i = 0; i < MAX_PEERS; i++)
+    {
+        if (reg_context->peers[i].replica_link)
+        {
+            send_node_frame(reg_context, &reg_context->peers[i], ACTION_REPL_PEER, 0, payload, payload_len);
+        }
+    }
+}
+
+// A connection is being dropped. On the leader a joined peer is withdrawn from the
+// followers; on either end a replication link is forgotten
+void replica_peer_dropped(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    struct ReplicaState* replica = reg_context->replica;
+
+    if (replica->role == REPLICA_LEADER)
+    {
+        if (peer->replica_link)
+        {
+            replica->follower_count--;
+            printf("Follower detached\n");
+            return;
+        }
+        if (peer->state == CLIENT_UNKNOWN || replica->follower_count == 0)
+        {
+            return;
+        }
+        uint32_t net_id = htonl(peer->peer_id);
+        for (int i = 0; i < MAX_PEERS; i++)
+        {
+            if (reg_context->peers[i].replica_link)
+            {
+                send_node_frame(reg_context, &reg_context->peers[i], ACTION_REPL_DEL, 0, &net_id, sizeof(net_id));
+            }
+        }
+        return;
+    }
+
+    if (peer - reg_context->peers != replica->leader_slot)
+    {
+        return;
+    }
+    // The copy keeps serving until it is too old; reads already waiting are refused
+    printf("Link to the leader closed\n");
+    replica->leader_slot = -1;
+    replica->sync_pending = false;
+    for (int w = 0; w < MAX_PEERS; w++)
+    {
+        if (replica->waits[w].used)
+        {
+            finish_wait(reg_context, &replica->waits[w], false);
+        }
+    }
+}
+
+// Follower: decide whether a read may be answered now. Returns false if so; otherwise
+// the read was queued until the leader confirms the copy, or refused, and the caller
+// must not answer it
+bool replica_defer_read(struct RegistryContext* reg_context, struct PeerData* requester, uint8_t action, const char* search_file, uint32_t peer_id)
+{
+    struct ReplicaState* replica = reg_context->replica;
+    if (replica->role != REPLICA_FOLLOWER)
+    {
+        return false;
+    }
+
+    double age = monotonic_seconds() - replica->fresh_as_of;
+    if (replica->fresh_as_of > 0 && age <= replica->max_staleness)
+    {
+        // Refresh ahead of time so steady traffic never has to wait
+        if (age > replica->max_staleness / 2)
+        {
+            request_sync(reg_context);
+        }
+        return false;
+    }
+
+    request_sync(reg_context);
+    struct ReplicaWait* wait = NULL;
+    for (int w = 0; w < MAX_PEERS && replica->sync_pending; w++)
+    {
+        if (!replica->waits[w].used)
+        {
+            wait = &replica->waits[w];
+            break;
+        }
+    }
+    if (wait == NULL)
+    {
+        printf("Refusing a read: the copy is too old and the leader cannot confirm it\n");
+        refuse_read(reg_context, requester, action);
+        return true;
+    }
+
+    wait->used = true;
+    wait->client_slot = requester - reg_context->peers;
+    wait->client_generation = requester->generation;
+    wait->action = action;
+    wait->peer_id = peer_id;
+    if (search_file != NULL)
+    {
+        snprintf(wait->search_file, sizeof(wait->search_file), "%s", search_file);
+    }
+    requester->awaiting_forward = true;
+    return true;
+}
+
+// Handle a replication frame received on a connection
+void replica_handle_frame(struct RegistryContext* reg_context, struct PeerData* link, uint8_t action, uint16_t flags, const uint8_t* payload, uint32_t payload_len)
+{
+    struct ReplicaState* replica = reg_context->replica;
+
+    if (replica->role == REPLICA_LEADER)
+    {
+        if (action == ACTION_REPL_HELLO && flags == 0 && !link->replica_link && link->state == CLIENT_UNKNOWN)
+        {
+            link->replica_link = true;
+            link->version = 2;
+            replica->follower_count++;
+            printf("Follower attached\n");
+            send_snapshot(reg_context, link);
+            return;
+        }
+        if (action == ACTION_REPL_PING && flags == 0 && link->replica_link)
+        {
+            send_node_frame(reg_context, link, ACTION_REPL_PING, V2_FLAG_RESPONSE, NULL, 0);
+            return;
+        }
+    }
+    else if (link - reg_context->peers == replica->leader_slot)
+    {
+        switch (action)
+        {
+            case ACTION_REPL_PEER:
+                handle_repl_peer(reg_context, payload, payload_len);
+                return;
+            case ACTION_REPL_DEL:
+                handle_repl_del(reg_context, payload, payload_len);
+                return;
+            case ACTION_REPL_HELLO:
+            case ACTION_REPL_PING:
+                if (flags == V2_FLAG_RESPONSE)
+                {
+                    handle_synced(reg_context);
+                    return;
+                }
+                break;
+            default:
+                break;
+        }
+        fprintf(stderr, "Unexpected replication action %u from the leader\n", action);
+        return;
+    }
+
+    send_v2_frame(reg_context, link->peer_socket, action, V2_FLAG_RESPONSE | V2_FLAG_ERROR, NULL, 0);
+}
+
+// When the outstanding HELLO or PING times out, in monotonic seconds, or 0 if there is
+// none
+double replica_next_deadline(struct RegistryContext* reg_context)
+{
+    struct ReplicaState* replica = reg_context->replica;
+
+    if (replica->role != REPLICA_FOLLOWER || !replica->sync_pending)
+    {
+        return 0;
+    }
+    return replica->sync_sent + REPLICA_SYNC_TIMEOUT_MS / 1000.0;
+}
+
+// Give up on a leader that did not answer in time; reads waiting for it are refused
+void replica_expire(struct RegistryContext* reg_context, double now)
+{
+    struct ReplicaState* replica = reg_context->replica;
+    double deadline = replica_next_deadline(reg_context);
+
+    if (deadline == 0 || deadline > now || replica->leader_slot < 0)
+    {
+        return;
+    }
+    printf("The leader did not answer in time\n");
+    drop_peer(reg_context, &reg_context->peers[replica->leader_slot]);
+}
+
+// A peer's record in CATALOG_ADD layout: peer ID, endpoint count, endpoints, file count,
+// then each name as length and bytes. Returns the encoded length
+static size_t encode_record(struct RegistryContext* reg_context, struct PeerData* peer, uint8_t* out)
+{
+    struct sockaddr_storage endpoints[MAX_ENDPOINTS];
+    int count = peer_endpoints(peer, endpoints);
+    uint32_t net_id = htonl(peer->peer_id);
+    size_t offset = 0;
+
+    memcpy(out, &net_id, sizeof(net_id));
+    offset += sizeof(net_id);
+    out[offset++] = count;
+    for (int e = 0; e < count; e++)
+    {
+        offset += p2p_endpoint_encode(out + offset, &endpoints[e]);
+    }
+
+    uint32_t file_count = catalog_file_count(reg_context, peer);
+    uint32_t net_count = htonl(file_count);
+    memcpy(out + offset, &net_count, sizeof(net_count));
+    offset += sizeof(net_count);
+    for (uint32_t k = 0; k < file_count; k++)
+    {
+        const char* name = catalog_file(reg_context, peer, k);
+        uint16_t name_len = strlen(name);
+        uint16_t net_name_len = htons(name_len);
+        memcpy(out + offset, &net_name_len, sizeof(net_name_len));
+        memcpy(out + offset + sizeof(net_name_len), name, name_len);
+        offset += sizeof(net_name_len) + name_len;
+    }
+    return offset;
+}
+
+// Send a new follower every joined peer, then answer its HELLO
+static void send_snapshot(struct RegistryContext* reg_context, struct PeerData* link)
+{
+    uint8_t payload[CATALOG_MAX_PAYLOAD];
+    int sent = 0;
+
+    for (int i = 0; i < MAX_PEERS; i++)
+    {
+        struct PeerData* peer = &reg_context->peers[i];
+        if (peer->state != CLIENT_UNKNOWN && peer->link_node < 0 && !peer->replica_link)
+        {
+            send_node_frame(reg_context, link, ACTION_REPL_PEER, 0, payload, encode_record(reg_context, peer, payload));
+            sent++;
+        }
+    }
+    send_node_frame(reg_context, link, ACTION_REPL_HELLO, V2_FLAG_RESPONSE, NULL, 0);
+    printf("Sent a snapshot of %d peers to a follower\n", sent);
+}
+
+// Open the link to the leader and ask for a snapshot, replacing the copy. Returns the
+// link's slot or -1 if the leader cannot be reached
+static int connect_leader(struct RegistryContext* reg_context)
+{
+    struct ReplicaState* replica = reg_context->replica;
+
+    time_t now = time(NULL);
+    if (replica->last_attempt != 0 && now - replica->last_attempt < REPLICA_RETRY_SECONDS)
+    {
+        return -1;
+    }
+    replica->last_attempt = now;
+
+    struct sockaddr_storage addr;
+    int sock = connect_node(replica->leader_host, replica->leader_port, &addr);
+    if (sock < 0)
+    {
+        return -1;
+    }
+    int slot = add_peer(reg_context, sock, &addr);
+    if (slot < 0)
+    {
+        printf("Reached max peer limit\n");
+        close(sock);
+        return -1;
+    }
+    struct PeerData* link = &reg_context->peers[slot];
+    link->replica_link = true;
+    link->version = 2;
+    replica->leader_slot = slot;
+    watch_peer(reg_context, slot);
+    // Not a cluster, so the first link session slot is free for the leader
+    if (reg_context->tls != NULL && tls_connect(reg_context, link, replica->leader_host, 0) < 0)
+    {
+        fprintf(stderr, "Failed to start TLS on the link to the leader\n");
+        drop_peer(reg_context, link);
+        return -1;
+    }
+
+    // The snapshot replaces everything; until it is complete the copy is not current
+    for (int r = 0; r < MAX_REMOTE_PEERS; r++)
+    {
+        if (replica->records[r].state != CLIENT_UNKNOWN)
+        {
+            remove_record(reg_context, &replica->records[r]);
+        }
+    }
+    replica->fresh_as_of = 0;
+    send_node_frame(reg_context, link, ACTION_REPL_HELLO, 0, NULL, 0);
+    replica->sync_pending = true;
+    replica->sync_sent = monotonic_seconds();
+    printf("Link to the leader (%s:%s) opened\n", replica->leader_host, replica->leader_port);
+    return slot;
+}
+
+// Ask the leader to confirm the copy, reconnecting first if the link is down
+static void request_sync(struct RegistryContext* reg_context)
+{
+    struct ReplicaState* replica = reg_context->replica;
+
+    if (replica->leader_slot < 0)
+    {
+        connect_leader(reg_context);
+        return;
+    }
+    if (!replica->sync_pending)
+    {
+        send_node_frame(reg_context, &reg_context->peers[replica->leader_slot], ACTION_REPL_PING, 0, NULL, 0);
+        replica->sync_pending = true;
+        replica->sync_sent = monotonic_seconds();
+    }
+}
+
+// REPL_PEER: add or replace the record of one of the leader's peers
+static void handle_repl_peer(struct RegistryContext* reg_context, const uint8_t* payload, uint32_t payload_len)
+{
+    struct ReplicaState* replica = reg_context->replica;
+    struct RegistryRequest entry;
+
+    if (parse_catalog_record(payload, payload_len, &entry) < 0 || entry.peer_id == 0)
+    {
+        fprintf(stderr, "Error: Malformed REPL_PEER\n");
+        return;
+    }
+
+    struct PeerData* record = peer_index_find(reg_context, entry.peer_id);
+    if (record == NULL)
+    {
+        for (int r = 0; r < MAX_REMOTE_PEERS && record == NULL; r++)
+        {
+            if (replica->records[r].state == CLIENT_UNKNOWN)
+            {
+                record = &replica->records[r];
+            }
+        }
+        if (record == NULL)
+        {
+            fprintf(stderr, "Error: Replica catalog is full\n");
+            return;
+        }
+        record->peer_id = entry.peer_id;
+        record->hits_updated = time(NULL);
+        peer_index_add(reg_context, record);
+    }
+    else if (record->state == CLIENT_REGISTERED)
+    {
+        // Answers cached for the names it published before
+        search_cache_invalidate_peer(reg_context, record);
+    }
+
+    if (catalog_set_files(reg_context, record, entry.files, entry.file_count) < 0)
+    {
+        perror("Failed to allocate memory for files");
+        return;
+    }
+    memcpy(record->endpoints, entry.endpoints, entry.endpoint_count * sizeof(entry.endpoints[0]));
+    record->endpoint_count = entry.endpoint_count;
+    // Locality checks compare against the peer's first endpoint
+    record->peer_addr = entry.endpoints[0];
+    record->state = entry.file_count > 0 ? CLIENT_REGISTERED : CLIENT_JOINED;
+    search_cache_invalidate_peer(reg_context, record);
+
+    printf("Replicated %u files of peer %u\n", entry.file_count, entry.peer_id);
+}
+
+// REPL_DEL: one of the leader's peers disconnected
+static void handle_repl_del(struct RegistryContext* reg_context, const uint8_t* payload, uint32_t payload_len)
+{
+    uint32_t peer_id;
+
+    if (payload_len != sizeof(peer_id))
+    {
+        fprintf(stderr, "Error: Malformed REPL_DEL\n");
+        return;
+    }
+    memcpy(&peer_id, payload, sizeof(peer_id));
+
+    struct PeerData* record = peer_index_find(reg_context, ntohl(peer_id));
+    if (record != NULL)
+    {
+        remove_record(reg_context, record);
+    }
+}
+
+// Reply to the outstanding HELLO or PING: the copy matched the leader when it was sent.
+// Waiting reads are answered now, however long the round trip took
+static void handle_synced(struct RegistryContext* reg_context)
+{
+    struct ReplicaState* replica = reg_context->replica;
+
+    if (!replica->sync_pending)
+    {
+        return;
+    }
+    replica->sync_pending = false;
+    replica->fresh_as_of = replica->sync_sent;
+    for (int w = 0; w < MAX_PEERS; w++)
+    {
+        if (replica->waits[w].used)
+        {
+            finish_wait(reg_context, &replica->waits[w], true);
+        }
+    }
+}
+
+// Answer (or refuse) a waiting read and resume the requester's queued input
+static void finish_wait(struct RegistryContext* reg_context, struct ReplicaWait* wait, bool answer)
+{
+    struct PeerData* client = &reg_context->peers[wait->client_slot];
+
+    wait->used = false;
+    if (client->generation != wait->client_generation || !client->awaiting_forward)
+    {
+        return;
+    }
+
+    client->awaiting_forward = false;
+    if (!answer)
+    {
+        refuse_read(reg_context, client, wait->action);
+    }
+    else if (wait->action == ACTION_SEARCH)
+    {
+        answer_search(reg_context, client, wait->search_file);
+    }
+    else
+    {
+        handle_lookup_peer(reg_context, client, wait->peer_id);
+    }
+    if (client->in_len > 0)
+    {
+        consume_peer_input(reg_context, client);
+    }
+}
+
+// Turn a read away: v2 peers get an error reply, v1 peers (which have none) "not found"
+static void refuse_read(struct RegistryContext* reg_context, struct PeerData* requester, uint8_t action)
+{
+    if (requester->version >= 2)
+    {
+        send_v2_frame(reg_context, requester->peer_socket, action, V2_FLAG_RESPONSE | V2_FLAG_ERROR, NULL, 0);
+        return;
+    }
+    uint8_t result[4 + 1];
+    send_search_result(reg_context, requester, result, encode_search_result(result, NULL), false);
+}
+
+// Forget one of the leader's peers
+static void remove_record(struct RegistryContext* reg_context, struct PeerData* record)
+{
+    if (record->state == CLIENT_REGISTERED)
+    {
+        search_cache_invalidate_peer(reg_context, record);
+    }
+    cleanup_peer(reg_context, record);
+    record->peer_socket = -1;
+}
@@ -0,0 +1,299 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Optional TLS on every registry connection (-t cert -k key). OpenSSL never touches the
+// sockets: each connection's SSL object reads ciphertext from one memory BIO and writes
+// ciphertext to another. tls_input() is handed the bytes a backend received and
+// decrypts them into the peer's input buffer, and tls_send() encrypts a response and
+// passes the ciphertext to send_to_socket(). Both backends, the output queues and
+// backpressure therefore work unchanged, they just carry ciphertext.
+//
+// Resumption: the server keeps the TLS 1.3 default of stateless session tickets (and a
+// session cache for TLS 1.2), so a peer reconnecting after a drop or a BUSY skips the
+// full handshake. Cluster links are the one place the registry is a TLS client; it
+// keeps the last session of each node and offers it when the link is reopened.
+
+#include "registry.h"
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+// Ciphertext moved from OpenSSL to the backend per copy
+#define TLS_COPY_SIZE 4096
+
+struct TlsState
+{
+    // Accepted connections
+    SSL_CTX* server;
+    // Cluster links this node opens
+    SSL_CTX* client;
+    // Last session of the link to each node, offered when the link is reopened
+    SSL_SESSION* link_sessions[MAX_CLUSTER_NODES];
+};
+
+// TLS state of one connection
+struct TlsConn
+{
+    SSL* ssl;
+    // Plaintext sent before the handshake finished (cluster links send NODE_HELLO right
+    // away); written once the handshake completes
+    BIO* early;
+};
+
+static int link_session_ready(SSL* ssl, SSL_SESSION* session);
+static void tls_flush(struct RegistryContext* reg_context, struct PeerData* peer);
+static void tls_write_early(struct RegistryContext* reg_context, struct PeerData* peer);
+static void tls_error(const char* what);
+
+// Index of the SSL ex-data slot holding the registry's TlsState for link sessions
+static int link_state_index = -1;
+
+// Load the registry's certificate and key, and the CA used to verify other cluster
+// nodes (NULL for the system default). Returns -1 if TLS cannot be set up
+int tls_init(struct RegistryContext* reg_context, const char* cert_file, const char* key_file, const char* ca_file)
+{
+    struct TlsState* tls = calloc(1, sizeof(*tls));
+    if (tls == NULL)
+    {
+        return -1;
+    }
+
+    tls->server = SSL_CTX_new(TLS_server_method());
+    tls->client = SSL_CTX_new(TLS_client_method());
+    if (tls->server == NULL || tls->client == NULL)
+    {
+        tls_error("Failed to create TLS contexts");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(tls->server, TLS1_2_VERSION);
+    SSL_CTX_set_min_proto_version(tls->client, TLS1_2_VERSION);
+
+    if (SSL_CTX_use_certificate_chain_file(tls->server, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls->server, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls->server) != 1)
+    {
+        tls_error("Failed to load the TLS certificate and key");
+        return -1;
+    }
+    // TLS 1.2 clients resume from the server's session cache, which needs an ID context
+    static const unsigned char session_context[] = "p2p-registry";
+    SSL_CTX_set_session_id_context(tls->server, session_context, sizeof(session_context) - 1);
+
+    int loaded = ca_file != NULL ? SSL_CTX_load_verify_locations(tls->client, ca_file, NULL) : SSL_CTX_set_default_verify_paths(tls->client);
+    if (loaded != 1)
+    {
+        tls_error("Failed to load the TLS CA");
+        return -1;
+    }
+    SSL_CTX_set_verify(tls->client, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_session_cache_mode(tls->client, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls->client, link_session_ready);
+    link_state_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+    reg_context->tls = tls;
+    return 0;
+}
+
+// Start TLS on a connection the registry accepted
+int tls_accept(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    struct TlsConn* conn = calloc(1, sizeof(*conn));
+    if (conn == NULL || (conn->ssl = SSL_new(reg_context->tls->server)) == NULL)
+    {
+        free(conn);
+        return -1;
+    }
+    SSL_set_bio(conn->ssl, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+    SSL_set_accept_state(conn->ssl);
+    peer->tls = conn;
+    return 0;
+}
+
+// Start TLS on a link this node opened to another node, resuming the link's last
+// session if there is one. The node's certificate must name host
+int tls_connect(struct RegistryContext* reg_context, struct PeerData* peer, const char* host, int node)
+{
+    struct TlsState* tls = reg_context->tls;
+    struct TlsConn* conn = calloc(1, sizeof(*conn));
+    if (conn == NULL || (conn->ssl = SSL_new(tls->client)) == NULL || (conn->early = BIO_new(BIO_s_mem())) == NULL)
+    {
+        if (conn != NULL)
+        {
+            SSL_free(conn->ssl);
+        }
+        free(conn);
+        return -1;
+    }
+    SSL_set_bio(conn->ssl, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+    SSL_set_connect_state(conn->ssl);
+    SSL_set_ex_data(conn->ssl, link_state_index, tls);
+    SSL_set_app_data(conn->ssl, (void*)(intptr_t)node);
+
+    // Nodes listed by address are checked against the certificate's IP addresses
+    X509_VERIFY_PARAM* param = SSL_get0_param(conn->ssl);
+    if (X509_VERIFY_PARAM_set1_ip_asc(param, host) != 1)
+    {
+        SSL_set_tlsext_host_name(conn->ssl, host);
+        SSL_set1_host(conn->ssl, host);
+    }
+    if (tls->link_sessions[node] != NULL)
+    {
+        SSL_set_session(conn->ssl, tls->link_sessions[node]);
+    }
+    peer->tls = conn;
+
+    // ClientHello
+    SSL_do_handshake(conn->ssl);
+    tls_flush(reg_context, peer);
+    return 0;
+}
+
+// Decrypt ciphertext a backend received (len may be 0 to continue with ciphertext
+// already buffered) and handle the requests in it. Stops while the peer's input is
+// paused; the rest stays buffered until output_drained() calls again. May drop the peer
+void tls_input(struct RegistryContext* reg_context, struct PeerData* peer, const void* data, size_t len)
+{
+    struct TlsConn* conn = peer->tls;
+    uint32_t generation = peer->generation;
+
+    if (len > 0 && BIO_write(SSL_get_rbio(conn->ssl), data, len) != (int)len)
+    {
+        fprintf(stderr, "Failed to buffer TLS input\n");
+        drop_peer(reg_context, peer);
+        return;
+    }
+
+    while (!peer->input_paused && !peer->output_failed)
+    {
+        if (!reserve_peer_input(reg_context, peer))
+        {
+            return;
+        }
+        bool handshaking = !SSL_is_init_finished(conn->ssl);
+        int got = SSL_read(conn->ssl, peer->in_buf + peer->in_len, peer->in_cap - peer->in_len);
+        // Read before anything else touches the connection
+        int error = got <= 0 ? SSL_get_error(conn->ssl, got) : SSL_ERROR_NONE;
+        // Handshake messages and tickets SSL_read produced go out right away
+        tls_flush(reg_context, peer);
+        if (handshaking && SSL_is_init_finished(conn->ssl))
+        {
+            tls_write_early(reg_context, peer);
+        }
+        if (got <= 0)
+        {
+            if (error == SSL_ERROR_WANT_READ)
+            {
+                return;
+            }
+            if (error == SSL_ERROR_ZERO_RETURN)
+            {
+                printf("Peer disconnnected\n");
+            }
+            else
+            {
+                tls_error("TLS error");
+            }
+            drop_peer(reg_context, peer);
+            return;
+        }
+
+        // Recordings hold plaintext, so they replay against a registry without TLS
+        record_input(reg_context, peer - reg_context->peers, peer->in_buf + peer->in_len, got);
+        peer->in_len += got;
+        consume_peer_input(reg_context, peer);
+        if (peer->generation != generation)
+        {
+            return;
+        }
+    }
+}
+
+// Encrypt a response and hand the ciphertext to the backend
+void tls_send(struct RegistryContext* reg_context, struct PeerData* peer, const void* data, size_t len)
+{
+    struct TlsConn* conn = peer->tls;
+
+    if (!SSL_is_init_finished(conn->ssl))
+    {
+        BIO_write(conn->early, data, len);
+        return;
+    }
+    // Memory BIOs never block, so every byte is taken at once
+    if (len > 0 && SSL_write(conn->ssl, data, len) <= 0)
+    {
+        tls_error("TLS error");
+        return;
+    }
+    tls_flush(reg_context, peer);
+}
+
+// Release a connection's TLS state when it is dropped
+void tls_close(struct PeerData* peer)
+{
+    struct TlsConn* conn = peer->tls;
+    if (conn == NULL)
+    {
+        return;
+    }
+    SSL_free(conn->ssl);
+    BIO_free(conn->early);
+    free(conn);
+    peer->tls = NULL;
+}
+
+// Move the ciphertext OpenSSL produced to the backend's send path
+static void tls_flush(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    BIO* out = SSL_get_wbio(peer->tls->ssl);
+    uint8_t buf[TLS_COPY_SIZE];
+    int got;
+
+    while ((got = BIO_read(out, buf, sizeof(buf))) > 0)
+    {
+        send_to_socket(reg_context, peer->peer_socket, buf, got);
+    }
+}
+
+// Send what was written while the handshake was still running
+static void tls_write_early(struct RegistryContext* reg_context, struct PeerData* peer)
+{
+    struct TlsConn* conn = peer->tls;
+    uint8_t buf[TLS_COPY_SIZE];
+    int got;
+
+    if (conn->early == NULL)
+    {
+        return;
+    }
+    while ((got = BIO_read(conn->early, buf, sizeof(buf))) > 0)
+    {
+        tls_send(reg_context, peer, buf, got);
+    }
+}
+
+// New session on a cluster link: keep it for the next time the link is opened
+static int link_session_ready(SSL* ssl, SSL_SESSION* session)
+{
+    struct TlsState* tls = SSL_get_ex_data(ssl, link_state_index);
+    int node = (int)(intptr_t)SSL_get_app_data(ssl);
+
+    if (tls == NULL)
+    {
+        return 0;
+    }
+    SSL_SESSION_free(tls->link_sessions[node]);
+    tls->link_sessions[node] = session;
+    // Returning 1 keeps the reference OpenSSL handed over
+    return 1;
+}
+
+// Report an OpenSSL failure with the reason from its error queue
+static void tls_error(const char* what)
+{
+    unsigned long error = ERR_get_error();
+    char reason[256];
+
+    ERR_error_string_n(error, reason, sizeof(reason));
+    fprintf(stderr, "%s: %s\n", what, error != 0 ? reason : "connection failed");
+    ERR_clear_error();
+}
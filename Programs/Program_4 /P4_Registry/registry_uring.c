@@ -0,0 +1,731 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// io_uring event loop for the registry. One multishot accept delivers every new
+// connection, each peer has one multishot recv that fills buffers from a provided buffer
+// ring, and responses are queued as SEND entries that are submitted together with the
+// next wait. A busy registry therefore makes one io_uring_enter() per batch of events
+// instead of several syscalls per request. The raw syscall interface is used so the
+// registry has no dependency on liburing.
+
+#include "registry.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Submission/completion queue depth
+#define URING_ENTRIES 256
+// Number of receive buffers in the provided buffer ring (power of two)
+#define URING_RECV_BUFS 64
+// Size of each provided receive buffer
+#define URING_RECV_BUF_SIZE 4096
+// Buffer group ID used for the receive buffer ring
+#define URING_BGID 0
+
+// Completion tags stored in the low bits of user_data; SEND entries carry a pointer instead
+#define UD_SEND 0
+#define UD_ACCEPT 1
+#define UD_RECV 2
+#define UD_CANCEL 3
+#define UD_TIMEOUT 4
+#define UD_TAG_MASK 7
+
+// Responses owned by the ring until their SEND completes. Each peer has at most one SEND
+// in flight so its responses cannot be reordered; anything produced meanwhile is appended
+// to a single queued buffer that goes out as one SEND when the current one completes.
+struct UringSend
+{
+    // Peer slot and connection generation the data belongs to
+    int slot;
+    uint32_t generation;
+    int peer_socket;
+    // Bytes already sent
+    size_t offset;
+    size_t len;
+    // Allocated size of data
+    size_t cap;
+    uint8_t data[];
+};
+
+// Mapped rings and provided buffers for one io_uring instance
+struct UringState
+{
+    int ring_fd;
+    // Submission queue
+    void* sq_ptr;
+    size_t sq_len;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    // Entries queued since the last io_uring_enter()
+    unsigned to_submit;
+    // Completion queue
+    void* cq_ptr;
+    size_t cq_len;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    // Provided buffer ring for multishot recv
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_len;
+    uint8_t* recv_bufs;
+    // Per peer slot: the SEND in flight and the responses waiting behind it
+    struct UringSend* inflight[MAX_PEERS];
+    struct UringSend* queued[MAX_PEERS];
+    // Per peer slot: whether its multishot recv is still armed
+    bool recv_armed[MAX_PEERS];
+    // Per peer slot: the peer closed its side, and is dropped once its last response
+    // has been sent
+    bool closing[MAX_PEERS];
+    // Monotonic time of the earliest armed TIMEOUT (0 when none is), and its duration,
+    // which must stay valid until it is submitted
+    double timeout_at;
+    struct __kernel_timespec timeout;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Whether the kernel can run this backend, asked of the kernel itself with a throwaway
+// ring. Multishot recv needs Linux 6.0, and older kernels reject it only once requests
+// are running; IORING_SETUP_SINGLE_ISSUER arrived in the same release, so io_uring_setup
+// failing with it (EINVAL before 6.0, ENOSYS without io_uring, EPERM if disabled) rules
+// those kernels out. Every opcode the loop submits must also be listed by the probe
+bool uring_supported(void)
+{
+    static const uint8_t needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL};
+    struct io_uring_params params;
+    struct io_uring_probe* probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    bool supported = probe != NULL;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER;
+    int ring_fd = supported ? sys_io_uring_setup(4, &params) : -1;
+    if (ring_fd < 0 || sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    {
+        supported = false;
+    }
+    for (size_t i = 0; supported && i < sizeof(needed); i++)
+    {
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    if (ring_fd >= 0)
+    {
+        close(ring_fd);
+    }
+    free(probe);
+    return supported;
+}
+
+// Submit everything queued so far
+static int uring_flush(struct UringState* ring)
+{
+    while (ring->to_submit > 0)
+    {
+        int ret = sys_io_uring_enter(ring->ring_fd, ring->to_submit, 0, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        ring->to_submit -= ret;
+    }
+    return 0;
+}
+
+// Claim the next submission entry, flushing the queue first if it is full
+static struct io_uring_sqe* uring_get_sqe(struct UringState* ring)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned head = atomic_load_explicit((_Atomic unsigned*)ring->sq_head, memory_order_acquire);
+
+    if (tail - head >= URING_ENTRIES)
+    {
+        if (uring_flush(ring) < 0)
+        {
+            return NULL;
+        }
+        head = atomic_load_explicit((_Atomic unsigned*)ring->sq_head, memory_order_acquire);
+        if (tail - head >= URING_ENTRIES)
+        {
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    atomic_store_explicit((_Atomic unsigned*)ring->sq_tail, tail + 1, memory_order_release);
+    ring->to_submit++;
+    return sqe;
+}
+
+// Hand a receive buffer back to the kernel
+static void uring_recycle_buffer(struct UringState* ring, unsigned short bid)
+{
+    unsigned short tail = ring->buf_ring->tail;
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[tail & (URING_RECV_BUFS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->recv_bufs + (size_t)bid * URING_RECV_BUF_SIZE);
+    buf->len = URING_RECV_BUF_SIZE;
+    buf->bid = bid;
+    atomic_store_explicit((_Atomic unsigned short*)&ring->buf_ring->tail, tail + 1, memory_order_release);
+}
+
+static int uring_arm_accept(struct RegistryContext* reg_context)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(reg_context->uring);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = reg_context->registry_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = UD_ACCEPT;
+    return 0;
+}
+
+static int uring_arm_recv(struct RegistryContext* reg_context, int slot);
+
+// Start receiving on a connection that was opened outside the multishot accept
+void uring_watch_peer(struct RegistryContext* reg_context, int slot)
+{
+    uring_arm_recv(reg_context, slot);
+}
+
+static int uring_arm_recv(struct RegistryContext* reg_context, int slot)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(reg_context->uring);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = reg_context->peers[slot].peer_socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = ((uint64_t)reg_context->peers[slot].generation << 32) | ((uint64_t)slot << 3) | UD_RECV;
+    reg_context->uring->recv_armed[slot] = true;
+    return 0;
+}
+
+// Stop receiving from a peer whose responses are piling up, by cancelling its
+// multishot recv. Data already received is still handled when it completes
+void uring_pause_recv(struct RegistryContext* reg_context, int slot)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(reg_context->uring);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = ((uint64_t)reg_context->peers[slot].generation << 32) | ((uint64_t)slot << 3) | UD_RECV;
+    sqe->user_data = UD_CANCEL;
+}
+
+// Receive from a paused peer again. If the cancelled recv has not completed yet, its
+// completion re-arms it instead
+void uring_resume_recv(struct RegistryContext* reg_context, int slot)
+{
+    if (!reg_context->uring->recv_armed[slot] && !reg_context->uring->closing[slot])
+    {
+        uring_arm_recv(reg_context, slot);
+    }
+}
+
+// Wake up the wait for the next cluster or replication deadline, unless a TIMEOUT that
+// fires no later is already armed. A TIMEOUT left over from an earlier deadline only
+// causes an extra wakeup
+static void uring_arm_timeout(struct RegistryContext* reg_context, int timeout_ms)
+{
+    struct UringState* ring = reg_context->uring;
+    double at = monotonic_seconds() + timeout_ms / 1000.0;
+
+    if (ring->timeout_at != 0 && ring->timeout_at <= at)
+    {
+        return;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    ring->timeout.tv_sec = timeout_ms / 1000;
+    ring->timeout.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->timeout;
+    sqe->len = 1;
+    sqe->user_data = UD_TIMEOUT;
+    ring->timeout_at = at;
+}
+
+static int uring_arm_send(struct UringState* ring, struct UringSend* pending)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = pending->peer_socket;
+    sqe->addr = (uint64_t)(uintptr_t)(pending->data + pending->offset);
+    sqe->len = pending->len - pending->offset;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uint64_t)(uintptr_t)pending;
+    return 0;
+}
+
+// Set up the ring, map its queues and register the receive buffer ring.
+// Returns 0 on success or -1 if the kernel refuses any step
+int uring_init(struct RegistryContext* reg_context)
+{
+    struct io_uring_params params;
+    struct UringState* ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+    {
+        return -1;
+    }
+
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring->ring_fd < 0)
+    {
+        perror("io_uring_setup");
+        free(ring);
+        return -1;
+    }
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    ring->buf_ring_len = URING_RECV_BUFS * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->recv_bufs = malloc((size_t)URING_RECV_BUFS * URING_RECV_BUF_SIZE);
+
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED ||
+        ring->buf_ring == MAP_FAILED || ring->recv_bufs == NULL)
+    {
+        perror("io_uring mmap");
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned*)((char*)ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned*)((char*)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)((char*)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((char*)ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned*)((char*)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned*)((char*)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)((char*)ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr + params.cq_off.cqes);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        perror("io_uring provided buffer ring");
+        goto fail;
+    }
+    for (unsigned short bid = 0; bid < URING_RECV_BUFS; bid++)
+    {
+        uring_recycle_buffer(ring, bid);
+    }
+
+    reg_context->uring = ring;
+    return 0;
+
+fail:
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+    {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED)
+    {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->buf_ring != NULL && ring->buf_ring != MAP_FAILED)
+    {
+        munmap(ring->buf_ring, ring->buf_ring_len);
+    }
+    free(ring->recv_bufs);
+    close(ring->ring_fd);
+    free(ring);
+    return -1;
+}
+
+// Copy a response into a ring-owned buffer and queue its SEND; it goes out with the
+// next io_uring_enter() together with every other queued response
+void uring_queue_send(struct RegistryContext* reg_context, int peer_socket, const void* data, size_t len)
+{
+    struct UringState* ring = reg_context->uring;
+    struct PeerData* peer = find_peer(reg_context, peer_socket);
+    if (peer == NULL)
+    {
+        return;
+    }
+    int slot = peer - reg_context->peers;
+
+    // Responses for a previous connection in this slot will never be sent
+    if (ring->queued[slot] != NULL && ring->queued[slot]->generation != peer->generation)
+    {
+        free(ring->queued[slot]);
+        ring->queued[slot] = NULL;
+    }
+
+    // Append to the buffer waiting behind the SEND already in flight
+    struct UringSend* pending = ring->inflight[slot] != NULL ? ring->queued[slot] : NULL;
+    size_t used = pending != NULL ? pending->len : 0;
+    if (pending == NULL || used + len > pending->cap)
+    {
+        size_t cap = pending != NULL ? pending->cap * 2 : BUFFER_SIZE;
+        while (cap < used + len)
+        {
+            cap *= 2;
+        }
+        struct UringSend* grown = realloc(pending, sizeof(*grown) + cap);
+        if (grown == NULL)
+        {
+            perror("Failed to allocate response");
+            return;
+        }
+        if (pending == NULL)
+        {
+            grown->slot = slot;
+            grown->generation = peer->generation;
+            grown->peer_socket = peer_socket;
+            grown->offset = 0;
+            grown->len = 0;
+        }
+        grown->cap = cap;
+        pending = grown;
+    }
+    memcpy(pending->data + pending->len, data, len);
+    pending->len += len;
+
+    if (ring->inflight[slot] != NULL)
+    {
+        ring->queued[slot] = pending;
+        output_queued(reg_context, peer, len);
+        return;
+    }
+
+    if (uring_arm_send(ring, pending) < 0)
+    {
+        fprintf(stderr, "io_uring submission queue full, response dropped\n");
+        free(pending);
+        return;
+    }
+    ring->inflight[slot] = pending;
+    output_queued(reg_context, peer, len);
+}
+
+// Let go of a dropped peer's socket. SENDs still waiting in the submission queue are
+// submitted first, so they hold their own reference to the socket rather than naming a
+// descriptor that is closed (or already reused by the next accept) by the time the
+// kernel reads them. While output is pending only the read side is shut down, which
+// still completes the armed multishot recv; otherwise the whole connection is
+void uring_close_peer(struct RegistryContext* reg_context, int slot)
+{
+    struct UringState* ring = reg_context->uring;
+    bool output_pending = ring->inflight[slot] != NULL;
+
+    ring->closing[slot] = false;
+    if (output_pending && uring_flush(ring) < 0)
+    {
+        perror("io_uring_enter");
+    }
+    shutdown(reg_context->peers[slot].peer_socket, output_pending ? SHUT_RD : SHUT_RDWR);
+}
+
+// A new connection arrived on the multishot accept
+static void uring_handle_accept(struct RegistryContext* reg_context, struct io_uring_cqe* cqe)
+{
+    // The multishot accept stops on some errors and must be armed again
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        uring_arm_accept(reg_context);
+    }
+
+    if (cqe->res < 0)
+    {
+        fprintf(stderr, "Failed to accept connection: %s\n", strerror(-cqe->res));
+        return;
+    }
+
+    int peer_socket = cqe->res;
+    struct sockaddr_storage peer_addr;
+    socklen_t addr_len = sizeof(peer_addr);
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    getpeername(peer_socket, (struct sockaddr*)&peer_addr, &addr_len);
+
+    // Same admission control as the select() backend; admitted peers get their recv armed
+    admit_peer(reg_context, peer_socket, &peer_addr);
+}
+
+// Data (or EOF) arrived on a peer's multishot recv
+static void uring_handle_recv(struct RegistryContext* reg_context, struct io_uring_cqe* cqe)
+{
+    struct UringState* ring = reg_context->uring;
+    int slot = (int)((cqe->user_data >> 3) & 0x1fffffff);
+    uint32_t generation = (uint32_t)(cqe->user_data >> 32);
+    struct PeerData* peer = &reg_context->peers[slot];
+    bool has_buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    bool stale = slot >= MAX_PEERS || peer->generation != generation;
+
+    if (!stale && !(cqe->flags & IORING_CQE_F_MORE))
+    {
+        ring->recv_armed[slot] = false;
+    }
+
+    if (stale || cqe->res <= 0)
+    {
+        if (has_buffer)
+        {
+            uring_recycle_buffer(ring, bid);
+        }
+        if (stale)
+        {
+            return;
+        }
+        // Out of receive buffers: the data is still queued in the socket, so just re-arm.
+        // A recv cancelled to pause the peer is re-armed once it may read again
+        if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED)
+        {
+            if (!peer->input_paused)
+            {
+                uring_arm_recv(reg_context, slot);
+            }
+            return;
+        }
+        if (cqe->res < 0)
+        {
+            fprintf(stderr, "Error receiving data: %s\n", strerror(-cqe->res));
+        }
+        else
+        {
+            printf("Peer disconnnected\n");
+            // A peer that only closed its sending side still gets the responses to what
+            // it sent before; it is dropped once the last of them has gone out
+            if (ring->inflight[slot] != NULL)
+            {
+                ring->closing[slot] = true;
+                return;
+            }
+        }
+        drop_peer(reg_context, peer);
+        return;
+    }
+
+    // Move the received bytes into the peer's message buffer and release the ring buffer
+    const uint8_t* data = ring->recv_bufs + (size_t)bid * URING_RECV_BUF_SIZE;
+    size_t remaining = cqe->res;
+    if (peer->tls != NULL)
+    {
+        // Ciphertext: tls_input() decrypts it into the message buffer
+        tls_input(reg_context, peer, data, remaining);
+        remaining = 0;
+        if (peer->generation != generation)
+        {
+            uring_recycle_buffer(ring, bid);
+            return;
+        }
+    }
+    else
+    {
+        record_input(reg_context, slot, data, remaining);
+    }
+    while (remaining > 0)
+    {
+        if (!reserve_peer_input(reg_context, peer))
+        {
+            uring_recycle_buffer(ring, bid);
+            return;
+        }
+        size_t chunk = peer->in_cap - peer->in_len;
+        if (chunk > remaining)
+        {
+            chunk = remaining;
+        }
+        memcpy(peer->in_buf + peer->in_len, data, chunk);
+        peer->in_len += chunk;
+        data += chunk;
+        remaining -= chunk;
+        consume_peer_input(reg_context, peer);
+        if (peer->generation != generation)
+        {
+            // The peer was dropped while its input was being handled
+            uring_recycle_buffer(ring, bid);
+            return;
+        }
+    }
+    uring_recycle_buffer(ring, bid);
+
+    if (!ring->recv_armed[slot] && !peer->input_paused)
+    {
+        uring_arm_recv(reg_context, slot);
+    }
+}
+
+// A peer's in-flight SEND finished (or failed); start whatever queued up behind it
+static void uring_handle_send(struct RegistryContext* reg_context, struct io_uring_cqe* cqe)
+{
+    struct UringState* ring = reg_context->uring;
+    struct UringSend* pending = (struct UringSend*)(uintptr_t)cqe->user_data;
+    int slot = pending->slot;
+    struct PeerData* peer = &reg_context->peers[slot];
+    bool current = peer->generation == pending->generation;
+    // Bytes that left the queue, sent or given up on
+    size_t done = 0;
+
+    if (cqe->res < 0)
+    {
+        fprintf(stderr, "Error sending response: %s\n", strerror(-cqe->res));
+    }
+    else
+    {
+        pending->offset += cqe->res;
+        // Short sends are resubmitted for the remainder
+        if (current && cqe->res > 0 && pending->offset < pending->len && uring_arm_send(ring, pending) == 0)
+        {
+            output_drained(reg_context, peer, cqe->res);
+            return;
+        }
+    }
+
+    done += pending->len - pending->offset + (cqe->res > 0 ? cqe->res : 0);
+    ring->inflight[slot] = NULL;
+    free(pending);
+
+    struct UringSend* next = ring->queued[slot];
+    ring->queued[slot] = NULL;
+    if (next != NULL && (next->generation != peer->generation || uring_arm_send(ring, next) < 0))
+    {
+        done += next->len;
+        free(next);
+        next = NULL;
+    }
+    ring->inflight[slot] = next;
+
+    // Stale buffers were already discounted when their connection was dropped
+    if (current)
+    {
+        output_drained(reg_context, peer, done);
+        if (next == NULL && ring->closing[slot])
+        {
+            drop_peer(reg_context, peer);
+        }
+    }
+}
+
+// Run the registry on io_uring until a fatal ring error or registry_stop
+void uring_run(struct RegistryContext* reg_context)
+{
+    struct UringState* ring = reg_context->uring;
+
+    if (uring_arm_accept(reg_context) < 0)
+    {
+        return;
+    }
+
+    while (!registry_stop)
+    {
+        int timeout_ms = next_deadline_ms(reg_context);
+        if (timeout_ms >= 0)
+        {
+            uring_arm_timeout(reg_context, timeout_ms);
+        }
+
+        // Submit every queued SQE and wait for at least one completion in a single call
+        int ret = sys_io_uring_enter(ring->ring_fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("io_uring_enter");
+            break;
+        }
+        ring->to_submit -= ret;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = atomic_load_explicit((_Atomic unsigned*)ring->cq_tail, memory_order_acquire);
+        while (head != tail)
+        {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+
+            switch (cqe->user_data & UD_TAG_MASK)
+            {
+                case UD_ACCEPT:
+                    uring_handle_accept(reg_context, cqe);
+                    break;
+                case UD_RECV:
+                    uring_handle_recv(reg_context, cqe);
+                    break;
+                // The recv it cancelled reports the outcome
+                case UD_CANCEL:
+                    break;
+                // Deadlines are checked below, and a TIMEOUT is armed again if one is
+                // still set
+                case UD_TIMEOUT:
+                    ring->timeout_at = 0;
+                    break;
+                default:
+                    uring_handle_send(reg_context, cqe);
+                    break;
+            }
+
+            head++;
+            // Completions handled so far are released before new ones are waited on
+            atomic_store_explicit((_Atomic unsigned*)ring->cq_head, head, memory_order_release);
+            if (head == tail)
+            {
+                tail = atomic_load_explicit((_Atomic unsigned*)ring->cq_tail, memory_order_acquire);
+            }
+        }
+
+        if (timeout_ms >= 0)
+        {
+            expire_deadlines(reg_context);
+        }
+    }
+}
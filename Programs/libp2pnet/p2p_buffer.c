@@ -0,0 +1,155 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Byte queues between non-blocking sockets and the code that parses or produces frames.
+// Bytes are consumed from the front by advancing head; the pending bytes move back to
+// the start only when the tail runs out of room, so a steady stream of small frames
+// costs no copying.
+
+#include "p2pnet.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Smallest allocation, and the room made before each receive
+#define BUFFER_MIN_CAP 4096
+#define BUFFER_READ_ROOM 16384
+
+void p2p_buffer_free(struct P2pBuffer* buf)
+{
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+int p2p_buffer_reserve(struct P2pBuffer* buf, size_t room)
+{
+    if (buf->cap - buf->head - buf->len >= room)
+    {
+        return 0;
+    }
+    if (buf->head > 0)
+    {
+        memmove(buf->data, buf->data + buf->head, buf->len);
+        buf->head = 0;
+        if (buf->cap - buf->len >= room)
+        {
+            return 0;
+        }
+    }
+
+    size_t cap = buf->cap > 0 ? buf->cap : BUFFER_MIN_CAP;
+    while (cap - buf->len < room)
+    {
+        cap *= 2;
+    }
+    uint8_t* data = realloc(buf->data, cap);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+int p2p_buffer_append(struct P2pBuffer* buf, const void* data, size_t len)
+{
+    if (p2p_buffer_reserve(buf, len) < 0)
+    {
+        return -1;
+    }
+    memcpy(buf->data + buf->head + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+void p2p_buffer_consume(struct P2pBuffer* buf, size_t n)
+{
+    buf->head += n;
+    buf->len -= n;
+    if (buf->len == 0)
+    {
+        buf->head = 0;
+    }
+}
+
+ssize_t p2p_buffer_read(struct P2pBuffer* buf, int sock, p2p_recv_fn recv_fn)
+{
+    if (p2p_buffer_reserve(buf, BUFFER_READ_ROOM) < 0)
+    {
+        return -1;
+    }
+
+    uint8_t* tail = buf->data + buf->head + buf->len;
+    size_t room = buf->cap - buf->head - buf->len;
+    ssize_t got;
+    do
+    {
+        got = recv_fn != NULL ? recv_fn(sock, tail, room, 0) : recv(sock, tail, room, 0);
+    } while (got < 0 && errno == EINTR);
+
+    if (got > 0)
+    {
+        buf->len += got;
+    }
+    return got;
+}
+
+ssize_t p2p_buffer_write(struct P2pBuffer* buf, int sock, p2p_send_fn send_fn)
+{
+    while (buf->len > 0)
+    {
+        const uint8_t* head = buf->data + buf->head;
+        ssize_t sent = send_fn != NULL ? send_fn(sock, head, buf->len, MSG_NOSIGNAL) : send(sock, head, buf->len, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? (ssize_t)buf->len : -1;
+        }
+        p2p_buffer_consume(buf, sent);
+    }
+    return 0;
+}
+
+int p2p_buffer_append_frame(struct P2pBuffer* buf, uint8_t action, uint16_t flags, const void* payload, uint32_t payload_len)
+{
+    if (p2p_buffer_reserve(buf, V2_HEADER_LEN + (size_t)payload_len) < 0)
+    {
+        return -1;
+    }
+    p2p_frame_header_encode(buf->data + buf->head + buf->len, action, flags, payload_len);
+    buf->len += V2_HEADER_LEN;
+    if (payload_len > 0)
+    {
+        memcpy(buf->data + buf->head + buf->len, payload, payload_len);
+        buf->len += payload_len;
+    }
+    return 0;
+}
+
+int p2p_buffer_frame(const struct P2pBuffer* buf, struct P2pFrameHeader* header, const uint8_t** payload, uint32_t max_payload)
+{
+    if (buf->len == 0)
+    {
+        return 0;
+    }
+    const uint8_t* head = buf->data + buf->head;
+    if (buf->len < V2_HEADER_LEN)
+    {
+        // A wrong version byte is known as soon as it arrives
+        return head[0] != PROTO_V2 ? -1 : 0;
+    }
+    if (p2p_frame_header_decode(head, header) < 0 || header->payload_len > max_payload)
+    {
+        return -1;
+    }
+    if (buf->len - V2_HEADER_LEN < header->payload_len)
+    {
+        return 0;
+    }
+    *payload = head + V2_HEADER_LEN;
+    return 1;
+}
@@ -0,0 +1,75 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// v2 frame headers and endpoints, the parts of the wire format the registry and the peer
+// both encode and decode
+
+#include "p2pnet.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+void p2p_frame_header_encode(uint8_t* out, uint8_t action, uint16_t flags, uint32_t payload_len)
+{
+    uint16_t net_flags = htons(flags);
+    uint32_t net_len = htonl(payload_len);
+
+    out[0] = PROTO_V2;
+    out[1] = action;
+    memcpy(out + 2, &net_flags, sizeof(net_flags));
+    memcpy(out + 4, &net_len, sizeof(net_len));
+}
+
+int p2p_frame_header_decode(const uint8_t* in, struct P2pFrameHeader* header)
+{
+    if (in[0] != PROTO_V2)
+    {
+        return -1;
+    }
+    header->action = in[1];
+    memcpy(&header->flags, in + 2, sizeof(header->flags));
+    memcpy(&header->payload_len, in + 4, sizeof(header->payload_len));
+    header->flags = ntohs(header->flags);
+    header->payload_len = ntohl(header->payload_len);
+    return 0;
+}
+
+size_t p2p_endpoint_encode(uint8_t* out, const struct sockaddr_storage* addr)
+{
+    if (addr->ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)addr;
+        out[0] = ENDPOINT_IPV6;
+        memcpy(out + 1, &addr6->sin6_port, sizeof(addr6->sin6_port));
+        memcpy(out + 3, &addr6->sin6_addr, sizeof(addr6->sin6_addr));
+        return 1 + 2 + 16;
+    }
+
+    const struct sockaddr_in* addr4 = (const struct sockaddr_in*)addr;
+    out[0] = ENDPOINT_IPV4;
+    memcpy(out + 1, &addr4->sin_port, sizeof(addr4->sin_port));
+    memcpy(out + 3, &addr4->sin_addr, sizeof(addr4->sin_addr));
+    return 1 + 2 + 4;
+}
+
+ssize_t p2p_endpoint_decode(const uint8_t* in, size_t len, struct sockaddr_storage* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (len >= 1 + 2 + 4 && in[0] == ENDPOINT_IPV4)
+    {
+        struct sockaddr_in* addr4 = (struct sockaddr_in*)addr;
+        addr4->sin_family = AF_INET;
+        memcpy(&addr4->sin_port, in + 1, sizeof(addr4->sin_port));
+        memcpy(&addr4->sin_addr, in + 3, sizeof(addr4->sin_addr));
+        return addr4->sin_port != 0 ? 1 + 2 + 4 : -1;
+    }
+    if (len >= 1 + 2 + 16 && in[0] == ENDPOINT_IPV6)
+    {
+        struct sockaddr_in6* addr6 = (struct sockaddr_in6*)addr;
+        addr6->sin6_family = AF_INET6;
+        memcpy(&addr6->sin6_port, in + 1, sizeof(addr6->sin6_port));
+        memcpy(&addr6->sin6_addr, in + 3, sizeof(addr6->sin6_addr));
+        return addr6->sin6_port != 0 ? 1 + 2 + 16 : -1;
+    }
+    return -1;
+}
@@ -0,0 +1,317 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Single-threaded poll() event loop with one-shot timers. Watches are kept dense, in the
+// order poll() gets them, with a table from descriptor to watch so adding, changing and
+// removing a watch costs O(1). Every pass first collects what poll() reported and only
+// then runs callbacks, so a callback may add or remove any watch; each watch carries a
+// serial number, and readiness reported for a watch that has since been removed or
+// replaced (a descriptor closed and reused within the pass) is dropped.
+//
+// Timers are few (retries, heartbeats, timeouts) and kept in an unsorted array; each
+// pass scans it for the nearest deadline.
+
+#include "p2pnet.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct LoopWatch
+{
+    int fd;
+    short events;
+    p2p_io_fn fn;
+    void* arg;
+    uint64_t serial;
+};
+
+struct LoopTimer
+{
+    uint64_t id;
+    uint64_t deadline;
+    p2p_timer_fn fn;
+    void* arg;
+};
+
+// A descriptor poll() reported, saved before any callback runs
+struct LoopReady
+{
+    int fd;
+    short revents;
+    uint64_t serial;
+};
+
+struct P2pLoop
+{
+    struct LoopWatch* watches;
+    struct pollfd* polls;
+    struct LoopReady* ready;
+    size_t watch_count;
+    size_t watch_cap;
+    // Index into watches of every descriptor below fd_cap, -1 if it is not watched
+    int* watch_of_fd;
+    size_t fd_cap;
+    struct LoopTimer* timers;
+    size_t timer_count;
+    size_t timer_cap;
+    // Source of watch serials and timer IDs; 0 is never handed out
+    uint64_t next_id;
+    bool stopped;
+};
+
+static int grow_watches(struct P2pLoop* loop, int fd);
+static void run_timers(struct P2pLoop* loop);
+
+struct P2pLoop* p2p_loop_new(void)
+{
+    return calloc(1, sizeof(struct P2pLoop));
+}
+
+void p2p_loop_free(struct P2pLoop* loop)
+{
+    if (loop == NULL)
+    {
+        return;
+    }
+    free(loop->watches);
+    free(loop->polls);
+    free(loop->ready);
+    free(loop->watch_of_fd);
+    free(loop->timers);
+    free(loop);
+}
+
+int p2p_loop_watch(struct P2pLoop* loop, int fd, short events, p2p_io_fn fn, void* arg)
+{
+    if (fd < 0 || grow_watches(loop, fd) < 0)
+    {
+        return -1;
+    }
+
+    int w = loop->watch_of_fd[fd];
+    if (w < 0)
+    {
+        w = loop->watch_count++;
+        loop->watch_of_fd[fd] = w;
+    }
+    loop->watches[w].fd = fd;
+    loop->watches[w].events = events;
+    loop->watches[w].fn = fn;
+    loop->watches[w].arg = arg;
+    loop->watches[w].serial = ++loop->next_id;
+    return 0;
+}
+
+int p2p_loop_modify(struct P2pLoop* loop, int fd, short events)
+{
+    if (fd < 0 || (size_t)fd >= loop->fd_cap || loop->watch_of_fd[fd] < 0)
+    {
+        return -1;
+    }
+    loop->watches[loop->watch_of_fd[fd]].events = events;
+    return 0;
+}
+
+void p2p_loop_unwatch(struct P2pLoop* loop, int fd)
+{
+    if (fd < 0 || (size_t)fd >= loop->fd_cap || loop->watch_of_fd[fd] < 0)
+    {
+        return;
+    }
+
+    // The last watch fills the hole
+    int w = loop->watch_of_fd[fd];
+    loop->watches[w] = loop->watches[--loop->watch_count];
+    loop->watch_of_fd[loop->watches[w].fd] = w;
+    loop->watch_of_fd[fd] = -1;
+}
+
+uint64_t p2p_loop_timer(struct P2pLoop* loop, uint64_t delay_ms, p2p_timer_fn fn, void* arg)
+{
+    if (loop->timer_count == loop->timer_cap)
+    {
+        size_t cap = loop->timer_cap > 0 ? loop->timer_cap * 2 : 16;
+        struct LoopTimer* timers = realloc(loop->timers, cap * sizeof(*timers));
+        if (timers == NULL)
+        {
+            return 0;
+        }
+        loop->timers = timers;
+        loop->timer_cap = cap;
+    }
+
+    struct LoopTimer* timer = &loop->timers[loop->timer_count++];
+    timer->id = ++loop->next_id;
+    timer->deadline = p2p_now_ms() + delay_ms;
+    timer->fn = fn;
+    timer->arg = arg;
+    return timer->id;
+}
+
+void p2p_loop_cancel(struct P2pLoop* loop, uint64_t timer_id)
+{
+    for (size_t t = 0; t < loop->timer_count; t++)
+    {
+        if (loop->timers[t].id == timer_id)
+        {
+            loop->timers[t] = loop->timers[--loop->timer_count];
+            return;
+        }
+    }
+}
+
+int p2p_loop_run_once(struct P2pLoop* loop, int timeout_ms)
+{
+    // Sleep no later than the nearest timer
+    if (loop->timer_count > 0)
+    {
+        uint64_t now = p2p_now_ms();
+        uint64_t nearest = loop->timers[0].deadline;
+        for (size_t t = 1; t < loop->timer_count; t++)
+        {
+            nearest = loop->timers[t].deadline < nearest ? loop->timers[t].deadline : nearest;
+        }
+        uint64_t wait = nearest > now ? nearest - now : 0;
+        if (timeout_ms < 0 || wait < (uint64_t)timeout_ms)
+        {
+            timeout_ms = wait > INT32_MAX ? INT32_MAX : (int)wait;
+        }
+    }
+
+    size_t count = loop->watch_count;
+    for (size_t w = 0; w < count; w++)
+    {
+        loop->polls[w].fd = loop->watches[w].fd;
+        loop->polls[w].events = loop->watches[w].events;
+        loop->polls[w].revents = 0;
+    }
+    int ready = poll(loop->polls, count, timeout_ms);
+    if (ready < 0 && errno != EINTR)
+    {
+        return -1;
+    }
+
+    size_t ready_count = 0;
+    for (size_t w = 0; w < count && ready > 0; w++)
+    {
+        if (loop->polls[w].revents != 0)
+        {
+            loop->ready[ready_count].fd = loop->polls[w].fd;
+            loop->ready[ready_count].revents = loop->polls[w].revents;
+            loop->ready[ready_count].serial = loop->watches[w].serial;
+            ready_count++;
+        }
+    }
+    for (size_t r = 0; r < ready_count; r++)
+    {
+        const struct LoopReady* event = &loop->ready[r];
+        int w = loop->watch_of_fd[event->fd];
+        if (w >= 0 && loop->watches[w].serial == event->serial)
+        {
+            loop->watches[w].fn(loop, event->fd, event->revents, loop->watches[w].arg);
+        }
+    }
+
+    run_timers(loop);
+    return 0;
+}
+
+int p2p_loop_run(struct P2pLoop* loop)
+{
+    loop->stopped = false;
+    while (!loop->stopped)
+    {
+        if (p2p_loop_run_once(loop, -1) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void p2p_loop_stop(struct P2pLoop* loop)
+{
+    loop->stopped = true;
+}
+
+uint64_t p2p_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Make room for one more watch and for descriptor fd in the descriptor table
+static int grow_watches(struct P2pLoop* loop, int fd)
+{
+    if ((size_t)fd >= loop->fd_cap)
+    {
+        size_t cap = loop->fd_cap > 0 ? loop->fd_cap : 64;
+        while (cap <= (size_t)fd)
+        {
+            cap *= 2;
+        }
+        int* table = realloc(loop->watch_of_fd, cap * sizeof(*table));
+        if (table == NULL)
+        {
+            return -1;
+        }
+        for (size_t i = loop->fd_cap; i < cap; i++)
+        {
+            table[i] = -1;
+        }
+        loop->watch_of_fd = table;
+        loop->fd_cap = cap;
+    }
+
+    if (loop->watch_count == loop->watch_cap)
+    {
+        size_t cap = loop->watch_cap > 0 ? loop->watch_cap * 2 : 16;
+        struct LoopWatch* watches = realloc(loop->watches, cap * sizeof(*watches));
+        if (watches == NULL)
+        {
+            return -1;
+        }
+        loop->watches = watches;
+        struct pollfd* polls = realloc(loop->polls, cap * sizeof(*polls));
+        if (polls == NULL)
+        {
+            return -1;
+        }
+        loop->polls = polls;
+        struct LoopReady* ready = realloc(loop->ready, cap * sizeof(*ready));
+        if (ready == NULL)
+        {
+            return -1;
+        }
+        loop->ready = ready;
+        loop->watch_cap = cap;
+    }
+    return 0;
+}
+
+// Run every timer that is due. Timers added by these callbacks wait for the next pass,
+// even with no delay, so a timer that re-arms itself cannot starve the descriptors
+static void run_timers(struct P2pLoop* loop)
+{
+    uint64_t now = p2p_now_ms();
+    uint64_t last_id = loop->next_id;
+    size_t t = 0;
+
+    while (t < loop->timer_count)
+    {
+        struct LoopTimer timer = loop->timers[t];
+        if (timer.deadline > now || timer.id > last_id)
+        {
+            t++;
+            continue;
+        }
+        // Removed before it runs, so the callback may add and cancel timers freely
+        loop->timers[t] = loop->timers[--loop->timer_count];
+        timer.fn(loop, timer.arg);
+        t = 0;
+    }
+}
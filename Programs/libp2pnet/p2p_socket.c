@@ -0,0 +1,260 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+// Connecting, listening and blocking send/receive helpers. Every program used to carry
+// its own copy of lookup_and_connect(); this is the one they share.
+
+#define _GNU_SOURCE
+#include "p2pnet.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+static struct addrinfo* resolve(const char* host, const char* service, int family);
+static int connect_one(const struct addrinfo* rp, int timeout_ms);
+static int open_listener(int family, uint16_t port, int backlog);
+
+int p2p_connect(const char* host, const char* service, int family)
+{
+    return p2p_connect_addr(host, service, family, -1, NULL);
+}
+
+int p2p_connect_addr(const char* host, const char* service, int family, int timeout_ms, struct sockaddr_storage* addr)
+{
+    struct addrinfo* results = resolve(host, service, family);
+    if (results == NULL)
+    {
+        return -1;
+    }
+
+    int sock = -1;
+    int error = ECONNREFUSED;
+    for (struct addrinfo* rp = results; rp != NULL && sock < 0; rp = rp->ai_next)
+    {
+        sock = connect_one(rp, timeout_ms);
+        if (sock < 0)
+        {
+            error = errno;
+        }
+        else if (addr != NULL)
+        {
+            memset(addr, 0, sizeof(*addr));
+            memcpy(addr, rp->ai_addr, rp->ai_addrlen);
+        }
+    }
+    freeaddrinfo(results);
+    errno = sock < 0 ? error : errno;
+    return sock;
+}
+
+int p2p_connect_start(const char* host, const char* service, int family)
+{
+    return p2p_connect_start_addr(host, service, family, NULL);
+}
+
+int p2p_connect_start_addr(const char* host, const char* service, int family, struct sockaddr_storage* addr)
+{
+    struct addrinfo* results = resolve(host, service, family);
+    if (results == NULL)
+    {
+        return -1;
+    }
+
+    int sock = -1;
+    for (struct addrinfo* rp = results; rp != NULL && sock < 0; rp = rp->ai_next)
+    {
+        sock = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
+        if (sock >= 0 && connect(sock, rp->ai_addr, rp->ai_addrlen) < 0 && errno != EINPROGRESS)
+        {
+            close(sock);
+            sock = -1;
+        }
+        else if (sock >= 0 && addr != NULL)
+        {
+            memset(addr, 0, sizeof(*addr));
+            memcpy(addr, rp->ai_addr, rp->ai_addrlen);
+        }
+    }
+    freeaddrinfo(results);
+    return sock;
+}
+
+int p2p_connect_finish(int sock)
+{
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0)
+    {
+        return -1;
+    }
+    if (error != 0)
+    {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int p2p_listen(uint16_t port, int backlog)
+{
+    // Falls back to IPv4 when IPv6 sockets cannot be opened or bound
+    int sock = open_listener(AF_INET6, port, backlog);
+    return sock >= 0 ? sock : open_listener(AF_INET, port, backlog);
+}
+
+int p2p_set_nonblocking(int sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+int p2p_send_all(int sock, const void* buf, size_t len, int flags)
+{
+    size_t total = 0;
+
+    while (total < len)
+    {
+        ssize_t n = send(sock, (const uint8_t*)buf + total, len - total, flags);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+ssize_t p2p_recv_all(int sock, void* buf, size_t len)
+{
+    size_t total = 0;
+
+    while (total < len)
+    {
+        // MSG_WAITALL lets the kernel gather the whole request in one call in the common case
+        ssize_t n = recv(sock, (uint8_t*)buf + total, len - total, MSG_WAITALL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return n < 0 && total == 0 ? -1 : (ssize_t)total;
+        }
+        total += n;
+    }
+    return total;
+}
+
+static struct addrinfo* resolve(const char* host, const char* service, int family)
+{
+    struct addrinfo hints;
+    struct addrinfo* results;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, service, &hints, &results) != 0)
+    {
+        errno = EHOSTUNREACH;
+        return NULL;
+    }
+    return results;
+}
+
+// Connect to one address, waiting at most timeout_ms when it is not negative. Returns a
+// blocking socket or -1
+static int connect_one(const struct addrinfo* rp, int timeout_ms)
+{
+    int sock = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+    if (sock < 0)
+    {
+        return -1;
+    }
+    if (timeout_ms < 0)
+    {
+        if (connect(sock, rp->ai_addr, rp->ai_addrlen) == 0)
+        {
+            return sock;
+        }
+        close(sock);
+        return -1;
+    }
+
+    // A host that is down must not stall the caller, so connect with a timeout
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    int rc = connect(sock, rp->ai_addr, rp->ai_addrlen);
+    if (rc < 0 && errno == EINPROGRESS)
+    {
+        struct pollfd pfd = {sock, POLLOUT, 0};
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready == 0)
+        {
+            errno = ETIMEDOUT;
+        }
+        rc = ready == 1 ? p2p_connect_finish(sock) : -1;
+    }
+    if (rc < 0)
+    {
+        int error = errno;
+        close(sock);
+        errno = error;
+        return -1;
+    }
+    fcntl(sock, F_SETFL, flags);
+    return sock;
+}
+
+static int open_listener(int family, uint16_t port, int backlog)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int reuse = 1;
+
+    int sock = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        return -1;
+    }
+    // A restarted program can bind again while old connections sit in TIME_WAIT
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    memset(&addr, 0, sizeof(addr));
+    if (family == AF_INET6)
+    {
+        // Dual-stack: IPv4 clients arrive as IPv4-mapped addresses on the same socket
+        int v6only = 0;
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+        struct sockaddr_in6* addr6 = (struct sockaddr_in6*)&addr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_addr = in6addr_any;
+        addr6->sin6_port = htons(port);
+        addr_len = sizeof(*addr6);
+    }
+    else
+    {
+        struct sockaddr_in* addr4 = (struct sockaddr_in*)&addr;
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = INADDR_ANY;
+        addr4->sin_port = htons(port);
+        addr_len = sizeof(*addr4);
+    }
+
+    if (bind(sock, (struct sockaddr*)&addr, addr_len) < 0 || listen(sock, backlog) < 0)
+    {
+        int error = errno;
+        close(sock);
+        errno = error;
+        return -1;
+    }
+    return sock;
+}
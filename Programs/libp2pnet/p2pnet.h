@@ -0,0 +1,151 @@
+/* EECE-446-FA-2024 | Nick Kaplan | Halin Gailey */
+
+#ifndef P2PNET_H
+#define P2PNET_H
+
+// Networking core shared by every program: connecting and listening (p2p_socket.c), the
+// v2 wire format (p2p_frame.c), buffered framed I/O on non-blocking sockets
+// (p2p_buffer.c) and a single-threaded event loop (p2p_loop.c). Nothing here prints;
+// failures are returned with errno set.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Wire format
+
+// First byte of every v2 frame; the high bit keeps it distinct from v1 action codes
+#define PROTO_V2 0x82
+// Length of a v2 frame header: version, action, flags and payload length
+#define V2_HEADER_LEN 8
+// v2 flag marking a frame as the reply to a request
+#define V2_FLAG_RESPONSE 0x0001
+// v2 flag marking a rejected request (the reply carries no payload)
+#define V2_FLAG_ERROR 0x0002
+// v2 flag on a SEARCH reply whose holder only matched a Bloom summary, so it may not
+// actually have the file; the requester confirms with the holder before relying on it
+#define V2_FLAG_CANDIDATE 0x0004
+// Maximum number of listen endpoints a peer advertises or a SEARCH reply carries
+#define MAX_ENDPOINTS 4
+// Endpoint family tags on the wire, followed by a 16-bit port and the 4 or 16 address bytes
+#define ENDPOINT_IPV4 4
+#define ENDPOINT_IPV6 6
+// Longest encoded endpoint: family, port and an IPv6 address
+#define MAX_ENDPOINT_LEN (1 + 2 + 16)
+
+// Decoded v2 frame header
+struct P2pFrameHeader
+{
+    uint8_t action;
+    uint16_t flags;
+    uint32_t payload_len;
+};
+
+// Write a v2 frame header into out (V2_HEADER_LEN bytes)
+void p2p_frame_header_encode(uint8_t* out, uint8_t action, uint16_t flags, uint32_t payload_len);
+// Read a v2 frame header from V2_HEADER_LEN bytes. Returns 0, or -1 if in does not start
+// with PROTO_V2
+int p2p_frame_header_decode(const uint8_t* in, struct P2pFrameHeader* header);
+// Write an IPv4 or IPv6 address and its port in wire format. Returns the bytes written,
+// at most MAX_ENDPOINT_LEN
+size_t p2p_endpoint_encode(uint8_t* out, const struct sockaddr_storage* addr);
+// Read one wire-format endpoint. Returns the bytes consumed, or -1 if it is truncated,
+// has an unknown family or has port 0
+ssize_t p2p_endpoint_decode(const uint8_t* in, size_t len, struct sockaddr_storage* addr);
+
+// Sockets
+
+// Resolve host and service (as getaddrinfo() takes them, family AF_INET, AF_INET6 or
+// AF_UNSPEC) and connect to the first address that answers. Returns a blocking socket,
+// or -1 with errno set (EHOSTUNREACH if the name does not resolve)
+int p2p_connect(const char* host, const char* service, int family);
+// p2p_connect() that gives up on each address after timeout_ms (negative waits as long
+// as connect() does) and stores the address it connected to in addr unless that is NULL
+int p2p_connect_addr(const char* host, const char* service, int family, int timeout_ms, struct sockaddr_storage* addr);
+// Start a non-blocking connection to the first address of host that accepts the attempt.
+// Returns the socket, still connecting, or -1. Once the event loop reports it writable,
+// p2p_connect_finish() tells whether it succeeded
+int p2p_connect_start(const char* host, const char* service, int family);
+// p2p_connect_start() that stores the address being connected to in addr unless that is
+// NULL
+int p2p_connect_start_addr(const char* host, const char* service, int family, struct sockaddr_storage* addr);
+// Returns 0 if a connection started with p2p_connect_start() is established, or -1 with
+// errno set to the reason it failed
+int p2p_connect_finish(int sock);
+// Listen on port on every address: a dual-stack IPv6 socket, or IPv4 only on hosts
+// without IPv6. The socket is non-blocking and close-on-exec. Returns it or -1
+int p2p_listen(uint16_t port, int backlog);
+int p2p_set_nonblocking(int sock);
+// Send all len bytes, retrying short writes and EINTR; flags go to send() (MSG_MORE,
+// MSG_NOSIGNAL). Returns 0 or -1
+int p2p_send_all(int sock, const void* buf, size_t len, int flags);
+// Receive exactly len bytes on a blocking socket. Returns the bytes received, fewer than
+// len if the connection closed or failed part way, or -1 if it failed before any arrived
+ssize_t p2p_recv_all(int sock, void* buf, size_t len);
+
+// Buffered framed I/O
+
+// send() and recv() shaped functions, so a buffer can move its bytes through a
+// wrapper such as TLS; NULL means send() and recv() themselves
+typedef ssize_t (*p2p_send_fn)(int sock, const void* buf, size_t len, int flags);
+typedef ssize_t (*p2p_recv_fn)(int sock, void* buf, size_t len, int flags);
+
+// Growable byte queue: data[head, head + len) is pending. Zero-initialized is empty
+struct P2pBuffer
+{
+    uint8_t* data;
+    size_t head;
+    size_t len;
+    size_t cap;
+};
+
+void p2p_buffer_free(struct P2pBuffer* buf);
+// Make room for at least room more bytes after the pending ones. Returns 0 or -1
+int p2p_buffer_reserve(struct P2pBuffer* buf, size_t room);
+int p2p_buffer_append(struct P2pBuffer* buf, const void* data, size_t len);
+// Drop n bytes from the front
+void p2p_buffer_consume(struct P2pBuffer* buf, size_t n);
+// Receive what a non-blocking socket has into the buffer. Returns the bytes read, 0 when
+// the peer closed, or -1 (errno EAGAIN when there was nothing to read)
+ssize_t p2p_buffer_read(struct P2pBuffer* buf, int sock, p2p_recv_fn recv_fn);
+// Send as much of the buffer as a non-blocking socket takes. Returns the bytes still
+// pending (0 when flushed), or -1 if the connection failed
+ssize_t p2p_buffer_write(struct P2pBuffer* buf, int sock, p2p_send_fn send_fn);
+// Queue one v2 frame. Returns 0 or -1
+int p2p_buffer_append_frame(struct P2pBuffer* buf, uint8_t action, uint16_t flags, const void* payload, uint32_t payload_len);
+// Look at the frame at the front of the buffer. Returns 1 and points payload into the
+// buffer when all of it has arrived (consume V2_HEADER_LEN + payload_len once done),
+// 0 while more is needed, or -1 if it is not a v2 frame or exceeds max_payload
+int p2p_buffer_frame(const struct P2pBuffer* buf, struct P2pFrameHeader* header, const uint8_t** payload, uint32_t max_payload);
+
+// Event loop
+
+struct P2pLoop;
+// Called when fd is ready; revents are poll() events. Watches may be added, changed or
+// removed from inside a callback, including the one being called
+typedef void (*p2p_io_fn)(struct P2pLoop* loop, int fd, short revents, void* arg);
+typedef void (*p2p_timer_fn)(struct P2pLoop* loop, void* arg);
+
+struct P2pLoop* p2p_loop_new(void);
+void p2p_loop_free(struct P2pLoop* loop);
+// Watch fd for events (POLLIN, POLLOUT), replacing any earlier watch of fd. An fd
+// watched for no events still reports errors and hang-ups. Returns 0 or -1
+int p2p_loop_watch(struct P2pLoop* loop, int fd, short events, p2p_io_fn fn, void* arg);
+// Change the events of a watched fd. Returns 0, or -1 if fd is not watched
+int p2p_loop_modify(struct P2pLoop* loop, int fd, short events);
+void p2p_loop_unwatch(struct P2pLoop* loop, int fd);
+// Call fn once after delay_ms (0 runs it on the next pass). Returns a timer ID for
+// p2p_loop_cancel(), or 0 if it cannot be added
+uint64_t p2p_loop_timer(struct P2pLoop* loop, uint64_t delay_ms, p2p_timer_fn fn, void* arg);
+void p2p_loop_cancel(struct P2pLoop* loop, uint64_t timer_id);
+// Wait at most timeout_ms (negative: until something happens) and run what is ready.
+// Returns 0, or -1 if poll() failed
+int p2p_loop_run_once(struct P2pLoop* loop, int timeout_ms);
+// Run until p2p_loop_stop(). Returns 0, or -1 if poll() failed
+int p2p_loop_run(struct P2pLoop* loop);
+void p2p_loop_stop(struct P2pLoop* loop);
+// Monotonic clock in milliseconds, the one timers use
+uint64_t p2p_now_ms(void);
+
+#endif